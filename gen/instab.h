@@ -0,0 +1,279 @@
+// generated by mkinstab from instab.txt
+
+static const rvins_t instab[100] = {
+	{ 0x0000007f, 0x00000037, "lui     %d, %U" },
+	{ 0x0000007f, 0x00000017, "auipc   %d, %U" },
+	{ 0x00000fff, 0x0000006f, "j       %J" },
+	{ 0x00000fff, 0x000000ef, "jal     %J" },
+	{ 0x0000007f, 0x0000006f, "jal     %d, %J" },
+	{ 0xffffffff, 0x00008067, "ret" },
+	{ 0xfff07fff, 0x00000067, "jr      %1" },
+	{ 0x00007fff, 0x00000067, "jr      %i(%1)" },
+	{ 0xfff07fff, 0x000000e7, "jalr    %1" },
+	{ 0x00007fff, 0x000000e7, "jalr    %i(%1)" },
+	{ 0x0000707f, 0x00000067, "jalr    %d, %i(%1)" },
+	{ 0x01f0707f, 0x00000063, "beqz    %1, %B" },
+	{ 0x0000707f, 0x00000063, "beq     %1, %2, %B" },
+	{ 0x01f0707f, 0x00001063, "bnez    %1, %B" },
+	{ 0x0000707f, 0x00001063, "bne     %1, %2, %B" },
+	{ 0x01f0707f, 0x00004063, "bltz    %1, %B" },
+	{ 0x000ff07f, 0x00004063, "bgtz    %2, %B" },
+	{ 0x0000707f, 0x00004063, "blt     %1, %2, %B" },
+	{ 0x000ff07f, 0x00005063, "blez    %2, %B" },
+	{ 0x01f0707f, 0x00005063, "bgez    %1, %B" },
+	{ 0x0000707f, 0x00005063, "bge     %1, %2, %B" },
+	{ 0x0000707f, 0x00006063, "bltu    %1, %2, %B" },
+	{ 0x0000707f, 0x00007063, "bgeu    %1, %2, %B" },
+	{ 0x0000707f, 0x00000003, "lb      %d, %i(%1)" },
+	{ 0x0000707f, 0x00001003, "lh      %d, %i(%1)" },
+	{ 0x0000707f, 0x00002003, "lw      %d, %i(%1)" },
+	{ 0x0000707f, 0x00004003, "lbu     %d, %i(%1)" },
+	{ 0x0000707f, 0x00005003, "lhu     %d, %i(%1)" },
+	{ 0x0000707f, 0x00000023, "sb      %2, %s(%1)" },
+	{ 0x0000707f, 0x00001023, "sh      %2, %s(%1)" },
+	{ 0x0000707f, 0x00002023, "sw      %2, %s(%1)" },
+	{ 0xffffffff, 0x00000013, "nop" },
+	{ 0x000ff07f, 0x00000013, "li      %d, %i" },
+	{ 0xfff0707f, 0x00000013, "mv      %d, %1" },
+	{ 0x0000707f, 0x00000013, "addi    %d, %1, %i" },
+	{ 0x0000707f, 0x00002013, "slti    %d, %1, %i" },
+	{ 0xfff0707f, 0x00103013, "seqz    %d, %1" },
+	{ 0x0000707f, 0x00003013, "sltiu   %d, %1, %i" },
+	{ 0xfff0707f, 0xfff04013, "not     %d, %1" },
+	{ 0x0000707f, 0x00004013, "xori    %d, %1, %i" },
+	{ 0x0000707f, 0x00006013, "ori     %d, %1, %i" },
+	{ 0x0000707f, 0x00007013, "andi    %d, %1, %i" },
+	{ 0xfe00707f, 0x00001013, "slli    %d, %1, %x" },
+	{ 0xfe00707f, 0x00005013, "srli    %d, %1, %x" },
+	{ 0xfe00707f, 0x40005013, "srai    %d, %1, %x" },
+	{ 0xfe00707f, 0x00000033, "add     %d, %1, %2" },
+	{ 0xfe0ff07f, 0x40000033, "neg     %d, %2" },
+	{ 0xfe00707f, 0x40000033, "sub     %d, %1, %2" },
+	{ 0xfe00707f, 0x00001033, "sll     %d, %1, %2" },
+	{ 0xfff0707f, 0x00002033, "sltz    %d, %1" },
+	{ 0xfe0ff07f, 0x00002033, "sgtz    %d, %2" },
+	{ 0xfe00707f, 0x00002033, "slt     %d, %1, %2" },
+	{ 0xfe0ff07f, 0x00003033, "snez    %d, %2" },
+	{ 0xfe00707f, 0x00003033, "sltu    %d, %1, %2" },
+	{ 0xfe00707f, 0x00004033, "xor     %d, %1, %2" },
+	{ 0xfe00707f, 0x00005033, "srl     %d, %1, %2" },
+	{ 0xfe00707f, 0x40005033, "sra     %d, %1, %2" },
+	{ 0xfe00707f, 0x00006033, "or      %d, %1, %2" },
+	{ 0xfe00707f, 0x00007033, "and     %d, %1, %2" },
+	{ 0xfe00707f, 0x02000033, "mul     %d, %1, %2" },
+	{ 0xfe00707f, 0x02001033, "mulh    %d, %1, %2" },
+	{ 0xfe00707f, 0x02002033, "mulhsu  %d, %1, %2" },
+	{ 0xfe00707f, 0x02003033, "mulhu   %d, %1, %2" },
+	{ 0xfe00707f, 0x02004033, "div     %d, %1, %2" },
+	{ 0xfe00707f, 0x02005033, "divu    %d, %1, %2" },
+	{ 0xfe00707f, 0x02006033, "rem     %d, %1, %2" },
+	{ 0xfe00707f, 0x02007033, "remu    %d, %1, %2" },
+	{ 0x0000707f, 0x0000000f, "fence" },
+	{ 0xf9f0707f, 0x1000202f, "lr.w    %d, (%1)" },
+	{ 0xf800707f, 0x1800202f, "sc.w    %d, %2, (%1)" },
+	{ 0xf800707f, 0x0800202f, "amoswap.w %d, %2, (%1)" },
+	{ 0xf800707f, 0x0000202f, "amoadd.w %d, %2, (%1)" },
+	{ 0xf800707f, 0x2000202f, "amoxor.w %d, %2, (%1)" },
+	{ 0xf800707f, 0x6000202f, "amoand.w %d, %2, (%1)" },
+	{ 0xf800707f, 0x4000202f, "amoor.w %d, %2, (%1)" },
+	{ 0xf800707f, 0x8000202f, "amomin.w %d, %2, (%1)" },
+	{ 0xf800707f, 0xa000202f, "amomax.w %d, %2, (%1)" },
+	{ 0xf800707f, 0xc000202f, "amominu.w %d, %2, (%1)" },
+	{ 0xf800707f, 0xe000202f, "amomaxu.w %d, %2, (%1)" },
+	{ 0x0000707f, 0x0000000b, "_exiti  %i" },
+	{ 0x0000707f, 0x0000100b, "_iocall %i" },
+	{ 0x0000707f, 0x0000400b, "_exit   %1" },
+	{ 0x00007fff, 0x00001073, "csrw    %C, %1" },
+	{ 0x0000707f, 0x00001073, "csrrw   %d, %C, %1" },
+	{ 0x000ff07f, 0x00002073, "csrr    %d, %C" },
+	{ 0x00007fff, 0x00002073, "csrs    %C, %1" },
+	{ 0x0000707f, 0x00002073, "csrrs   %d, %C, %1" },
+	{ 0x00007fff, 0x00003073, "csrc    %C, %1" },
+	{ 0x0000707f, 0x00003073, "csrrc   %d, %C, %1" },
+	{ 0x00007fff, 0x00005073, "csrwi   %C, %c" },
+	{ 0x0000707f, 0x00005073, "csrrwi  %d, %C, %c" },
+	{ 0x00007fff, 0x00006073, "csrsi   %C, %c" },
+	{ 0x0000707f, 0x00006073, "csrrsi  %d, %C, %c" },
+	{ 0x00007fff, 0x00007073, "csrci   %C, %c" },
+	{ 0x0000707f, 0x00007073, "csrrci  %d, %C, %c" },
+	{ 0xffffffff, 0x00000073, "ecall" },
+	{ 0xffffffff, 0x00100073, "ebreak" },
+	{ 0xffffffff, 0x30200073, "mret" },
+	{ 0xffffffff, 0x10500073, "wfi" },
+	{ 0x00000000, 0x00000000, "unknown" },
+};
+
+static const uint8_t instab_list[] = {
+	99,
+	23,
+	79,
+	67,
+	31, 32, 33, 34,
+	1,
+	28,
+	45, 46, 47, 59, 99,
+	0,
+	11, 12,
+	5, 6, 7, 8, 9, 10,
+	2, 3, 4,
+	95, 96, 97, 98, 99,
+	24,
+	80,
+	42, 99,
+	29,
+	48, 60, 99,
+	13, 14,
+	82, 83,
+	25,
+	35,
+	30,
+	68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 99,
+	49, 50, 51, 61, 99,
+	84, 85, 86,
+	36, 37,
+	52, 53, 62, 99,
+	87, 88,
+	26,
+	81,
+	38, 39,
+	54, 63, 99,
+	15, 16, 17,
+	27,
+	43, 44, 99,
+	55, 56, 64, 99,
+	18, 19, 20,
+	89, 90,
+	40,
+	57, 65, 99,
+	21,
+	91, 92,
+	41,
+	58, 66, 99,
+	22,
+	93, 94,
+};
+
+// into instab_list, by funct3 << 7 | opcode
+static const uint16_t instab_index[1024] = {
+	0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0, 3,
+	0, 0, 0, 4, 0, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 9, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 10, 0, 0, 0, 15, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 16, 0, 0, 0, 18, 0, 0, 0, 0, 0, 0, 0, 24,
+	0, 0, 0, 27, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 32, 0, 0, 0, 0, 0, 0, 0, 33, 0, 0, 0, 0,
+	0, 0, 0, 34, 0, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 36, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 37, 0, 0, 0, 15, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 40, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 24,
+	0, 0, 0, 42, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 44, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 45, 0, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 46, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 47,
+	0, 0, 0, 59, 0, 0, 0, 15, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 24,
+	0, 0, 0, 64, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 67, 0, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 69, 0, 0, 0, 15, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 24,
+	0, 0, 0, 73, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 75, 0, 0, 0, 0, 0, 0, 0, 76, 0, 0, 0, 0,
+	0, 0, 0, 77, 0, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 79, 0, 0, 0, 15, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 82, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 24,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 85, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 86, 0, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 89, 0, 0, 0, 15, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 93, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 24,
+	0, 0, 0, 96, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 98, 0, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 99, 0, 0, 0, 15, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 102, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 24,
+	0, 0, 0, 103, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 105, 0, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 106, 0, 0, 0, 15, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 109, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 24,
+	0, 0, 0, 110, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static const rvins_t instab16[29] = {
+	{ 0x0000ffe3, 0x00000000, "unknown" },
+	{ 0x0000e003, 0x00000000, "c.addi4spn %4, x2, %A" },
+	{ 0x0000e003, 0x00004000, "c.lw    %4, %w(%3)" },
+	{ 0x0000e003, 0x0000c000, "c.sw    %4, %w(%3)" },
+	{ 0x0000ffff, 0x00000001, "c.nop" },
+	{ 0x0000e003, 0x00000001, "c.addi  %d, %k" },
+	{ 0x0000e003, 0x00002001, "c.jal   %T" },
+	{ 0x0000e003, 0x00004001, "c.li    %d, %k" },
+	{ 0x0000ef83, 0x00006101, "c.addi16sp x2, %a" },
+	{ 0x0000e003, 0x00006001, "c.lui   %d, %K" },
+	{ 0x0000ec03, 0x00008001, "c.srli  %3, %h" },
+	{ 0x0000ec03, 0x00008401, "c.srai  %3, %h" },
+	{ 0x0000ec03, 0x00008801, "c.andi  %3, %k" },
+	{ 0x0000fc63, 0x00008c01, "c.sub   %3, %4" },
+	{ 0x0000fc63, 0x00008c21, "c.xor   %3, %4" },
+	{ 0x0000fc63, 0x00008c41, "c.or    %3, %4" },
+	{ 0x0000fc63, 0x00008c61, "c.and   %3, %4" },
+	{ 0x0000e003, 0x0000a001, "c.j     %T" },
+	{ 0x0000e003, 0x0000c001, "c.beqz  %3, %E" },
+	{ 0x0000e003, 0x0000e001, "c.bnez  %3, %E" },
+	{ 0x0000e003, 0x00000002, "c.slli  %d, %h" },
+	{ 0x0000e003, 0x00004002, "c.lwsp  %d, %p(x2)" },
+	{ 0x0000f07f, 0x00008002, "c.jr    %d" },
+	{ 0x0000f003, 0x00008002, "c.mv    %d, %5" },
+	{ 0x0000ffff, 0x00009002, "c.ebreak" },
+	{ 0x0000f07f, 0x00009002, "c.jalr  %d" },
+	{ 0x0000f003, 0x00009002, "c.add   %d, %5" },
+	{ 0x0000e003, 0x0000c002, "c.swsp  %5, %P(x2)" },
+	{ 0x00000000, 0x00000000, "unknown" },
+};
+
+static const uint8_t instab16_list[] = {
+	0, 1,
+	4, 5,
+	20,
+	28,
+	6,
+	2,
+	7,
+	21,
+	8, 9,
+	10, 11, 12, 13, 14, 15, 16, 28,
+	22, 23, 24, 25, 26, 28,
+	17,
+	3,
+	18,
+	27,
+	19,
+};
+
+// into instab16_list, by funct3 << 2 | quadrant
+static const uint16_t instab16_index[32] = {
+	0, 2, 4, 5, 5, 6, 5, 5, 7, 8, 9, 5, 5, 10, 5, 5,
+	5, 12, 20, 5, 5, 26, 5, 5, 27, 28, 29, 5, 5, 30, 5, 5,
+};
@@ -6,3 +6,78 @@
 #define IOCALL_CLOSE  0x11
 #define IOCALL_READ   0x12
 #define IOCALL_WRITE  0x13
+
+// asynchronous i/o: a submission and a completion queue in guest ram,
+// serviced in order by a host thread while the guest runs on
+#define IOCALL_RING_SETUP 0x14 // (addr, entries) -> 0/error
+#define IOCALL_RING_ENTER 0x15 // (flags) -> 0/error: the doorbell
+
+// map a file into ram, copy-on-write (the file is never written), at a
+// page aligned address the guest picks; unmapping leaves zeros there
+#define IOCALL_MMAP   0x16 // (addr, len, fd, off_lo, off_hi) -> addr/error
+#define IOCALL_MUNMAP 0x17 // (addr, len) -> 0/error
+
+// the guest has got to where it wants a checkpoint taken (rvsim
+// -checkpoint=), which is saved as this returns, and restored from
+// there
+#define IOCALL_CHECKPOINT 0x18 // () -> 0
+
+// an input to fuzz with (rvsim -fuzz=), up to max bytes at buf: the
+// guest is checkpointed in its first call, and each input is a run from
+// there (the call returning it), which ends at the next call, or exit
+#define IOCALL_FUZZ 0x19 // (buf, max) -> len/error
+
+#define IOCALL_HARTSTART 0x20
+
+// IOCALL_RING_ENTER flags
+#define IORING_ENTER_WAIT 1 // stop until the completion queue is not empty
+
+// iosqe_t.op
+#define IORING_OP_NOP   0
+#define IORING_OP_READ  1 // (fd, ptr, len) -> len/error
+#define IORING_OP_WRITE 2 // (fd, ptr, len) -> len/error
+
+#ifndef __ASSEMBLER__
+#include <stdint.h>
+
+// the ring is an ioring_t followed by entries (a power of two, up to
+// IORING_MAXENTRIES) iosqe_t then entries iocqe_t, word aligned
+//
+// The indexes run freely, wrapping at 2^32, and name slot
+// (index & (entries - 1)).  The guest fills sq[sq_tail], advances
+// sq_tail and rings the doorbell; the host advances sq_head once it
+// has copied a submission out (the slot may be reused), and posts its
+// result at cq[cq_tail] when done.  The guest must not have more than
+// entries submissions whose completions it has not taken.
+typedef struct {
+	uint32_t sq_head; // written by the host
+	uint32_t sq_tail; // written by the guest
+	uint32_t cq_head; // written by the guest
+	uint32_t cq_tail; // written by the host
+} ioring_t;
+
+typedef struct {
+	uint32_t op;
+	uint32_t fd;
+	uint32_t ptr;
+	uint32_t len;
+	uint32_t user; // copied to the completion
+	uint32_t reserved[3];
+} iosqe_t;
+
+typedef struct {
+	uint32_t user;
+	uint32_t result;
+} iocqe_t;
+
+#define IORING_MAXENTRIES 4096
+#define IORING_SIZE(entries) \
+	(sizeof(ioring_t) + (entries) * (sizeof(iosqe_t) + sizeof(iocqe_t)))
+
+static inline iosqe_t* ioring_sqe(ioring_t* r, uint32_t entries, uint32_t n) {
+	return ((iosqe_t*) (r + 1)) + (n & (entries - 1));
+}
+static inline iocqe_t* ioring_cqe(ioring_t* r, uint32_t entries, uint32_t n) {
+	return ((iocqe_t*) (((iosqe_t*) (r + 1)) + entries)) + (n & (entries - 1));
+}
+#endif
@@ -1,11 +1,141 @@
 // Copyright 2019, Brian Swetland <swetland@frotz.net>
 // Licensed under the Apache License, Version 2.0.
 
+// Generates the instruction tables of rvdis.c from instab.txt, one for
+// 32 bit instructions and one for compressed (16 bit) ones: the entries
+// in order (the first that matches wins, so pseudo-instructions come
+// before the instructions they are special cases of, and the last entry
+// matches anything) and, for each key (opcode and funct3), the entries
+// that could match instructions with it.
+
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 
+#define MAXINS 256
+#define MAXKEYS 1024
+
+typedef struct {
+	const char* name;
+	unsigned width; // bits
+	uint32_t keymask;
+	unsigned keys;
+	uint32_t (*key_bits)(unsigned key);
+
+	uint32_t mask[MAXINS];
+	uint32_t bits[MAXINS];
+	char* fmt[MAXINS];
+	unsigned count;
+
+	// entries that can match each key, each list ending with one that
+	// always matches it
+	uint8_t list[MAXKEYS][MAXINS];
+	unsigned len[MAXKEYS];
+	unsigned first[MAXKEYS]; // key whose list this one repeats
+} table_t;
+
+// opcode (bits 6:0) and funct3 (bits 14:12)
+static uint32_t key_bits32(unsigned key) {
+	return (key & 0x7f) | ((key >> 7) << 12);
+}
+
+// quadrant (bits 1:0) and funct3 (bits 15:13)
+static uint32_t key_bits16(unsigned key) {
+	return (key & 3) | ((key >> 2) << 13);
+}
+
+static table_t tab32 = {
+	.name = "instab", .width = 32,
+	.keymask = 0x0000707f, .keys = 1024, .key_bits = key_bits32,
+};
+static table_t tab16 = {
+	.name = "instab16", .width = 16,
+	.keymask = 0xe003, .keys = 32, .key_bits = key_bits16,
+};
+
+static int add(table_t* t, const char* line) {
+	if (t->count == MAXINS) {
+		fprintf(stderr, "mkinstab: too many instructions\n");
+		return -1;
+	}
+	uint32_t m = 0, b = 0;
+	for (unsigned n = 0; n < t->width; n++) {
+		uint32_t bit = 1U << (t->width - 1 - n);
+		switch (line[n]) {
+		case '1':
+			m |= bit;
+			b |= bit;
+			break;
+		case '0':
+			m |= bit;
+			break;
+		}
+	}
+	t->mask[t->count] = m;
+	t->bits[t->count] = b;
+	t->fmt[t->count] = strdup(line + t->width + 1);
+	t->count++;
+	return 0;
+}
+
+static int emit(table_t* t) {
+	if ((t->count == 0) || (t->mask[t->count - 1] != 0)) {
+		fprintf(stderr, "mkinstab: the last instruction must match anything\n");
+		return -1;
+	}
+
+	for (unsigned k = 0; k < t->keys; k++) {
+		uint32_t kb = t->key_bits(k);
+		for (unsigned n = 0; n < t->count; n++) {
+			if ((kb ^ t->bits[n]) & t->mask[n] & t->keymask) continue;
+			t->list[k][t->len[k]++] = n;
+			// nothing after an entry that matches all of the key
+			if ((t->mask[n] & ~t->keymask) == 0) break;
+		}
+		t->first[k] = k;
+		for (unsigned j = 0; j < k; j++) {
+			if ((t->len[j] == t->len[k]) && !memcmp(t->list[j], t->list[k], t->len[k])) {
+				t->first[k] = j;
+				break;
+			}
+		}
+	}
+
+	printf("static const rvins_t %s[%u] = {\n", t->name, t->count);
+	for (unsigned n = 0; n < t->count; n++) {
+		printf("\t{ 0x%08x, 0x%08x, \"%s\" },\n", t->mask[n], t->bits[n], t->fmt[n]);
+	}
+	printf("};\n\n");
+
+	unsigned off[MAXKEYS];
+	unsigned total = 0;
+	printf("static const uint8_t %s_list[] = {\n", t->name);
+	for (unsigned k = 0; k < t->keys; k++) {
+		if (t->first[k] != k) {
+			off[k] = off[t->first[k]];
+			continue;
+		}
+		off[k] = total;
+		total += t->len[k];
+		printf("\t");
+		for (unsigned n = 0; n < t->len[k]; n++) {
+			printf("%u,%s", t->list[k][n], (n == t->len[k] - 1) ? "\n" : " ");
+		}
+	}
+	printf("};\n\n");
+
+	printf("// into %s_list, by %s\n", t->name, (t->width == 32) ?
+		"funct3 << 7 | opcode" : "funct3 << 2 | quadrant");
+	printf("static const uint16_t %s_index[%u] = {", t->name, t->keys);
+	for (unsigned k = 0; k < t->keys; k++) {
+		printf("%s%u,", (k % 16) ? " " : "\n\t", off[k]);
+	}
+	printf("\n};\n");
+	return 0;
+}
+
 int main(int argc, char** argv) {
 	char line[128];
 	while (fgets(line, sizeof(line), stdin) != NULL) {
@@ -15,24 +145,23 @@ int main(int argc, char** argv) {
 			if (!isspace(line[end])) break;
 			line[end] = 0;
 		}
-		if ((line[0] == 0) || (line[0] == '#') ||
-			isspace(line[0]) || (end < 34)) {
+		if ((line[0] == 0) || (line[0] == '#') || isspace(line[0])) {
 			continue;
 		}
-		uint32_t mask = 0, bits = 0;
-		for (unsigned n = 0; n < 32; n++) {
-			uint32_t bit = 1U << (31 - n);
-			switch (line[n]) {
-			case '1':
-				mask |= bit;
-				bits |= bit;
-				break;
-			case '0':
-				mask |= bit;
-				break;
-			} 
+		// the width of the pattern says which table it is for
+		unsigned width = strcspn(line, " \t");
+		table_t* t = (width == 32) ? &tab32 : (width == 16) ? &tab16 : NULL;
+		if ((t == NULL) || (end <= width)) {
+			continue;
+		}
+		if (add(t, line) < 0) {
+			return -1;
 		}
-		printf("{ 0x%08x, 0x%08x, \"%s\" },\n", mask, bits, line + 33);
 	}
+
+	printf("// generated by mkinstab from instab.txt\n\n");
+	if (emit(&tab32) < 0) return -1;
+	printf("\n");
+	if (emit(&tab16) < 0) return -1;
 	return 0;
 }
@@ -45,6 +45,9 @@ static inline uint32_t get_fn3(uint32_t ins) {
 static inline uint32_t get_fn7(uint32_t ins) {
 	return ins >> 25;
 }
+static inline uint32_t get_fn5(uint32_t ins) {
+	return ins >> 27;
+}
 static inline uint32_t get_ic(uint32_t ins) {
 	return (ins >> 15) & 0x1F;
 }
@@ -52,6 +55,59 @@ static inline uint32_t get_iC(uint32_t ins) {
 	return ins >> 20;
 }
 
+// compressed (16 bit) instruction fields
+// (rd and rs1 at 11:7 are where get_rd() finds them)
+static inline uint32_t get_c_r2(uint32_t ins) {
+	return (ins >> 2) & 0x1f;
+}
+static inline uint32_t get_c_r1p(uint32_t ins) { // rs1' and rd' at 9:7
+	return ((ins >> 7) & 7) + 8;
+}
+static inline uint32_t get_c_r2p(uint32_t ins) { // rs2' and rd' at 4:2
+	return ((ins >> 2) & 7) + 8;
+}
+static inline uint32_t get_c_fn3(uint32_t ins) {
+	return (ins >> 13) & 7;
+}
+static inline uint32_t get_c_imm(uint32_t ins) { // ci: addi, li, andi
+	return (((int32_t)(ins << 19)) >> 26 & 0xffffffe0) | ((ins >> 2) & 0x1f);
+}
+static inline uint32_t get_c_shamt(uint32_t ins) {
+	return ((ins >> 7) & 0x20) | ((ins >> 2) & 0x1f);
+}
+static inline uint32_t get_c_lui(uint32_t ins) {
+	return get_c_imm(ins) << 12;
+}
+static inline uint32_t get_c_addi16sp(uint32_t ins) {
+	return (((int32_t)(ins << 19)) >> 22 & 0xfffffe00) |
+		((ins >> 2) & 0x10) | ((ins << 1) & 0x40) |
+		((ins << 4) & 0x180) | ((ins << 3) & 0x20);
+}
+static inline uint32_t get_c_addi4spn(uint32_t ins) {
+	return ((ins >> 7) & 0x30) | ((ins >> 1) & 0x3c0) |
+		((ins >> 4) & 0x4) | ((ins >> 2) & 0x8);
+}
+static inline uint32_t get_c_lw(uint32_t ins) { // cl and cs: lw, sw
+	return ((ins >> 7) & 0x38) | ((ins >> 4) & 0x4) | ((ins << 1) & 0x40);
+}
+static inline uint32_t get_c_lwsp(uint32_t ins) {
+	return ((ins >> 7) & 0x20) | ((ins >> 2) & 0x1c) | ((ins << 4) & 0xc0);
+}
+static inline uint32_t get_c_swsp(uint32_t ins) {
+	return ((ins >> 7) & 0x3c) | ((ins >> 1) & 0xc0);
+}
+static inline uint32_t get_c_j(uint32_t ins) { // cj: j, jal
+	return (((int32_t)(ins << 19)) >> 20 & 0xfffff800) |
+		((ins >> 7) & 0x10) | ((ins >> 1) & 0x300) |
+		((ins << 2) & 0x400) | ((ins >> 1) & 0x40) |
+		((ins << 1) & 0x80) | ((ins >> 2) & 0xe) |
+		((ins << 3) & 0x20);
+}
+static inline uint32_t get_c_b(uint32_t ins) { // cb: beqz, bnez
+	return (((int32_t)(ins << 19)) >> 23 & 0xffffff00) |
+		((ins >> 7) & 0x18) | ((ins << 1) & 0xc0) |
+		((ins >> 2) & 0x6) | ((ins << 3) & 0x20);
+}
 
 // opcode constants (6:0)
 #define OC_LOAD     0b0000011
@@ -60,6 +116,7 @@ static inline uint32_t get_iC(uint32_t ins) {
 #define OC_OP_IMM   0b0010011
 #define OC_AUIPC    0b0010111
 #define OC_STORE    0b0100011
+#define OC_AMO      0b0101111
 #define OC_OP       0b0110011
 #define OC_LUI      0b0110111
 #define OC_BRANCH   0b1100011
@@ -127,6 +184,19 @@ static inline uint32_t get_iC(uint32_t ins) {
 #define F3_CSRRS 0b10
 #define F3_CSRRC 0b11
 
+// further discrimination of OC_AMO (31:27) (fn3==0b010)
+#define F5_LR      0b00010
+#define F5_SC      0b00011
+#define F5_AMOSWAP 0b00001
+#define F5_AMOADD  0b00000
+#define F5_AMOXOR  0b00100
+#define F5_AMOAND  0b01100
+#define F5_AMOOR   0b01000
+#define F5_AMOMIN  0b10000
+#define F5_AMOMAX  0b10100
+#define F5_AMOMINU 0b11000
+#define F5_AMOMAXU 0b11100
+
 // further discrimination of OC_MISC_MEM (14:12)
 #define F3_FENCE   0b000
 #define F3_FENCE_I 0b001
@@ -151,6 +221,40 @@ static inline uint32_t get_iC(uint32_t ins) {
 #define CSR_MTVAL       0x343
 #define CSR_MIP         0x344
 
+// counters: (m)hpmcounter3..31 follow (m)instret, the high halves of
+// all of them are 0x80 above
+#define CSR_CYCLE       0xC00
+#define CSR_TIME        0xC01
+#define CSR_INSTRET     0xC02
+#define CSR_HPMCOUNTER3 0xC03
+#define CSR_CYCLEH      0xC80
+#define CSR_TIMEH       0xC81
+#define CSR_INSTRETH    0xC82
+#define CSR_HPMCOUNTER3H 0xC83
+
+#define CSR_MCYCLE      0xB00
+#define CSR_MINSTRET    0xB02
+#define CSR_MHPMCOUNTER3 0xB03
+#define CSR_MCYCLEH     0xB80
+#define CSR_MINSTRETH   0xB82
+#define CSR_MHPMCOUNTER3H 0xB83
+
+#define CSR_MHPMEVENT3  0x323
+
+// mstatus fields (only machine mode, so mpp always reads as 11)
+#define MSTATUS_MIE     0x00000008
+#define MSTATUS_MPIE    0x00000080
+#define MSTATUS_MPP     0x00001800
+
+// mie and mip bits, and the interrupt codes of mcause
+#define MIP_MSIP        0x00000008
+#define MIP_MTIP        0x00000080
+#define MIP_MEIP        0x00000800
+#define IC_M_SOFTWARE   3
+#define IC_M_TIMER      7
+#define IC_M_EXTERNAL   11
+#define MCAUSE_INT      0x80000000
+
 // exception codes
 #define EC_I_ALIGN       0
 #define EC_I_ACCESS      1
@@ -167,6 +271,18 @@ static inline uint32_t get_iC(uint32_t ins) {
 #define EC_L_PAGEFAULT   13
 #define EC_S_PAGEFAULT   15
 
+// CLINT registers (offsets from its base)
+#define CLINT_MSIP      0x0000 // a word per hart
+#define CLINT_MTIMECMP  0x4000 // a doubleword per hart
+#define CLINT_MTIME     0xBFF8
+#define CLINT_SIZE      0x10000
+
+// disassemble ins, an instruction word or the halfword of a compressed
+// instruction (anything with bits 1:0 not 11)
 void rvdis(uint32_t pc, uint32_t ins, char *out);
+
+// the 32 bit instruction a compressed one (ins & 3 != 3) stands for,
+// or 0 (illegal) if it is reserved or needs an extension we lack
+uint32_t rvc_expand(uint32_t ins);
 const char* rvregname(uint32_t n);
 
@@ -0,0 +1,140 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// The C (compressed) extension: every 16 bit instruction is an alias
+// for a 32 bit one, so they are expanded when decoded and then run like
+// any other.  The expansion of all 64K encodings is worked out once, up
+// front, into a table.
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "riscv.h"
+#include "rvcore.h"
+
+static inline uint32_t enc_i(uint32_t oc, uint32_t fn3, uint32_t rd, uint32_t r1, uint32_t imm) {
+	return (imm << 20) | (r1 << 15) | (fn3 << 12) | (rd << 7) | oc;
+}
+
+static inline uint32_t enc_r(uint32_t oc, uint32_t fn3, uint32_t fn7, uint32_t rd, uint32_t r1, uint32_t r2) {
+	return (fn7 << 25) | (r2 << 20) | (r1 << 15) | (fn3 << 12) | (rd << 7) | oc;
+}
+
+static inline uint32_t enc_s(uint32_t oc, uint32_t fn3, uint32_t r1, uint32_t r2, uint32_t imm) {
+	return ((imm & 0xfe0) << 20) | (r2 << 20) | (r1 << 15) | (fn3 << 12) | ((imm & 0x1f) << 7) | oc;
+}
+
+static inline uint32_t enc_b(uint32_t fn3, uint32_t r1, uint32_t r2, uint32_t imm) {
+	return ((imm & 0x1000) << 19) | ((imm & 0x7e0) << 20) | (r2 << 20) | (r1 << 15) |
+		(fn3 << 12) | ((imm & 0x1e) << 7) | ((imm & 0x800) >> 4) | OC_BRANCH;
+}
+
+static inline uint32_t enc_j(uint32_t rd, uint32_t imm) {
+	return ((imm & 0x100000) << 11) | ((imm & 0x7fe) << 20) | ((imm & 0x800) << 9) |
+		(imm & 0xff000) | (rd << 7) | OC_JAL;
+}
+
+uint32_t rvc_expand(uint32_t ins) {
+	uint32_t rd = get_rd(ins);
+	uint32_t r2 = get_c_r2(ins);
+	uint32_t rdp = get_c_r1p(ins);
+	uint32_t r2p = get_c_r2p(ins);
+	switch (((ins & 3) << 3) | get_c_fn3(ins)) {
+	// quadrant 0 (c.fld, c.flw, c.fsd and c.fsw need F and D)
+	case 0b00000: { // c.addi4spn
+		uint32_t imm = get_c_addi4spn(ins);
+		if (imm == 0) return 0;
+		return enc_i(OC_OP_IMM, F3_ADDI, r2p, 2, imm);
+	}
+	case 0b00010: // c.lw
+		return enc_i(OC_LOAD, F3_LW, r2p, rdp, get_c_lw(ins));
+	case 0b00110: // c.sw
+		return enc_s(OC_STORE, F3_SW, rdp, r2p, get_c_lw(ins));
+	// quadrant 1
+	case 0b01000: // c.addi (and c.nop)
+		return enc_i(OC_OP_IMM, F3_ADDI, rd, rd, get_c_imm(ins) & 0xfff);
+	case 0b01001: // c.jal
+		return enc_j(1, get_c_j(ins));
+	case 0b01010: // c.li
+		return enc_i(OC_OP_IMM, F3_ADDI, rd, 0, get_c_imm(ins) & 0xfff);
+	case 0b01011:
+		if (rd == 2) { // c.addi16sp
+			uint32_t imm = get_c_addi16sp(ins);
+			if (imm == 0) return 0;
+			return enc_i(OC_OP_IMM, F3_ADDI, 2, 2, imm & 0xfff);
+		} else { // c.lui
+			uint32_t imm = get_c_lui(ins);
+			if (imm == 0) return 0;
+			return imm | (rd << 7) | OC_LUI;
+		}
+	case 0b01100:
+		switch ((ins >> 10) & 3) {
+		case 0b00: // c.srli
+			if (ins & 0x1000) return 0;
+			return enc_i(OC_OP_IMM, F3_SRLI, rdp, rdp, get_c_shamt(ins));
+		case 0b01: // c.srai
+			if (ins & 0x1000) return 0;
+			return enc_i(OC_OP_IMM, F3_SRAI, rdp, rdp, get_c_shamt(ins) | 0x400);
+		case 0b10: // c.andi
+			return enc_i(OC_OP_IMM, F3_ANDI, rdp, rdp, get_c_imm(ins) & 0xfff);
+		default:
+			if (ins & 0x1000) return 0; // c.subw and c.addw are RV64
+			switch ((ins >> 5) & 3) {
+			case 0b00: return enc_r(OC_OP, F3_SUB, 0b0100000, rdp, rdp, r2p);
+			case 0b01: return enc_r(OC_OP, F3_XOR, 0, rdp, rdp, r2p);
+			case 0b10: return enc_r(OC_OP, F3_OR, 0, rdp, rdp, r2p);
+			default:   return enc_r(OC_OP, F3_AND, 0, rdp, rdp, r2p);
+			}
+		}
+	case 0b01101: // c.j
+		return enc_j(0, get_c_j(ins));
+	case 0b01110: // c.beqz
+		return enc_b(F3_BEQ, rdp, 0, get_c_b(ins));
+	case 0b01111: // c.bnez
+		return enc_b(F3_BNE, rdp, 0, get_c_b(ins));
+	// quadrant 2 (c.fldsp, c.flwsp, c.fsdsp and c.fswsp need F and D)
+	case 0b10000: // c.slli
+		if (ins & 0x1000) return 0;
+		return enc_i(OC_OP_IMM, F3_SLLI, rd, rd, get_c_shamt(ins));
+	case 0b10010: // c.lwsp
+		if (rd == 0) return 0;
+		return enc_i(OC_LOAD, F3_LW, rd, 2, get_c_lwsp(ins));
+	case 0b10100:
+		if ((ins & 0x1000) == 0) {
+			if (r2 == 0) { // c.jr
+				if (rd == 0) return 0;
+				return enc_i(OC_JALR, 0, 0, rd, 0);
+			} else { // c.mv
+				return enc_r(OC_OP, F3_ADD, 0, rd, 0, r2);
+			}
+		} else {
+			if (r2 == 0) {
+				if (rd == 0) { // c.ebreak
+					return enc_i(OC_SYSTEM, 0, 0, 0, 1);
+				} else { // c.jalr
+					return enc_i(OC_JALR, 0, 1, rd, 0);
+				}
+			} else { // c.add
+				return enc_r(OC_OP, F3_ADD, 0, rd, rd, r2);
+			}
+		}
+	case 0b10110: // c.swsp
+		return enc_s(OC_STORE, F3_SW, 2, r2, get_c_swsp(ins));
+	default:
+		return 0;
+	}
+}
+
+static uint32_t rvc_tab[65536];
+static pthread_once_t rvc_once = PTHREAD_ONCE_INIT;
+
+static void rvc_init(void) {
+	for (uint32_t n = 0; n < 65536; n++) {
+		rvc_tab[n] = ((n & 3) == 3) ? 0 : rvc_expand(n);
+	}
+}
+
+const uint32_t* rvc_table(void) {
+	pthread_once(&rvc_once, rvc_init);
+	return rvc_tab;
+}
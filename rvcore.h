@@ -0,0 +1,368 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "rvsim.h"
+
+// simulator internals shared between rvsim.c and rvjit.c
+
+// default memory layout
+#define RVMEMBASE 0x80000000
+#define RVMEMSIZE 0x01000000
+
+// decode cache geometry: one rvpage_t per 4K page of guest ram, with a
+// slot for each place an instruction can start: every word or, with
+// the C extension, every halfword (1 << rvstate_t.slotshift bytes)
+#define RVPAGESHIFT 12
+#define RVPAGESIZE  (1U << RVPAGESHIFT)
+#define RVPAGEMASK  (RVPAGESIZE - 1)
+#define RVPAGESLOTS(s) (RVPAGESIZE >> (s)->slotshift)
+
+// host huge page size, for RVSIM_HUGEPAGES_HUGETLB
+#define RVHUGEPAGESIZE 0x200000
+
+// host address space reserved per instance (on 64bit hosts): all of the
+// guest's, with ram mapped at its offset and nothing anywhere else, so
+// that compiled code can access memory without checking the address
+#define RVVMSIZE 0x100000000ULL
+
+// harts share ram, everything else (including the decode cache) is
+// private to the host thread running the hart
+// (codemap has a bit for each, and RVCODEMAP_CLEAN)
+#define RVMAXHARTS 63
+
+// codemap bit of pages not written since the last checkpoint, so that
+// the first store to one takes the code write path and notes it dirty
+#define RVCODEMAP_CLEAN (1ULL << 63)
+
+// events posted to a hart by other threads, polled whenever it enters
+// a basic block
+#define RVEV_STOP  1 // the simulation is over
+#define RVEV_INVAL 2 // pages holding its decoded code were written
+#define RVEV_JITFAULT 4 // an unchecked access in compiled code faulted
+#define RVEV_IRQ   8 // an interrupt may be pending and enabled
+#define RVEV_TIMER 16 // mtimecmp or mtime were written
+#define RVEV_DEBUG 32 // a store hit a watchpoint (s->dbgstop)
+
+// breakpoints and watchpoints (rvsim_breakpoint(), rvsim_watchpoint())
+#define RVMAXBREAK 64
+#define RVMAXWATCH 8
+
+// distinct pages queued for RVEV_INVAL before a full flush is cheaper
+#define RVINVALMAX 16
+
+// entries of a shadow call stack (rvconfig_t.callstack)
+#define RVCALLDEPTH 256
+
+// counters 3..31 are mhpmcounters
+#define RVHPMCOUNTERS 32
+
+// resv_addr when there is no lr.w reservation (never word aligned)
+#define RVRESV_NONE 1
+
+// why an engine returned
+#define RVRUN_BUDGET 0 // instruction limit reached, resume at s->pc
+#define RVRUN_STOP   1 // the simulation is over (sys->exitcode)
+#define RVRUN_WAIT   2 // waiting for a deferred iocall, resume at s->pc
+#define RVRUN_WFI    3 // executed wfi, resume at s->pc
+#define RVRUN_DEBUG  4 // stopped for the debugger (s->dbgstop), resume at s->pc
+
+// harts sharing a host thread (rvsim_run) take turns this long
+#define RVRUN_QUANTUM 10000
+
+// handler indices for pre-decoded instructions
+enum {
+	OP_DECODE = 0, // slot not yet decoded
+	OP_PAGE_END, // sentinel following the last slot of a page
+	OP_ILLEGAL,
+	OP_IFAULT, // instruction fetch access fault
+	OP_NOP,
+	OP_LI, // lui, auipc
+	OP_ADDI, OP_SLTI, OP_SLTIU, OP_XORI, OP_ORI, OP_ANDI,
+	OP_SLLI, OP_SRLI, OP_SRAI,
+	OP_ADD, OP_SUB, OP_SLL, OP_SLT, OP_SLTU,
+	OP_XOR, OP_SRL, OP_SRA, OP_OR, OP_AND,
+	OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU,
+	OP_DIV, OP_DIVU, OP_REM, OP_REMU,
+	OP_LB, OP_LH, OP_LW, OP_LBU, OP_LHU,
+	OP_SB, OP_SH, OP_SW,
+	OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+	OP_JAL, OP_JALR,
+	OP_CALL, OP_CALLR, OP_RET, // jal/jalr tracked by the shadow call stack
+	OP_FENCE, OP_FENCE_I,
+	OP_LR, OP_SC,
+	OP_AMOSWAP, OP_AMOADD, OP_AMOXOR, OP_AMOAND, OP_AMOOR,
+	OP_AMOMIN, OP_AMOMAX, OP_AMOMINU, OP_AMOMAXU,
+	OP_ECALL, OP_EBREAK, OP_MRET, OP_WFI,
+	OP_CSRRW, OP_CSRRS, OP_CSRRC,
+	OP_CSRRWI, OP_CSRRSI, OP_CSRRCI,
+	OP_EXITI, OP_EXIT, OP_IOCALL,
+	OP_JIT, // head of a compiled block
+	OP_BREAK, // a breakpoint, planted over the decoded instruction
+	// pairs run as one (rvsim.c, fuse()): the fields of the first,
+	// lui or auipc, slli or the compare, and rd2 and imm2 of the second
+	OP_LI_ADDI, // addi rd, rd, imm2
+	OP_LI_JALR, // jalr rd2, imm2(rd)
+	OP_LI_LW, // lw rd2, imm2(rd)
+	OP_SLLI_SRLI, // srli rd, rd, imm
+	OP_SLT_BZ, OP_SLTU_BZ, OP_SLTI_BZ, OP_SLTIU_BZ, // beqz or bnez rd, pc + 4 + imm2
+	OP_COUNT,
+};
+
+// the first instruction of a fused pair, op otherwise
+static inline unsigned rvop_unfused(unsigned op) {
+	switch (op) {
+	case OP_LI_ADDI: case OP_LI_JALR: case OP_LI_LW: return OP_LI;
+	case OP_SLLI_SRLI: return OP_SLLI;
+	case OP_SLT_BZ: return OP_SLT;
+	case OP_SLTU_BZ: return OP_SLTU;
+	case OP_SLTI_BZ: return OP_SLTI;
+	case OP_SLTIU_BZ: return OP_SLTIU;
+	default: return op;
+	}
+}
+
+// a pre-decoded instruction
+// rd of x0 is redirected to x[32] so writes need not be checked
+// imm holds the immediate, the absolute target of pc-relative
+// branches/jumps/auipc, the csr number, or (OP_ILLEGAL) the encoding
+typedef struct rvop {
+	uint8_t op;
+	uint8_t rd;
+	uint8_t r1; // zimm for csr*i
+	uint8_t r2;
+	uint32_t imm;
+	uint32_t pc;
+	uint8_t len; // in bytes: 2 (compressed) or 4
+	// fused pairs: the second instruction's rd (or, branching on the
+	// compare, the value that takes the branch) and immediate
+	uint8_t rd2;
+	int16_t imm2;
+	union {
+		// threaded engine: last target of a branch or jump
+		struct rvop* link;
+		// OP_JIT: the compiled block starting here
+		struct rvjitblock* jit;
+	};
+} rvop_t;
+
+typedef struct rvpage {
+	uint8_t jitted; // has OP_JIT slots
+	uint8_t nojit;  // code in this page was modified, don't compile it
+	uint8_t checked; // compile with address checks (it has faulted)
+	// RVPAGESLOTS() slots, then two sentinels: where falling through
+	// from the last slot lands (a slot on, or a word on from the last
+	// halfword)
+	rvop_t op[];
+} rvpage_t;
+
+typedef struct rvjit rvjit_t;
+typedef struct rvsys rvsys_t;
+
+// a device mapped by rvsim_device_add()
+typedef struct rvregion {
+	uint32_t base;
+	uint32_t size;
+	rvdevice_t dev;
+	void* ctx;
+} rvregion_t;
+
+// one hart
+typedef struct rvstate {
+	uint32_t x[33];
+	uint32_t events;
+	uint32_t pc; // where the next run resumes
+	void* memory;    // sys->memory
+	uint8_t* vmem;   // sys->vmem
+	uint64_t* codemap; // sys->codemap
+	uint32_t membase;
+	uint32_t memsize;
+	uint32_t pagecount;
+	uint32_t mscratch;
+	uint32_t mtvec;
+	uint32_t mtval;
+	uint32_t mepc;
+	uint32_t mcause;
+	uint32_t hartid;
+	// lr.w reservation: address and the value loaded from it
+	// (sc.w succeeds if memory still holds that value)
+	uint32_t resv_addr;
+	uint32_t resv_val;
+	rvregion_t* lastdev; // device last accessed (or NULL)
+	void* ctx;
+	rvpage_t** dcache;
+	unsigned engine;
+	rvjit_t* jit;
+	uint16_t* jithot;
+	uint32_t jitfault; // pc of the last compiled access that faulted
+	uint64_t ccount;
+	rvsys_t* sys;
+
+	// secondary harts don't run until started
+	pthread_t thread;
+	int started;
+
+	// deferred iocalls (rvsim_iocall_defer)
+	int iodefer;  // the iocall in progress will complete later
+	int iowait;   // stopped until it does
+	int iodone;   // it completed before the hart stopped
+	uint32_t ioresult;
+
+	// pages written by other harts, for RVEV_INVAL
+	pthread_mutex_t inval_lock;
+	uint32_t inval[RVINVALMAX];
+	unsigned inval_count;
+
+	// events seen (evcount[RVSIM_EV_NONE] stays 0) and the counter csrs
+	// made of them: each reads as a count plus an offset set by writes
+	uint64_t evcount[RVSIM_EV_COUNT];
+	uint64_t cycleoff;
+	uint64_t instretoff;
+	uint64_t hpmoff[RVHPMCOUNTERS];
+	uint8_t hpmevent[RVHPMCOUNTERS];
+
+	// shadow call stack (rvconfig_t.callstack): return addresses of the
+	// calls in progress, outermost first, of which only the first
+	// RVCALLDEPTH are kept
+	uint32_t* callstack;
+	unsigned calldepth;
+
+	struct rvtracer* trace; // rvsim_trace_start() (or NULL)
+	uint8_t* cover; // rvsim_coverage() (or NULL)
+	uint32_t coverprev; // hash of the last block entered, halved
+	struct rvtiming* timing; // rvtiming_start() (or NULL)
+	unsigned debug; // rvconfig_t.debug
+
+	// rvconfig_t.rvc: expansions of compressed instructions (or NULL),
+	// the bits of a jump target that must be clear, and the decode
+	// cache slot size
+	const uint32_t* rvc;
+	uint32_t ialign;
+	uint32_t slotshift;
+	int fuse; // decode idiomatic pairs as one (rvconfig_t.nofuse)
+
+	// interrupts: mip has MSIP and MEIP raised by other threads (so it
+	// is only changed atomically) and MTIP, kept up to date with time
+	// by hart_run(); time is the instructions retired plus timeoff,
+	// which wfi moves on to the next timer interrupt
+	uint32_t mstatus; // MIE and MPIE
+	uint32_t mie;
+	uint32_t mip;
+	uint64_t mtimecmp;
+	uint64_t timeoff;
+	int wfi; // stopped in wfi until an interrupt is raised
+
+	// debugging: why the hart stopped (RVSIM_STOP_*, for the address
+	// written with RVSIM_STOP_WATCH), and running a single instruction
+	unsigned dbgstop;
+	uint32_t dbgaddr;
+	int step;
+} rvstate_t;
+
+// the machine: ram and the harts sharing it
+struct rvsys {
+	void* memory;
+	uint32_t membase;
+	uint32_t memsize;
+	// the RVVMSIZE reservation ram lives in (or NULL): vmem is the host
+	// address of guest address 0
+	uint8_t* vmem;
+	void* vmmap;
+	size_t vmmaplen;
+	// per page, a bit for each hart that has decoded code there, and
+	// RVCODEMAP_CLEAN
+	uint64_t* codemap;
+	// a bit per page written since the last checkpoint saved or
+	// restored (NULL until then), and which one that was (snapid)
+	uint64_t* dirty;
+	uint64_t snapid;
+	struct rvsnapshot* snap; // rvsnap.c: what rvsim_rewind() goes back to
+	// devices, sorted by base
+	rvregion_t* region;
+	unsigned nregions;
+	unsigned maxregions;
+	rvstate_t* hart[RVMAXHARTS];
+	unsigned nharts;
+	uint32_t clint; // base of the CLINT (rvconfig_t.clint)
+	unsigned turn; // hart rvsim_run() runs next
+	rvconfig_t cfg;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // a hart was started or the simulation stopped
+	int stop;
+	int exitcode;
+
+	struct rvguest* guest; // rvsched.c: scheduler state of this instance
+
+	// breakpoint pcs, and ram ranges (offsets) watched for writes
+	uint32_t brk[RVMAXBREAK];
+	unsigned nbrk;
+	struct { uint32_t off, len; } watch[RVMAXWATCH];
+	unsigned nwatch;
+
+	// trace file (or -1), written a chunk at a time under tracelock
+	int tracefd;
+	int traceerr;
+	pthread_mutex_t tracelock;
+};
+
+// rvsim.c
+void rvsim_decode(rvstate_t* s, rvop_t* op);
+int rvsim_code_write(rvstate_t* s, uint32_t off);
+int rvsim_dirty_clear(rvstate_t* s);
+
+// rvsnap.c: release what rvsim_rewind() goes back to
+void rvsnap_free(rvstate_t* s);
+
+// rvc.c: the expansions of all 16 bit encodings, indexed by encoding
+const uint32_t* rvc_table(void);
+
+// rvjit.c
+// block entries are counted in jithot[] (hashed by pc) and a block
+// is compiled (or tried again, if it could not be) each time its
+// counter reaches RVJIT_HOT
+#define RVJIT_HOTBITS 12
+#define RVJIT_HOT     64
+
+typedef struct rvjitblock {
+	rvop_t op; // original decode of the head slot
+	uint64_t (*code)(rvstate_t* s);
+} rvjitblock_t;
+
+int rvjit_init(rvstate_t* s);
+void rvjit_free(rvstate_t* s);
+void rvjit_compile(rvstate_t* s, rvop_t* op);
+void rvjit_page_inval(rvstate_t* s, rvpage_t* pg);
+void rvjit_flush(rvstate_t* s);
+void rvjit_bind(rvstate_t* s);
+void rvjit_fault(rvstate_t* s);
+
+static inline void rvjit_profile(rvstate_t* s, rvop_t* op) {
+	uint32_t n = (op->pc >> 2) & ((1U << RVJIT_HOTBITS) - 1);
+	if (++s->jithot[n] == RVJIT_HOT) {
+		s->jithot[n] = 0;
+		rvjit_compile(s, op);
+	}
+}
+
+// rvtrace.c: recording, from rvsim_exec_hooks()
+// rvtrace_ins() starts the record of each instruction, the others add
+// to it (rd is the instruction's, or a0 for iocalls) and rvtrace_sync()
+// completes the last one
+typedef struct rvtracer rvtracer_t;
+
+void rvtrace_ins(rvstate_t* s, uint32_t pc, uint32_t ins);
+void rvtrace_rd(rvstate_t* s, uint32_t v);
+void rvtrace_mem(rvstate_t* s, uint32_t addr, uint32_t v);
+void rvtrace_trap(rvstate_t* s, uint32_t cause, uint32_t tval);
+void rvtrace_sync(rvstate_t* s);
+
+// rvtiming.c: the timing model, given each instruction (decoded or not)
+// by rvsim_exec_hooks() before it executes
+typedef struct rvtiming rvtiming_t;
+
+void rvtiming_ins(rvstate_t* s, rvop_t* op);
@@ -11,16 +11,42 @@ static char *append_str(char *buf, const char *s) {
 	return buf;
 }
 
+// at least digits hex digits of n (without sprintf, which dominated)
+static char *append_hex(char *buf, uint32_t n, unsigned digits) {
+	char tmp[8];
+	unsigned len = 0;
+	do {
+		tmp[len++] = "0123456789abcdef"[n & 15];
+		n >>= 4;
+	} while (n || (len < digits));
+	*buf++ = '0';
+	*buf++ = 'x';
+	while (len > 0) *buf++ = tmp[--len];
+	return buf;
+}
+
 static char *append_i32(char *buf, int32_t n) {
-	return buf + sprintf(buf, "%d", n);
+	char tmp[10];
+	unsigned len = 0;
+	uint32_t u = n;
+	if (n < 0) {
+		*buf++ = '-';
+		u = -u;
+	}
+	do {
+		tmp[len++] = '0' + (u % 10);
+		u /= 10;
+	} while (u);
+	while (len > 0) *buf++ = tmp[--len];
+	return buf;
 }
 
 static char *append_u32(char *buf, int32_t n) {
-	return buf + sprintf(buf, "0x%x", n);
+	return append_hex(buf, n, 1);
 }
 
 static char *append_csr(char *buf, int32_t n) {
-	return buf + sprintf(buf, "0x%03x", n & 0xFFF);
+	return append_hex(buf, n & 0xFFF, 3);
 }
 
 static const char* regname_plain[32] = {
@@ -53,14 +79,23 @@ typedef struct {
 	const char* fmt;
 } rvins_t;
 
-static rvins_t instab[] = {
 #include "gen/instab.h"
-};
 
 void rvdis(uint32_t pc, uint32_t ins, char *out) {
-	unsigned n = 0;
-	while ((ins & instab[n].mask) != instab[n].bits) n++;
-	const char* fmt = instab[n].fmt;
+	const char* fmt;
+	if ((ins & 3) != 3) {
+		// compressed: the first of the entries that can match its
+		// quadrant and funct3
+		ins &= 0xffff;
+		const uint8_t* n = instab16_list + instab16_index[((ins >> 11) & 0x1c) | (ins & 3)];
+		while ((ins & instab16[*n].mask) != instab16[*n].bits) n++;
+		fmt = instab16[*n].fmt;
+	} else {
+		// the first of the entries that can match its opcode and funct3
+		const uint8_t* n = instab_list + instab_index[((ins >> 5) & 0x380) | (ins & 0x7f)];
+		while ((ins & instab[*n].mask) != instab[*n].bits) n++;
+		fmt = instab[*n].fmt;
+	}
 	char c;
 	while ((c = *fmt++) != 0) {
 		if (c != '%') {
@@ -82,6 +117,20 @@ void rvdis(uint32_t pc, uint32_t ins, char *out) {
 		case 'c': out = append_i32(out, get_ic(ins)); break;
 		case 'x': out = append_i32(out, get_r2(ins)); break;
 		case 'C': out = append_csr(out, get_ii(ins)); break;
+		// compressed instruction fields
+		case '3': out = append_str(out, regname[get_c_r1p(ins)]); break;
+		case '4': out = append_str(out, regname[get_c_r2p(ins)]); break;
+		case '5': out = append_str(out, regname[get_c_r2(ins)]); break;
+		case 'k': out = append_i32(out, get_c_imm(ins)); break;
+		case 'K': out = append_u32(out, get_c_lui(ins)); break;
+		case 'h': out = append_i32(out, get_c_shamt(ins)); break;
+		case 'a': out = append_i32(out, get_c_addi16sp(ins)); break;
+		case 'A': out = append_i32(out, get_c_addi4spn(ins)); break;
+		case 'w': out = append_i32(out, get_c_lw(ins)); break;
+		case 'p': out = append_i32(out, get_c_lwsp(ins)); break;
+		case 'P': out = append_i32(out, get_c_swsp(ins)); break;
+		case 'T': out = append_u32(out, pc + get_c_j(ins)); break;
+		case 'E': out = append_u32(out, pc + get_c_b(ins)); break;
 		}
 	}
 	*out = 0;
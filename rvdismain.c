@@ -0,0 +1,262 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// Disassembles a whole image: the code sections of an ELF executable
+// (labelled with its symbols) or a raw binary.  Chunks of it are
+// disassembled by a pool of threads and written out in order.  With
+// the C extension instructions are 2 or 4 bytes, so chunks are cut at
+// instruction boundaries, found by a quick pass over their lengths.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "riscv.h"
+#include "rvelf.h"
+
+// instruction words per chunk
+#define CHUNK 16384
+
+#define MAXTHREADS 64
+
+typedef struct {
+	uint32_t addr;
+	const char* name;
+} label_t;
+
+typedef struct {
+	const char* section; // first chunk of a section (or NULL)
+	uint32_t addr;
+	const uint8_t* data;
+	uint32_t size;
+	char* out;
+	size_t outlen;
+} chunk_t;
+
+static label_t* labels;
+static unsigned nlabels;
+static unsigned maxlabels;
+
+static chunk_t* chunks;
+static unsigned nchunks;
+static unsigned maxchunks;
+static unsigned next_chunk;
+
+// the image has compressed instructions
+static int rvc;
+
+// the length of the instruction at p, of which there are avail bytes
+static uint32_t ins_len(const uint8_t* p, uint32_t avail) {
+	if (rvc && (avail >= 2) && ((p[0] & 3) != 3)) return 2;
+	return 4;
+}
+
+static void add_label(void* cookie, const char* name, uint32_t addr, uint32_t size) {
+	if (nlabels == maxlabels) {
+		maxlabels = maxlabels ? maxlabels * 2 : 1024;
+		if ((labels = realloc(labels, maxlabels * sizeof(label_t))) == NULL) {
+			fprintf(stderr, "error: out of memory\n");
+			exit(-1);
+		}
+	}
+	labels[nlabels].addr = addr;
+	labels[nlabels].name = name;
+	nlabels++;
+}
+
+static int label_cmp(const void* _a, const void* _b) {
+	const label_t* a = _a;
+	const label_t* b = _b;
+	if (a->addr != b->addr) return (a->addr < b->addr) ? -1 : 1;
+	return strcmp(a->name, b->name);
+}
+
+// the first label at or after addr
+static unsigned label_find(uint32_t addr) {
+	unsigned lo = 0, hi = nlabels;
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (labels[mid].addr < addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static void add_code(void* cookie, const char* name, uint32_t addr,
+	const void* data, uint32_t size) {
+	const char* section = name ? name : "(segment)";
+	uint32_t len;
+	for (uint32_t off = 0; off < size; off += len) {
+		len = ((size - off) < (CHUNK * 4)) ? (size - off) : (CHUNK * 4);
+		if (rvc) {
+			// end the chunk after an instruction, not inside one
+			const uint8_t* p = (const uint8_t*) data + off;
+			uint32_t end = 0;
+			while (end < len) end += ins_len(p + end, size - off - end);
+			if (end < (size - off)) len = end;
+		}
+		if (nchunks == maxchunks) {
+			maxchunks = maxchunks ? maxchunks * 2 : 256;
+			if ((chunks = realloc(chunks, maxchunks * sizeof(chunk_t))) == NULL) {
+				fprintf(stderr, "error: out of memory\n");
+				exit(-1);
+			}
+		}
+		chunk_t* c = chunks + nchunks++;
+		c->section = off ? NULL : section;
+		c->addr = addr + off;
+		c->data = (const uint8_t*) data + off;
+		c->size = len;
+		c->out = NULL;
+		c->outlen = 0;
+	}
+}
+
+static void disassemble(chunk_t* c) {
+	FILE* fp;
+	if ((fp = open_memstream(&c->out, &c->outlen)) == NULL) {
+		fprintf(stderr, "error: out of memory\n");
+		exit(-1);
+	}
+	if (c->section) fprintf(fp, "\nDisassembly of section %s:\n", c->section);
+	unsigned l = label_find(c->addr);
+	uint32_t off, len;
+	for (off = 0; (len = ins_len(c->data + off, c->size - off)) <= (c->size - off); off += len) {
+		uint32_t pc = c->addr + off;
+		while ((l < nlabels) && (labels[l].addr <= pc)) {
+			if (labels[l].addr == pc) fprintf(fp, "\n%08x <%s>:\n", pc, labels[l].name);
+			l++;
+		}
+		uint32_t ins = 0;
+		char dis[128];
+		memcpy(&ins, c->data + off, len);
+		rvdis(pc, ins, dis);
+		if (len == 2) {
+			fprintf(fp, "%08x: %04x     %s\n", pc, ins, dis);
+		} else {
+			fprintf(fp, "%08x: %08x %s\n", pc, ins, dis);
+		}
+	}
+	for (; off < c->size; off++) {
+		fprintf(fp, "%08x: %02x       .byte\n", c->addr + off, c->data[off]);
+	}
+	fclose(fp);
+}
+
+static void* worker(void* arg) {
+	for (;;) {
+		unsigned n = __atomic_fetch_add(&next_chunk, 1, __ATOMIC_RELAXED);
+		if (n >= nchunks) return NULL;
+		disassemble(chunks + n);
+	}
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: rvdis [options] <image>\n"
+		"  -base=ADDR   load address of a raw binary (hex, default 80000000)\n"
+		"  -rvc         a raw binary has compressed instructions (ELF\n"
+		"               executables say so themselves)\n"
+		"  -threads=N   disassemble with N threads (default: one per cpu)\n");
+}
+
+int main(int argc, char** argv) {
+	const char* fn = NULL;
+	uint32_t base = 0x80000000;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while (argc > 1) {
+		argc--;
+		argv++;
+		if (argv[0][0] != '-') {
+			if (fn != NULL) {
+				usage();
+				return -1;
+			}
+			fn = argv[0];
+			continue;
+		}
+		if (!strncmp(argv[0],"-base=",6)) {
+			base = strtoul(argv[0] + 6, NULL, 16);
+			continue;
+		}
+		if (!strcmp(argv[0],"-rvc")) {
+			rvc = 1;
+			continue;
+		}
+		if (!strncmp(argv[0],"-threads=",9)) {
+			threads = strtoul(argv[0] + 9, NULL, 0);
+			continue;
+		}
+		fprintf(stderr, "error: unknown argument: %s\n", argv[0]);
+		usage();
+		return -1;
+	}
+	if (fn == NULL) {
+		usage();
+		return -1;
+	}
+	if (threads < 1) threads = 1;
+	if (threads > MAXTHREADS) threads = MAXTHREADS;
+
+	rvelf_t* e = NULL;
+	void* data = NULL;
+	size_t size = 0;
+	if (rvelf_check(fn)) {
+		if (rvelf_open(&e, fn) < 0) {
+			fprintf(stderr, "error: cannot load '%s'\n", fn);
+			return -1;
+		}
+		rvc = rvelf_rvc(e);
+		rvelf_functions(e, add_label, NULL);
+		qsort(labels, nlabels, sizeof(label_t), label_cmp);
+		rvelf_code(e, add_code, NULL);
+	} else {
+		struct stat st;
+		int fd;
+		if (((fd = open(fn, O_RDONLY)) < 0) || (fstat(fd, &st) < 0)) {
+			fprintf(stderr, "error: cannot open '%s'\n", fn);
+			return -1;
+		}
+		size = st.st_size;
+		if (size) {
+			data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED) {
+				fprintf(stderr, "error: cannot map '%s'\n", fn);
+				return -1;
+			}
+		}
+		close(fd);
+		add_code(NULL, NULL, base, data, size);
+		if (nchunks) chunks[0].section = NULL;
+	}
+
+	pthread_t t[MAXTHREADS];
+	if (threads > nchunks) threads = nchunks;
+	for (long n = 1; n < threads; n++) {
+		if (pthread_create(t + n, NULL, worker, NULL)) {
+			fprintf(stderr, "error: cannot start thread\n");
+			return -1;
+		}
+	}
+	worker(NULL);
+	for (long n = 1; n < threads; n++) {
+		pthread_join(t[n], NULL);
+	}
+	for (unsigned n = 0; n < nchunks; n++) {
+		fwrite(chunks[n].out, 1, chunks[n].outlen, stdout);
+		free(chunks[n].out);
+	}
+
+	if (e) rvelf_close(e);
+	if (data) munmap(data, size);
+	return 0;
+}
@@ -0,0 +1,253 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "rvsim.h"
+#include "rvelf.h"
+
+#define PAGESIZE 4096
+#define PAGEMASK (PAGESIZE - 1)
+
+struct rvelf {
+	int fd;
+	uint8_t* data; // the whole file, mapped read-only
+	size_t size;
+	Elf32_Ehdr* eh;
+	Elf32_Phdr* ph;
+	Elf32_Shdr* sh;  // section headers (or NULL)
+	unsigned nsh;
+	Elf32_Sym* sym;  // .symtab (or NULL)
+	unsigned nsyms;
+	const char* str; // its string table
+	size_t strsize;
+};
+
+// is [off, off + len) inside the file?
+static int inside(rvelf_t* e, uint64_t off, uint64_t len) {
+	return (off <= e->size) && (len <= (e->size - off));
+}
+
+static int map_file(rvelf_t* e, const char* fn) {
+	struct stat st;
+	if ((e->fd = open(fn, O_RDONLY)) < 0) return -1;
+	if ((fstat(e->fd, &st) < 0) || (st.st_size == 0)) return -1;
+	e->size = st.st_size;
+	e->data = mmap(NULL, e->size, PROT_READ, MAP_PRIVATE, e->fd, 0);
+	if (e->data == MAP_FAILED) {
+		e->data = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static int check(rvelf_t* e) {
+	Elf32_Ehdr* eh = (void*) e->data;
+	if (!inside(e, 0, sizeof(Elf32_Ehdr)) ||
+		memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+		(eh->e_ident[EI_CLASS] != ELFCLASS32) ||
+		(eh->e_ident[EI_DATA] != ELFDATA2LSB) ||
+		(eh->e_type != ET_EXEC) || (eh->e_machine != EM_RISCV) ||
+		(eh->e_phentsize != sizeof(Elf32_Phdr)) ||
+		!inside(e, eh->e_phoff, eh->e_phnum * sizeof(Elf32_Phdr))) {
+		return -1;
+	}
+	e->eh = eh;
+	e->ph = (void*) (e->data + eh->e_phoff);
+
+	// the symbol table is optional
+	if ((eh->e_shentsize != sizeof(Elf32_Shdr)) ||
+		!inside(e, eh->e_shoff, eh->e_shnum * sizeof(Elf32_Shdr))) {
+		return 0;
+	}
+	Elf32_Shdr* sh = (void*) (e->data + eh->e_shoff);
+	e->sh = sh;
+	e->nsh = eh->e_shnum;
+	for (unsigned n = 0; n < eh->e_shnum; n++) {
+		if (sh[n].sh_type != SHT_SYMTAB) continue;
+		if (sh[n].sh_link >= eh->e_shnum) break;
+		Elf32_Shdr* ss = sh + sh[n].sh_link;
+		if (!inside(e, sh[n].sh_offset, sh[n].sh_size) ||
+			!inside(e, ss->sh_offset, ss->sh_size) ||
+			(ss->sh_size == 0)) {
+			break;
+		}
+		e->sym = (void*) (e->data + sh[n].sh_offset);
+		e->nsyms = sh[n].sh_size / sizeof(Elf32_Sym);
+		e->str = (void*) (e->data + ss->sh_offset);
+		e->strsize = ss->sh_size;
+		break;
+	}
+	return 0;
+}
+
+int rvelf_open(rvelf_t** _e, const char* fn) {
+	rvelf_t* e;
+	if ((e = calloc(1, sizeof(rvelf_t))) == NULL) {
+		return -1;
+	}
+	e->fd = -1;
+	if ((map_file(e, fn) < 0) || (check(e) < 0)) {
+		rvelf_close(e);
+		return -1;
+	}
+	*_e = e;
+	return 0;
+}
+
+void rvelf_close(rvelf_t* e) {
+	if (e->data) munmap(e->data, e->size);
+	if (e->fd >= 0) close(e->fd);
+	free(e);
+}
+
+// clear [addr, addr + len), handing whole pages back as demand-zero
+static void zero(rvstate_t* s, uint8_t* ptr, uint32_t addr, uint32_t len) {
+	uint32_t head = (PAGESIZE - (addr & PAGEMASK)) & PAGEMASK;
+	if (len > head) {
+		uint32_t body = (len - head) & ~PAGEMASK;
+		if (body && (rvsim_mmap(s, addr + head, body, -1, 0) == 0)) {
+			memset(ptr, 0, head);
+			memset(ptr + head + body, 0, len - head - body);
+			return;
+		}
+	}
+	memset(ptr, 0, len);
+}
+
+// whole pages of file data are mapped copy-on-write, the partial
+// pages at either end (which may be shared with another segment)
+// are copied
+static int load_segment(rvelf_t* e, rvstate_t* s, Elf32_Phdr* ph) {
+	uint32_t addr = ph->p_paddr;
+	uint32_t len = ph->p_filesz;
+	uint8_t* ptr;
+	if ((ph->p_filesz > ph->p_memsz) ||
+		!inside(e, ph->p_offset, ph->p_filesz) ||
+		((ptr = rvsim_dma(s, addr, ph->p_memsz)) == NULL)) {
+		return -1;
+	}
+	uint8_t* data = e->data + ph->p_offset;
+	uint32_t head = (PAGESIZE - (addr & PAGEMASK)) & PAGEMASK;
+	uint32_t body = 0;
+	if ((((addr ^ ph->p_offset) & PAGEMASK) == 0) && (len > head)) {
+		body = (len - head) & ~PAGEMASK;
+		if (body && (rvsim_mmap(s, addr + head, body, e->fd, ph->p_offset + head) < 0)) {
+			body = 0;
+		}
+	}
+	if (body) {
+		memcpy(ptr, data, head);
+		memcpy(ptr + head + body, data + head + body, len - head - body);
+	} else {
+		memcpy(ptr, data, len);
+	}
+	zero(s, ptr + len, addr + len, ph->p_memsz - len);
+	return 0;
+}
+
+int rvelf_load(rvelf_t* e, rvstate_t* s) {
+	for (unsigned n = 0; n < e->eh->e_phnum; n++) {
+		Elf32_Phdr* ph = e->ph + n;
+		if ((ph->p_type != PT_LOAD) || (ph->p_memsz == 0)) continue;
+		if (load_segment(e, s, ph) < 0) return -1;
+	}
+	return 0;
+}
+
+uint32_t rvelf_entry(rvelf_t* e) {
+	return e->eh->e_entry;
+}
+
+int rvelf_rvc(rvelf_t* e) {
+	return (e->eh->e_flags & 0x0001) != 0; // EF_RISCV_RVC
+}
+
+int rvelf_symbol(rvelf_t* e, const char* name, uint32_t* value) {
+	size_t len = strlen(name);
+	for (unsigned n = 0; n < e->nsyms; n++) {
+		uint32_t off = e->sym[n].st_name;
+		if ((off >= e->strsize) || (len >= (e->strsize - off))) continue;
+		if (memcmp(e->str + off, name, len + 1)) continue;
+		*value = e->sym[n].st_value;
+		return 0;
+	}
+	return -1;
+}
+
+void rvelf_functions(rvelf_t* e, void (*fn)(void* cookie, const char* name,
+	uint32_t addr, uint32_t size), void* cookie) {
+	for (unsigned n = 0; n < e->nsyms; n++) {
+		Elf32_Sym* sym = e->sym + n;
+		uint32_t type = ELF32_ST_TYPE(sym->st_info);
+		// functions, and the plain labels of assembly code
+		if ((type != STT_FUNC) && (type != STT_NOTYPE)) continue;
+		if ((sym->st_shndx >= e->nsh) ||
+			!(e->sh[sym->st_shndx].sh_flags & SHF_EXECINSTR)) {
+			continue;
+		}
+		uint32_t off = sym->st_name;
+		if ((off >= e->strsize) || (memchr(e->str + off, 0, e->strsize - off) == NULL)) {
+			continue;
+		}
+		const char* name = e->str + off;
+		// local and mapping symbols
+		if ((name[0] == 0) || (name[0] == '$') || !strncmp(name, ".L", 2)) continue;
+		fn(cookie, name, sym->st_value, sym->st_size);
+	}
+}
+
+void rvelf_code(rvelf_t* e, void (*fn)(void* cookie, const char* name,
+	uint32_t addr, const void* data, uint32_t size), void* cookie) {
+	if (e->sh == NULL) {
+		for (unsigned n = 0; n < e->eh->e_phnum; n++) {
+			Elf32_Phdr* ph = e->ph + n;
+			if ((ph->p_type != PT_LOAD) || !(ph->p_flags & PF_X) ||
+				!inside(e, ph->p_offset, ph->p_filesz)) {
+				continue;
+			}
+			fn(cookie, NULL, ph->p_vaddr, e->data + ph->p_offset, ph->p_filesz);
+		}
+		return;
+	}
+	// section names
+	const char* str = NULL;
+	size_t strsize = 0;
+	if (e->eh->e_shstrndx < e->nsh) {
+		Elf32_Shdr* ss = e->sh + e->eh->e_shstrndx;
+		if (inside(e, ss->sh_offset, ss->sh_size)) {
+			str = (void*) (e->data + ss->sh_offset);
+			strsize = ss->sh_size;
+		}
+	}
+	for (unsigned n = 0; n < e->nsh; n++) {
+		Elf32_Shdr* sh = e->sh + n;
+		if ((sh->sh_type != SHT_PROGBITS) || !(sh->sh_flags & SHF_EXECINSTR) ||
+			!inside(e, sh->sh_offset, sh->sh_size)) {
+			continue;
+		}
+		const char* name = "";
+		if ((sh->sh_name < strsize) &&
+			memchr(str + sh->sh_name, 0, strsize - sh->sh_name)) {
+			name = str + sh->sh_name;
+		}
+		fn(cookie, name, sh->sh_addr, e->data + sh->sh_offset, sh->sh_size);
+	}
+}
+
+int rvelf_check(const char* fn) {
+	uint8_t magic[SELFMAG];
+	int fd;
+	if ((fd = open(fn, O_RDONLY)) < 0) return 0;
+	int r = read(fd, magic, SELFMAG);
+	close(fd);
+	return (r == SELFMAG) && !memcmp(magic, ELFMAG, SELFMAG);
+}
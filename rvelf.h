@@ -0,0 +1,46 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "rvsim.h"
+
+// ELF32 RISC-V executables
+
+typedef struct rvelf rvelf_t;
+
+// map and check an executable
+int rvelf_open(rvelf_t** e, const char* fn);
+
+void rvelf_close(rvelf_t* e);
+
+// load the segments into the ram of an instance (all of them must be
+// inside ram): their page aligned parts are mapped from the file, copy
+// on write, and their .bss becomes demand-zero pages
+// the instance keeps its mappings after rvelf_close()
+int rvelf_load(rvelf_t* e, rvstate_t* s);
+
+// entry point
+uint32_t rvelf_entry(rvelf_t* e);
+
+// is the code built for the C extension (EF_RISCV_RVC)?
+int rvelf_rvc(rvelf_t* e);
+
+// look up the value of a symbol by name
+int rvelf_symbol(rvelf_t* e, const char* name, uint32_t* value);
+
+// call fn for each function (or label in code) in the symbol table,
+// in no particular order (size is 0 if unknown)
+void rvelf_functions(rvelf_t* e, void (*fn)(void* cookie, const char* name,
+	uint32_t addr, uint32_t size), void* cookie);
+
+// call fn for each part of the file holding code, in file order: the
+// executable sections or, without section headers, the executable
+// segments (with a NULL name)
+void rvelf_code(rvelf_t* e, void (*fn)(void* cookie, const char* name,
+	uint32_t addr, const void* data, uint32_t size), void* cookie);
+
+// is the file an ELF image (as opposed to a raw binary)?
+int rvelf_check(const char* fn);
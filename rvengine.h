@@ -0,0 +1,840 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// Execution engine template, included by rvsim.c once per engine.
+//
+// ENGINE_NAME      name of the generated function
+// ENGINE_THREADED  0: one switch on the handler index per instruction
+//                     (the reference engine)
+//                  1: computed goto dispatch from the end of every
+//                     handler, walking the decode cache slots directly
+// ENGINE_JIT       1: count block entries and hand hot blocks to rvjit
+//                     (threaded only)
+// ENGINE_HOOKS     1: hand each instruction to the trace recorder and
+//                     the timing model, when enabled, count the edges
+//                     between blocks for coverage, and stop after one
+//                     when single stepping (switch only)
+// ENGINE_RVC       0: every instruction is a word (one slot) and jump
+//                     targets must be word aligned
+//                  1: instructions are a halfword or a word (op->len,
+//                     a slot per halfword), jump targets halfword
+//                     aligned: the C extension (stepping by a length
+//                     loaded from the slot puts a load on the path from
+//                     each instruction to the next, so hart_run() only
+//                     uses these with it)
+// ENGINE_DEBUG     RVSIM_DEBUG_* options printing every instruction or
+//                     write (DO_* in rvsim.c), 0 but for the reference
+//                     engine (rvhooks.h)
+//
+// A basic block is a run of decoded slots that ends in a control
+// transfer.  In both engines falling through is just the slot after the
+// instruction, a word or a halfword on (the sentinels at the end of each
+// page find the following page).  In the threaded engine every direct
+// branch or jump also caches a pointer to the slot of its target the
+// first time it is taken, chaining blocks together so the decode cache
+// is only consulted again for indirect jumps and traps.  jalr and mret
+// keep a one entry inline cache of their last target as well.
+//
+// Both engines poll s->events and the instruction limit on entry to a
+// basic block (a taken branch or jump, a trap, or crossing into the next
+// page), never in between, so a run may overshoot its limit by a block.
+// Interrupts are taken there too: a csr write or mret that may enable
+// one ends its block, as does a CLINT access.
+
+#if ENGINE_RVC
+#define ILEN() (op->len)
+#define ISLOTS() (op->len >> 1)
+#define IALIGN 1
+#else
+#define ILEN() 4
+#define ISLOTS() 1
+#define IALIGN 3
+#endif
+
+#if ENGINE_THREADED
+#define OP(name) op_##name:
+#define DISPATCH() do { ccount++; TRACE_INS(); goto *handlers[op->op]; } while (0)
+#define REDISPATCH() goto *handlers[op->op]
+#define NEXT() do { op += ISLOTS(); DISPATCH(); } while (0)
+#else
+#define OP(name) case OP_##name:
+#define REDISPATCH() goto redispatch
+#define NEXT() goto next_seq
+#endif
+
+// entering a basic block at op
+#if ENGINE_JIT
+#define PROFILE() do { if (op->op != OP_JIT) rvjit_profile(s, op); } while (0)
+#else
+#define PROFILE() do {} while (0)
+#endif
+#define ENTER() do { \
+	if (__builtin_expect((ccount >= limit) || \
+		__atomic_load_n(&s->events, __ATOMIC_RELAXED), 0)) goto events; \
+	PROFILE(); \
+	} while (0)
+
+// direct branch or jump to op->imm
+#define BRANCH() goto branch_taken
+// conditional branch taken
+#define TAKEN() do { COUNT(BRANCHES); BRANCH(); } while (0)
+
+// after a csr write, which may have enabled an interrupt
+#define CSR_NEXT() do { \
+	if (__atomic_load_n(&s->events, __ATOMIC_RELAXED)) { \
+		next = op->pc + ILEN(); \
+		goto next_jump; \
+	} \
+	NEXT(); \
+	} while (0)
+
+// an event for the performance counters
+#define COUNT(ev) s->evcount[RVSIM_EV_##ev]++
+
+// the second instruction of a fused pair retired
+#define FUSED() do { ccount++; COUNT(FUSED); } while (0)
+// the instruction after it (both are 32 bit, and the second's slot
+// need not be decoded, so skip by the first's size)
+#if ENGINE_THREADED
+#define NEXT2() do { op += 2 * ISLOTS(); DISPATCH(); } while (0)
+#else
+#define NEXT2() goto next_pair
+#endif
+// a compare (c) and a branch on it, to pc + 4 + imm2 if it is rd2
+#define FUSED_BZ(c) do { \
+	uint32_t v = (c); \
+	WrRd(v); \
+	FUSED(); \
+	if (v == op->rd2) { \
+		COUNT(BRANCHES); \
+		JUMP(op->pc + 4 + op->imm2); \
+	} \
+	NEXT2(); } while (0)
+// indirect jump to t
+#define JUMP(t) do { next = (t); goto jump_indirect; } while (0)
+
+#if ENGINE_HOOKS
+#define RECORD_INS() do { \
+	if (op->op != OP_PAGE_END) { \
+		if (s->step && (ccount > 1)) goto step_done; \
+		if (s->timing) rvtiming_ins(s, op); \
+		if (s->trace) rvtrace_ins(s, op->pc, fetch_ins(s, op->pc)); \
+	}} while (0)
+#define RECORD_REG_WR(v) do { \
+	if (s->trace && (op->rd != 32)) rvtrace_rd(s, v); } while (0)
+#define RECORD_MEM_WR(a, v) do { if (s->trace) rvtrace_mem(s, a, v); } while (0)
+#define RECORD_A0_WR(v) do { if (s->trace) rvtrace_rd(s, v); } while (0)
+#define RECORD_TRAP() do { \
+	if (s->trace) rvtrace_trap(s, s->mcause, s->mtval); } while (0)
+// control transferred to next
+#define RECORD_EDGE() do { if (s->cover) cover_edge(s, next); } while (0)
+// a conditional branch not taken is an edge to the next block too
+#define NOT_TAKEN() do { \
+	if (s->cover) { cover_edge(s, op->pc + ILEN()); } \
+	NEXT(); } while (0)
+#else
+#define RECORD_INS() do {} while (0)
+#define RECORD_REG_WR(v) do {} while (0)
+#define RECORD_MEM_WR(a, v) do {} while (0)
+#define RECORD_A0_WR(v) do {} while (0)
+#define RECORD_TRAP() do {} while (0)
+#define RECORD_EDGE() do {} while (0)
+#define NOT_TAKEN() NEXT()
+#endif
+
+#if DO_TRACE_INS
+#define TRACE_INS() do { \
+	if (op->op != OP_PAGE_END) { \
+		char dis[128]; \
+		uint32_t ins = fetch_ins(s, op->pc); \
+		rvdis(op->pc, ins, dis); \
+		fprintf(stderr, "%08x: %08x %s\n", op->pc, ins, dis); \
+	} \
+	RECORD_INS(); \
+	} while (0)
+#else
+#define TRACE_INS() RECORD_INS()
+#endif
+
+// run from s->pc until the simulation stops or, at a block boundary,
+// limit instructions have been executed
+// returns RVRUN_STOP, RVRUN_BUDGET, RVRUN_WAIT, RVRUN_WFI or RVRUN_DEBUG
+// (with s->pc saved)
+static int ENGINE_NAME(rvstate_t* s, uint64_t limit) {
+	uint64_t ccount = 0;
+	uint32_t next = s->pc;
+	rvop_t tmp[3];
+	rvop_t* op;
+#if ENGINE_THREADED
+#define H(name) [OP_##name] = &&op_##name
+	static void* const handlers[OP_COUNT] = {
+		H(DECODE), H(PAGE_END), H(ILLEGAL), H(IFAULT), H(NOP), H(LI),
+		H(ADDI), H(SLTI), H(SLTIU), H(XORI), H(ORI), H(ANDI),
+		H(SLLI), H(SRLI), H(SRAI),
+		H(ADD), H(SUB), H(SLL), H(SLT), H(SLTU),
+		H(XOR), H(SRL), H(SRA), H(OR), H(AND),
+		H(MUL), H(MULH), H(MULHSU), H(MULHU),
+		H(DIV), H(DIVU), H(REM), H(REMU),
+		H(LB), H(LH), H(LW), H(LBU), H(LHU),
+		H(SB), H(SH), H(SW),
+		H(BEQ), H(BNE), H(BLT), H(BGE), H(BLTU), H(BGEU),
+		H(JAL), H(JALR),
+		H(CALL), H(CALLR), H(RET),
+		H(FENCE), H(FENCE_I),
+		H(LR), H(SC),
+		H(AMOSWAP), H(AMOADD), H(AMOXOR), H(AMOAND), H(AMOOR),
+		H(AMOMIN), H(AMOMAX), H(AMOMINU), H(AMOMAXU),
+		H(ECALL), H(EBREAK), H(MRET), H(WFI),
+		H(CSRRW), H(CSRRS), H(CSRRC),
+		H(CSRRWI), H(CSRRSI), H(CSRRCI),
+		H(EXITI), H(EXIT), H(IOCALL),
+		H(JIT), H(BREAK),
+		H(LI_ADDI), H(LI_JALR), H(LI_LW), H(SLLI_SRLI),
+		H(SLT_BZ), H(SLTU_BZ), H(SLTI_BZ), H(SLTIU_BZ),
+	};
+#undef H
+	goto next_jump;
+#else
+	goto next_jump;
+	for (;;) {
+	ccount++;
+	TRACE_INS();
+redispatch:
+	switch (op->op) {
+#endif
+	OP(DECODE)
+		rvsim_decode(s, op);
+		REDISPATCH();
+	OP(PAGE_END)
+		// fell off the end of a page, not an instruction
+		ccount--;
+		next = op->pc;
+		goto next_jump;
+	OP(NOP)
+		NEXT();
+	OP(LI)
+		WrRd(op->imm);
+		trace_reg_wr(op->imm);
+		NEXT();
+	OP(ADDI) WrRd(RdR1() + op->imm); trace_reg_wr(RdRd()); NEXT();
+	OP(SLTI) WrRd(((int32_t)RdR1()) < ((int32_t)op->imm)); trace_reg_wr(RdRd()); NEXT();
+	OP(SLTIU) WrRd(RdR1() < op->imm); trace_reg_wr(RdRd()); NEXT();
+	OP(XORI) WrRd(RdR1() ^ op->imm); trace_reg_wr(RdRd()); NEXT();
+	OP(ORI) WrRd(RdR1() | op->imm); trace_reg_wr(RdRd()); NEXT();
+	OP(ANDI) WrRd(RdR1() & op->imm); trace_reg_wr(RdRd()); NEXT();
+	OP(SLLI) WrRd(RdR1() << op->imm); trace_reg_wr(RdRd()); NEXT();
+	OP(SRLI) WrRd(RdR1() >> op->imm); trace_reg_wr(RdRd()); NEXT();
+	OP(SRAI) WrRd(((int32_t)RdR1()) >> op->imm); trace_reg_wr(RdRd()); NEXT();
+	OP(ADD) WrRd(RdR1() + RdR2()); trace_reg_wr(RdRd()); NEXT();
+	OP(SUB) WrRd(RdR1() - RdR2()); trace_reg_wr(RdRd()); NEXT();
+	OP(SLL) WrRd(RdR1() << (RdR2() & 31)); trace_reg_wr(RdRd()); NEXT();
+	OP(SLT) WrRd(((int32_t)RdR1()) < ((int32_t)RdR2())); trace_reg_wr(RdRd()); NEXT();
+	OP(SLTU) WrRd(RdR1() < RdR2()); trace_reg_wr(RdRd()); NEXT();
+	OP(XOR) WrRd(RdR1() ^ RdR2()); trace_reg_wr(RdRd()); NEXT();
+	OP(SRL) WrRd(RdR1() >> (RdR2() & 31)); trace_reg_wr(RdRd()); NEXT();
+	OP(SRA) WrRd(((int32_t)RdR1()) >> (RdR2() & 31)); trace_reg_wr(RdRd()); NEXT();
+	OP(OR) WrRd(RdR1() | RdR2()); trace_reg_wr(RdRd()); NEXT();
+	OP(AND) WrRd(RdR1() & RdR2()); trace_reg_wr(RdRd()); NEXT();
+	OP(MUL) WrRd(RdR1() * RdR2()); trace_reg_wr(RdRd()); NEXT();
+	OP(MULH)
+		WrRd(((int64_t)(int32_t)RdR1() * (int64_t)(int32_t)RdR2()) >> 32);
+		trace_reg_wr(RdRd());
+		NEXT();
+	OP(MULHSU)
+		WrRd(((int64_t)(int32_t)RdR1() * (uint64_t)RdR2()) >> 32);
+		trace_reg_wr(RdRd());
+		NEXT();
+	OP(MULHU)
+		WrRd(((uint64_t)RdR1() * (uint64_t)RdR2()) >> 32);
+		trace_reg_wr(RdRd());
+		NEXT();
+	OP(DIV) {
+		uint32_t a = RdR1();
+		uint32_t b = RdR2();
+		uint32_t n;
+		if (b == 0) { n = 0xffffffff; }
+		else if ((a == 0x80000000) && (b == 0xffffffff)) { n = a; }
+		else { n = ((int32_t)a / (int32_t)b); }
+		WrRd(n);
+		trace_reg_wr(n);
+		NEXT();
+		}
+	OP(DIVU) {
+		uint32_t a = RdR1();
+		uint32_t b = RdR2();
+		uint32_t n;
+		if (b == 0) { n = 0xffffffff; }
+		else { n = a / b; }
+		WrRd(n);
+		trace_reg_wr(n);
+		NEXT();
+		}
+	OP(REM) {
+		uint32_t a = RdR1();
+		uint32_t b = RdR2();
+		uint32_t n;
+		if (b == 0) { n = a; }
+		else if ((a == 0x80000000) && (b == 0xffffffff)) { n = 0; }
+		else { n = ((int32_t)a % (int32_t)b); }
+		WrRd(n);
+		trace_reg_wr(n);
+		NEXT();
+		}
+	OP(REMU) {
+		uint32_t a = RdR1();
+		uint32_t b = RdR2();
+		uint32_t n;
+		if (b == 0) { n = a; }
+		else { n = a % b; }
+		WrRd(n);
+		trace_reg_wr(n);
+		NEXT();
+		}
+	OP(LW) {
+		uint32_t a = RdR1() + op->imm;
+		uint32_t v;
+		if (a & 3) goto trap_load_align;
+		if (rd32(s, a, &v)) goto trap_load_access;
+		COUNT(LOADS);
+		WrRd(v);
+		trace_reg_wr(v);
+		NEXT();
+		}
+	OP(LHU) {
+		uint32_t a = RdR1() + op->imm;
+		uint32_t v;
+		if (a & 1) goto trap_load_align;
+		if (rd16(s, a, &v)) goto trap_load_access;
+		COUNT(LOADS);
+		WrRd(v);
+		trace_reg_wr(v);
+		NEXT();
+		}
+	OP(LBU) {
+		uint32_t v;
+		if (rd8(s, RdR1() + op->imm, &v)) goto trap_load_access;
+		COUNT(LOADS);
+		WrRd(v);
+		trace_reg_wr(v);
+		NEXT();
+		}
+	OP(LH) {
+		uint32_t a = RdR1() + op->imm;
+		uint32_t v;
+		if (a & 1) goto trap_load_align;
+		if (rd16(s, a, &v)) goto trap_load_access;
+		COUNT(LOADS);
+		if (v & 0x8000) { v |= 0xFFFF0000; }
+		WrRd(v);
+		trace_reg_wr(v);
+		NEXT();
+		}
+	OP(LB) {
+		uint32_t v;
+		if (rd8(s, RdR1() + op->imm, &v)) goto trap_load_access;
+		COUNT(LOADS);
+		if (v & 0x80) { v |= 0xFFFFFF00; }
+		WrRd(v);
+		trace_reg_wr(v);
+		NEXT();
+		}
+trap_load_align:
+		s->mcause = EC_L_ALIGN;
+		s->mtval = RdR1() + op->imm;
+		goto trap_common;
+	OP(SW) {
+		uint32_t a = RdR1() + op->imm;
+		uint32_t v = RdR2();
+		if (a & 3) goto trap_store_align;
+		if (wr32(s, a, v)) goto trap_store_access;
+		COUNT(STORES);
+		trace_mem_wr(a, v);
+		NEXT();
+		}
+	OP(SH) {
+		uint32_t a = RdR1() + op->imm;
+		uint32_t v = RdR2();
+		if (a & 1) goto trap_store_align;
+		if (wr16(s, a, v)) goto trap_store_access;
+		COUNT(STORES);
+		trace_mem_wr(a, v);
+		NEXT();
+		}
+	OP(SB) {
+		uint32_t a = RdR1() + op->imm;
+		uint32_t v = RdR2();
+		if (wr8(s, a, v)) goto trap_store_access;
+		COUNT(STORES);
+		trace_mem_wr(a, v);
+		NEXT();
+		}
+trap_store_align:
+		s->mcause = EC_S_ALIGN;
+		s->mtval = RdR1() + op->imm;
+		goto trap_common;
+	OP(LR) {
+		uint32_t a = RdR1();
+		if (a & 3) goto trap_load_align;
+		if ((a - s->membase) >= s->memsize) goto trap_load_access;
+		uint32_t v = __atomic_load_n((uint32_t*) (s->memory +
+			(a - s->membase)), __ATOMIC_SEQ_CST);
+		s->resv_addr = a;
+		s->resv_val = v;
+		COUNT(LOADS);
+		WrRd(v);
+		trace_reg_wr(v);
+		NEXT();
+		}
+	OP(SC) {
+		uint32_t a = RdR1();
+		if (a & 3) goto trap_store_align;
+		if ((a - s->membase) >= s->memsize) goto trap_store_access;
+		uint32_t v;
+		int hit = sc(s, a, RdR2(), &v);
+		if (v == 0) {
+			COUNT(STORES);
+			trace_mem_wr(a, RdR2());
+		}
+		WrRd(v);
+		trace_reg_wr(v);
+		if (hit) {
+			// a watchpoint: stop after it
+			next = op->pc + ILEN();
+			goto next_jump;
+		}
+		NEXT();
+		}
+	OP(AMOSWAP)
+	OP(AMOADD)
+	OP(AMOXOR)
+	OP(AMOAND)
+	OP(AMOOR)
+	OP(AMOMIN)
+	OP(AMOMAX)
+	OP(AMOMINU)
+	OP(AMOMAXU) {
+		uint32_t a = RdR1();
+		if (a & 3) goto trap_store_align;
+		if ((a - s->membase) >= s->memsize) goto trap_store_access;
+		uint32_t v = RdR2();
+		int hit = amo(s, op->op, a - s->membase, &v);
+		COUNT(LOADS);
+		COUNT(STORES);
+		trace_mem_wr(a, peek32(s, a));
+		WrRd(v);
+		trace_reg_wr(v);
+		if (hit) {
+			// a watchpoint: stop after it
+			next = op->pc + ILEN();
+			goto next_jump;
+		}
+		NEXT();
+		}
+trap_load_access:
+		if (op->op == OP_LW) {
+			uint32_t v;
+			if (clint_rd(s, RdR1() + op->imm, s->ccount + ccount - 1, &v) == 0) {
+				COUNT(LOADS);
+				WrRd(v);
+				trace_reg_wr(v);
+				next = op->pc + ILEN();
+				goto next_jump;
+			}
+		}
+		s->mcause = EC_L_ACCESS;
+		s->mtval = RdR1() + op->imm;
+		goto trap_common;
+trap_store_access:
+		if (s->dbgstop) {
+			// not a fault: it hit a watchpoint, stop after it
+			COUNT(STORES);
+			trace_mem_wr(RdR1() + op->imm, RdR2());
+			next = op->pc + ILEN();
+			goto next_jump;
+		}
+		if ((op->op == OP_SW) &&
+			(clint_wr(s, RdR1() + op->imm, RdR2(), s->ccount + ccount - 1) == 0)) {
+			COUNT(STORES);
+			trace_mem_wr(RdR1() + op->imm, RdR2());
+			next = op->pc + ILEN();
+			goto next_jump;
+		}
+		s->mcause = EC_S_ACCESS;
+		s->mtval = RdR1() + op->imm;
+		goto trap_common;
+	OP(FENCE)
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		NEXT();
+	OP(BEQ)
+		if (RdR1() == RdR2()) TAKEN();
+		NOT_TAKEN();
+	OP(BNE)
+		if (RdR1() != RdR2()) TAKEN();
+		NOT_TAKEN();
+	OP(BLT)
+		if (((int32_t)RdR1()) < ((int32_t)RdR2())) TAKEN();
+		NOT_TAKEN();
+	OP(BGE)
+		if (((int32_t)RdR1()) >= ((int32_t)RdR2())) TAKEN();
+		NOT_TAKEN();
+	OP(BLTU)
+		if (RdR1() < RdR2()) TAKEN();
+		NOT_TAKEN();
+	OP(BGEU)
+		if (RdR1() >= RdR2()) TAKEN();
+		NOT_TAKEN();
+	OP(JALR) {
+		uint32_t a = (RdR1() + op->imm) & 0xFFFFFFFE;
+		WrRd(op->pc + ILEN());
+		trace_reg_wr(op->pc + ILEN());
+		if (a & IALIGN) {
+			next = a;
+			goto trap_pc_align;
+		}
+		JUMP(a);
+		}
+	OP(JAL)
+		WrRd(op->pc + ILEN());
+		trace_reg_wr(op->pc + ILEN());
+		BRANCH();
+	OP(FENCE_I)
+		dcache_flush(s);
+		NEXT();
+	OP(ECALL)
+		s->mcause = EC_ECALL_FROM_M;
+		s->mtval = 0;
+		goto trap_common;
+	OP(EBREAK)
+		s->mcause = EC_BREAKPOINT;
+		s->mtval = 0;
+		goto trap_common;
+	OP(MRET)
+		s->mstatus = MSTATUS_MPIE | ((s->mstatus & MSTATUS_MPIE) ? MSTATUS_MIE : 0);
+		irq_check(s);
+		JUMP(s->mepc);
+	OP(WFI)
+		s->ccount += ccount;
+		s->pc = op->pc + ILEN();
+		return RVRUN_WFI;
+	OP(CSRRW)
+	OP(CSRRWI) {
+		uint32_t nv = (op->op == OP_CSRRWI) ? op->r1 : RdR1();
+		uint32_t ov = 0;
+		uint64_t retired = s->ccount + ccount - 1;
+		// only reads if rd != x0
+		if (op->rd != 32) ov = get_csr(s, op->imm, retired);
+		put_csr(s, op->imm, nv, retired);
+		WrRd(ov);
+		trace_reg_wr(ov);
+		CSR_NEXT();
+		}
+	OP(CSRRS)
+	OP(CSRRSI) {
+		uint32_t nv = (op->op == OP_CSRRSI) ? op->r1 : RdR1();
+		uint64_t retired = s->ccount + ccount - 1;
+		uint32_t ov = get_csr(s, op->imm, retired);
+		// only writes if nv != 0
+		if (nv) put_csr(s, op->imm, ov | nv, retired);
+		WrRd(ov);
+		trace_reg_wr(ov);
+		CSR_NEXT();
+		}
+	OP(CSRRC)
+	OP(CSRRCI) {
+		uint32_t nv = (op->op == OP_CSRRCI) ? op->r1 : RdR1();
+		uint64_t retired = s->ccount + ccount - 1;
+		uint32_t ov = get_csr(s, op->imm, retired);
+		// only writes if nv != 0
+		if (nv) put_csr(s, op->imm, ov & (~nv), retired);
+		WrRd(ov);
+		trace_reg_wr(ov);
+		CSR_NEXT();
+		}
+	OP(EXITI)
+		s->ccount += ccount;
+		s->pc = op->pc;
+		rvsim_exit(s, op->imm);
+		return RVRUN_STOP;
+	OP(EXIT)
+		s->ccount += ccount;
+		s->pc = op->pc;
+		rvsim_exit(s, RdR1());
+		return RVRUN_STOP;
+	OP(IOCALL) {
+		COUNT(IOCALLS);
+		uint32_t r = rvsim_iocall(s, op->imm);
+		if (s->iodefer) {
+			// a0 is set by rvsim_iocall_complete()
+			if (hart_iowait(s)) {
+				s->ccount += ccount;
+				s->pc = op->pc + ILEN();
+				return RVRUN_WAIT;
+			}
+		} else {
+			s->x[10] = r;
+			RECORD_A0_WR(r);
+		}
+		NEXT();
+		}
+	OP(JIT) {
+#if ENGINE_JIT
+		// returns instructions executed << 32 | next pc
+		uint64_t r = op->jit->code(s);
+		if (r >> 32) {
+			ccount += (r >> 32) - 1;
+			next = r;
+			goto next_jump;
+		}
+#endif
+		// the block exited before its first instruction (or this
+		// engine doesn't run compiled code), so interpret that
+		tmp[0] = op->jit->op;
+		tmp[0].link = NULL;
+		tmp[1].op = OP_PAGE_END;
+		tmp[1].pc = op->pc + (1U << s->slotshift);
+		tmp[2].op = OP_PAGE_END;
+		tmp[2].pc = op->pc + 4;
+		op = tmp;
+		REDISPATCH();
+		}
+	OP(BREAK)
+#if ENGINE_HOOKS
+		if (s->step && (ccount == 1)) {
+			// stepping off a breakpoint: run the instruction under it
+			tmp[0].pc = op->pc;
+			decode(s, tmp);
+			tmp[1].op = OP_PAGE_END;
+			tmp[1].pc = op->pc + (1U << s->slotshift);
+			tmp[2].op = OP_PAGE_END;
+			tmp[2].pc = op->pc + 4;
+			op = tmp;
+			REDISPATCH();
+		}
+#endif
+		ccount--;
+		s->ccount += ccount;
+		s->pc = op->pc;
+		s->dbgstop = RVSIM_STOP_BREAK;
+		return RVRUN_DEBUG;
+	// fused pairs: the second instruction retires too, unless it is
+	// left to its own slot
+#if ENGINE_HOOKS
+	// one instruction at a time, for the hooks: run a copy of the
+	// first, leaving the slot fused for the other engines
+	OP(LI_ADDI) OP(LI_JALR) OP(LI_LW) OP(SLLI_SRLI)
+	OP(SLT_BZ) OP(SLTU_BZ) OP(SLTI_BZ) OP(SLTIU_BZ)
+		tmp[0] = *op;
+		tmp[0].op = rvop_unfused(op->op);
+		tmp[1].op = OP_PAGE_END;
+		tmp[1].pc = op->pc + (1U << s->slotshift);
+		tmp[2].op = OP_PAGE_END;
+		tmp[2].pc = op->pc + 4;
+		op = tmp;
+		REDISPATCH();
+#else
+	OP(LI_ADDI)
+		FUSED();
+		WrRd(op->imm + op->imm2);
+		NEXT2();
+	OP(LI_JALR)
+		FUSED();
+		WrRd(op->imm);
+		s->x[op->rd2] = op->pc + 8;
+		JUMP((op->imm + op->imm2) & ~1);
+	OP(LI_LW) {
+		uint32_t v;
+		WrRd(op->imm);
+		if (rd32(s, op->imm + op->imm2, &v)) {
+			// a fault (or the clint): the load on its own
+			next = op->pc + 4;
+			goto next_jump;
+		}
+		FUSED();
+		COUNT(LOADS);
+		s->x[op->rd2] = v;
+		NEXT2();
+		}
+	OP(SLLI_SRLI)
+		FUSED();
+		WrRd((RdR1() << op->imm) >> op->imm);
+		NEXT2();
+	OP(SLT_BZ) FUSED_BZ(((int32_t)RdR1()) < ((int32_t)RdR2()));
+	OP(SLTU_BZ) FUSED_BZ(RdR1() < RdR2());
+	OP(SLTI_BZ) FUSED_BZ(((int32_t)RdR1()) < ((int32_t)op->imm));
+	OP(SLTIU_BZ) FUSED_BZ(RdR1() < op->imm);
+#endif
+	// calls and returns, when keeping a shadow call stack
+	OP(CALL)
+		call_push(s, op->pc + ILEN());
+		WrRd(op->pc + ILEN());
+		trace_reg_wr(op->pc + ILEN());
+		BRANCH();
+	OP(CALLR) {
+		uint32_t a = (RdR1() + op->imm) & 0xFFFFFFFE;
+		WrRd(op->pc + ILEN());
+		trace_reg_wr(op->pc + ILEN());
+		if (a & IALIGN) {
+			next = a;
+			goto trap_pc_align;
+		}
+		call_push(s, op->pc + ILEN());
+		JUMP(a);
+		}
+	OP(RET) {
+		uint32_t a = RdR1() & 0xFFFFFFFE;
+		if (a & IALIGN) {
+			next = a;
+			goto trap_pc_align;
+		}
+		call_pop(s, a);
+		JUMP(a);
+		}
+	OP(IFAULT)
+		s->mcause = EC_I_ACCESS;
+		s->mtval = op->pc;
+		goto trap_common;
+#if !ENGINE_THREADED
+	default:
+#endif
+	OP(ILLEGAL)
+		s->mcause = EC_I_ILLEGAL;
+		s->mtval = op->imm;
+		if (DO_ABORT_INVAL) {
+			fprintf(stderr,"          (TRAP ILLEGAL %08x)\n", op->imm);
+			s->ccount += ccount;
+			s->pc = op->pc;
+			rvsim_exit(s, -1);
+			return RVRUN_STOP;
+		}
+		goto trap_common;
+#if !ENGINE_THREADED
+	}
+#endif
+
+branch_taken:
+#if ENGINE_THREADED
+	if (op->link) {
+		op = op->link;
+		ENTER();
+		DISPATCH();
+	}
+#endif
+	next = op->imm;
+	if (next & IALIGN) goto trap_pc_align;
+#if ENGINE_THREADED
+	rvop_t* t = dcache_lookup(s, next, tmp);
+	if (t != tmp) op->link = t;
+	op = t;
+	ENTER();
+	DISPATCH();
+#else
+	RECORD_EDGE();
+	goto next_jump;
+#endif
+
+jump_indirect:
+#if ENGINE_THREADED
+	if (op->link && (op->link->pc == next)) {
+		op = op->link;
+	} else {
+		rvop_t* t = dcache_lookup(s, next, tmp);
+		if (t != tmp) op->link = t;
+		op = t;
+	}
+	ENTER();
+	DISPATCH();
+#else
+	RECORD_EDGE();
+	goto next_jump;
+#endif
+
+trap_pc_align:
+	s->mcause = EC_I_ALIGN;
+	s->mtval = next;
+trap_common:
+	COUNT(TRAPS);
+	s->mepc = op->pc;
+	s->mstatus = (s->mstatus & MSTATUS_MIE) ? MSTATUS_MPIE : 0;
+	next = s->mtvec & ~3;
+	if (DO_TRACE_TRAPS) {
+		fprintf(stderr, "          (TRAP C=%08x V=%08x)\n", s->mcause, s->mtval);
+	}
+	RECORD_TRAP();
+	RECORD_EDGE();
+	goto next_jump;
+
+#if ENGINE_HOOKS
+step_done:
+	// single stepping: stop before the second instruction
+	ccount--;
+	s->ccount += ccount;
+	s->pc = op->pc;
+	return RVRUN_BUDGET;
+#endif
+
+#if ENGINE_THREADED
+next_jump:
+	op = dcache_lookup(s, next, tmp);
+	ENTER();
+	DISPATCH();
+
+events:
+	// about to execute op, the first instruction of a block
+	next = op->pc;
+	if (hart_events(s, &next) || (ccount >= limit)) {
+		s->ccount += ccount;
+		s->pc = next;
+		return s->sys->stop ? RVRUN_STOP : RVRUN_BUDGET;
+	}
+	if (next != op->pc) goto next_jump;
+	DISPATCH();
+#else
+next_seq:
+	op += ISLOTS();
+	continue;
+#if !ENGINE_HOOKS
+next_pair:
+	op += 2 * ISLOTS();
+	continue;
+#endif
+next_jump:
+	op = dcache_lookup(s, next, tmp);
+	ENTER();
+	continue;
+events:
+	next = op->pc;
+	if (hart_events(s, &next) || (ccount >= limit)) {
+		s->ccount += ccount;
+		s->pc = next;
+		return s->sys->stop ? RVRUN_STOP : RVRUN_BUDGET;
+	}
+	if (next != op->pc) goto next_jump;
+	}
+#endif
+}
+
+#undef ILEN
+#undef ISLOTS
+#undef IALIGN
+#undef OP
+#undef DISPATCH
+#undef REDISPATCH
+#undef NEXT
+#undef BRANCH
+#undef TAKEN
+#undef COUNT
+#undef JUMP
+#undef CSR_NEXT
+#undef ENTER
+#undef PROFILE
+#undef TRACE_INS
+#undef RECORD_INS
+#undef RECORD_REG_WR
+#undef RECORD_MEM_WR
+#undef RECORD_A0_WR
+#undef RECORD_TRAP
+#undef RECORD_EDGE
+#undef FUSED
+#undef NEXT2
+#undef FUSED_BZ
+#undef NOT_TAKEN
@@ -0,0 +1,493 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// Each input costs a rewind (the pages the last one wrote, and the
+// harts), the copy of the input into the guest's buffer, and the run,
+// in the reference engine while coverage is counted.  New coverage is
+// judged the way AFL judges it: each edge's count is put in a bucket
+// (1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+) and an input is kept if it
+// hits an edge, or a bucket of one, no input has before.  Crashes and
+// timeouts are kept the same way, against coverage of their own, so
+// one bug doesn't fill the directory.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+
+#include "rvsim.h"
+#include "rvcore.h"
+#include "rvfuzz.h"
+
+#define FUZZ_OK      0
+#define FUZZ_CRASH   1
+#define FUZZ_TIMEOUT 2
+
+typedef struct {
+	uint8_t* data;
+	uint32_t len;
+} fuzzinput_t;
+
+struct rvfuzz {
+	rvstate_t* s;
+	rvfuzz_config_t cfg;
+
+	// the hart that asks for input, where it wants it, and whether it
+	// has asked again (the end of a run)
+	rvstate_t* hart;
+	uint32_t buf;
+	uint32_t max;
+	int asked;
+
+	fuzzinput_t* inputs;
+	unsigned count;
+	unsigned alloc;
+	uint64_t bytes;
+	uint8_t* next; // cfg.maxlen
+
+	uint32_t rng;
+	uint64_t execs;
+	unsigned edges;
+	unsigned crashes;
+	unsigned timeouts;
+	struct timespec t0;
+
+	uint8_t map[RVSIM_COVERSIZE];
+	// buckets seen so far by inputs kept, crashes and timeouts
+	uint8_t seen[3][RVSIM_COVERSIZE];
+};
+
+static uint8_t bucket[256];
+
+int rvfuzz_create(rvfuzz_t** out, rvstate_t* s, const rvfuzz_config_t* cfg) {
+	rvfuzz_t* f;
+	if ((f = calloc(1, sizeof(rvfuzz_t))) == NULL) return -1;
+	f->s = s;
+	f->cfg = *cfg;
+	if (f->cfg.prefix == NULL) f->cfg.prefix = "";
+	if (f->cfg.limit == 0) f->cfg.limit = 10000000;
+	if (f->cfg.maxlen == 0) f->cfg.maxlen = 4096;
+	if ((f->next = malloc(f->cfg.maxlen)) == NULL) {
+		free(f);
+		return -1;
+	}
+	if ((f->rng = f->cfg.seed) == 0) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		f->rng = (ts.tv_sec * 1000003) ^ ts.tv_nsec ^ getpid();
+		if (f->rng == 0) f->rng = 1;
+	}
+	for (unsigned n = 1; n < 256; n++) {
+		bucket[n] = (n < 4) ? (1 << (n - 1)) : (n < 8) ? 8 : (n < 16) ? 16 :
+			(n < 32) ? 32 : (n < 128) ? 64 : 128;
+	}
+	*out = f;
+	return 0;
+}
+
+void rvfuzz_destroy(rvfuzz_t* f) {
+	for (unsigned n = 0; n < f->count; n++) {
+		free(f->inputs[n].data);
+	}
+	free(f->inputs);
+	free(f->next);
+	free(f);
+}
+
+uint32_t rvfuzz_iocall(rvfuzz_t* f, rvstate_t* hart, uint32_t buf, uint32_t max) {
+	if (f->hart == NULL) {
+		if (rvsim_dma(f->s, buf, max) == NULL) return -1;
+		f->hart = hart;
+		f->buf = buf;
+		f->max = max;
+	} else if (hart != f->hart) {
+		// one hart takes the input
+		return -1;
+	}
+	f->asked = 1;
+	rvsim_iocall_defer(hart);
+	return 0;
+}
+
+// run until the guest first asks for input, and leave it waiting there
+static int fuzz_start(rvfuzz_t* f, uint32_t pc) {
+	rvstate_t* s = f->s;
+	rvsim_set_pc(s, pc);
+	for (;;) {
+		int r = rvsim_run(s, 1000000);
+		if (f->hart) return 0;
+		if (r == RVSIM_EXITED) break;
+		if (r == RVSIM_WAITING) usleep(1000);
+	}
+	fprintf(stderr, "error: the guest exited without asking for input\n");
+	return -1;
+}
+
+// put an input in the guest's buffer, returning how much of it fits
+static uint32_t fuzz_input(rvfuzz_t* f, const uint8_t* data, uint32_t len) {
+	if (len > f->max) len = f->max;
+	if (len) {
+		memcpy(rvsim_dma(f->s, f->buf, len), data, len);
+		rvsim_dma_written(f->s, f->buf, len);
+	}
+	return len;
+}
+
+static int fuzz_finish(rvfuzz_t* f) {
+	rvstate_t* s = f->s;
+	f->asked = 0;
+	int r = rvsim_run(s, f->cfg.limit);
+	f->execs++;
+	if (r == RVSIM_EXITED) return rvsim_exit_status(s) ? FUZZ_CRASH : FUZZ_OK;
+	// the next input, or too long, or stuck
+	return f->asked ? FUZZ_OK : FUZZ_TIMEOUT;
+}
+
+static int fuzz_one(rvfuzz_t* f, const uint8_t* data, uint32_t len) {
+	if (rvsim_rewind(f->s) < 0) return -1;
+	f->hart->x[10] = fuzz_input(f, data, len);
+	memset(f->map, 0, sizeof(f->map));
+	return fuzz_finish(f);
+}
+
+// fold the last run's coverage into seen: returns 2 if it took an edge
+// none had, 1 if it only took one a new number of times, or 0
+static int fuzz_novel(rvfuzz_t* f, uint8_t* seen) {
+	const uint64_t* map = (const void*) f->map;
+	int r = 0;
+	for (unsigned w = 0; w < (RVSIM_COVERSIZE / 8); w++) {
+		if (map[w] == 0) continue;
+		for (unsigned n = w * 8; n < (w * 8 + 8); n++) {
+			uint8_t b = bucket[f->map[n]];
+			if ((b & seen[n]) != b) {
+				if (seen[n] == 0) {
+					r = 2;
+					if (seen == f->seen[0]) f->edges++;
+				} else if (r == 0) {
+					r = 1;
+				}
+				seen[n] |= b;
+			}
+		}
+	}
+	return r;
+}
+
+static uint64_t fuzz_hash(const uint8_t* data, uint32_t len) {
+	uint64_t h = 0xcbf29ce484222325;
+	for (uint32_t n = 0; n < len; n++) {
+		h = (h ^ data[n]) * 0x100000001b3;
+	}
+	return h;
+}
+
+static int fuzz_save(const char* fn, const uint8_t* data, uint32_t len) {
+	int fd;
+	if ((fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) return -1;
+	int r = (write(fd, data, len) == (ssize_t) len) ? 0 : -1;
+	close(fd);
+	return r;
+}
+
+static int fuzz_keep(rvfuzz_t* f, const uint8_t* data, uint32_t len) {
+	if (f->count == f->alloc) {
+		unsigned alloc = f->alloc ? f->alloc * 2 : 64;
+		fuzzinput_t* inputs;
+		if ((inputs = realloc(f->inputs, alloc * sizeof(fuzzinput_t))) == NULL) return -1;
+		f->inputs = inputs;
+		f->alloc = alloc;
+	}
+	uint8_t* copy;
+	if ((copy = malloc(len ? len : 1)) == NULL) return -1;
+	memcpy(copy, data, len);
+	f->inputs[f->count].data = copy;
+	f->inputs[f->count].len = len;
+	f->count++;
+	f->bytes += len;
+	return 0;
+}
+
+static void fuzz_status(rvfuzz_t* f, const char* what) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	double t = (ts.tv_sec - f->t0.tv_sec) + (ts.tv_nsec - f->t0.tv_nsec) / 1e9;
+	fprintf(stderr, "#%lu\t%-6s cov: %u corp: %u/%lub exec/s: %lu",
+		f->execs, what, f->edges, f->count, f->bytes,
+		(t > 0) ? (uint64_t) (f->execs / t) : 0);
+	if (f->crashes || f->timeouts) {
+		fprintf(stderr, " crashes: %u timeouts: %u", f->crashes, f->timeouts);
+	}
+	fprintf(stderr, "\n");
+}
+
+// act on the outcome of a run of an input (from the corpus if seed)
+static int fuzz_outcome(rvfuzz_t* f, int r, const uint8_t* data, uint32_t len, int seed) {
+	char fn[4096];
+	if (r < 0) return -1;
+	if (r != FUZZ_OK) {
+		if (!fuzz_novel(f, f->seen[r])) return 0;
+		snprintf(fn, sizeof(fn), "%s%s-%016lx", f->cfg.prefix,
+			(r == FUZZ_CRASH) ? "crash" : "timeout", fuzz_hash(data, len));
+		if (r == FUZZ_CRASH) {
+			f->crashes++;
+			fprintf(stderr, "#%lu\tcrash (exit status %d), input written to %s\n",
+				f->execs, rvsim_exit_status(f->s), fn);
+		} else {
+			f->timeouts++;
+			fprintf(stderr, "#%lu\ttimeout, input written to %s\n", f->execs, fn);
+		}
+		if (fuzz_save(fn, data, len) < 0) {
+			fprintf(stderr, "error: cannot write '%s'\n", fn);
+			return -1;
+		}
+		return 0;
+	}
+	if (!fuzz_novel(f, f->seen[0])) return 0;
+	if (fuzz_keep(f, data, len) < 0) return -1;
+	if (seed) return 0;
+	if (f->cfg.corpus) {
+		snprintf(fn, sizeof(fn), "%s/%016lx", f->cfg.corpus, fuzz_hash(data, len));
+		if (fuzz_save(fn, data, len) < 0) {
+			fprintf(stderr, "error: cannot write '%s'\n", fn);
+			return -1;
+		}
+	}
+	fuzz_status(f, "NEW");
+	return 0;
+}
+
+static uint8_t* fuzz_load(const char* fn, uint32_t* len) {
+	int fd;
+	struct stat st;
+	uint8_t* data = NULL;
+	if ((fd = open(fn, O_RDONLY)) < 0) return NULL;
+	if ((fstat(fd, &st) < 0) || !S_ISREG(st.st_mode) ||
+		((data = malloc(st.st_size ? st.st_size : 1)) == NULL) ||
+		(read(fd, data, st.st_size) != st.st_size)) {
+		free(data);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	*len = st.st_size;
+	return data;
+}
+
+// run every file in directory dir (which need not exist)
+static int fuzz_seed(rvfuzz_t* f, const char* dir) {
+	char fn[4096];
+	DIR* d;
+	struct dirent* de;
+	if ((d = opendir(dir)) == NULL) return (errno == ENOENT) ? 0 : -1;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.') continue;
+		snprintf(fn, sizeof(fn), "%s/%s", dir, de->d_name);
+		uint32_t len;
+		uint8_t* data;
+		// skipping directories and the like
+		if ((data = fuzz_load(fn, &len)) == NULL) continue;
+		int r = fuzz_outcome(f, fuzz_one(f, data, len), data, len, 1);
+		free(data);
+		if (r < 0) {
+			closedir(d);
+			return -1;
+		}
+	}
+	closedir(d);
+	return 0;
+}
+
+static uint32_t fuzz_rand(rvfuzz_t* f) {
+	uint32_t x = f->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return f->rng = x;
+}
+
+static const int32_t interesting[] = {
+	-128, -1, 0, 1, 16, 32, 64, 100, 127, 128, 255, 256, 512, 1000,
+	1024, 4096, 32767, -32768, 65535, 65536, 0x7fffffff, 0x80000000,
+};
+
+// mutate the input of len bytes in f->next a few times over, as AFL's
+// havoc stage does, returning its new length
+static uint32_t fuzz_mutate(rvfuzz_t* f, uint32_t len) {
+	uint8_t* p = f->next;
+	uint32_t max = f->cfg.maxlen;
+	unsigned count = 1 << (1 + (fuzz_rand(f) % 4));
+	while (count-- > 0) {
+		uint32_t r = fuzz_rand(f);
+		uint32_t at = len ? (fuzz_rand(f) % len) : 0;
+		int32_t v = interesting[fuzz_rand(f) % (sizeof(interesting) / sizeof(interesting[0]))];
+		switch (r % 10) {
+		case 0: // flip a bit
+			if (len) p[at] ^= 1 << ((r >> 8) & 7);
+			break;
+		case 1: // a random byte
+			if (len) p[at] = r >> 8;
+			break;
+		case 2: // add or subtract a little
+			if (len) p[at] += ((r >> 8) & 1) ? (1 + ((r >> 9) % 35)) : -(1 + ((r >> 9) % 35));
+			break;
+		case 3: // an interesting byte
+			if (len) p[at] = v;
+			break;
+		case 4: // an interesting halfword or word, either way round
+			if (len >= 4) {
+				at %= len - 3;
+				if (r & 0x100) v = __builtin_bswap32(v);
+				memcpy(p + at, &v, (r & 0x200) ? 4 : 2);
+			}
+			break;
+		case 5: { // delete some
+			if (len < 2) break;
+			uint32_t n = 1 + ((r >> 8) % ((len - at) < 32 ? (len - at) : 32));
+			memmove(p + at, p + at + n, len - at - n);
+			len -= n;
+			break;
+		}
+		case 6: { // insert a copy of some, or a run of one byte
+			if (len == max) break;
+			at = fuzz_rand(f) % (len + 1);
+			uint32_t n = 1 + ((r >> 8) % ((max - len) < 32 ? (max - len) : 32));
+			memmove(p + at + n, p + at, len - at);
+			if (len && (r & 0x80)) {
+				uint32_t from = fuzz_rand(f) % len;
+				for (uint32_t i = 0; i < n; i++) {
+					p[at + i] = p[from + (i % (len - from))];
+				}
+			} else {
+				memset(p + at, v, n);
+			}
+			len += n;
+			break;
+		}
+		case 7: { // overwrite some with some from elsewhere
+			if (len < 2) break;
+			uint32_t from = fuzz_rand(f) % len;
+			uint32_t n = 1 + ((r >> 8) % (len - (at > from ? at : from)));
+			memmove(p + at, p + from, n);
+			break;
+		}
+		default: { // splice: the rest from another input
+			fuzzinput_t* in = f->inputs + (fuzz_rand(f) % f->count);
+			if (in->len == 0) break;
+			uint32_t from = fuzz_rand(f) % in->len;
+			uint32_t n = in->len - from;
+			at = fuzz_rand(f) % (len + 1);
+			if (n > (max - at)) n = max - at;
+			memcpy(p + at, in->data + from, n);
+			len = at + n;
+			break;
+		}
+		}
+	}
+	return len;
+}
+
+int rvfuzz_run(rvfuzz_t* f, uint32_t pc) {
+	rvstate_t* s = f->s;
+	const char* corpus = f->cfg.corpus;
+	char fn[4096];
+	if (fuzz_start(f, pc) < 0) return -1;
+	rvsim_iocall_complete(f->hart, 0);
+
+	// the checkpoint is only wanted for rewinding to: its file stays
+	// mapped while the instance lives
+	const char* tmp = getenv("TMPDIR");
+	snprintf(fn, sizeof(fn), "%s/rvfuzz-XXXXXX", tmp ? tmp : "/tmp");
+	int fd;
+	if ((fd = mkstemp(fn)) < 0) {
+		fprintf(stderr, "error: cannot create '%s'\n", fn);
+		return -1;
+	}
+	close(fd);
+	int r = rvsim_checkpoint(s, fn, NULL);
+	unlink(fn);
+	if (r < 0) {
+		fprintf(stderr, "error: cannot checkpoint the guest\n");
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &f->t0);
+	rvsim_coverage(s, f->map);
+	if (corpus) {
+		if ((mkdir(corpus, 0755) < 0) && (errno != EEXIST)) {
+			fprintf(stderr, "error: cannot create '%s'\n", corpus);
+			return -1;
+		}
+		snprintf(fn, sizeof(fn), "%s/queue", corpus);
+		if ((fuzz_seed(f, corpus) < 0) || (fuzz_seed(f, fn) < 0)) {
+			fprintf(stderr, "error: cannot read corpus '%s'\n", corpus);
+			return -1;
+		}
+	}
+	if (f->count == 0) {
+		// nothing to start from but nothing
+		if ((fuzz_outcome(f, fuzz_one(f, NULL, 0), NULL, 0, 1) < 0) ||
+			((f->count == 0) && (fuzz_keep(f, NULL, 0) < 0))) {
+			return -1;
+		}
+	}
+	fuzz_status(f, "INITED");
+
+	uint64_t pulse = 1;
+	while ((f->cfg.runs == 0) || (f->execs < f->cfg.runs)) {
+		fuzzinput_t* in = f->inputs + (fuzz_rand(f) % f->count);
+		uint32_t len = (in->len < f->cfg.maxlen) ? in->len : f->cfg.maxlen;
+		memcpy(f->next, in->data, len);
+		len = fuzz_mutate(f, len);
+		if (fuzz_outcome(f, fuzz_one(f, f->next, len), f->next, len, 0) < 0) {
+			return -1;
+		}
+		if (f->execs >= pulse) {
+			fuzz_status(f, "pulse");
+			pulse <<= 1;
+		}
+	}
+	fuzz_status(f, "DONE");
+	rvsim_coverage(s, NULL);
+	return f->crashes;
+}
+
+int rvfuzz_replay(rvfuzz_t* f, uint32_t pc, const char* fn) {
+	rvstate_t* s = f->s;
+	uint8_t* data;
+	uint32_t len;
+	if ((data = fuzz_load(fn, &len)) == NULL) {
+		fprintf(stderr, "error: cannot read '%s'\n", fn);
+		return -1;
+	}
+	// the map afl-fuzz made for this run
+	const char* id = getenv("__AFL_SHM_ID");
+	if (id) {
+		uint8_t* map = shmat(atoi(id), NULL, 0);
+		if (map == (void*) -1) {
+			fprintf(stderr, "error: cannot attach afl map %s\n", id);
+		} else {
+			rvsim_coverage(s, map);
+		}
+	}
+	int r = -1;
+	if (fuzz_start(f, pc) == 0) {
+		rvsim_iocall_complete(f->hart, fuzz_input(f, data, len));
+		switch (fuzz_finish(f)) {
+		case FUZZ_OK:
+			r = 0;
+			break;
+		case FUZZ_CRASH:
+			r = rvsim_exit_status(s);
+			break;
+		}
+	}
+	free(data);
+	return r;
+}
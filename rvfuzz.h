@@ -0,0 +1,56 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "rvsim.h"
+
+// an in-process, coverage guided fuzzer for guests that take their
+// input with IOCALL_FUZZ (iocall.h): the guest runs up to its first
+// call and is checkpointed there, then each input is a run rewound to
+// that point (rvsim_rewind()) with its edge coverage counted
+// (rvsim_coverage()), and inputs that find new edges are mutated further
+//
+// The corpus is a directory of inputs, a file each, as libFuzzer and
+// AFL++ keep theirs (the queue/ of an AFL++ output directory is read
+// too): it seeds the fuzzer, and inputs with new coverage are added to
+// it, named for a hash of their contents.  Inputs the guest exits with
+// a nonzero status for are saved as crash-<hash>, and those that run
+// past the instruction limit as timeout-<hash>.
+
+typedef struct rvfuzz rvfuzz_t;
+
+typedef struct {
+	const char* corpus; // directory (created if need be), or NULL
+	const char* prefix; // of crash and timeout files ("" by default)
+	uint64_t runs;      // inputs to try, 0 for no end
+	uint64_t limit;     // instructions an input may run, 0 for 10M
+	uint32_t maxlen;    // of the inputs made, 0 for 4096
+	uint32_t seed;      // of the mutations, 0 for one from the clock
+} rvfuzz_config_t;
+
+// a fuzzer for the instance s belongs to, which has been loaded (or
+// restored) but not run
+int rvfuzz_create(rvfuzz_t** f, rvstate_t* s, const rvfuzz_config_t* cfg);
+
+// release the fuzzer (before the instance is destroyed)
+void rvfuzz_destroy(rvfuzz_t* f);
+
+// IOCALL_FUZZ, from the iocall callback of hart: deferred, for the
+// fuzzer to supply the input
+uint32_t rvfuzz_iocall(rvfuzz_t* f, rvstate_t* hart, uint32_t buf, uint32_t max);
+
+// fuzz from the entry point, printing progress to stderr, until the
+// runs are done
+// returns the number of crashing inputs found, or -1 if the guest never
+// asked for input or the corpus can't be read or written
+int rvfuzz_run(rvfuzz_t* f, uint32_t pc);
+
+// run the input in file fn once, from the entry point, as afl-fuzz
+// runs a target, counting coverage into its shared memory when
+// __AFL_SHM_ID says where that is
+// returns the guest's exit status, 0 if it asked for more input, or
+// -1 if it did not finish (or never asked for input)
+int rvfuzz_replay(rvfuzz_t* f, uint32_t pc, const char* fn);
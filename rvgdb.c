@@ -0,0 +1,466 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// gdb talks to this over a socket while the harts run on the same
+// thread a slice at a time (rvsim_run()), with a look for ^C in between.
+// They all stop when one does (at a breakpoint, a watchpoint, after a
+// step, or for ^C), and that one is the thread gdb is shown.  The
+// breakpoints and watchpoints are the simulator's own, so the harts run
+// at full speed until one is hit.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "rvsim.h"
+#include "rvcore.h"
+#include "rvgdb.h"
+
+// instructions run between looks for ^C
+#define GDB_SLICE 1000000
+
+// largest packet (the registers, or a read of 8KB, as hex)
+#define GDB_MAXPKT 0x4000
+
+// the signals stops are reported as
+#define GDB_SIGINT  2
+#define GDB_SIGTRAP 5
+
+typedef struct {
+	rvstate_t* s;
+	int fd;
+	unsigned hart; // the hart g, G, p, P and s act on (Hg, Hc)
+	unsigned nharts;
+	int status; // the guest's exit status, once it has exited
+	// input not taken yet
+	uint8_t in[4096];
+	unsigned inpos;
+	unsigned inlen;
+	char pkt[GDB_MAXPKT + 1];
+	char out[GDB_MAXPKT + 8];
+	char xml[4096]; // target.xml
+} gdb_t;
+
+static const char* regname[32] = {
+	"zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2",
+	"fp", "s1", "a0", "a1", "a2", "a3", "a4", "a5",
+	"a6", "a7", "s2", "s3", "s4", "s5", "s6", "s7",
+	"s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6",
+};
+
+static void make_xml(gdb_t* g) {
+	char* p = g->xml;
+	char* end = g->xml + sizeof(g->xml);
+	p += snprintf(p, end - p, "<?xml version=\"1.0\"?>"
+		"<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+		"<target><architecture>riscv:rv32</architecture>"
+		"<feature name=\"org.gnu.gdb.riscv.cpu\">");
+	for (unsigned n = 0; n < 32; n++) {
+		p += snprintf(p, end - p, "<reg name=\"%s\" bitsize=\"32\" type=\"%s\"/>",
+			regname[n], (n == 2) ? "data_ptr" : "int");
+	}
+	snprintf(p, end - p, "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
+		"</feature></target>");
+}
+
+static int hexval(int c) {
+	if ((c >= '0') && (c <= '9')) return c - '0';
+	if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+	if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+	return -1;
+}
+
+// a hex number at *p, moving *p past it
+static uint32_t hexnum(const char** p) {
+	uint32_t v = 0;
+	int x;
+	while ((x = hexval(**p)) >= 0) {
+		v = (v << 4) | x;
+		(*p)++;
+	}
+	return v;
+}
+
+// bytes as hex, so words come out in target (little endian) order
+static char* put_hex(char* out, const uint8_t* data, unsigned len) {
+	static const char digit[] = "0123456789abcdef";
+	for (unsigned n = 0; n < len; n++) {
+		*out++ = digit[data[n] >> 4];
+		*out++ = digit[data[n] & 15];
+	}
+	*out = 0;
+	return out;
+}
+static int get_hex(const char** p, uint8_t* data, unsigned len) {
+	for (unsigned n = 0; n < len; n++) {
+		int hi = hexval((*p)[0]);
+		int lo = (hi < 0) ? -1 : hexval((*p)[1]);
+		if (lo < 0) return -1;
+		data[n] = (hi << 4) | lo;
+		*p += 2;
+	}
+	return 0;
+}
+
+static int gdb_write(gdb_t* g, const void* data, size_t len) {
+	const char* p = data;
+	while (len > 0) {
+		ssize_t r = write(g->fd, p, len);
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += r;
+		len -= r;
+	}
+	return 0;
+}
+
+// a byte from gdb, or -1 if it went away
+static int gdb_getc(gdb_t* g) {
+	if (g->inpos == g->inlen) {
+		ssize_t r;
+		do {
+			r = read(g->fd, g->in, sizeof(g->in));
+		} while ((r < 0) && (errno == EINTR));
+		if (r <= 0) return -1;
+		g->inpos = 0;
+		g->inlen = r;
+	}
+	return g->in[g->inpos++];
+}
+
+// gdb sent ^C while the harts were running
+static int gdb_interrupted(gdb_t* g, int wait) {
+	if (g->inpos == g->inlen) {
+		struct pollfd pfd = { .fd = g->fd, .events = POLLIN };
+		if (poll(&pfd, 1, wait) <= 0) return 0;
+	}
+	// or gdb went away, which stops things too
+	int c = gdb_getc(g);
+	return (c == 3) || (c < 0);
+}
+
+// the next packet into g->pkt, acknowledged, or -1 if gdb went away
+// acks and ^C outside of packets are skipped
+static int gdb_recv(gdb_t* g) {
+	for (;;) {
+		int c;
+		do {
+			if ((c = gdb_getc(g)) < 0) return -1;
+		} while (c != '$');
+		unsigned n = 0;
+		uint8_t sum = 0;
+		int bad = 0;
+		while ((c = gdb_getc(g)) != '#') {
+			if (c < 0) return -1;
+			sum += c;
+			if (n == GDB_MAXPKT) {
+				bad = 1;
+			} else {
+				g->pkt[n++] = c;
+			}
+		}
+		int hi = gdb_getc(g);
+		int lo = gdb_getc(g);
+		if ((hi < 0) || (lo < 0)) return -1;
+		g->pkt[n] = 0;
+		if (bad || (((hexval(hi) << 4) | hexval(lo)) != sum)) {
+			if (gdb_write(g, "-", 1)) return -1;
+			continue;
+		}
+		if (gdb_write(g, "+", 1)) return -1;
+		return n;
+	}
+}
+
+static int gdb_send(gdb_t* g, const char* data) {
+	char tail[4];
+	uint8_t sum = 0;
+	size_t len = strlen(data);
+	for (size_t n = 0; n < len; n++) {
+		sum += (uint8_t) data[n];
+	}
+	snprintf(tail, sizeof(tail), "#%02x", sum);
+	if (gdb_write(g, "$", 1) || gdb_write(g, data, len) || gdb_write(g, tail, 3)) {
+		return -1;
+	}
+	return 0;
+}
+
+static rvstate_t* gdb_hart(gdb_t* g) {
+	return rvsim_hart(g->s, g->hart);
+}
+
+// tell gdb why the harts stopped: sig, or a watchpoint
+static int gdb_stopped(gdb_t* g, unsigned sig, unsigned why, uint32_t addr) {
+	if (why == RVSIM_STOP_WATCH) {
+		snprintf(g->out, sizeof(g->out), "T%02xwatch:%x;thread:%x;",
+			sig, addr, g->hart + 1);
+	} else {
+		snprintf(g->out, sizeof(g->out), "T%02xthread:%x;", sig, g->hart + 1);
+	}
+	return gdb_send(g, g->out);
+}
+
+// after running the harts (r from rvsim_run() or rvsim_step())
+// returns 1 once the guest has exited (and gdb was told), -1 if gdb
+// went away
+static int gdb_report(gdb_t* g, int r) {
+	if (r == RVSIM_EXITED) {
+		g->status = rvsim_exit_status(g->s);
+		snprintf(g->out, sizeof(g->out), "W%02x", g->status & 0xff);
+		gdb_send(g, g->out);
+		return 1;
+	}
+	unsigned why = 0;
+	uint32_t addr = 0;
+	for (unsigned n = 0; n < g->nharts; n++) {
+		uint32_t a;
+		unsigned w = rvsim_stopped(rvsim_hart(g->s, n), &a);
+		if (w && !why) {
+			why = w;
+			addr = a;
+			g->hart = n;
+		}
+	}
+	return gdb_stopped(g, GDB_SIGTRAP, why, addr) ? -1 : 0;
+}
+
+// run until a hart stops, the guest exits, or ^C
+static int gdb_continue(gdb_t* g) {
+	// the first step takes the hart off a breakpoint it may be at
+	int r = rvsim_step(gdb_hart(g));
+	while ((r == RVSIM_RUNNING) || (r == RVSIM_WAITING)) {
+		if (gdb_interrupted(g, (r == RVSIM_WAITING) ? 10 : 0)) {
+			return gdb_stopped(g, GDB_SIGINT, 0, 0) ? -1 : 0;
+		}
+		r = rvsim_run(g->s, GDB_SLICE);
+	}
+	return gdb_report(g, r);
+}
+
+// qXfer:features:read:target.xml:off,len
+static void gdb_xfer(gdb_t* g, const char* p) {
+	uint32_t off = hexnum(&p);
+	if (*p++ != ',') {
+		strcpy(g->out, "E01");
+		return;
+	}
+	uint32_t len = hexnum(&p);
+	uint32_t size = strlen(g->xml);
+	if (len > (GDB_MAXPKT - 1)) len = GDB_MAXPKT - 1;
+	if (off >= size) {
+		strcpy(g->out, "l");
+	} else {
+		if (len > (size - off)) len = size - off;
+		g->out[0] = ((off + len) < size) ? 'm' : 'l';
+		memcpy(g->out + 1, g->xml + off, len);
+		g->out[len + 1] = 0;
+	}
+}
+
+// a packet that doesn't run the harts, its reply into g->out
+static void gdb_command(gdb_t* g) {
+	rvstate_t* h = gdb_hart(g);
+	const char* p = g->pkt + 1;
+	char* out = g->out;
+	out[0] = 0;
+	switch (g->pkt[0]) {
+	case '?':
+		snprintf(out, sizeof(g->out), "T%02xthread:%x;", GDB_SIGTRAP, g->hart + 1);
+		break;
+	case 'g':
+		for (unsigned n = 0; n < 32; n++) {
+			out = put_hex(out, (uint8_t*) (h->x + n), 4);
+		}
+		put_hex(out, (uint8_t*) &h->pc, 4);
+		break;
+	case 'G': {
+		uint32_t x[33];
+		if (get_hex(&p, (uint8_t*) x, sizeof(x))) {
+			strcpy(out, "E01");
+			break;
+		}
+		memcpy(h->x + 1, x + 1, 31 * sizeof(uint32_t));
+		h->pc = x[32];
+		strcpy(out, "OK");
+		break;
+	}
+	case 'p': {
+		uint32_t n = hexnum(&p);
+		if (n < 32) {
+			put_hex(out, (uint8_t*) (h->x + n), 4);
+		} else if (n == 32) {
+			put_hex(out, (uint8_t*) &h->pc, 4);
+		} else {
+			strcpy(out, "E01");
+		}
+		break;
+	}
+	case 'P': {
+		uint32_t n = hexnum(&p);
+		uint32_t v;
+		if ((*p++ != '=') || get_hex(&p, (uint8_t*) &v, 4) || (n > 32)) {
+			strcpy(out, "E01");
+			break;
+		}
+		if (n == 32) {
+			h->pc = v;
+		} else if (n > 0) {
+			h->x[n] = v;
+		}
+		strcpy(out, "OK");
+		break;
+	}
+	case 'm': case 'M': {
+		uint32_t addr = hexnum(&p);
+		uint32_t len = (*p++ == ',') ? hexnum(&p) : 0;
+		uint8_t* ptr = rvsim_dma(g->s, addr, len);
+		if ((ptr == NULL) || (len > (GDB_MAXPKT / 2))) {
+			strcpy(out, "E01");
+		} else if (g->pkt[0] == 'm') {
+			put_hex(out, ptr, len);
+		} else if ((*p++ != ':') || get_hex(&p, ptr, len)) {
+			strcpy(out, "E01");
+		} else {
+			rvsim_dma_written(g->s, addr, len);
+			strcpy(out, "OK");
+		}
+		break;
+	}
+	case 'Z': case 'z': {
+		// Z0/Z1 breakpoint, Z2 write watchpoint,addr,kind or length
+		unsigned type = hexnum(&p);
+		uint32_t addr = (*p++ == ',') ? hexnum(&p) : 0;
+		uint32_t len = (*p++ == ',') ? hexnum(&p) : 0;
+		int on = (g->pkt[0] == 'Z');
+		if (type <= 1) {
+			strcpy(out, rvsim_breakpoint(g->s, addr, on) ? "E01" : "OK");
+		} else if (type == 2) {
+			strcpy(out, rvsim_watchpoint(g->s, addr, len, on) ? "E01" : "OK");
+		}
+		break;
+	}
+	case 'H': {
+		// Hg or Hc, then a thread (0: any, -1: all)
+		p++;
+		if (*p != '-') {
+			uint32_t t = hexnum(&p);
+			if ((t > 0) && (t <= g->nharts)) g->hart = t - 1;
+		}
+		strcpy(out, "OK");
+		break;
+	}
+	case 'T': {
+		uint32_t t = hexnum(&p);
+		strcpy(out, ((t > 0) && (t <= g->nharts)) ? "OK" : "E01");
+		break;
+	}
+	case 'q':
+		if (!strncmp(p, "Supported", 9)) {
+			snprintf(out, sizeof(g->out), "PacketSize=%x;qXfer:features:read+", GDB_MAXPKT);
+		} else if (!strncmp(p, "Xfer:features:read:target.xml:", 31)) {
+			gdb_xfer(g, p + 31);
+		} else if (!strcmp(p, "Attached")) {
+			strcpy(out, "1");
+		} else if (!strcmp(p, "C")) {
+			snprintf(out, sizeof(g->out), "QC%x", g->hart + 1);
+		} else if (!strcmp(p, "fThreadInfo")) {
+			*out++ = 'm';
+			for (unsigned n = 0; n < g->nharts; n++) {
+				out += sprintf(out, n ? ",%x" : "%x", n + 1);
+			}
+		} else if (!strcmp(p, "sThreadInfo")) {
+			strcpy(out, "l");
+		}
+		break;
+	}
+}
+
+static int gdb_accept(const char* where) {
+	int fd, s;
+	if (strchr(where, '/')) {
+		struct sockaddr_un sa = { .sun_family = AF_UNIX };
+		if (strlen(where) >= sizeof(sa.sun_path)) return -1;
+		strcpy(sa.sun_path, where);
+		unlink(where);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+		if (bind(fd, (struct sockaddr*) &sa, sizeof(sa)) < 0) goto fail;
+	} else {
+		struct sockaddr_in sa = {
+			.sin_family = AF_INET,
+			.sin_port = htons(atoi(where)),
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		};
+		int on = 1;
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, (struct sockaddr*) &sa, sizeof(sa)) < 0) goto fail;
+	}
+	if (listen(fd, 1) < 0) goto fail;
+	fprintf(stderr, "rvgdb: waiting for gdb on %s\n", where);
+	while (((s = accept(fd, NULL, NULL)) < 0) && (errno == EINTR)) ;
+	if (s < 0) goto fail;
+	close(fd);
+	if (!strchr(where, '/')) {
+		int on = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+	return s;
+fail:
+	close(fd);
+	return -1;
+}
+
+int rvgdb_serve(rvstate_t* s, const char* where) {
+	gdb_t* g;
+	if ((g = calloc(1, sizeof(gdb_t))) == NULL) {
+		return -1;
+	}
+	g->s = s;
+	while (rvsim_hart(s, g->nharts)) g->nharts++;
+	make_xml(g);
+	if ((g->fd = gdb_accept(where)) < 0) {
+		fprintf(stderr, "rvgdb: cannot listen on %s\n", where);
+		free(g);
+		return -1;
+	}
+	g->status = -1;
+	for (;;) {
+		if (gdb_recv(g) < 0) break;
+		const char* p = g->pkt + 1;
+		int r;
+		if ((g->pkt[0] == 'c') || (g->pkt[0] == 's')) {
+			if (*p) gdb_hart(g)->pc = hexnum(&p);
+			r = (g->pkt[0] == 'c') ? gdb_continue(g) :
+				gdb_report(g, rvsim_step(gdb_hart(g)));
+		} else if (g->pkt[0] == 'D') {
+			// detached: run on without it
+			gdb_send(g, "OK");
+			while ((r = rvsim_run(s, GDB_SLICE)) != RVSIM_EXITED) {
+				if (r == RVSIM_WAITING) usleep(1000);
+			}
+			g->status = rvsim_exit_status(s);
+			break;
+		} else if (g->pkt[0] == 'k') {
+			break;
+		} else {
+			gdb_command(g);
+			r = gdb_send(g, g->out);
+		}
+		if (r) break;
+	}
+	int status = g->status;
+	close(g->fd);
+	free(g);
+	return status;
+}
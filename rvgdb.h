@@ -0,0 +1,15 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include "rvsim.h"
+
+// a gdb remote serial protocol stub (target remote): registers, memory,
+// single step, breakpoints and write watchpoints, with each hart a thread
+
+// wait for gdb to connect to where (a tcp port on localhost, or a path
+// for a unix socket), then run the harts of the instance s belongs to on
+// the calling thread as it says, from where they are
+// returns the guest's exit status, or -1 if gdb killed it or went away
+int rvgdb_serve(rvstate_t* s, const char* where);
@@ -0,0 +1,31 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// The reference engine (rvengine.h with ENGINE_HOOKS), included by
+// rvsim.c once per ENGINE_DEBUG, a combination of the RVSIM_DEBUG_ENGINE
+// options written in decimal: defines rvsim_exec_hooks_N and
+// rvsim_exec_hooks_rvc_N
+
+#define HOOKS_NAME_(name, n) name##_##n
+#define HOOKS_NAME(name, n) HOOKS_NAME_(name, n)
+
+#define ENGINE_NAME HOOKS_NAME(rvsim_exec_hooks, ENGINE_DEBUG)
+#define ENGINE_THREADED 0
+#define ENGINE_JIT 0
+#define ENGINE_HOOKS 1
+#define ENGINE_RVC 0
+#include "rvengine.h"
+#undef ENGINE_NAME
+#undef ENGINE_RVC
+
+#define ENGINE_NAME HOOKS_NAME(rvsim_exec_hooks_rvc, ENGINE_DEBUG)
+#define ENGINE_RVC 1
+#include "rvengine.h"
+#undef ENGINE_NAME
+#undef ENGINE_THREADED
+#undef ENGINE_JIT
+#undef ENGINE_HOOKS
+#undef ENGINE_RVC
+
+#undef HOOKS_NAME
+#undef HOOKS_NAME_
@@ -0,0 +1,732 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// x86-64 compiler for hot RV32IM basic blocks
+//
+// A block starts at a slot the threaded engine found hot and runs
+// until a branch or jump (included) or an instruction the compiler
+// doesn't handle (excluded), never crossing a page.  Guest registers
+// live at fixed offsets from the rvstate_t pointer, pinned in rbx,
+// and guest ram is addressed from r12.  Compiled code returns
+// (instructions executed << 32) | next pc.
+//
+// Anything unusual leaves the block *before* the instruction that
+// would cause it (io space, misalignment, out of range targets) so
+// the interpreter executes it and raises the trap.  When the instance
+// has a guard page reservation (rvsim.c, RVVMSIZE) r12 points at guest
+// address 0 and loads and stores are not checked at all: an access
+// outside of ram faults, and the SIGSEGV handler below resumes at an
+// exit stub for that instruction instead.  Stores to pages with code
+// decoded by any hart call back into rvsim_code_write() and leave the
+// block right after the store.  Once code in a page is modified all of
+// its compiled blocks are dropped and the page is left to the
+// interpreter.
+
+#define _GNU_SOURCE // REG_RIP
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "riscv.h"
+#include "rvsim.h"
+#include "rvcore.h"
+
+#define JITCODESIZE (16 * 1024 * 1024)
+#define JITMAXBLOCKS 65536
+#define JITMAXINS 128
+
+// generous worst case bytes emitted per instruction
+#define JITINSMAX 256
+
+#define JITMAXFAULTS (4 * JITMAXBLOCKS)
+
+// an unchecked load or store, and where to go if it faults
+typedef struct {
+	uint32_t at;   // code offset of the instruction
+	uint32_t stub; // code offset of its exit
+	uint32_t pc;
+} jitfault_t;
+
+struct rvjit {
+	uint8_t* code;
+	uint32_t used;
+	uint32_t nblocks;
+	rvjitblock_t block[JITMAXBLOCKS];
+	uint16_t hot[1U << RVJIT_HOTBITS];
+	uint32_t nfaults;
+	jitfault_t fault[JITMAXFAULTS]; // in code order
+};
+
+#if defined(__x86_64__)
+
+// x86 registers
+#define rAX 0
+#define rCX 1
+#define rDX 2
+#define rBX 3
+#define rSI 6
+#define rDI 7
+
+// condition codes
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_L  0xC
+#define CC_GE 0xD
+
+// an unchecked access awaiting its exit stub
+typedef struct {
+	uint8_t* at;
+	uint32_t count;
+	uint32_t pc;
+	uint32_t loads;
+	uint32_t stores;
+} site_t;
+
+typedef struct {
+	uint8_t* p;
+	uint8_t* epilogue;
+	uint32_t count; // instructions completed so far
+	// and the events among them, for the performance counters
+	uint32_t loads;
+	uint32_t stores;
+	uint32_t taken;
+	uint32_t membase;
+	uint32_t memsize;
+	uint32_t ialign; // s->ialign
+	int direct; // r12 is vmem, accesses are not checked
+	unsigned nsites;
+	site_t site[JITMAXINS];
+} emitter_t;
+
+static void e8(emitter_t* e, uint32_t v) {
+	*e->p++ = v;
+}
+static void e32(emitter_t* e, uint32_t v) {
+	memcpy(e->p, &v, 4);
+	e->p += 4;
+}
+static void e64(emitter_t* e, uint64_t v) {
+	memcpy(e->p, &v, 8);
+	e->p += 8;
+}
+
+// modrm for [rbx + offset of x[n]]
+static void xreg(emitter_t* e, uint32_t reg, uint32_t n) {
+	uint32_t disp = offsetof(rvstate_t, x) + n * 4;
+	if (disp < 128) {
+		e8(e, 0x40 | (reg << 3) | rBX);
+		e8(e, disp);
+	} else {
+		e8(e, 0x80 | (reg << 3) | rBX);
+		e32(e, disp);
+	}
+}
+
+// mov reg, x[n]
+static void ld_x(emitter_t* e, uint32_t reg, uint32_t n) {
+	e8(e, 0x8B);
+	xreg(e, reg, n);
+}
+// mov x[n], reg
+static void st_x(emitter_t* e, uint32_t reg, uint32_t n) {
+	e8(e, 0x89);
+	xreg(e, reg, n);
+}
+// mov x[n], imm
+static void st_x_imm(emitter_t* e, uint32_t n, uint32_t imm) {
+	e8(e, 0xC7);
+	xreg(e, 0, n);
+	e32(e, imm);
+}
+// <alu> eax, x[n]
+static void alu_x(emitter_t* e, uint32_t opc, uint32_t n) {
+	e8(e, opc);
+	xreg(e, rAX, n);
+}
+// <alu> reg, imm (group 1: 0 add, 1 or, 4 and, 5 sub, 6 xor, 7 cmp)
+static void alu_imm(emitter_t* e, uint32_t grp, uint32_t reg, uint32_t imm) {
+	e8(e, 0x81);
+	e8(e, 0xC0 | (grp << 3) | reg);
+	e32(e, imm);
+}
+// shift eax by imm (group 2: 4 shl, 5 shr, 7 sar)
+static void shift_imm(emitter_t* e, uint32_t grp, uint32_t imm) {
+	e8(e, 0xC1);
+	e8(e, 0xC0 | (grp << 3) | rAX);
+	e8(e, imm);
+}
+// shift eax by cl
+static void shift_cl(emitter_t* e, uint32_t grp) {
+	e8(e, 0xD3);
+	e8(e, 0xC0 | (grp << 3) | rAX);
+}
+// eax = (flags satisfy cc)
+static void setcc(emitter_t* e, uint32_t cc) {
+	e8(e, 0x0F); e8(e, 0x90 | cc); e8(e, 0xC0); // setcc al
+	e8(e, 0x0F); e8(e, 0xB6); e8(e, 0xC0); // movzx eax, al
+}
+// jcc rel32, returns the location to patch
+static uint8_t* jcc(emitter_t* e, uint32_t cc) {
+	e8(e, 0x0F);
+	e8(e, 0x80 | cc);
+	e32(e, 0);
+	return e->p - 4;
+}
+static uint8_t* jmp(emitter_t* e) {
+	e8(e, 0xE9);
+	e32(e, 0);
+	return e->p - 4;
+}
+static void patch(emitter_t* e, uint8_t* at) {
+	int32_t rel = e->p - (at + 4);
+	memcpy(at, &rel, 4);
+}
+
+// evcount[ev] += n
+static void count_event(emitter_t* e, uint32_t ev, uint32_t n) {
+	if (n == 0) return;
+	e8(e, 0x48); e8(e, (n < 128) ? 0x83 : 0x81); e8(e, 0x83); // add qword [rbx + evcount[ev]], n
+	e32(e, offsetof(rvstate_t, evcount) + ev * sizeof(uint64_t));
+	if (n < 128) {
+		e8(e, n);
+	} else {
+		e32(e, n);
+	}
+}
+
+// on the way out, count the events of the instructions completed
+// (they are known when compiling, so nothing is counted in between)
+static void count_events(emitter_t* e) {
+	count_event(e, RVSIM_EV_LOADS, e->loads);
+	count_event(e, RVSIM_EV_STORES, e->stores);
+	count_event(e, RVSIM_EV_BRANCHES, e->taken);
+}
+
+// leave the block with a constant next pc
+static void exit_pc(emitter_t* e, uint32_t count, uint32_t pc) {
+	count_events(e);
+	e8(e, 0x48); e8(e, 0xB8); // mov rax, imm64
+	e64(e, (((uint64_t)count) << 32) | pc);
+	e8(e, 0xE9); // jmp epilogue
+	e32(e, e->epilogue - (e->p + 4));
+}
+
+// leave the block with the next pc in eax
+static void exit_eax(emitter_t* e, uint32_t count) {
+	count_events(e);
+	e8(e, 0x48); e8(e, 0xBA); // mov rdx, imm64
+	e64(e, ((uint64_t)count) << 32);
+	e8(e, 0x48); e8(e, 0x09); e8(e, 0xD0); // or rax, rdx
+	e8(e, 0xE9); // jmp epilogue
+	e32(e, e->epilogue - (e->p + 4));
+}
+
+// leave the block before the current instruction if cc holds
+static void exit_if(emitter_t* e, uint32_t cc, uint32_t pc) {
+	uint8_t* skip = jcc(e, cc ^ 1);
+	exit_pc(e, e->count, pc);
+	patch(e, skip);
+}
+
+// eax = x[r1] + imm, leave the block if misaligned or (unless direct)
+// not in ram, then eax is what to add to r12 for the access
+static void mem_addr(emitter_t* e, rvop_t* op, uint32_t align) {
+	ld_x(e, rAX, op->r1);
+	if (op->imm) alu_imm(e, 0, rAX, op->imm);
+	if (align) {
+		e8(e, 0xA8); e8(e, align); // test al, align
+		exit_if(e, CC_NE, op->pc);
+	}
+	if (e->direct) {
+		// the access itself is emitted next, note it in case it faults
+		site_t* s = e->site + e->nsites++;
+		s->at = e->p;
+		s->count = e->count;
+		s->pc = op->pc;
+		s->loads = e->loads;
+		s->stores = e->stores;
+		return;
+	}
+	// below membase wraps around, so one compare finds both io and faults
+	alu_imm(e, 5, rAX, e->membase); // sub eax, membase
+	alu_imm(e, 7, rAX, e->memsize); // cmp eax, memsize
+	exit_if(e, CC_AE, op->pc);
+}
+
+// after a store to ram at eax (see mem_addr()), leave the block if the
+// page holds decoded code
+static void store_check(emitter_t* e, rvop_t* op) {
+	e8(e, 0x89); e8(e, 0xC1); // mov ecx, eax
+	if (e->direct) alu_imm(e, 5, rCX, e->membase); // sub ecx, membase
+	e8(e, 0x89); e8(e, 0xCA); // mov edx, ecx
+	e8(e, 0xC1); e8(e, 0xEA); e8(e, RVPAGESHIFT); // shr edx, RVPAGESHIFT
+	e8(e, 0x48); e8(e, 0x8B); e8(e, 0xB3); // mov rsi, [rbx + codemap]
+	e32(e, offsetof(rvstate_t, codemap));
+	e8(e, 0x48); e8(e, 0x83); e8(e, 0x3C); e8(e, 0xD6); e8(e, 0x00); // cmp qword [rsi + rdx * 8], 0
+	uint8_t* skip = jcc(e, CC_E);
+	e8(e, 0x48); e8(e, 0x89); e8(e, 0xDF); // mov rdi, rbx
+	e8(e, 0x89); e8(e, 0xCE); // mov esi, ecx
+	e8(e, 0x48); e8(e, 0xB8); // mov rax, rvsim_code_write
+	e64(e, (uintptr_t) rvsim_code_write);
+	e8(e, 0xFF); e8(e, 0xD0); // call rax
+	exit_pc(e, e->count + 1, op->pc + op->len);
+	patch(e, skip);
+}
+
+// x86 opcode for <alu> r32, r/m32
+static uint32_t alu_opcode(uint32_t op) {
+	switch (op) {
+	case OP_ADD: return 0x03;
+	case OP_SUB: return 0x2B;
+	case OP_XOR: return 0x33;
+	case OP_OR:  return 0x0B;
+	case OP_AND: return 0x23;
+	default:     return 0x3B; // cmp
+	}
+}
+
+static void emit_divrem(emitter_t* e, rvop_t* op) {
+	uint32_t sign = (op->op == OP_DIV) || (op->op == OP_REM);
+	uint32_t rem = (op->op == OP_REM) || (op->op == OP_REMU);
+	ld_x(e, rAX, op->r1);
+	ld_x(e, rCX, op->r2);
+	e8(e, 0x85); e8(e, 0xC9); // test ecx, ecx
+	uint8_t* zero = jcc(e, CC_E);
+	uint8_t* ovf = NULL;
+	if (sign) {
+		e8(e, 0x83); e8(e, 0xF9); e8(e, 0xFF); // cmp ecx, -1
+		uint8_t* ok = jcc(e, CC_NE);
+		alu_imm(e, 7, rAX, 0x80000000);
+		ovf = jcc(e, CC_E);
+		patch(e, ok);
+		e8(e, 0x99); // cdq
+		e8(e, 0xF7); e8(e, 0xF9); // idiv ecx
+	} else {
+		e8(e, 0x31); e8(e, 0xD2); // xor edx, edx
+		e8(e, 0xF7); e8(e, 0xF1); // div ecx
+	}
+	if (rem) {
+		e8(e, 0x89); e8(e, 0xD0); // mov eax, edx
+	}
+	uint8_t* done = jmp(e);
+	patch(e, zero);
+	// divide by zero: quotient is all ones, remainder is the dividend
+	if (!rem) {
+		e8(e, 0xB8); e32(e, 0xFFFFFFFF); // mov eax, -1
+	}
+	if (ovf) {
+		uint8_t* done2 = jmp(e);
+		patch(e, ovf);
+		// overflow: quotient is the dividend, remainder is zero
+		if (rem) {
+			e8(e, 0x31); e8(e, 0xC0); // xor eax, eax
+		}
+		patch(e, done2);
+	}
+	patch(e, done);
+	st_x(e, rAX, op->rd);
+}
+
+// emit one instruction
+// returns 0 if it's not supported (the block ends before it),
+// 1 if the block continues, 2 if the block ends after it
+static int emit(emitter_t* e, rvop_t* op) {
+	switch (op->op) {
+	case OP_NOP:
+		return 1;
+	case OP_FENCE:
+		e8(e, 0x0F); e8(e, 0xAE); e8(e, 0xF0); // mfence
+		return 1;
+	case OP_LI:
+		st_x_imm(e, op->rd, op->imm);
+		return 1;
+	case OP_ADDI:
+	case OP_XORI:
+	case OP_ORI:
+	case OP_ANDI: {
+		static const uint8_t grp[] = {
+			[OP_ADDI] = 0, [OP_XORI] = 6, [OP_ORI] = 1, [OP_ANDI] = 4,
+		};
+		ld_x(e, rAX, op->r1);
+		alu_imm(e, grp[op->op], rAX, op->imm);
+		st_x(e, rAX, op->rd);
+		return 1;
+	}
+	case OP_SLTI:
+	case OP_SLTIU:
+		ld_x(e, rAX, op->r1);
+		alu_imm(e, 7, rAX, op->imm);
+		setcc(e, (op->op == OP_SLTI) ? CC_L : CC_B);
+		st_x(e, rAX, op->rd);
+		return 1;
+	case OP_SLLI:
+	case OP_SRLI:
+	case OP_SRAI:
+		ld_x(e, rAX, op->r1);
+		shift_imm(e, (op->op == OP_SLLI) ? 4 : (op->op == OP_SRLI) ? 5 : 7, op->imm);
+		st_x(e, rAX, op->rd);
+		return 1;
+	case OP_ADD:
+	case OP_SUB:
+	case OP_XOR:
+	case OP_OR:
+	case OP_AND:
+		ld_x(e, rAX, op->r1);
+		alu_x(e, alu_opcode(op->op), op->r2);
+		st_x(e, rAX, op->rd);
+		return 1;
+	case OP_SLT:
+	case OP_SLTU:
+		ld_x(e, rAX, op->r1);
+		alu_x(e, 0x3B, op->r2);
+		setcc(e, (op->op == OP_SLT) ? CC_L : CC_B);
+		st_x(e, rAX, op->rd);
+		return 1;
+	case OP_SLL:
+	case OP_SRL:
+	case OP_SRA:
+		// x86 masks 32bit shift counts to 5 bits, as does riscv
+		ld_x(e, rAX, op->r1);
+		ld_x(e, rCX, op->r2);
+		shift_cl(e, (op->op == OP_SLL) ? 4 : (op->op == OP_SRL) ? 5 : 7);
+		st_x(e, rAX, op->rd);
+		return 1;
+	case OP_MUL:
+		ld_x(e, rAX, op->r1);
+		e8(e, 0x0F); e8(e, 0xAF); xreg(e, rAX, op->r2); // imul eax, x[r2]
+		st_x(e, rAX, op->rd);
+		return 1;
+	case OP_MULH:
+	case OP_MULHU:
+		ld_x(e, rAX, op->r1);
+		e8(e, 0xF7); xreg(e, (op->op == OP_MULH) ? 5 : 4, op->r2); // (i)mul x[r2]
+		st_x(e, rDX, op->rd);
+		return 1;
+	case OP_MULHSU:
+		e8(e, 0x48); e8(e, 0x63); xreg(e, rAX, op->r1); // movsxd rax, x[r1]
+		ld_x(e, rCX, op->r2);
+		e8(e, 0x48); e8(e, 0x0F); e8(e, 0xAF); e8(e, 0xC1); // imul rax, rcx
+		e8(e, 0x48); e8(e, 0xC1); e8(e, 0xE8); e8(e, 32); // shr rax, 32
+		st_x(e, rAX, op->rd);
+		return 1;
+	case OP_DIV:
+	case OP_DIVU:
+	case OP_REM:
+	case OP_REMU:
+		emit_divrem(e, op);
+		return 1;
+	case OP_LW:
+	case OP_LH:
+	case OP_LHU:
+	case OP_LB:
+	case OP_LBU:
+		mem_addr(e, op, (op->op == OP_LW) ? 3 : ((op->op == OP_LH) || (op->op == OP_LHU)) ? 1 : 0);
+		switch (op->op) {
+		case OP_LW:  e8(e, 0x41); e8(e, 0x8B); break; // mov eax, [r12 + rax]
+		case OP_LH:  e8(e, 0x41); e8(e, 0x0F); e8(e, 0xBF); break; // movsx
+		case OP_LHU: e8(e, 0x41); e8(e, 0x0F); e8(e, 0xB7); break; // movzx
+		case OP_LB:  e8(e, 0x41); e8(e, 0x0F); e8(e, 0xBE); break; // movsx
+		case OP_LBU: e8(e, 0x41); e8(e, 0x0F); e8(e, 0xB6); break; // movzx
+		}
+		e8(e, 0x04); e8(e, 0x04);
+		e->loads++;
+		st_x(e, rAX, op->rd);
+		return 1;
+	case OP_SW:
+	case OP_SH:
+	case OP_SB:
+		ld_x(e, rCX, op->r2);
+		mem_addr(e, op, (op->op == OP_SW) ? 3 : (op->op == OP_SH) ? 1 : 0);
+		switch (op->op) {
+		case OP_SW: e8(e, 0x41); e8(e, 0x89); break; // mov [r12 + rax], ecx
+		case OP_SH: e8(e, 0x66); e8(e, 0x41); e8(e, 0x89); break;
+		case OP_SB: e8(e, 0x41); e8(e, 0x88); break;
+		}
+		e8(e, 0x0C); e8(e, 0x04);
+		e->stores++;
+		store_check(e, op);
+		return 1;
+	case OP_BEQ:
+	case OP_BNE:
+	case OP_BLT:
+	case OP_BGE:
+	case OP_BLTU:
+	case OP_BGEU: {
+		static const uint8_t cc[] = {
+			[OP_BEQ] = CC_E, [OP_BNE] = CC_NE,
+			[OP_BLT] = CC_L, [OP_BGE] = CC_GE,
+			[OP_BLTU] = CC_B, [OP_BGEU] = CC_AE,
+		};
+		if (op->imm & e->ialign) return 0;
+		ld_x(e, rAX, op->r1);
+		alu_x(e, 0x3B, op->r2);
+		uint8_t* taken = jcc(e, cc[op->op]);
+		exit_pc(e, e->count + 1, op->pc + op->len);
+		patch(e, taken);
+		e->taken = 1;
+		exit_pc(e, e->count + 1, op->imm);
+		e->taken = 0;
+		return 2;
+	}
+	case OP_JAL:
+		if (op->imm & e->ialign) return 0;
+		st_x_imm(e, op->rd, op->pc + op->len);
+		exit_pc(e, e->count + 1, op->imm);
+		return 2;
+	case OP_JALR:
+		ld_x(e, rAX, op->r1);
+		if (op->imm) alu_imm(e, 0, rAX, op->imm);
+		alu_imm(e, 4, rAX, 0xFFFFFFFE);
+		if (e->ialign & 2) {
+			e8(e, 0xA8); e8(e, 2); // test al, 2
+			exit_if(e, CC_NE, op->pc);
+		}
+		st_x_imm(e, op->rd, op->pc + op->len);
+		exit_eax(e, e->count + 1);
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+// the hart running compiled code on this thread, for the fault handler
+static __thread rvstate_t* jit_bound;
+static struct sigaction segv_next;
+static pthread_once_t segv_once = PTHREAD_ONCE_INIT;
+
+static void segv_handler(int sig, siginfo_t* info, void* _uc) {
+	ucontext_t* uc = _uc;
+	rvstate_t* s = jit_bound;
+	rvjit_t* j = s ? s->jit : NULL;
+	uintptr_t rip = uc->uc_mcontext.gregs[REG_RIP];
+	if (j && (rip >= (uintptr_t) j->code) && (rip < ((uintptr_t) j->code + j->used))) {
+		uint32_t at = rip - (uintptr_t) j->code;
+		uint32_t lo = 0, hi = j->nfaults;
+		while (lo < hi) {
+			uint32_t mid = (lo + hi) / 2;
+			if (j->fault[mid].at < at) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if ((lo < j->nfaults) && (j->fault[lo].at == at)) {
+			uc->uc_mcontext.gregs[REG_RIP] = (uintptr_t) j->code + j->fault[lo].stub;
+			// have its page compiled with checks from now on
+			s->jitfault = j->fault[lo].pc;
+			__atomic_fetch_or(&s->events, RVEV_JITFAULT, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+	// not ours: chain to the previous handler, staying installed for
+	// the next fault in compiled code
+	if (segv_next.sa_flags & SA_SIGINFO) {
+		segv_next.sa_sigaction(sig, info, _uc);
+	} else if ((segv_next.sa_handler != SIG_DFL) &&
+		(segv_next.sa_handler != SIG_IGN)) {
+		segv_next.sa_handler(sig);
+	} else {
+		// the default: the fault happens again when we return, and
+		// kills the process
+		signal(SIGSEGV, SIG_DFL);
+	}
+}
+
+static void segv_install(void) {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = segv_handler;
+	sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &segv_next);
+}
+
+void rvjit_bind(rvstate_t* s) {
+	jit_bound = s;
+}
+
+static void* jit_alloc(void) {
+	void* p = mmap(NULL, JITCODESIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+int rvjit_init(rvstate_t* s) {
+	if (s->jit) return 0;
+	rvjit_t* j;
+	if ((j = calloc(1, sizeof(rvjit_t))) == NULL) {
+		return -1;
+	}
+	if ((j->code = jit_alloc()) == NULL) {
+		free(j);
+		return -1;
+	}
+	if (s->vmem) pthread_once(&segv_once, segv_install);
+	s->jit = j;
+	s->jithot = j->hot;
+	return 0;
+}
+
+void rvjit_free(rvstate_t* s) {
+	munmap(s->jit->code, JITCODESIZE);
+	free(s->jit);
+	s->jit = NULL;
+	s->jithot = NULL;
+}
+
+void rvjit_compile(rvstate_t* s, rvop_t* head) {
+	rvjit_t* j = s->jit;
+	uint32_t off = head->pc - s->membase;
+	if (off >= s->memsize) return;
+	rvpage_t* pg = s->dcache[off >> RVPAGESHIFT];
+	if ((pg == NULL) || pg->nojit) return;
+	if ((head < pg->op) || (head >= (pg->op + RVPAGESLOTS(s)))) return;
+
+	if ((j->nblocks == JITMAXBLOCKS) ||
+		((JITMAXFAULTS - j->nfaults) < JITMAXINS) ||
+		((JITCODESIZE - j->used) < (JITMAXINS * JITINSMAX + 64))) {
+		rvjit_flush(s);
+	}
+
+	emitter_t e;
+	uint8_t* start = j->code + j->used;
+	e.p = start;
+	e.count = 0;
+	e.loads = 0;
+	e.stores = 0;
+	e.taken = 0;
+	e.membase = s->membase;
+	e.memsize = s->memsize;
+	e.ialign = s->ialign;
+	e.direct = (s->vmem != NULL) && !pg->checked;
+	e.nsites = 0;
+
+	// shared epilogue first, so exits can jump back to it
+	e.epilogue = e.p;
+	e8(&e, 0x5D); // pop rbp
+	e8(&e, 0x41); e8(&e, 0x5C); // pop r12
+	e8(&e, 0x5B); // pop rbx
+	e8(&e, 0xC3); // ret
+
+	uint8_t* entry = e.p;
+	e8(&e, 0x53); // push rbx
+	e8(&e, 0x41); e8(&e, 0x54); // push r12
+	e8(&e, 0x55); // push rbp
+	e8(&e, 0x48); e8(&e, 0x89); e8(&e, 0xFB); // mov rbx, rdi
+	e8(&e, 0x4C); e8(&e, 0x8B); e8(&e, 0xA7); // mov r12, [rdi + vmem or memory]
+	e32(&e, e.direct ? offsetof(rvstate_t, vmem) : offsetof(rvstate_t, memory));
+
+	rvop_t* op = head;
+	rvop_t* end = pg->op + RVPAGESLOTS(s);
+	uint32_t next = head->pc;
+	int r = 0;
+	while ((op < end) && (e.count < JITMAXINS)) {
+		if (op->op == OP_DECODE) rvsim_decode(s, op);
+		// compile through the heads of other blocks
+		rvop_t* src = (op->op == OP_JIT) ? &op->jit->op : op;
+		// and fused pairs an instruction at a time (the dispatch
+		// fusing saves is gone anyway)
+		rvop_t first;
+		if (rvop_unfused(src->op) != src->op) {
+			first = *src;
+			first.op = rvop_unfused(src->op);
+			src = &first;
+		}
+		if ((r = emit(&e, src)) == 0) break;
+		e.count++;
+		next = src->pc + src->len;
+		op += src->len >> s->slotshift;
+		if (r == 2) break;
+	}
+	if (e.count == 0) return;
+	if (r != 2) {
+		// fell out of the block without a branch
+		exit_pc(&e, e.count, next);
+	}
+	// out of line exits for unchecked accesses that fault
+	for (unsigned n = 0; n < e.nsites; n++) {
+		site_t* site = e.site + n;
+		jitfault_t* f = j->fault + j->nfaults++;
+		f->at = site->at - j->code;
+		f->stub = e.p - j->code;
+		f->pc = site->pc;
+		e.loads = site->loads;
+		e.stores = site->stores;
+		exit_pc(&e, site->count, site->pc);
+	}
+
+	rvjitblock_t* b = j->block + j->nblocks++;
+	b->op = *head;
+	b->code = (void*) entry;
+	j->used += e.p - start;
+	head->jit = b;
+	head->op = OP_JIT;
+	pg->jitted = 1;
+}
+
+#else
+
+int rvjit_init(rvstate_t* s) {
+	return -1;
+}
+
+void rvjit_free(rvstate_t* s) {
+}
+
+void rvjit_compile(rvstate_t* s, rvop_t* op) {
+}
+
+void rvjit_bind(rvstate_t* s) {
+}
+
+#endif
+
+// put back the original decode of every compiled block in pg
+static void page_unjit(rvstate_t* s, rvpage_t* pg) {
+	for (unsigned n = 0; n < RVPAGESLOTS(s); n++) {
+		rvop_t* op = pg->op + n;
+		if (op->op == OP_JIT) {
+			*op = op->jit->op;
+			op->link = NULL;
+		}
+	}
+	pg->jitted = 0;
+}
+
+// code in pg was written to
+void rvjit_page_inval(rvstate_t* s, rvpage_t* pg) {
+	page_unjit(s, pg);
+	pg->nojit = 1;
+}
+
+// an unchecked access in compiled code faulted, most likely io that
+// will keep faulting: recompile that page with address checks
+void rvjit_fault(rvstate_t* s) {
+	uint32_t off = s->jitfault - s->membase;
+	if (off >= s->memsize) return;
+	rvpage_t* pg = s->dcache[off >> RVPAGESHIFT];
+	if ((pg == NULL) || pg->checked) return;
+	if (pg->jitted) page_unjit(s, pg);
+	pg->checked = 1;
+}
+
+// drop all compiled code
+void rvjit_flush(rvstate_t* s) {
+	rvjit_t* j = s->jit;
+	for (unsigned n = 0; n < s->pagecount; n++) {
+		rvpage_t* pg = s->dcache[n];
+		if (pg && pg->jitted) page_unjit(s, pg);
+	}
+	j->used = 0;
+	j->nblocks = 0;
+	j->nfaults = 0;
+}
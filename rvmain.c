@@ -10,22 +10,55 @@
 #include <sys/stat.h>
 
 #include "rvsim.h"
+#include "rvsched.h"
+#include "rvelf.h"
+#include "rvprof.h"
+#include "rvtiming.h"
+#include "rvring.h"
+#include "rvgdb.h"
+#include "rvsnap.h"
+#include "rvfuzz.h"
 #include "iocall.h"
 
-uint32_t ior32(uint32_t addr) {
-        return 0xffffffff;
-}
+typedef struct {
+	rvstate_t* s;
+	rvring_t* ring; // IOCALL_RING_SETUP
+	// -checkpoint: where to save it, and the hart that asked for it
+	const char* snapfn;
+	rvstate_t* snaphart;
+	// -fuzz: the fuzzer, and whether console output is dropped
+	rvfuzz_t* fuzz;
+	int quiet;
+	// batch mode: console output, written out when the guest exits
+	int buffered;
+	char* out;
+	size_t outlen;
+	size_t outmax;
+} guest_t;
 
-void iow32(uint32_t addr, uint32_t val) {
+static int guest_putc(guest_t* g, uint8_t x) {
+	if (g->quiet) return 0;
+	if (g->buffered) {
+		if (g->outlen == g->outmax) {
+			size_t max = g->outmax ? g->outmax * 2 : 256;
+			char* out;
+			if ((out = realloc(g->out, max)) == NULL) return -1;
+			g->out = out;
+			g->outmax = max;
+		}
+		g->out[g->outlen++] = x;
+		return 0;
+	}
+	if (write(1, &x, 1) != 1) { return -1; }
+	return 0;
 }
 
 uint32_t iocall(void* ctx, uint32_t n, const uint32_t args[8]) {
-	rvstate_t* s = ctx;
+	guest_t* g = ctx;
+	rvstate_t* s = g->s;
 	switch (n) {
 	case IOCALL_DPUTC: {
-		uint8_t x = args[0];
-		if (write(1, &x, 1)) { return -1; }
-		return 0;
+		return guest_putc(g, args[0]);
 	}
 	case IOCALL_OPEN: { // (path, flags, mode) -> fd/error
 		void* ptr = rvsim_dma(s, args[0], 1024);
@@ -39,18 +72,84 @@ uint32_t iocall(void* ctx, uint32_t n, const uint32_t args[8]) {
 	case IOCALL_READ: { // (fd, ptr, len) -> len/error
 		void* ptr = rvsim_dma(s, args[1], args[2]);
 		if (ptr == NULL) return -1;
-		return read(args[0], ptr, args[2]);
+		ssize_t r = read(args[0], ptr, args[2]);
+		if (r > 0) rvsim_dma_written(s, args[1], r);
+		return r;
 	}
 	case IOCALL_WRITE: { // (fd, ptr, len) -> len/error
 		void* ptr = rvsim_dma(s, args[1], args[2]);
 		if (ptr == NULL) return -1;
+		if (g->quiet && (args[0] <= 2)) return args[2];
 		return write(args[0], ptr, args[2]);
 	}
+	case IOCALL_MMAP: { // (addr, len, fd, off_lo, off_hi) -> addr/error
+		uint64_t off = args[3] | (((uint64_t) args[4]) << 32);
+		if (rvsim_mmap(s, args[0], args[1], args[2], off) < 0) return -1;
+		return args[0];
+	}
+	case IOCALL_MUNMAP: { // (addr, len) -> 0/error
+		return rvsim_mmap(s, args[0], args[1], -1, 0);
+	}
+	case IOCALL_CHECKPOINT: { // () -> 0
+		// saved by checkpoint() once the harts have stopped
+		if (g->snapfn && (g->snaphart == NULL)) {
+			g->snaphart = rvsim_iocall_hart();
+			rvsim_iocall_defer(g->snaphart);
+		}
+		return 0;
+	}
+	case IOCALL_FUZZ: { // (buf, max) -> len/error
+		if (g->fuzz == NULL) return -1;
+		return rvfuzz_iocall(g->fuzz, rvsim_iocall_hart(), args[0], args[1]);
+	}
+	case IOCALL_RING_SETUP: { // (addr, entries) -> 0/error
+		// not while fuzzing: the ring would outlive the runs rewound
+		if (g->fuzz) return -1;
+		rvring_t* r;
+		if (rvring_create(&r, s, args[0], args[1]) < 0) return -1;
+		rvring_t* none = NULL;
+		if (!__atomic_compare_exchange_n(&g->ring, &none, r, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			// another hart got there first
+			rvring_destroy(r);
+			return -1;
+		}
+		return 0;
+	}
+	case IOCALL_RING_ENTER: { // (flags) -> 0/error
+		rvring_t* r = __atomic_load_n(&g->ring, __ATOMIC_ACQUIRE);
+		if (r == NULL) return -1;
+		return rvring_enter(r, rvsim_iocall_hart(), args[0]);
+	}
 	default:
 		return -1;
 	}
 }
 
+// a minimal 16550 style uart: transmit only, always ready
+#define UART_BASE 0x10000000
+#define UART_THR 0 // transmit holding register
+#define UART_LSR 5 // line status register
+#define UART_LSR_THRE 0x20
+#define UART_LSR_TEMT 0x40
+
+static uint32_t uart_rd8(void* ctx, uint32_t off) {
+	return (off == UART_LSR) ? (UART_LSR_THRE | UART_LSR_TEMT) : 0;
+}
+static void uart_wr8(void* ctx, uint32_t off, uint32_t val) {
+	if (off == UART_THR) guest_putc(ctx, val);
+}
+
+static const rvdevice_t uart = {
+	.rd8 = uart_rd8,
+	.wr8 = uart_wr8,
+};
+
+// map the devices of a guest (unless they collide with its ram)
+static void attach(guest_t* g) {
+	rvsim_device_add(g->s, UART_BASE, 8, &uart, g);
+}
+
 int load_image(const char* fn, uint8_t* ptr, size_t sz) {
 	struct stat s;
 	int fd = open(fn, O_RDONLY);
@@ -72,19 +171,280 @@ int load_image(const char* fn, uint8_t* ptr, size_t sz) {
 	return 0;
 }
 
+// load an ELF executable, or a raw binary at membase, and find its
+// entry point
+// an ELF's begin_signature and end_signature symbols, if it has them,
+// are the default dump range
+static int load(rvstate_t* s, const char* fn, uint32_t membase, uint32_t memsize,
+	uint32_t* entry, uint32_t* dumpfrom, uint32_t* dumpto) {
+	if (!rvelf_check(fn)) {
+		void* memory = rvsim_dma(s, membase, memsize);
+		if ((memory == NULL) || (load_image(fn, memory, memsize) < 0)) {
+			return -1;
+		}
+		*entry = membase;
+		return 0;
+	}
+	rvelf_t* e;
+	if (rvelf_open(&e, fn) < 0) {
+		return -1;
+	}
+	if (rvelf_load(e, s) < 0) {
+		rvelf_close(e);
+		return -1;
+	}
+	*entry = rvelf_entry(e);
+	if (dumpfrom && (*dumpto <= *dumpfrom)) {
+		if ((rvelf_symbol(e, "begin_signature", dumpfrom) < 0) ||
+			(rvelf_symbol(e, "end_signature", dumpto) < 0)) {
+			*dumpfrom = *dumpto = 0;
+		}
+	}
+	rvelf_close(e);
+	return 0;
+}
+
+// ELF executables built for the C extension turn it on
+static int wants_rvc(const char* fn) {
+	rvelf_t* e;
+	if (!rvelf_check(fn) || (rvelf_open(&e, fn) < 0)) return 0;
+	int r = rvelf_rvc(e);
+	rvelf_close(e);
+	return r;
+}
+
+static void batch_done(rvguest_t* rg, void* cookie) {
+	guest_t* g = cookie;
+	flockfile(stdout);
+	fwrite(g->out, 1, g->outlen, stdout);
+	fflush(stdout);
+	funlockfile(stdout);
+	if (g->ring) rvring_destroy(g->ring);
+	rvsim_destroy(g->s);
+	free(g->out);
+	free(g);
+}
+
+// run every input (repeat times) as a separate guest on a worker pool
+// (or, with restore, start each from the checkpoint fns[0])
+static int batch(rvconfig_t* cfg, const char** fns, unsigned count,
+	unsigned repeat, unsigned workers, uint64_t quantum, int rvc, int restore) {
+	rvsched_t* sc;
+	if ((sc = rvsched_create(workers, quantum)) == NULL) {
+		fprintf(stderr, "error: cannot create scheduler\n");
+		return -1;
+	}
+	for (unsigned r = 0; r < repeat; r++) {
+		for (unsigned n = 0; n < count; n++) {
+			guest_t* g;
+			if ((g = calloc(1, sizeof(guest_t))) == NULL) {
+				fprintf(stderr, "error: out of memory\n");
+				return -1;
+			}
+			g->buffered = 1;
+			cfg->ctx = g;
+			cfg->rvc = rvc || wants_rvc(fns[n]);
+			if (rvsim_create(&g->s, cfg)) {
+				fprintf(stderr, "error: cannot initialize simulator\n");
+				return -1;
+			}
+			attach(g);
+			uint32_t entry;
+			if (restore) {
+				if (rvsim_restore(g->s, fns[n]) < 0) {
+					fprintf(stderr, "error: failed to restore '%s'\n", fns[n]);
+					return -1;
+				}
+				entry = rvsim_pc(g->s);
+			} else if (load(g->s, fns[n], cfg->membase, cfg->memsize, &entry, NULL, NULL) < 0) {
+				fprintf(stderr, "error: failed to load '%s'\n", fns[n]);
+				return -1;
+			}
+			rvsim_set_pc(g->s, entry);
+			if (rvsched_add(sc, g->s, batch_done, g) == NULL) {
+				fprintf(stderr, "error: cannot schedule '%s'\n", fns[n]);
+				return -1;
+			}
+		}
+	}
+	rvsched_wait(sc);
+	rvsched_report(sc, stderr);
+	rvsched_destroy(sc);
+	return 0;
+}
+
+static int write_file(const char* fn, const char* ext, rvprof_t* p,
+	void (*out)(rvprof_t* p, FILE* fp)) {
+	char path[1024];
+	snprintf(path, sizeof(path), "%s%s", fn, ext);
+	FILE* fp;
+	if ((fp = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "error: failed to open '%s' to write\n", path);
+		return -1;
+	}
+	out(p, fp);
+	fclose(fp);
+	return 0;
+}
+
+// run on this thread, sampling the call stacks of the harts every
+// so many instructions, then write the profile to name.folded
+// (collapsed stacks) and name.txt (per function)
+static int profile(rvstate_t* s, const char* fn, uint32_t entry,
+	const char* name, uint64_t every) {
+	rvelf_t* e = NULL;
+	if (fn && rvelf_check(fn) && (rvelf_open(&e, fn) < 0)) {
+		return -1;
+	}
+	rvprof_t* p = rvprof_create(s, e);
+	if (e) rvelf_close(e);
+	if (p == NULL) {
+		return -1;
+	}
+	rvsim_set_pc(s, entry);
+	while (rvsim_run(s, every) == RVSIM_RUNNING) {
+		rvprof_sample(p);
+	}
+	rvprof_sample(p);
+	int r = 0;
+	if ((write_file(name, ".folded", p, rvprof_folded) < 0) ||
+		(write_file(name, ".txt", p, rvprof_report) < 0)) {
+		r = -1;
+	}
+	rvprof_destroy(p);
+	return r;
+}
+
+// a number with an optional K, M or G suffix
+static uint32_t parse_size(const char* s) {
+	char* end;
+	uint64_t n = strtoull(s, &end, 0);
+	switch (*end) {
+	case 'k': case 'K': n <<= 10; break;
+	case 'm': case 'M': n <<= 20; break;
+	case 'g': case 'G': n <<= 30; break;
+	}
+	return (n > 0xFFFFFFFFULL) ? 0xFFFFFFFF : n;
+}
+
+// SIZE:WAYS:LINE, or 0 for no cache
+static int parse_cache(const char* s, rvcache_config_t* c) {
+	char* end;
+	c->size = parse_size(s);
+	if (c->size == 0) return 0;
+	if ((end = strchr(s, ':')) == NULL) return -1;
+	c->ways = strtoul(end + 1, &end, 0);
+	if (*end != ':') return -1;
+	c->line = strtoul(end + 1, NULL, 0);
+	return 0;
+}
+
+// a comma separated list of ins, mem, regs, traps and inval (or all)
+static int parse_debug(const char* s, unsigned* debug) {
+	static const char* names[] = { "ins", "mem", "regs", "traps", "inval" };
+	while (*s) {
+		size_t len = strcspn(s, ",");
+		unsigned n;
+		for (n = 0; n < 5; n++) {
+			if ((strlen(names[n]) == len) && !strncmp(s, names[n], len)) break;
+		}
+		if (n < 5) {
+			*debug |= 1U << n;
+		} else if ((len == 3) && !strncmp(s, "all", 3)) {
+			*debug |= RVSIM_DEBUG_ALL;
+		} else {
+			return -1;
+		}
+		s += len;
+		if (*s == ',') s++;
+	}
+	return 0;
+}
+
+static void timing_report(rvstate_t* s, unsigned n) {
+	rvtiming_stats_t st;
+	if (rvtiming_stats(s, &st) || (st.instructions == 0)) return;
+	double i = st.instructions;
+	fprintf(stderr, "TIMING cycles %lu CPI %.3f = base %.3f + fetch %.3f"
+		" + memory %.3f + branch %.3f + hazard %.3f + execute %.3f (hart %u)\n",
+		st.cycles, st.cycles / i, st.base / i, st.fetch / i,
+		st.memory / i, st.branch / i, st.hazard / i, st.execute / i, n);
+	fprintf(stderr, "TIMING l1i %lu/%lu l1d %lu/%lu l2 %lu/%lu misses,"
+		" branches %lu/%lu jumps %lu/%lu mispredicted (hart %u)\n",
+		st.l1i_misses, st.l1i_accesses, st.l1d_misses, st.l1d_accesses,
+		st.l2_misses, st.l2_accesses, st.mispredicts, st.branches,
+		st.jump_misses, st.jumps, n);
+}
+
+// run on this thread until the guest asks for a checkpoint, save it
+// (adding to base, if that's where it was restored from), and let the
+// guest carry on
+// returns 1 if the guest exited without asking
+static int checkpoint(guest_t* g, const char* base) {
+	rvstate_t* s = g->s;
+	for (;;) {
+		int r = rvsim_run(s, 1000000);
+		if (g->snaphart) break;
+		if (r == RVSIM_EXITED) return 1;
+		// in a deferred iocall or wfi: wait for a completion or irq
+		if (r == RVSIM_WAITING) usleep(1000);
+	}
+	if (__atomic_load_n(&g->ring, __ATOMIC_ACQUIRE)) {
+		// its thread may be busy with ram, and its state isn't saved
+		fprintf(stderr, "error: cannot checkpoint a guest with an i/o ring\n");
+		return -1;
+	}
+	rvsim_iocall_complete(g->snaphart, 0);
+	if (rvsim_checkpoint(s, g->snapfn, base) < 0) {
+		return -1;
+	}
+	fprintf(stderr, "checkpoint: %s at %lu instructions\n", g->snapfn,
+		rvsim_icount(s));
+	g->snapfn = NULL;
+	return 0;
+}
+
+#define MAXINPUTS 1024
+
 int main(int argc, char** argv) {
-	const char* fn = NULL;
+	const char* fns[MAXINPUTS];
+	unsigned count = 0;
 	const char* dumpfn = NULL;
 	uint32_t dumpfrom = 0, dumpto = 0;
+	unsigned engine = RVSIM_ENGINE_SWITCH;
+	unsigned harts = 1;
+	unsigned hugepages = RVSIM_HUGEPAGES_NONE;
+	uint32_t membase = 0x80000000;
+	uint32_t memsize = 0x01000000;
+	uint32_t clint = 0x02000000;
+	unsigned workers = 0;
+	unsigned repeat = 1;
+	uint64_t quantum = 0;
+	int batched = 0;
+	int counters = 0;
+	int nofuse = 0;
+	unsigned debug = 0;
+	const char* profname = NULL;
+	uint64_t every = 10000;
+	const char* tracefn = NULL;
+	const char* gdbaddr = NULL;
+	const char* snapfn = NULL;
+	const char* restorefn = NULL;
+	const char* fuzzpath = NULL;
+	rvfuzz_config_t fcfg = { 0 };
+	int timing = 0;
+	int rvc = 0;
+	rvtiming_config_t tcfg;
+	rvtiming_defaults(&tcfg);
 	while (argc > 1) {
 		argc--;
 		argv++;
 		if (argv[0][0] != '-') {
-			if (fn != NULL) {
-				fprintf(stderr, "error: multiple inputs\n");
+			if (count == MAXINPUTS) {
+				fprintf(stderr, "error: too many inputs\n");
 				return -1;
 			}
-			fn = argv[0];
+			fns[count++] = argv[0];
 			continue;
 		}
 		if (!strncmp(argv[0],"-dump=",6)) {
@@ -99,27 +459,317 @@ int main(int argc, char** argv) {
 			dumpto = strtoul(argv[0] + 4, NULL, 16);
 			continue;
 		}
+		if (!strncmp(argv[0],"-harts=",7)) {
+			harts = strtoul(argv[0] + 7, NULL, 0);
+			continue;
+		}
+		if (!strncmp(argv[0],"-membase=",9)) {
+			membase = strtoul(argv[0] + 9, NULL, 16);
+			continue;
+		}
+		if (!strncmp(argv[0],"-gdb=",5)) {
+			gdbaddr = argv[0] + 5;
+			continue;
+		}
+		if (!strncmp(argv[0],"-checkpoint=",12)) {
+			snapfn = argv[0] + 12;
+			continue;
+		}
+		if (!strncmp(argv[0],"-restore=",9)) {
+			restorefn = argv[0] + 9;
+			continue;
+		}
+		if (!strncmp(argv[0],"-fuzz=",6)) {
+			fuzzpath = argv[0] + 6;
+			continue;
+		}
+		if (!strncmp(argv[0],"-runs=",6)) {
+			fcfg.runs = strtoull(argv[0] + 6, NULL, 0);
+			continue;
+		}
+		if (!strncmp(argv[0],"-fuzzlimit=",11)) {
+			fcfg.limit = strtoull(argv[0] + 11, NULL, 0);
+			continue;
+		}
+		if (!strncmp(argv[0],"-maxlen=",8)) {
+			fcfg.maxlen = strtoul(argv[0] + 8, NULL, 0);
+			continue;
+		}
+		if (!strncmp(argv[0],"-seed=",6)) {
+			fcfg.seed = strtoul(argv[0] + 6, NULL, 0);
+			continue;
+		}
+		if (!strncmp(argv[0],"-artifacts=",11)) {
+			fcfg.prefix = argv[0] + 11;
+			continue;
+		}
+		if (!strncmp(argv[0],"-clint=",7)) {
+			clint = strtoul(argv[0] + 7, NULL, 16);
+			continue;
+		}
+		if (!strncmp(argv[0],"-memsize=",9)) {
+			memsize = parse_size(argv[0] + 9);
+			continue;
+		}
+		if (!strcmp(argv[0],"-hugepages=thp")) {
+			hugepages = RVSIM_HUGEPAGES_THP;
+			continue;
+		}
+		if (!strcmp(argv[0],"-hugepages=hugetlb")) {
+			hugepages = RVSIM_HUGEPAGES_HUGETLB;
+			continue;
+		}
+		if (!strncmp(argv[0],"-workers=",9)) {
+			workers = strtoul(argv[0] + 9, NULL, 0);
+			batched = 1;
+			continue;
+		}
+		if (!strncmp(argv[0],"-quantum=",9)) {
+			quantum = strtoull(argv[0] + 9, NULL, 0);
+			batched = 1;
+			continue;
+		}
+		if (!strncmp(argv[0],"-repeat=",8)) {
+			repeat = strtoul(argv[0] + 8, NULL, 0);
+			batched = 1;
+			continue;
+		}
+		if (!strncmp(argv[0],"-profile=",9)) {
+			profname = argv[0] + 9;
+			continue;
+		}
+		if (!strncmp(argv[0],"-sample=",8)) {
+			every = strtoull(argv[0] + 8, NULL, 0);
+			continue;
+		}
+		if (!strncmp(argv[0],"-trace=",7)) {
+			tracefn = argv[0] + 7;
+			continue;
+		}
+		if (!strcmp(argv[0],"-timing")) {
+			timing = 1;
+			continue;
+		}
+		if (!strncmp(argv[0],"-l1i=",5) || !strncmp(argv[0],"-l1d=",5) ||
+			!strncmp(argv[0],"-l2=",4)) {
+			rvcache_config_t* c = (argv[0][2] == '2') ? &tcfg.l2 :
+				(argv[0][3] == 'i') ? &tcfg.l1i : &tcfg.l1d;
+			if (parse_cache(strchr(argv[0], '=') + 1, c) < 0) {
+				fprintf(stderr, "error: bad cache: %s\n", argv[0]);
+				return -1;
+			}
+			timing = 1;
+			continue;
+		}
+		if (!strncmp(argv[0],"-gshare=",8)) {
+			tcfg.gsharebits = strtoul(argv[0] + 8, NULL, 0);
+			timing = 1;
+			continue;
+		}
+		if (!strncmp(argv[0],"-btb=",5)) {
+			tcfg.btbentries = strtoul(argv[0] + 5, NULL, 0);
+			timing = 1;
+			continue;
+		}
+		if (!strcmp(argv[0],"-rvc")) {
+			rvc = 1;
+			continue;
+		}
+		if (!strcmp(argv[0],"-nofuse")) {
+			nofuse = 1;
+			continue;
+		}
+		if (!strncmp(argv[0],"-debug=",7)) {
+			if (parse_debug(argv[0] + 7, &debug) < 0) {
+				fprintf(stderr, "error: bad debug option: %s\n", argv[0]);
+				return -1;
+			}
+			continue;
+		}
+		if (!strcmp(argv[0],"-counters")) {
+			counters = 1;
+			continue;
+		}
+		if (!strcmp(argv[0],"-engine=switch")) {
+			engine = RVSIM_ENGINE_SWITCH;
+			continue;
+		}
+		if (!strcmp(argv[0],"-engine=threaded")) {
+			engine = RVSIM_ENGINE_THREADED;
+			continue;
+		}
+		if (!strcmp(argv[0],"-engine=jit")) {
+			engine = RVSIM_ENGINE_JIT;
+			continue;
+		}
 		fprintf(stderr, "error: unknown argument: %s\n", argv[0]);
 		return -1;
 	}
-	void* memory;
-	uint32_t membase = 0x80000000;
-	uint32_t memsize = 0x01000000;
 	rvstate_t* s;
+	guest_t g = { 0 };
+	rvconfig_t cfg = {
+		.membase = membase,
+		.memsize = memsize,
+		.harts = harts,
+		.clint = clint,
+		.nofuse = nofuse,
+		.debug = debug,
+		.engine = engine,
+		.hugepages = hugepages,
+		.callstack = (profname != NULL),
+		.ctx = &g,
+		.iocall = iocall,
+	};
 
-	if (rvsim_init(&s, NULL)) {
-		fprintf(stderr, "error: cannot initialize simulator\n");
+	if (restorefn) {
+		// the checkpoint says what machine it was
+		if (count) {
+			fprintf(stderr, "error: -restore replaces the input\n");
+			return -1;
+		}
+		if (rvsnap_config(restorefn, &cfg) < 0) {
+			fprintf(stderr, "error: cannot read checkpoint '%s'\n", restorefn);
+			return -1;
+		}
+		membase = cfg.membase;
+		memsize = cfg.memsize;
+		harts = cfg.harts;
+		rvc = cfg.rvc;
+		fns[count++] = restorefn;
+	}
+	if (count == 0) {
+		fprintf(stderr, "error: no input\n");
+		return -1;
+	}
+	if (profname && (batched || (count > 1) || (every == 0))) {
+		fprintf(stderr, "error: -profile runs a single guest, sampling every -sample=N > 0\n");
 		return -1;
 	}
-	if ((memory = rvsim_dma(s, membase, memsize)) == NULL) {
-		fprintf(stderr, "error: cannot access sim memory\n");
+	if ((tracefn || timing || gdbaddr) && (batched || (count > 1))) {
+		fprintf(stderr, "error: -trace, -timing and -gdb run a single guest\n");
+		return -1;
+	}
+	if (gdbaddr && profname) {
+		fprintf(stderr, "error: -gdb and -profile don't mix\n");
+		return -1;
+	}
+	if (snapfn && (batched || (count > 1) || gdbaddr || profname)) {
+		fprintf(stderr, "error: -checkpoint runs a single guest, without -gdb or -profile\n");
+		return -1;
+	}
+	if (fuzzpath && (batched || (count > 1) || gdbaddr || profname ||
+		snapfn || tracefn || timing)) {
+		fprintf(stderr, "error: -fuzz runs a single guest, on its own\n");
+		return -1;
+	}
+	if (batched || (count > 1)) {
+		return batch(&cfg, fns, count, repeat, workers, quantum, rvc, restorefn != NULL);
+	}
+	const char* fn = restorefn ? NULL : fns[0];
+	cfg.rvc = rvc || (fn && wants_rvc(fn));
+	if (rvsim_create(&s, &cfg)) {
+		fprintf(stderr, "error: cannot initialize simulator\n");
 		return -1;
 	}
-	if (load_image(fn, memory, memsize) < 0) {
+	g.s = s;
+	g.snapfn = snapfn;
+	attach(&g);
+	uint32_t entry;
+	if (restorefn) {
+		if (rvsim_restore(s, restorefn) < 0) {
+			fprintf(stderr, "error: failed to restore '%s'\n", restorefn);
+			return -1;
+		}
+		entry = rvsim_pc(s);
+	} else if (load(s, fn, membase, memsize, &entry, &dumpfrom, &dumpto) < 0) {
 		fprintf(stderr, "error: failed to load '%s'\n", fn);
 		return -1;
 	}
-	rvsim_exec(s, membase);
+	if (timing && (rvtiming_start(s, &tcfg) < 0)) {
+		fprintf(stderr, "error: bad timing model configuration\n");
+		return -1;
+	}
+	if (tracefn && (rvsim_trace_start(s, tracefn) < 0)) {
+		fprintf(stderr, "error: cannot create trace '%s'\n", tracefn);
+		return -1;
+	}
+	if (profname) {
+		if (profile(s, fn, entry, profname, every) < 0) {
+			fprintf(stderr, "error: failed to profile '%s'\n", fns[0]);
+			return -1;
+		}
+	} else if (gdbaddr) {
+		rvsim_set_pc(s, entry);
+		rvgdb_serve(s, gdbaddr);
+	} else if (fuzzpath) {
+		// a corpus directory, or an input to run once (as afl-fuzz
+		// runs a target)
+		struct stat st;
+		int once = (stat(fuzzpath, &st) == 0) && S_ISREG(st.st_mode);
+		int r;
+		fcfg.corpus = once ? NULL : fuzzpath;
+		if (rvfuzz_create(&g.fuzz, s, &fcfg) < 0) {
+			fprintf(stderr, "error: cannot create fuzzer\n");
+			return -1;
+		}
+		if (once) {
+			r = rvfuzz_replay(g.fuzz, entry, fuzzpath);
+			// afl-fuzz without a fork server knows crashes by signal
+			if ((r > 0) && getenv("__AFL_SHM_ID")) abort();
+		} else {
+			g.quiet = 1;
+			r = rvfuzz_run(g.fuzz, entry);
+		}
+		rvfuzz_destroy(g.fuzz);
+		if (g.ring) rvring_destroy(g.ring);
+		rvsim_destroy(s);
+		return r;
+	} else {
+		rvsim_set_pc(s, entry);
+		int r = snapfn ? checkpoint(&g, restorefn) : 0;
+		if (r < 0) {
+			fprintf(stderr, "error: failed to save checkpoint '%s'\n", snapfn);
+			return -1;
+		}
+		if (r > 0) {
+			fprintf(stderr, "warning: the guest exited before a checkpoint\n");
+		} else {
+			rvsim_exec(s, rvsim_pc(s));
+		}
+	}
+	if (g.ring) rvring_destroy(g.ring);
+	if (tracefn && (rvsim_trace_stop(s) < 0)) {
+		fprintf(stderr, "error: failed to write trace '%s'\n", tracefn);
+		return -1;
+	}
+
+	if (harts == 1) {
+		fprintf(stderr, "CCOUNT %lu\n", rvsim_icount(s));
+	} else {
+		for (unsigned n = 0; n < harts; n++) {
+			fprintf(stderr, "CCOUNT %lu (hart %u)\n",
+				rvsim_icount(rvsim_hart(s, n)), n);
+		}
+	}
+	if (counters) {
+		for (unsigned n = 0; n < harts; n++) {
+			rvstate_t* h = rvsim_hart(s, n);
+			fprintf(stderr, "COUNTERS loads %lu stores %lu branches %lu"
+				" traps %lu iocalls %lu fused %lu (hart %u)\n",
+				rvsim_counter(h, RVSIM_EV_LOADS),
+				rvsim_counter(h, RVSIM_EV_STORES),
+				rvsim_counter(h, RVSIM_EV_BRANCHES),
+				rvsim_counter(h, RVSIM_EV_TRAPS),
+				rvsim_counter(h, RVSIM_EV_IOCALLS),
+				rvsim_counter(h, RVSIM_EV_FUSED), n);
+		}
+	}
+
+	if (timing) {
+		for (unsigned n = 0; n < harts; n++) {
+			timing_report(rvsim_hart(s, n), n);
+		}
+	}
 
 	if (dumpfn && (dumpto > dumpfrom)) {
 		FILE* fp;
@@ -133,6 +783,7 @@ int main(int argc, char** argv) {
 		}
 		fclose(fp);
 	}
+	rvsim_destroy(s);
 	return 0;
 }
 
@@ -0,0 +1,382 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// Samples are folded into distinct paths (call stacks, as frame
+// indices) as they are taken, each with the instructions attributed to
+// it, so memory grows with the shape of the program rather than with
+// the length of the run.  A frame is a function or, outside of all of
+// them, a single pc.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rvsim.h"
+#include "rvelf.h"
+#include "rvprof.h"
+
+// deepest call stack recorded (the innermost calls of deeper ones are
+// left out)
+#define PROFDEPTH 128
+
+typedef struct {
+	uint32_t addr;
+	uint32_t size; // 0: up to the next function
+	char* name;
+} func_t;
+
+typedef struct {
+	uint32_t pc;   // a pc outside of all functions, or the function's address
+	int func;      // index of the function (or -1)
+	uint64_t self;
+	uint64_t total;
+	unsigned seen; // last path counted in total
+} frame_t;
+
+typedef struct {
+	uint32_t hash;
+	unsigned depth;
+	unsigned* frame; // outermost first
+	uint64_t count;
+} path_t;
+
+struct rvprof {
+	rvstate_t* s;
+	unsigned nharts;
+	uint64_t* last; // instruction count of each hart at its last sample
+
+	func_t* func; // sorted by address
+	unsigned nfuncs;
+	unsigned maxfuncs;
+
+	frame_t* frame; // one per function, then pcs as they turn up
+	unsigned nframes;
+	unsigned maxframes;
+	unsigned npcs;    // frames that are pcs
+	unsigned* pcslot; // hash of those (index + 1, 0: empty)
+	unsigned pcslots;
+
+	path_t* path;
+	unsigned npaths;
+	unsigned maxpaths;
+	unsigned* pathslot; // hash of paths (index + 1, 0: empty)
+	unsigned pathslots;
+};
+
+static void add_func(void* cookie, const char* name, uint32_t addr, uint32_t size) {
+	rvprof_t* p = cookie;
+	if (p->nfuncs == p->maxfuncs) {
+		unsigned max = p->maxfuncs ? p->maxfuncs * 2 : 256;
+		func_t* list;
+		if ((list = realloc(p->func, max * sizeof(func_t))) == NULL) return;
+		p->func = list;
+		p->maxfuncs = max;
+	}
+	char* copy;
+	if ((copy = strdup(name)) == NULL) return;
+	func_t* f = p->func + p->nfuncs++;
+	f->addr = addr;
+	f->size = size;
+	f->name = copy;
+}
+
+// by address, the one with a size first among aliases
+static int func_cmp(const void* _a, const void* _b) {
+	const func_t* a = _a;
+	const func_t* b = _b;
+	if (a->addr != b->addr) return (a->addr < b->addr) ? -1 : 1;
+	if (a->size != b->size) return (a->size > b->size) ? -1 : 1;
+	return strcmp(a->name, b->name);
+}
+
+// the function pc is in (or -1)
+static int func_find(rvprof_t* p, uint32_t pc) {
+	unsigned lo = 0, hi = p->nfuncs;
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (p->func[mid].addr <= pc) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) return -1;
+	func_t* f = p->func + lo - 1;
+	if (f->size && ((pc - f->addr) >= f->size)) return -1;
+	return lo - 1;
+}
+
+static uint32_t hash32(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+static int grow(void** list, unsigned* max, size_t size) {
+	unsigned n = *max ? *max * 2 : 256;
+	void* p;
+	if ((p = realloc(*list, n * size)) == NULL) return -1;
+	*list = p;
+	*max = n;
+	return 0;
+}
+
+// a hash table of twice the size for n entries, keyed by hash(p, i)
+// (entries it returns 0 for are left out)
+static int rehash(rvprof_t* p, unsigned** slot, unsigned* nslots, unsigned n,
+	uint32_t (*hash)(rvprof_t* p, unsigned i)) {
+	unsigned size = *nslots ? *nslots * 2 : 512;
+	unsigned* table;
+	if ((table = calloc(size, sizeof(unsigned))) == NULL) return -1;
+	for (unsigned i = 0; i < n; i++) {
+		uint32_t h = hash(p, i);
+		if (h == 0) continue;
+		while (table[h & (size - 1)]) h++;
+		table[h & (size - 1)] = i + 1;
+	}
+	free(*slot);
+	*slot = table;
+	*nslots = size;
+	return 0;
+}
+
+static uint32_t pc_hash(uint32_t pc) {
+	return hash32(pc) | 1;
+}
+
+static uint32_t frame_hash(rvprof_t* p, unsigned i) {
+	return (p->frame[i].func < 0) ? pc_hash(p->frame[i].pc) : 0;
+}
+
+static uint32_t path_hash(rvprof_t* p, unsigned i) {
+	return p->path[i].hash;
+}
+
+// the frame of pc (or -1 if out of memory)
+static int frame_of(rvprof_t* p, uint32_t pc) {
+	int fn = func_find(p, pc);
+	if (fn >= 0) return fn;
+	uint32_t h = pc_hash(pc);
+	if (p->pcslots) {
+		for (;; h++) {
+			unsigned n = p->pcslot[h & (p->pcslots - 1)];
+			if (n == 0) break;
+			if ((p->frame[n - 1].func < 0) && (p->frame[n - 1].pc == pc)) return n - 1;
+		}
+	}
+	if ((p->nframes == p->maxframes) &&
+		grow((void**) &p->frame, &p->maxframes, sizeof(frame_t))) {
+		return -1;
+	}
+	frame_t* f = p->frame + p->nframes++;
+	memset(f, 0, sizeof(frame_t));
+	f->pc = pc;
+	f->func = -1;
+	if ((2 * ++p->npcs) > p->pcslots) {
+		if (rehash(p, &p->pcslot, &p->pcslots, p->nframes, frame_hash)) {
+			p->nframes--;
+			p->npcs--;
+			return -1;
+		}
+	} else {
+		while (p->pcslot[h & (p->pcslots - 1)]) h++;
+		p->pcslot[h & (p->pcslots - 1)] = p->nframes;
+	}
+	return f - p->frame;
+}
+
+static void path_add(rvprof_t* p, unsigned* frame, unsigned depth, uint64_t count) {
+	uint32_t h = depth;
+	for (unsigned n = 0; n < depth; n++) {
+		h = hash32(h ^ frame[n]);
+	}
+	h |= 1;
+	if (p->pathslots) {
+		for (uint32_t i = h;; i++) {
+			unsigned n = p->pathslot[i & (p->pathslots - 1)];
+			if (n == 0) break;
+			path_t* x = p->path + n - 1;
+			if ((x->hash == h) && (x->depth == depth) &&
+				!memcmp(x->frame, frame, depth * sizeof(unsigned))) {
+				x->count += count;
+				return;
+			}
+		}
+	}
+	if ((p->npaths == p->maxpaths) &&
+		grow((void**) &p->path, &p->maxpaths, sizeof(path_t))) {
+		return;
+	}
+	path_t* x = p->path + p->npaths;
+	if ((x->frame = malloc(depth * sizeof(unsigned))) == NULL) return;
+	memcpy(x->frame, frame, depth * sizeof(unsigned));
+	x->hash = h;
+	x->depth = depth;
+	x->count = count;
+	p->npaths++;
+	if ((2 * p->npaths) > p->pathslots) {
+		if (rehash(p, &p->pathslot, &p->pathslots, p->npaths, path_hash)) {
+			free(x->frame);
+			p->npaths--;
+		}
+		return;
+	}
+	while (p->pathslot[h & (p->pathslots - 1)]) h++;
+	p->pathslot[h & (p->pathslots - 1)] = p->npaths;
+}
+
+rvprof_t* rvprof_create(rvstate_t* s, rvelf_t* e) {
+	rvprof_t* p;
+	if ((p = calloc(1, sizeof(rvprof_t))) == NULL) {
+		return NULL;
+	}
+	p->s = s;
+	while (rvsim_hart(s, p->nharts)) p->nharts++;
+	if ((p->last = calloc(p->nharts, sizeof(uint64_t))) == NULL) {
+		goto fail;
+	}
+	for (unsigned n = 0; n < p->nharts; n++) {
+		p->last[n] = rvsim_icount(rvsim_hart(s, n));
+	}
+	if (e) rvelf_functions(e, add_func, p);
+	if (p->nfuncs) {
+		qsort(p->func, p->nfuncs, sizeof(func_t), func_cmp);
+		// drop aliases
+		unsigned n = 1;
+		for (unsigned i = 1; i < p->nfuncs; i++) {
+			if (p->func[i].addr == p->func[n - 1].addr) {
+				free(p->func[i].name);
+			} else {
+				p->func[n++] = p->func[i];
+			}
+		}
+		p->nfuncs = n;
+		p->maxframes = p->nfuncs;
+		if ((p->frame = calloc(p->maxframes, sizeof(frame_t))) == NULL) {
+			goto fail;
+		}
+		for (n = 0; n < p->nfuncs; n++) {
+			p->frame[n].pc = p->func[n].addr;
+			p->frame[n].func = n;
+		}
+		p->nframes = p->nfuncs;
+	}
+	return p;
+fail:
+	rvprof_destroy(p);
+	return NULL;
+}
+
+void rvprof_destroy(rvprof_t* p) {
+	for (unsigned n = 0; n < p->nfuncs; n++) {
+		free(p->func[n].name);
+	}
+	for (unsigned n = 0; n < p->npaths; n++) {
+		free(p->path[n].frame);
+	}
+	free(p->func);
+	free(p->frame);
+	free(p->pcslot);
+	free(p->path);
+	free(p->pathslot);
+	free(p->last);
+	free(p);
+}
+
+void rvprof_sample(rvprof_t* p) {
+	uint32_t ra[PROFDEPTH];
+	unsigned frame[PROFDEPTH + 1];
+	for (unsigned n = 0; n < p->nharts; n++) {
+		rvstate_t* h = rvsim_hart(p->s, n);
+		uint64_t count = rvsim_icount(h) - p->last[n];
+		if (count == 0) continue;
+		p->last[n] += count;
+		unsigned depth = rvsim_callstack(h, ra, PROFDEPTH);
+		if (depth > PROFDEPTH) depth = PROFDEPTH;
+		int f;
+		for (unsigned i = 0; i < depth; i++) {
+			// the call, not where it returns to (the next function,
+			// if it never does): ra - 2 is inside it whether it is
+			// 4 bytes or compressed
+			if ((f = frame_of(p, ra[i] - 2)) < 0) return;
+			frame[i] = f;
+		}
+		if ((f = frame_of(p, rvsim_pc(h))) < 0) return;
+		frame[depth] = f;
+		path_add(p, frame, depth + 1, count);
+	}
+}
+
+static void frame_name(rvprof_t* p, unsigned n, FILE* fp) {
+	frame_t* f = p->frame + n;
+	if (f->func >= 0) {
+		fputs(p->func[f->func].name, fp);
+	} else {
+		fprintf(fp, "0x%08x", f->pc);
+	}
+}
+
+void rvprof_folded(rvprof_t* p, FILE* fp) {
+	for (unsigned n = 0; n < p->npaths; n++) {
+		path_t* x = p->path + n;
+		for (unsigned i = 0; i < x->depth; i++) {
+			if (i) fputc(';', fp);
+			frame_name(p, x->frame[i], fp);
+		}
+		fprintf(fp, " %lu\n", x->count);
+	}
+}
+
+// by instructions spent in the function itself, then with callees
+static int frame_cmp(const void* _a, const void* _b) {
+	const frame_t* a = *((frame_t* const*) _a);
+	const frame_t* b = *((frame_t* const*) _b);
+	if (a->self != b->self) return (a->self > b->self) ? -1 : 1;
+	if (a->total != b->total) return (a->total > b->total) ? -1 : 1;
+	return (a->pc < b->pc) ? -1 : (a->pc > b->pc);
+}
+
+void rvprof_report(rvprof_t* p, FILE* fp) {
+	uint64_t all = 0;
+	for (unsigned n = 0; n < p->nframes; n++) {
+		p->frame[n].self = 0;
+		p->frame[n].total = 0;
+		p->frame[n].seen = 0;
+	}
+	for (unsigned n = 0; n < p->npaths; n++) {
+		path_t* x = p->path + n;
+		all += x->count;
+		p->frame[x->frame[x->depth - 1]].self += x->count;
+		for (unsigned i = 0; i < x->depth; i++) {
+			// recursion counts once
+			frame_t* f = p->frame + x->frame[i];
+			if (f->seen == (n + 1)) continue;
+			f->seen = n + 1;
+			f->total += x->count;
+		}
+	}
+	frame_t** order;
+	if ((order = malloc((p->nframes + 1) * sizeof(frame_t*))) == NULL) {
+		return;
+	}
+	unsigned count = 0;
+	for (unsigned n = 0; n < p->nframes; n++) {
+		if (p->frame[n].total) order[count++] = p->frame + n;
+	}
+	qsort(order, count, sizeof(frame_t*), frame_cmp);
+	fprintf(fp, "%lu instructions sampled\n", all);
+	fprintf(fp, "       self         %%       total         %%  function\n");
+	double scale = all ? (100.0 / all) : 0;
+	for (unsigned n = 0; n < count; n++) {
+		frame_t* f = order[n];
+		fprintf(fp, "%11lu  %7.2f%%  %11lu  %7.2f%%  ",
+			f->self, f->self * scale, f->total, f->total * scale);
+		frame_name(p, f - p->frame, fp);
+		fputc('\n', fp);
+	}
+	free(order);
+}
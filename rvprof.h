@@ -0,0 +1,34 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "rvsim.h"
+#include "rvelf.h"
+
+// sampling profiler: between rvsim_run() slices, the pc and shadow call
+// stack (rvconfig_t.callstack) of each hart, attributed to the functions
+// of an ELF symbol table
+
+typedef struct rvprof rvprof_t;
+
+// profile the harts of instance s, naming functions from e (or NULL:
+// every pc is its own frame)
+// the symbols are copied, e may be closed afterwards
+rvprof_t* rvprof_create(rvstate_t* s, rvelf_t* e);
+
+void rvprof_destroy(rvprof_t* p);
+
+// sample each hart that ran since the last sample: the instructions it
+// ran since are attributed to the call stack it is in now
+void rvprof_sample(rvprof_t* p);
+
+// collapsed stacks, "outer;inner;leaf instructions" per line, as
+// flamegraph.pl, inferno and speedscope read them
+void rvprof_folded(rvprof_t* p, FILE* fp);
+
+// instructions per function, by itself and with its callees
+void rvprof_report(rvprof_t* p, FILE* fp);
@@ -0,0 +1,176 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// The guest writes submissions into its ram and rings the doorbell (one
+// iocall); the ring thread copies them out and works through them, so
+// a guest can queue a batch of reads and writes and carry on running.
+// The indexes the host advances are kept here and only published to
+// the guest, so a guest scribbling on its ring can upset nothing but
+// its own i/o.  A hart waiting for a completion is parked in a deferred
+// iocall, completed when the next completion is posted.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "rvsim.h"
+#include "rvcore.h"
+#include "rvsched.h"
+#include "rvring.h"
+#include "iocall.h"
+
+struct rvring {
+	rvstate_t* s;
+	ioring_t* ring; // in guest ram
+	uint32_t addr;  // of the ring
+	uint32_t entries;
+	uint32_t sq_head;
+	uint32_t cq_tail;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int rung; // the doorbell rang since the thread last looked
+	int stop;
+	unsigned nwaiting;
+	rvstate_t* waiting[RVMAXHARTS]; // harts stopped until a completion
+};
+
+static uint32_t ring_do(rvring_t* r, const iosqe_t* e) {
+	switch (e->op) {
+	case IORING_OP_NOP:
+		return 0;
+	case IORING_OP_READ: {
+		void* ptr = rvsim_dma(r->s, e->ptr, e->len);
+		if (ptr == NULL) return -1;
+		ssize_t n = read(e->fd, ptr, e->len);
+		if (n > 0) rvsim_dma_written(r->s, e->ptr, n);
+		return n;
+	}
+	case IORING_OP_WRITE: {
+		void* ptr = rvsim_dma(r->s, e->ptr, e->len);
+		if (ptr == NULL) return -1;
+		return write(e->fd, ptr, e->len);
+	}
+	default:
+		return -1;
+	}
+}
+
+// the ring thread wrote len bytes of the ring at p: count the page
+// as written, for checkpoints and rvsim_rewind()
+static void ring_written(rvring_t* r, const void* p, uint32_t len) {
+	rvsim_dma_written(r->s, r->addr + ((const uint8_t*) p - (const uint8_t*) r->ring), len);
+}
+
+// let the harts waiting for a completion go
+static void ring_wake(rvring_t* r) {
+	rvstate_t* waiting[RVMAXHARTS];
+	pthread_mutex_lock(&r->lock);
+	unsigned n = r->nwaiting;
+	memcpy(waiting, r->waiting, n * sizeof(rvstate_t*));
+	r->nwaiting = 0;
+	pthread_mutex_unlock(&r->lock);
+	for (unsigned i = 0; i < n; i++) {
+		rvsched_iocall_complete(waiting[i], 0);
+	}
+}
+
+// do submissions until there are none, or no room to post a completion
+// (the guest rings again once it has taken some)
+static void ring_drain(rvring_t* r) {
+	ioring_t* q = r->ring;
+	while (!__atomic_load_n(&r->stop, __ATOMIC_RELAXED)) {
+		if (r->sq_head == __atomic_load_n(&q->sq_tail, __ATOMIC_ACQUIRE)) break;
+		if ((r->cq_tail - __atomic_load_n(&q->cq_head, __ATOMIC_ACQUIRE)) >= r->entries) break;
+		iosqe_t e = *ioring_sqe(q, r->entries, r->sq_head);
+		__atomic_store_n(&q->sq_head, ++r->sq_head, __ATOMIC_RELEASE);
+		ring_written(r, &q->sq_head, sizeof(q->sq_head));
+		uint32_t result = ring_do(r, &e);
+		iocqe_t* c = ioring_cqe(q, r->entries, r->cq_tail);
+		c->user = e.user;
+		c->result = result;
+		ring_written(r, c, sizeof(*c));
+		__atomic_store_n(&r->cq_tail, r->cq_tail + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&q->cq_tail, r->cq_tail, __ATOMIC_RELEASE);
+		ring_written(r, &q->cq_tail, sizeof(q->cq_tail));
+		ring_wake(r);
+	}
+}
+
+static void* ring_main(void* arg) {
+	rvring_t* r = arg;
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		while (!r->rung && !r->stop) {
+			pthread_cond_wait(&r->cond, &r->lock);
+		}
+		if (r->stop) break;
+		r->rung = 0;
+		pthread_mutex_unlock(&r->lock);
+		ring_drain(r);
+		pthread_mutex_lock(&r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+int rvring_create(rvring_t** _r, rvstate_t* s, uint32_t addr, uint32_t entries) {
+	if ((entries == 0) || (entries > IORING_MAXENTRIES) ||
+		(entries & (entries - 1)) || (addr & 3)) {
+		return -1;
+	}
+	ioring_t* q;
+	if ((q = rvsim_dma(s, addr, IORING_SIZE(entries))) == NULL) {
+		return -1;
+	}
+	rvring_t* r;
+	if ((r = calloc(1, sizeof(rvring_t))) == NULL) {
+		return -1;
+	}
+	r->s = s;
+	r->ring = q;
+	r->addr = addr;
+	r->entries = entries;
+	memset(q, 0, sizeof(ioring_t));
+	rvsim_dma_written(s, addr, sizeof(ioring_t));
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	if (pthread_create(&r->thread, NULL, ring_main, r)) {
+		pthread_cond_destroy(&r->cond);
+		pthread_mutex_destroy(&r->lock);
+		free(r);
+		return -1;
+	}
+	*_r = r;
+	return 0;
+}
+
+void rvring_destroy(rvring_t* r) {
+	pthread_mutex_lock(&r->lock);
+	__atomic_store_n(&r->stop, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	free(r);
+}
+
+uint32_t rvring_enter(rvring_t* r, rvstate_t* hart, uint32_t flags) {
+	pthread_mutex_lock(&r->lock);
+	r->rung = 1;
+	pthread_cond_signal(&r->cond);
+	// ring_drain() publishes a completion before ring_wake() takes
+	// the lock, so either it is seen here or this hart is woken
+	if ((flags & IORING_ENTER_WAIT) &&
+		(__atomic_load_n(&r->cq_tail, __ATOMIC_ACQUIRE) ==
+		__atomic_load_n(&r->ring->cq_head, __ATOMIC_ACQUIRE))) {
+		r->waiting[r->nwaiting++] = hart;
+		rvsim_iocall_defer(hart);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return 0;
+}
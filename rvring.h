@@ -0,0 +1,28 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "rvsim.h"
+
+// the host side of the asynchronous i/o ring of a guest (IOCALL_RING_*,
+// layout in iocall.h): a thread that, when the doorbell rings, takes
+// the queued submissions, does them one after another with blocking
+// syscalls, and posts their completions, while the harts keep running
+
+typedef struct rvring rvring_t;
+
+// set up a ring of entries slots per queue at guest address addr of
+// the instance s belongs to, and start its thread
+int rvring_create(rvring_t** r, rvstate_t* s, uint32_t addr, uint32_t entries);
+
+// stop the thread, once it has finished the submission it is doing,
+// and release the ring (before the instance is destroyed)
+void rvring_destroy(rvring_t* r);
+
+// IOCALL_RING_ENTER, from the iocall callback of hart: ring the doorbell
+// with IORING_ENTER_WAIT, the iocall is deferred (rvsim_iocall_defer())
+// until there is a completion to take, if there isn't one already
+uint32_t rvring_enter(rvring_t* r, rvstate_t* hart, uint32_t flags);
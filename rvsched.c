@@ -0,0 +1,405 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// Every worker owns a deque of runnable guests.  It takes guests from
+// the bottom of its own deque and puts them back there after their
+// slice, so a guest tends to stay on one thread (and in its caches).
+// A worker with nothing to do steals from the top of the others' deques
+// and sleeps only when every deque is empty.  A slice is long next to a
+// lock round trip, so the deques are simple mutex protected rings.
+//
+// A guest whose harts all stopped in deferred iocalls is parked, in no
+// deque, until rvsched_iocall_complete() puts it back in one.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "rvsim.h"
+#include "rvcore.h"
+#include "rvsched.h"
+
+#define RVSCHED_QUANTUM 100000
+
+typedef struct {
+	pthread_mutex_t lock;
+	rvguest_t** ring;
+	unsigned size;   // power of two
+	unsigned top;    // thieves take from here
+	unsigned bottom; // the owner pushes and pops here
+} deque_t;
+
+typedef struct {
+	rvsched_t* sc;
+	pthread_t thread;
+	uint32_t seed;
+	deque_t dq;
+} worker_t;
+
+struct rvguest {
+	rvsched_t* sc;
+	rvstate_t* s;
+	void (*done)(rvguest_t* g, void* cookie);
+	void* cookie;
+	unsigned id;
+
+	pthread_mutex_t lock;
+	int parked; // waiting for an iocall, in no deque
+	int wake;   // an iocall completed while it was running
+	uint64_t added_ns;
+	rvguest_stats_t st;
+};
+
+struct rvsched {
+	worker_t* worker;
+	unsigned nworkers;
+	uint64_t quantum;
+	uint64_t limit;
+	uint64_t start_ns;
+
+	int queued;    // guests in deques
+	int idle;      // workers waiting for work
+	unsigned next; // deque for guests arriving from outside
+
+	pthread_mutex_t lock;
+	pthread_cond_t work; // guests were queued or the pool is stopping
+	pthread_cond_t done; // no guests left
+	int stop;
+	unsigned live;
+	rvguest_t** guest;
+	unsigned nguests;
+	unsigned maxguests;
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int dq_init(deque_t* dq) {
+	pthread_mutex_init(&dq->lock, NULL);
+	dq->size = 64;
+	dq->top = 0;
+	dq->bottom = 0;
+	dq->ring = malloc(dq->size * sizeof(rvguest_t*));
+	return dq->ring ? 0 : -1;
+}
+
+static void dq_push(deque_t* dq, rvguest_t* g) {
+	pthread_mutex_lock(&dq->lock);
+	if ((dq->bottom - dq->top) == dq->size) {
+		unsigned size = dq->size * 2;
+		rvguest_t** ring;
+		if ((ring = malloc(size * sizeof(rvguest_t*))) == NULL) {
+			fprintf(stderr, "error: out of memory for scheduler\n");
+			abort();
+		}
+		for (unsigned n = dq->top; n != dq->bottom; n++) {
+			ring[n & (size - 1)] = dq->ring[n & (dq->size - 1)];
+		}
+		free(dq->ring);
+		dq->ring = ring;
+		dq->size = size;
+	}
+	dq->ring[dq->bottom++ & (dq->size - 1)] = g;
+	pthread_mutex_unlock(&dq->lock);
+}
+
+static rvguest_t* dq_pop(deque_t* dq) {
+	rvguest_t* g = NULL;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom != dq->top) {
+		g = dq->ring[--dq->bottom & (dq->size - 1)];
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return g;
+}
+
+static rvguest_t* dq_steal(deque_t* dq) {
+	rvguest_t* g = NULL;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom != dq->top) {
+		g = dq->ring[dq->top++ & (dq->size - 1)];
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return g;
+}
+
+static void sched_push(rvsched_t* sc, deque_t* dq, rvguest_t* g) {
+	dq_push(dq, g);
+	// pairs with the idle/queued check in worker_main()
+	__atomic_fetch_add(&sc->queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sc->idle, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&sc->lock);
+		pthread_cond_signal(&sc->work);
+		pthread_mutex_unlock(&sc->lock);
+	}
+}
+
+// queue a guest from outside the pool
+static void sched_inject(rvsched_t* sc, rvguest_t* g) {
+	unsigned n = __atomic_fetch_add(&sc->next, 1, __ATOMIC_RELAXED);
+	sched_push(sc, &sc->worker[n % sc->nworkers].dq, g);
+}
+
+static rvguest_t* steal(rvsched_t* sc, worker_t* w) {
+	// xorshift, to spread thieves over victims
+	w->seed ^= w->seed << 13;
+	w->seed ^= w->seed >> 17;
+	w->seed ^= w->seed << 5;
+	unsigned start = w->seed % sc->nworkers;
+	for (unsigned n = 0; n < sc->nworkers; n++) {
+		worker_t* v = sc->worker + ((start + n) % sc->nworkers);
+		if (v == w) continue;
+		rvguest_t* g;
+		if ((g = dq_steal(&v->dq)) != NULL) return g;
+	}
+	return NULL;
+}
+
+static void guest_run(worker_t* w, rvguest_t* g) {
+	rvsched_t* sc = w->sc;
+
+	pthread_mutex_lock(&g->lock);
+	g->wake = 0;
+	pthread_mutex_unlock(&g->lock);
+
+	uint64_t t0 = now_ns();
+	int r = rvsim_run(g->s, sc->quantum);
+	uint64_t t1 = now_ns();
+
+	uint64_t count = 0;
+	rvstate_t* h;
+	for (unsigned n = 0; (h = rvsim_hart(g->s, n)) != NULL; n++) {
+		count += rvsim_icount(h);
+	}
+
+	int timeout = 0;
+	if ((r != RVSIM_EXITED) && sc->limit && (count >= sc->limit)) {
+		r = RVSIM_EXITED;
+		timeout = 1;
+	}
+
+	pthread_mutex_lock(&g->lock);
+	g->st.instructions = count;
+	g->st.slices++;
+	g->st.run_ns += t1 - t0;
+	switch (r) {
+	case RVSIM_EXITED:
+		g->st.exited = 1;
+		g->st.timeout = timeout;
+		if (!timeout) g->st.status = rvsim_exit_status(g->s);
+		g->st.wall_ns = t1 - g->added_ns;
+		break;
+	case RVSIM_WAITING:
+		if (g->wake) {
+			// completed while we were getting here
+			r = RVSIM_RUNNING;
+		} else {
+			g->parked = 1;
+			g->st.parks++;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&g->lock);
+
+	switch (r) {
+	case RVSIM_RUNNING:
+		sched_push(sc, &w->dq, g);
+		break;
+	case RVSIM_EXITED:
+		if (g->done) g->done(g, g->cookie);
+		pthread_mutex_lock(&sc->lock);
+		if (--sc->live == 0) pthread_cond_broadcast(&sc->done);
+		pthread_mutex_unlock(&sc->lock);
+		break;
+	}
+}
+
+static void* worker_main(void* arg) {
+	worker_t* w = arg;
+	rvsched_t* sc = w->sc;
+	while (!__atomic_load_n(&sc->stop, __ATOMIC_RELAXED)) {
+		rvguest_t* g = dq_pop(&w->dq);
+		if (g == NULL) g = steal(sc, w);
+		if (g != NULL) {
+			__atomic_fetch_sub(&sc->queued, 1, __ATOMIC_SEQ_CST);
+			guest_run(w, g);
+			continue;
+		}
+		pthread_mutex_lock(&sc->lock);
+		__atomic_fetch_add(&sc->idle, 1, __ATOMIC_SEQ_CST);
+		if (!sc->stop && (__atomic_load_n(&sc->queued, __ATOMIC_SEQ_CST) <= 0)) {
+			pthread_cond_wait(&sc->work, &sc->lock);
+		}
+		__atomic_fetch_sub(&sc->idle, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&sc->lock);
+	}
+	return NULL;
+}
+
+rvsched_t* rvsched_create(unsigned workers, uint64_t quantum) {
+	rvsched_t* sc;
+	if (workers == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = (n > 0) ? n : 1;
+	}
+	if ((sc = calloc(1, sizeof(rvsched_t))) == NULL) {
+		return NULL;
+	}
+	if ((sc->worker = calloc(workers, sizeof(worker_t))) == NULL) {
+		free(sc);
+		return NULL;
+	}
+	sc->nworkers = workers;
+	sc->quantum = quantum ? quantum : RVSCHED_QUANTUM;
+	sc->start_ns = now_ns();
+	pthread_mutex_init(&sc->lock, NULL);
+	pthread_cond_init(&sc->work, NULL);
+	pthread_cond_init(&sc->done, NULL);
+	for (unsigned n = 0; n < workers; n++) {
+		worker_t* w = sc->worker + n;
+		w->sc = sc;
+		w->seed = 0x9E3779B9 * (n + 1);
+		if (dq_init(&w->dq) < 0) {
+			fprintf(stderr, "error: out of memory for scheduler\n");
+			abort();
+		}
+	}
+	for (unsigned n = 0; n < workers; n++) {
+		worker_t* w = sc->worker + n;
+		if (pthread_create(&w->thread, NULL, worker_main, w)) {
+			fprintf(stderr, "error: cannot start worker %u\n", n);
+			abort();
+		}
+	}
+	return sc;
+}
+
+void rvsched_destroy(rvsched_t* sc) {
+	pthread_mutex_lock(&sc->lock);
+	sc->stop = 1;
+	pthread_cond_broadcast(&sc->work);
+	pthread_mutex_unlock(&sc->lock);
+	for (unsigned n = 0; n < sc->nworkers; n++) {
+		worker_t* w = sc->worker + n;
+		pthread_join(w->thread, NULL);
+		pthread_mutex_destroy(&w->dq.lock);
+		free(w->dq.ring);
+	}
+	for (unsigned n = 0; n < sc->nguests; n++) {
+		pthread_mutex_destroy(&sc->guest[n]->lock);
+		free(sc->guest[n]);
+	}
+	pthread_mutex_destroy(&sc->lock);
+	pthread_cond_destroy(&sc->work);
+	pthread_cond_destroy(&sc->done);
+	free(sc->guest);
+	free(sc->worker);
+	free(sc);
+}
+
+void rvsched_set_limit(rvsched_t* sc, uint64_t max) {
+	sc->limit = max;
+}
+
+rvguest_t* rvsched_add(rvsched_t* sc, rvstate_t* s,
+	void (*done)(rvguest_t* g, void* cookie), void* cookie) {
+	rvguest_t* g;
+	if ((g = calloc(1, sizeof(rvguest_t))) == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&g->lock, NULL);
+	g->sc = sc;
+	g->s = s;
+	g->done = done;
+	g->cookie = cookie;
+	g->added_ns = now_ns();
+
+	pthread_mutex_lock(&sc->lock);
+	if (sc->nguests == sc->maxguests) {
+		unsigned max = sc->maxguests ? sc->maxguests * 2 : 64;
+		rvguest_t** list;
+		if ((list = realloc(sc->guest, max * sizeof(rvguest_t*))) == NULL) {
+			pthread_mutex_unlock(&sc->lock);
+			pthread_mutex_destroy(&g->lock);
+			free(g);
+			return NULL;
+		}
+		sc->guest = list;
+		sc->maxguests = max;
+	}
+	g->id = sc->nguests;
+	sc->guest[sc->nguests++] = g;
+	sc->live++;
+	s->sys->guest = g;
+	pthread_mutex_unlock(&sc->lock);
+
+	sched_inject(sc, g);
+	return g;
+}
+
+void rvsched_iocall_complete(rvstate_t* hart, uint32_t result) {
+	rvguest_t* g = hart->sys->guest;
+	if (!rvsim_iocall_complete(hart, result) || (g == NULL)) {
+		// the hart hadn't stopped yet and will just carry on, or
+		// its instance isn't scheduled (so nothing is parked)
+		return;
+	}
+	pthread_mutex_lock(&g->lock);
+	int parked = g->parked;
+	g->parked = 0;
+	g->wake = !parked;
+	pthread_mutex_unlock(&g->lock);
+	if (parked) sched_inject(g->sc, g);
+}
+
+void rvsched_wait(rvsched_t* sc) {
+	pthread_mutex_lock(&sc->lock);
+	while (sc->live > 0) {
+		pthread_cond_wait(&sc->done, &sc->lock);
+	}
+	pthread_mutex_unlock(&sc->lock);
+}
+
+void rvsched_guest_stats(rvguest_t* g, rvguest_stats_t* st) {
+	pthread_mutex_lock(&g->lock);
+	*st = g->st;
+	if (!st->exited) st->wall_ns = now_ns() - g->added_ns;
+	pthread_mutex_unlock(&g->lock);
+}
+
+void rvsched_report(rvsched_t* sc, FILE* fp) {
+	uint64_t total = 0;
+	uint64_t wall = now_ns() - sc->start_ns;
+	pthread_mutex_lock(&sc->lock);
+	unsigned count = sc->nguests;
+	pthread_mutex_unlock(&sc->lock);
+	fprintf(fp, "guest   instructions   slices   parks     run-ms    MIPS  status\n");
+	for (unsigned n = 0; n < count; n++) {
+		rvguest_stats_t st;
+		pthread_mutex_lock(&sc->lock);
+		rvguest_t* g = sc->guest[n];
+		pthread_mutex_unlock(&sc->lock);
+		rvsched_guest_stats(g, &st);
+		total += st.instructions;
+		fprintf(fp, "%5u %14lu %8lu %7lu %10.3f %7.1f  ", n,
+			st.instructions, st.slices, st.parks, st.run_ns / 1000000.0,
+			st.run_ns ? (st.instructions * 1000.0 / st.run_ns) : 0.0);
+		if (st.timeout) {
+			fprintf(fp, "timeout\n");
+		} else if (st.exited) {
+			fprintf(fp, "%d\n", st.status);
+		} else {
+			fprintf(fp, "running\n");
+		}
+	}
+	fprintf(fp, "%u guests, %lu instructions in %.3f s, %.1f MIPS on %u workers\n",
+		count, total, wall / 1000000000.0,
+		wall ? (total * 1000.0 / wall) : 0.0, sc->nworkers);
+}
@@ -0,0 +1,57 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "rvsim.h"
+
+// M:N scheduler: many simulator instances (guests) multiplexed over a
+// fixed pool of worker threads, each guest running rvsim_run() for a
+// quantum of instructions at a time
+
+typedef struct rvsched rvsched_t;
+typedef struct rvguest rvguest_t;
+
+// start workers threads (0: one per host cpu) running guests for
+// quantum instructions (0: a default) per slice
+rvsched_t* rvsched_create(unsigned workers, uint64_t quantum);
+
+// stop the workers and release the scheduler
+// guests still running are abandoned, their instances are not destroyed
+void rvsched_destroy(rvsched_t* sc);
+
+// retire guests that have run max instructions (0: no limit, the
+// default) as if they had exited, with rvguest_stats_t.timeout set
+void rvsched_set_limit(rvsched_t* sc, uint64_t max);
+
+// hand an instance to the scheduler, to run until it exits
+// done (if not NULL) is called from a worker thread once it has, after
+// which the scheduler no longer touches the instance
+rvguest_t* rvsched_add(rvsched_t* sc, rvstate_t* s,
+	void (*done)(rvguest_t* g, void* cookie), void* cookie);
+
+// complete a deferred iocall (see rvsim_iocall_defer()) of a hart,
+// making its guest runnable again if it is scheduled and was parked on it
+void rvsched_iocall_complete(rvstate_t* hart, uint32_t result);
+
+// wait until every guest added so far has exited
+void rvsched_wait(rvsched_t* sc);
+
+typedef struct rvguest_stats {
+	uint64_t instructions; // executed, all harts
+	uint64_t slices;       // times it was run
+	uint64_t parks;        // times it was parked on an iocall
+	uint64_t run_ns;       // time spent running
+	uint64_t wall_ns;      // time from rvsched_add() to exit (or now)
+	int exited;
+	int timeout;           // retired at the instruction limit
+	int status;            // exit status
+} rvguest_stats_t;
+
+void rvsched_guest_stats(rvguest_t* g, rvguest_stats_t* st);
+
+// per guest instruction counts and throughput, then the totals
+void rvsched_report(rvsched_t* sc, FILE* fp);
@@ -5,448 +5,1730 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "riscv.h"
 #include "rvsim.h"
+#include "rvcore.h"
+#include "iocall.h"
+#include "rvtiming.h"
 
-#define DO_TRACE_INS     0
-#define DO_TRACE_TRAPS   0
-#define DO_TRACE_MEM_WR  0
-#define DO_TRACE_REG_WR  0
+// the RVSIM_DEBUG_* options: those for every instruction are compiled
+// into the engine being generated (ENGINE_DEBUG, rvengine.h), the rest
+// are looked at when a trap is taken
+#define DO_TRACE_INS     (ENGINE_DEBUG & RVSIM_DEBUG_INS)
+#define DO_TRACE_MEM_WR  (ENGINE_DEBUG & RVSIM_DEBUG_MEM_WR)
+#define DO_TRACE_REG_WR  (ENGINE_DEBUG & RVSIM_DEBUG_REG_WR)
+#define DO_TRACE_TRAPS   (ENGINE_HOOKS && (s->debug & RVSIM_DEBUG_TRAPS))
+#define DO_ABORT_INVAL   (ENGINE_HOOKS && (s->debug & RVSIM_DEBUG_INVAL))
 
-#define DO_ABORT_INVAL   0
-
-#define RVMEMBASE 0x80000000
-#define RVMEMSIZE 0x01000000
-#define RVMEMMASK (RVMEMSIZE - 1)
-
-typedef struct rvstate {
-	uint32_t x[32];
-	void* memory;
-	uint32_t mscratch;
-	uint32_t mtvec;
-	uint32_t mtval;
-	uint32_t mepc;
-	uint32_t mcause;
-	void* ctx;
-} rvstate_t;
+// the options that make an engine of their own
+#define RVSIM_DEBUG_ENGINE (RVSIM_DEBUG_INS | RVSIM_DEBUG_MEM_WR | RVSIM_DEBUG_REG_WR)
 
 void* rvsim_dma(rvstate_t* s, uint32_t va, uint32_t len) {
-	if (va < RVMEMBASE) return NULL;
-	va -= RVMEMBASE;
-	if (va >= RVMEMSIZE) return NULL;
-	if (len > (RVMEMSIZE - va)) return NULL;
+	if (va < s->membase) return NULL;
+	va -= s->membase;
+	if (va >= s->memsize) return NULL;
+	if (len > (s->memsize - va)) return NULL;
 	return s->memory + va;
 }
 
-static uint32_t rd32(uint8_t* memory, uint32_t addr) {
-	if (addr < RVMEMBASE) {
-		return ior32(addr);
-	} else {
-		addr &= RVMEMMASK;
-		return ((uint32_t*) memory)[addr >> 2];
+// reset every slot of a decode cache page
+static void dcache_page_inval(rvstate_t* s, rvpage_t* pg) {
+	if (pg->jitted) rvjit_page_inval(s, pg);
+	for (unsigned i = 0; i < RVPAGESLOTS(s); i++) {
+		pg->op[i].op = OP_DECODE;
 	}
 }
-static void wr32(uint8_t* memory, uint32_t addr, uint32_t val) {
-	if (addr < RVMEMBASE) {
-		iow32(addr, val);
-	} else {
-		addr &= RVMEMMASK;
-		((uint32_t*) memory)[addr >> 2] = val;
+
+// drop every decoded instruction (fence.i)
+static void dcache_flush(rvstate_t* s) {
+	if (s->jit) rvjit_flush(s);
+	for (unsigned n = 0; n < s->pagecount; n++) {
+		rvpage_t* pg = s->dcache[n];
+		if (pg == NULL) continue;
+		for (unsigned i = 0; i < RVPAGESLOTS(s); i++) {
+			pg->op[i].op = OP_DECODE;
+		}
 	}
 }
-static uint32_t rd16(uint8_t* memory, uint32_t addr) {
-	if (addr < RVMEMBASE) {
-		return 0xffff;
-	} else {
-		addr &= RVMEMMASK;
-		return ((uint16_t*) memory)[addr >> 1];
+
+// queue a page for another hart to invalidate at its next block boundary
+static void hart_post_inval(rvstate_t* h, uint32_t pn) {
+	pthread_mutex_lock(&h->inval_lock);
+	unsigned n;
+	for (n = 0; (n < h->inval_count) && (n < RVINVALMAX); n++) {
+		if (h->inval[n] == pn) break;
+	}
+	if (n == h->inval_count) {
+		if (n < RVINVALMAX) h->inval[n] = pn;
+		h->inval_count = n + 1;
+	}
+	pthread_mutex_unlock(&h->inval_lock);
+	__atomic_fetch_or(&h->events, RVEV_INVAL, __ATOMIC_RELEASE);
+}
+
+// reset the slots of instructions that may overlap the word at ram
+// offset off: the ones starting in it, or (compressed code) in the
+// halfword before it, and those before them, which may be fused to them
+static void dcache_word_inval(rvstate_t* s, uint32_t off) {
+	off &= ~3;
+	uint32_t a = s->rvc ? (off - 6) : (off - 4);
+	for (; a != (off + 4); a += (1U << s->slotshift)) {
+		if (a >= s->memsize) continue;
+		rvpage_t* pg = s->dcache[a >> RVPAGESHIFT];
+		if (pg == NULL) continue;
+		if (pg->jitted) rvjit_page_inval(s, pg);
+		pg->op[(a & RVPAGEMASK) >> s->slotshift].op = OP_DECODE;
 	}
 }
-static void wr16(uint8_t* memory, uint32_t addr, uint32_t val) {
-	if (addr >= RVMEMBASE) {
-		addr &= RVMEMMASK;
-		((uint16_t*) memory)[addr >> 1] = val;
+
+// a store to a watched word: stop the hart for the debugger
+static int watch_hit(rvstate_t* s, uint32_t off) {
+	rvsys_t* sys = s->sys;
+	off &= ~3;
+	for (unsigned n = 0; n < sys->nwatch; n++) {
+		uint32_t w = sys->watch[n].off;
+		if ((off < (w + sys->watch[n].len)) && ((off + 4) > w)) {
+			s->dbgstop = RVSIM_STOP_WATCH;
+			s->dbgaddr = sys->membase + w;
+			__atomic_fetch_or(&s->events, RVEV_DEBUG, __ATOMIC_RELAXED);
+			return 1;
+		}
 	}
+	return 0;
 }
-static uint32_t rd8(uint8_t* memory, uint32_t addr) {
-	if (addr < RVMEMBASE) {
-		return 0xff;
+
+// the first write to page pn since the last checkpoint
+static void page_dirty(rvsys_t* sys, uint32_t pn) {
+	__atomic_fetch_and(sys->codemap + pn, ~RVCODEMAP_CLEAN, __ATOMIC_RELAXED);
+	__atomic_fetch_or(sys->dirty + (pn >> 6), 1ULL << (pn & 63), __ATOMIC_RELAXED);
+}
+
+int rvsim_dirty_clear(rvstate_t* s) {
+	rvsys_t* sys = s->sys;
+	uint32_t pages = sys->memsize >> RVPAGESHIFT;
+	uint32_t words = (pages + 63) >> 6;
+	if (sys->dirty == NULL) {
+		// the first time, every page starts out clean
+		if ((sys->dirty = malloc(words * sizeof(uint64_t))) == NULL) {
+			return -1;
+		}
+		memset(sys->dirty, 0xff, words * sizeof(uint64_t));
+		if (pages & 63) sys->dirty[words - 1] = (1ULL << (pages & 63)) - 1;
+	}
+	// after that, only the pages written since are not
+	for (uint32_t w = 0; w < words; w++) {
+		uint64_t bits = sys->dirty[w];
+		sys->dirty[w] = 0;
+		while (bits) {
+			uint32_t pn = (w << 6) + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			sys->codemap[pn] |= RVCODEMAP_CLEAN;
+		}
+	}
+	return 0;
+}
+
+// a store landed at ram offset off, in a page some hart decoded code from
+// (or with a watchpoint in it, rvsim_watchpoint(), or clean since the
+// last checkpoint)
+// the slots are reset here, other harts drop the whole page
+// returns nonzero if it hit a watchpoint: the hart stops after the store
+int rvsim_code_write(rvstate_t* s, uint32_t off) {
+	uint32_t pn = off >> RVPAGESHIFT;
+	dcache_word_inval(s, off);
+	uint64_t map = __atomic_load_n(s->codemap + pn, __ATOMIC_RELAXED);
+	if (map & RVCODEMAP_CLEAN) page_dirty(s->sys, pn);
+	uint64_t others = map & ~(RVCODEMAP_CLEAN | (1ULL << s->hartid));
+	while (others) {
+		unsigned id = __builtin_ctzll(others);
+		others &= others - 1;
+		hart_post_inval(s->sys->hart[id], pn);
+	}
+	return s->sys->nwatch ? watch_hit(s, off) : 0;
+}
+
+int rvsim_mmap(rvstate_t* s, uint32_t addr, uint32_t len, int fd, uint64_t off) {
+	uint32_t hostmask = sysconf(_SC_PAGESIZE) - 1;
+	uint8_t* ptr = rvsim_dma(s, addr, len);
+	if ((s->sys->cfg.hugepages == RVSIM_HUGEPAGES_HUGETLB) ||
+		(ptr == NULL) || (len == 0) || (len & hostmask) ||
+		(((uintptr_t) ptr) & hostmask) || (off & hostmask)) {
+		return -1;
+	}
+	// touching a page past the end of a file raises SIGBUS, so those
+	// are demand-zero instead
+	uint32_t flen = 0;
+	if (fd >= 0) {
+		struct stat st;
+		if (fstat(fd, &st) < 0) return -1;
+		uint64_t size = st.st_size;
+		size = (size > off) ? ((size - off + hostmask) & ~(uint64_t) hostmask) : 0;
+		flen = (size < len) ? size : len;
+	}
+	if (flen && (mmap(ptr, flen, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_FIXED, fd, off) == MAP_FAILED)) {
+		return -1;
+	}
+	if ((flen < len) && (mmap(ptr + flen, len - flen, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0) == MAP_FAILED)) {
+		return -1;
+	}
+	// whatever was decoded from the old contents is stale
+	rvsim_dma_written(s, addr, len);
+	return 0;
+}
+
+void rvsim_dma_written(rvstate_t* s, uint32_t addr, uint32_t len) {
+	rvsys_t* sys = s->sys;
+	uint32_t off = addr - s->membase;
+	if ((len == 0) || (off >= s->memsize)) return;
+	if (len > (s->memsize - off)) len = s->memsize - off;
+	for (uint32_t pn = off >> RVPAGESHIFT; pn <= ((off + len - 1) >> RVPAGESHIFT); pn++) {
+		uint64_t harts = __atomic_load_n(sys->codemap + pn, __ATOMIC_RELAXED);
+		if (harts & RVCODEMAP_CLEAN) page_dirty(sys, pn);
+		harts &= ~RVCODEMAP_CLEAN;
+		while (harts) {
+			unsigned id = __builtin_ctzll(harts);
+			harts &= harts - 1;
+			hart_post_inval(sys->hart[id], pn);
+		}
+	}
+}
+
+// post events to hart h, from any thread, waking it if it is in wfi
+static void hart_kick(rvstate_t* h, uint32_t ev) {
+	__atomic_fetch_or(&h->events, ev, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&h->wfi, __ATOMIC_SEQ_CST)) {
+		rvsys_t* sys = h->sys;
+		pthread_mutex_lock(&sys->lock);
+		h->wfi = 0;
+		pthread_cond_broadcast(&sys->cond);
+		pthread_mutex_unlock(&sys->lock);
+	}
+}
+
+// raise (level 1) or lower (level 0) the mip bits of hart h
+static void hart_raise(rvstate_t* h, uint32_t bits, int level) {
+	if (level) {
+		__atomic_fetch_or(&h->mip, bits, __ATOMIC_SEQ_CST);
+		hart_kick(h, RVEV_IRQ);
 	} else {
-		addr &= RVMEMMASK;
-		return memory[addr];
+		__atomic_fetch_and(&h->mip, ~bits, __ATOMIC_SEQ_CST);
 	}
 }
-static void wr8(uint8_t* memory, uint32_t addr, uint32_t val) {
-	if (addr >= RVMEMBASE) {
-		addr &= RVMEMMASK;
-		memory[addr] = val;
+
+void rvsim_irq(rvstate_t* s, int level) {
+	hart_raise(s, MIP_MEIP, level);
+}
+
+// the interrupt to take (mcause), or 0 if none is pending and enabled
+static uint32_t irq_cause(rvstate_t* s) {
+	if (!(s->mstatus & MSTATUS_MIE)) return 0;
+	uint32_t p = __atomic_load_n(&s->mip, __ATOMIC_RELAXED) & s->mie;
+	if (p & MIP_MEIP) return MCAUSE_INT | IC_M_EXTERNAL;
+	if (p & MIP_MSIP) return MCAUSE_INT | IC_M_SOFTWARE;
+	if (p & MIP_MTIP) return MCAUSE_INT | IC_M_TIMER;
+	return 0;
+}
+
+// mstatus or mie changed: an interrupt already pending is taken at the
+// next block boundary
+static void irq_check(rvstate_t* s) {
+	if (irq_cause(s)) __atomic_fetch_or(&s->events, RVEV_IRQ, __ATOMIC_RELAXED);
+}
+
+// service the events posted to this hart, about to run the instruction
+// at *pc (taking an interrupt moves *pc to its handler)
+// returns nonzero if it must stop
+static int hart_events(rvstate_t* s, uint32_t* pc) {
+	uint32_t ev = __atomic_exchange_n(&s->events, 0, __ATOMIC_ACQUIRE);
+	if (ev & RVEV_INVAL) {
+		pthread_mutex_lock(&s->inval_lock);
+		if (s->inval_count > RVINVALMAX) {
+			dcache_flush(s);
+		} else {
+			for (unsigned n = 0; n < s->inval_count; n++) {
+				uint32_t pn = s->inval[n];
+				rvpage_t* pg = s->dcache[pn];
+				if (pg) dcache_page_inval(s, pg);
+				// and an instruction running into it from the last
+				if (s->rvc) dcache_word_inval(s, pn << RVPAGESHIFT);
+			}
+		}
+		s->inval_count = 0;
+		pthread_mutex_unlock(&s->inval_lock);
+	}
+	if (ev & RVEV_JITFAULT) rvjit_fault(s);
+	if (ev & RVEV_IRQ) {
+		uint32_t cause = irq_cause(s);
+		if (cause) {
+			s->mepc = *pc;
+			s->mcause = cause;
+			s->mtval = 0;
+			s->mstatus = MSTATUS_MPIE; // MIE was set
+			*pc = (s->mtvec & ~3) + ((s->mtvec & 1) ? ((cause & 0x1f) * 4) : 0);
+		}
+	}
+	// hart_run() works out when the timer fires again, or stops for the
+	// debugger
+	if (ev & (RVEV_TIMER | RVEV_DEBUG)) return 1;
+	return __atomic_load_n(&s->sys->stop, __ATOMIC_ACQUIRE);
+}
+
+// end the simulation, the first hart to get here sets the exit code
+static int rvsim_exit(rvstate_t* s, int code) {
+	rvsys_t* sys = s->sys;
+	pthread_mutex_lock(&sys->lock);
+	if (!sys->stop) {
+		sys->exitcode = code;
+		__atomic_store_n(&sys->stop, 1, __ATOMIC_RELEASE);
+		for (unsigned n = 0; n < sys->nharts; n++) {
+			__atomic_fetch_or(&sys->hart[n]->events, RVEV_STOP, __ATOMIC_RELEASE);
+		}
+		pthread_cond_broadcast(&sys->cond);
+	}
+	code = sys->exitcode;
+	pthread_mutex_unlock(&sys->lock);
+	return code;
+}
+
+// the device mapped at addr, if any
+static rvregion_t* bus_find(rvstate_t* s, uint32_t addr) {
+	rvregion_t* r = s->lastdev;
+	if (r && ((addr - r->base) < r->size)) return r;
+	rvsys_t* sys = s->sys;
+	unsigned lo = 0, hi = sys->nregions;
+	// the last region starting at or below addr
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (sys->region[mid].base <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) return NULL;
+	r = sys->region + lo - 1;
+	if ((addr - r->base) >= r->size) return NULL;
+	s->lastdev = r;
+	return r;
+}
+
+// outside of ram: devices, then the catch-all callbacks below membase
+// narrow reads of devices without handlers for them come from rd32
+// the CLINT faults here, the engines try clint_rd()/clint_wr() then
+static int io_rd(rvstate_t* s, uint32_t addr, unsigned size, uint32_t* val) {
+	if (s->sys->clint && ((addr - s->sys->clint) < CLINT_SIZE)) return -1;
+	rvregion_t* r = bus_find(s, addr);
+	if (r) {
+		rvdevice_t* d = &r->dev;
+		uint32_t off = addr - r->base;
+		uint32_t v = 0xffffffff;
+		if ((size == 1) && d->rd8) {
+			v = d->rd8(r->ctx, off);
+		} else if ((size == 2) && d->rd16) {
+			v = d->rd16(r->ctx, off);
+		} else if (d->rd32) {
+			v = d->rd32(r->ctx, off & ~3) >> ((off & 3) * 8);
+		}
+		*val = (size == 4) ? v : (v & ((1U << (size * 8)) - 1));
+		return 0;
+	}
+	if (addr >= s->membase) return -1;
+	switch (size) {
+	case 4: *val = s->sys->cfg.ior32(s->ctx, addr); break;
+	case 2: *val = 0xffff; break;
+	default: *val = 0xff; break;
+	}
+	return 0;
+}
+static int io_wr(rvstate_t* s, uint32_t addr, unsigned size, uint32_t val) {
+	if (s->sys->clint && ((addr - s->sys->clint) < CLINT_SIZE)) return -1;
+	rvregion_t* r = bus_find(s, addr);
+	if (r) {
+		rvdevice_t* d = &r->dev;
+		uint32_t off = addr - r->base;
+		switch (size) {
+		case 4: if (d->wr32) d->wr32(r->ctx, off, val); break;
+		case 2: if (d->wr16) d->wr16(r->ctx, off, val & 0xffff); break;
+		default: if (d->wr8) d->wr8(r->ctx, off, val & 0xff); break;
+		}
+		return 0;
 	}
+	if (addr >= s->membase) return -1;
+	if (size == 4) s->sys->cfg.iow32(s->ctx, addr, val);
+	return 0;
+}
+
+// ram is checked first, everything else is io_rd()/io_wr()
+// the accessors return nonzero on a fault
+static inline int rd32(rvstate_t* s, uint32_t addr, uint32_t* val) {
+	uint32_t off = addr - s->membase;
+	if (__builtin_expect(off < s->memsize, 1)) {
+		*val = ((uint32_t*) s->memory)[off >> 2];
+		return 0;
+	}
+	return io_rd(s, addr, 4, val);
+}
+static inline int wr32(rvstate_t* s, uint32_t addr, uint32_t val) {
+	uint32_t off = addr - s->membase;
+	if (__builtin_expect(off < s->memsize, 1)) {
+		((uint32_t*) s->memory)[off >> 2] = val;
+		if (s->codemap[off >> RVPAGESHIFT]) return rvsim_code_write(s, off);
+		return 0;
+	}
+	return io_wr(s, addr, 4, val);
+}
+static inline int rd16(rvstate_t* s, uint32_t addr, uint32_t* val) {
+	uint32_t off = addr - s->membase;
+	if (__builtin_expect(off < s->memsize, 1)) {
+		*val = ((uint16_t*) s->memory)[off >> 1];
+		return 0;
+	}
+	return io_rd(s, addr, 2, val);
+}
+static inline int wr16(rvstate_t* s, uint32_t addr, uint32_t val) {
+	uint32_t off = addr - s->membase;
+	if (__builtin_expect(off < s->memsize, 1)) {
+		((uint16_t*) s->memory)[off >> 1] = val;
+		if (s->codemap[off >> RVPAGESHIFT]) return rvsim_code_write(s, off);
+		return 0;
+	}
+	return io_wr(s, addr, 2, val);
+}
+static inline int rd8(rvstate_t* s, uint32_t addr, uint32_t* val) {
+	uint32_t off = addr - s->membase;
+	if (__builtin_expect(off < s->memsize, 1)) {
+		*val = ((uint8_t*) s->memory)[off];
+		return 0;
+	}
+	return io_rd(s, addr, 1, val);
+}
+static inline int wr8(rvstate_t* s, uint32_t addr, uint32_t val) {
+	uint32_t off = addr - s->membase;
+	if (__builtin_expect(off < s->memsize, 1)) {
+		((uint8_t*) s->memory)[off] = val;
+		if (s->codemap[off >> RVPAGESHIFT]) return rvsim_code_write(s, off);
+		return 0;
+	}
+	return io_wr(s, addr, 1, val);
+}
+
+int rvsim_device_add(rvstate_t* s, uint32_t base, uint32_t size,
+	const rvdevice_t* dev, void* ctx) {
+	rvsys_t* sys = s->sys;
+	uint64_t end = (uint64_t) base + size;
+	if ((size == 0) || (end > 0x100000000ULL) ||
+		((base < (sys->membase + (uint64_t) sys->memsize)) && (end > sys->membase)) ||
+		(sys->clint && (base < (sys->clint + (uint64_t) CLINT_SIZE)) && (end > sys->clint))) {
+		return -1;
+	}
+	// keep them sorted by base, refusing overlaps
+	unsigned n;
+	for (n = 0; n < sys->nregions; n++) {
+		rvregion_t* r = sys->region + n;
+		if ((base < (r->base + (uint64_t) r->size)) && (end > r->base)) return -1;
+		if (r->base > base) break;
+	}
+	if (sys->nregions == sys->maxregions) {
+		unsigned max = sys->maxregions ? sys->maxregions * 2 : 8;
+		rvregion_t* list;
+		if ((list = realloc(sys->region, max * sizeof(rvregion_t))) == NULL) {
+			return -1;
+		}
+		sys->region = list;
+		sys->maxregions = max;
+	}
+	memmove(sys->region + n + 1, sys->region + n,
+		(sys->nregions - n) * sizeof(rvregion_t));
+	sys->region[n].base = base;
+	sys->region[n].size = size;
+	sys->region[n].dev = *dev;
+	sys->region[n].ctx = ctx;
+	sys->nregions++;
+	for (unsigned h = 0; h < sys->nharts; h++) {
+		sys->hart[h]->lastdev = NULL;
+	}
+	return 0;
+}
+
+// for tracing and the host: faults read as all ones
+static uint32_t peek32(rvstate_t* s, uint32_t addr) {
+	uint32_t v;
+	return rd32(s, addr, &v) ? 0xffffffff : v;
 }
 
 uint32_t rvsim_rd32(rvstate_t* s, uint32_t addr) {
-	return rd32(s->memory, addr);
+	return peek32(s, addr);
+}
+
+// atomic memory operations, on ram offset off, with operand *v
+// sets *v to the old value, returns nonzero if the write hit a
+// watchpoint (rvsim_code_write())
+static int amo(rvstate_t* s, unsigned oc, uint32_t off, uint32_t* _v) {
+	uint32_t* p = s->memory + off;
+	uint32_t v = *_v;
+	uint32_t ov, nv;
+	switch (oc) {
+	case OP_AMOSWAP: ov = __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); break;
+	case OP_AMOADD: ov = __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); break;
+	case OP_AMOXOR: ov = __atomic_fetch_xor(p, v, __ATOMIC_SEQ_CST); break;
+	case OP_AMOAND: ov = __atomic_fetch_and(p, v, __ATOMIC_SEQ_CST); break;
+	case OP_AMOOR: ov = __atomic_fetch_or(p, v, __ATOMIC_SEQ_CST); break;
+	default:
+		// min/max have no host equivalent
+		ov = __atomic_load_n(p, __ATOMIC_RELAXED);
+		do {
+			switch (oc) {
+			case OP_AMOMIN: nv = ((int32_t)ov < (int32_t)v) ? ov : v; break;
+			case OP_AMOMAX: nv = ((int32_t)ov > (int32_t)v) ? ov : v; break;
+			case OP_AMOMINU: nv = (ov < v) ? ov : v; break;
+			default: nv = (ov > v) ? ov : v; break;
+			}
+		} while (!__atomic_compare_exchange_n(p, &ov, nv, 1,
+			__ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	}
+	*_v = ov;
+	if (s->codemap[off >> RVPAGESHIFT]) return rvsim_code_write(s, off);
+	return 0;
+}
+
+// sc.w to addr (in ram), sets *rd to 0 on success and 1 on failure
+// returns nonzero if the write hit a watchpoint
+static int sc(rvstate_t* s, uint32_t addr, uint32_t v, uint32_t* rd) {
+	uint32_t resv = s->resv_addr;
+	s->resv_addr = RVRESV_NONE;
+	*rd = 1;
+	if (resv != addr) return 0;
+	uint32_t off = addr - s->membase;
+	uint32_t ov = s->resv_val;
+	if (!__atomic_compare_exchange_n((uint32_t*) (s->memory + off), &ov, v, 0,
+		__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return 0;
+	*rd = 0;
+	if (s->codemap[off >> RVPAGESHIFT]) return rvsim_code_write(s, off);
+	return 0;
 }
 
-int rvsim_init(rvstate_t** _s, void* ctx) {
+static rvstate_t* hart_new(rvsys_t* sys) {
 	rvstate_t *s;
-	if ((s = malloc(sizeof(rvstate_t))) == NULL) {
-		return -1;
+	if ((s = calloc(1, sizeof(rvstate_t))) == NULL) {
+		return NULL;
 	}
-	memset(s, 0, sizeof(rvstate_t));
-	if ((s->memory = malloc(RVMEMSIZE)) == NULL) {
+	s->pagecount = sys->memsize >> RVPAGESHIFT;
+	if ((s->dcache = calloc(s->pagecount, sizeof(rvpage_t*))) == NULL) {
 		free(s);
+		return NULL;
+	}
+	if (sys->cfg.callstack &&
+		((s->callstack = malloc(RVCALLDEPTH * sizeof(uint32_t))) == NULL)) {
+		free(s->dcache);
+		free(s);
+		return NULL;
+	}
+	pthread_mutex_init(&s->inval_lock, NULL);
+	s->memory = sys->memory;
+	s->vmem = sys->vmem;
+	s->codemap = sys->codemap;
+	s->membase = sys->membase;
+	s->memsize = sys->memsize;
+	s->sys = sys;
+	s->hartid = sys->nharts;
+	s->resv_addr = RVRESV_NONE;
+	s->rvc = sys->cfg.rvc ? rvc_table() : NULL;
+	s->ialign = sys->cfg.rvc ? 1 : 3;
+	s->slotshift = sys->cfg.rvc ? 1 : 2;
+	// the debug output shows each instruction as it runs
+	s->debug = sys->cfg.debug;
+	s->fuse = !sys->cfg.nofuse && !s->debug;
+	s->pc = sys->membase;
+	s->mtvec = sys->membase;
+	s->mtimecmp = UINT64_MAX; // never
+	s->ctx = sys->cfg.ctx ? sys->cfg.ctx : s;
+	sys->hart[sys->nharts++] = s;
+	return s;
+}
+
+static void hart_free(rvstate_t* s) {
+	for (unsigned n = 0; n < s->pagecount; n++) {
+		free(s->dcache[n]);
+	}
+	if (s->jit) rvjit_free(s);
+	pthread_mutex_destroy(&s->inval_lock);
+	free(s->callstack);
+	free(s->dcache);
+	free(s);
+}
+
+static uint32_t default_iocall(void* ctx, uint32_t n, const uint32_t args[8]) {
+	return -1;
+}
+static void ram_free(rvsys_t* sys) {
+	if (sys->vmmap) {
+		munmap(sys->vmmap, sys->vmmaplen);
+	} else if (sys->memory) {
+		munmap(sys->memory, sys->memsize);
+	}
+	sys->vmmap = NULL;
+	sys->vmem = NULL;
+	sys->memory = NULL;
+}
+
+static uint32_t default_ior32(void* ctx, uint32_t addr) {
+	return 0xffffffff;
+}
+static void default_iow32(void* ctx, uint32_t addr, uint32_t val) {
+}
+
+// ram is demand-zero, and page aligned so files can be mapped into it
+// (hugetlb pages are reserved up front, so a short pool fails here
+// rather than with SIGBUS later)
+static int ram_alloc(rvsys_t* sys) {
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	if (sys->cfg.hugepages == RVSIM_HUGEPAGES_HUGETLB) {
+		flags |= MAP_HUGETLB;
+	} else {
+		flags |= MAP_NORESERVE;
+	}
+	uint8_t* at = NULL;
+#if UINTPTR_MAX > 0xFFFFFFFF
+	// place it in a reservation of the whole guest address space,
+	// aligned for hugepages, if there's room
+	size_t len = RVVMSIZE + RVHUGEPAGESIZE;
+	void* vm = mmap(NULL, len, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (vm != MAP_FAILED) {
+		sys->vmmap = vm;
+		sys->vmmaplen = len;
+		sys->vmem = (uint8_t*) (((uintptr_t) vm + RVHUGEPAGESIZE - 1) &
+			~((uintptr_t) RVHUGEPAGESIZE - 1));
+		at = sys->vmem + sys->membase;
+		flags |= MAP_FIXED;
+	}
+#endif
+	void* p = mmap(at, sys->memsize, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED) {
+		ram_free(sys);
+		return -1;
+	}
+	sys->memory = p;
+	if (sys->cfg.hugepages == RVSIM_HUGEPAGES_THP) {
+		// only a hint, not an error if THP is unavailable
+		madvise(sys->memory, sys->memsize, MADV_HUGEPAGE);
+	}
+	return 0;
+}
+
+void rvsim_destroy(rvstate_t* s) {
+	rvsys_t* sys = s->sys;
+	if (sys->tracefd >= 0) rvsim_trace_stop(s);
+	rvtiming_stop(s);
+	rvsnap_free(s);
+	for (unsigned n = 0; n < sys->nharts; n++) {
+		hart_free(sys->hart[n]);
+	}
+	pthread_mutex_destroy(&sys->lock);
+	pthread_cond_destroy(&sys->cond);
+	pthread_mutex_destroy(&sys->tracelock);
+	free(sys->codemap);
+	free(sys->dirty);
+	free(sys->region);
+	ram_free(sys);
+	free(sys);
+}
+
+int rvsim_create(rvstate_t** _s, const rvconfig_t* cfg) {
+	rvsys_t* sys;
+	if ((sys = calloc(1, sizeof(rvsys_t))) == NULL) {
+		return -1;
+	}
+	if (cfg) sys->cfg = *cfg;
+	cfg = &sys->cfg;
+	if (cfg->membase == 0) sys->cfg.membase = RVMEMBASE;
+	if (cfg->memsize == 0) sys->cfg.memsize = RVMEMSIZE;
+	if (cfg->harts == 0) sys->cfg.harts = 1;
+	if (cfg->iocall == NULL) sys->cfg.iocall = default_iocall;
+	if (cfg->ior32 == NULL) sys->cfg.ior32 = default_ior32;
+	if (cfg->iow32 == NULL) sys->cfg.iow32 = default_iow32;
+	sys->membase = cfg->membase;
+	sys->memsize = cfg->memsize;
+	if ((cfg->membase & RVPAGEMASK) || (cfg->memsize & RVPAGEMASK) ||
+		(cfg->memsize == 0) || (cfg->memsize > 0x80000000) ||
+		((cfg->membase + (uint64_t) cfg->memsize) > 0x100000000ULL) ||
+		(cfg->harts > RVMAXHARTS) || (cfg->engine > RVSIM_ENGINE_JIT) ||
+		(cfg->debug > RVSIM_DEBUG_ALL) ||
+		(cfg->hugepages > RVSIM_HUGEPAGES_HUGETLB) ||
+		((cfg->hugepages == RVSIM_HUGEPAGES_HUGETLB) &&
+		((cfg->membase | cfg->memsize) & (RVHUGEPAGESIZE - 1))) ||
+		(cfg->clint && (((cfg->clint + (uint64_t) CLINT_SIZE) > 0x100000000ULL) ||
+		((cfg->clint < (cfg->membase + (uint64_t) cfg->memsize)) &&
+		((cfg->clint + CLINT_SIZE) > cfg->membase))))) {
+		free(sys);
+		return -1;
+	}
+	sys->clint = cfg->clint;
+	pthread_mutex_init(&sys->lock, NULL);
+	pthread_cond_init(&sys->cond, NULL);
+	pthread_mutex_init(&sys->tracelock, NULL);
+	sys->tracefd = -1;
+	if (ram_alloc(sys) < 0) {
+		goto fail;
+	}
+	sys->codemap = calloc(sys->memsize >> RVPAGESHIFT, sizeof(uint64_t));
+	if (sys->codemap == NULL) {
+		goto fail;
+	}
+	while (sys->nharts < cfg->harts) {
+		rvstate_t* s;
+		if ((s = hart_new(sys)) == NULL) {
+			goto fail;
+		}
+		s->engine = cfg->engine;
+		if ((cfg->engine == RVSIM_ENGINE_JIT) && (rvjit_init(s) < 0)) {
+			goto fail;
+		}
+	}
+	sys->hart[0]->started = 1;
+	*_s = sys->hart[0];
+	return 0;
+fail:
+	for (unsigned n = 0; n < sys->nharts; n++) {
+		hart_free(sys->hart[n]);
+	}
+	free(sys->codemap);
+	ram_free(sys);
+	free(sys);
+	return -1;
+}
+
+rvstate_t* rvsim_hart(rvstate_t* s, unsigned n) {
+	if (n >= s->sys->nharts) return NULL;
+	return s->sys->hart[n];
+}
+
+void rvsim_set_pc(rvstate_t* s, uint32_t pc) {
+	s->pc = pc;
+}
+
+uint32_t rvsim_pc(rvstate_t* s) {
+	return s->pc;
+}
+
+unsigned rvsim_callstack(rvstate_t* s, uint32_t* ra, unsigned max) {
+	unsigned n = (s->calldepth < RVCALLDEPTH) ? s->calldepth : RVCALLDEPTH;
+	if (s->callstack) memcpy(ra, s->callstack, ((n < max) ? n : max) * sizeof(uint32_t));
+	return s->calldepth;
+}
+
+uint64_t rvsim_icount(rvstate_t* s) {
+	return s->ccount;
+}
+
+uint64_t rvsim_counter(rvstate_t* s, unsigned ev) {
+	return (ev < RVSIM_EV_COUNT) ? s->evcount[ev] : 0;
+}
+
+int rvsim_exit_status(rvstate_t* s) {
+	return s->sys->exitcode;
+}
+
+int rvsim_hart_start(rvstate_t* s, uint32_t hartid, uint32_t pc, uint32_t sp, uint32_t arg) {
+	rvsys_t* sys = s->sys;
+	if (hartid >= sys->nharts) return -1;
+	rvstate_t* h = sys->hart[hartid];
+	pthread_mutex_lock(&sys->lock);
+	if (h->started) {
+		pthread_mutex_unlock(&sys->lock);
 		return -1;
 	}
-	memset(s->memory, 0, RVMEMSIZE);
-	s->mtvec = 0x80000000;
-	s->ctx = ctx ? ctx : s;
-	*_s = s;
+	h->x[2] = sp;
+	h->x[10] = hartid;
+	h->x[11] = arg;
+	h->pc = pc;
+	h->started = 1;
+	pthread_cond_broadcast(&sys->cond);
+	pthread_mutex_unlock(&sys->lock);
 	return 0;
 }
 
-static inline uint32_t rreg(rvstate_t* s, uint32_t n) {
-	return n ? s->x[n] : 0;
+void rvsim_iocall_defer(rvstate_t* s) {
+	s->iodefer = 1;
 }
-static inline void wreg(rvstate_t* s, uint32_t n, uint32_t v) {
-	s->x[n] = v;
+
+int rvsim_iocall_complete(rvstate_t* s, uint32_t result) {
+	rvsys_t* sys = s->sys;
+	int r = 0;
+	pthread_mutex_lock(&sys->lock);
+	if (s->iowait) {
+		s->x[10] = result;
+		__atomic_store_n(&s->iowait, 0, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&sys->cond);
+		r = 1;
+	} else {
+		s->ioresult = result;
+		s->iodone = 1;
+	}
+	pthread_mutex_unlock(&sys->lock);
+	return r;
 }
 
-static void put_csr(rvstate_t* s, uint32_t csr, uint32_t v) {
+// a deferred iocall returned, returns nonzero if the hart must stop
+// until it completes
+static int hart_iowait(rvstate_t* s) {
+	rvsys_t* sys = s->sys;
+	int r = 1;
+	s->iodefer = 0;
+	pthread_mutex_lock(&sys->lock);
+	if (s->iodone) {
+		s->x[10] = s->ioresult;
+		s->iodone = 0;
+		r = 0;
+	} else {
+		s->iowait = 1;
+	}
+	pthread_mutex_unlock(&sys->lock);
+	return r;
+}
+
+// the hart in an iocall callback on this thread
+static __thread rvstate_t* iocall_hart;
+
+rvstate_t* rvsim_iocall_hart(void) {
+	return iocall_hart;
+}
+
+// iocalls the simulator handles itself
+static uint32_t rvsim_iocall(rvstate_t* s, uint32_t n) {
+	uint32_t* a = s->x + 10;
+	switch (n) {
+	case IOCALL_HARTSTART:
+		return rvsim_hart_start(s, a[0], a[1], a[2], a[3]);
+	default: {
+		iocall_hart = s;
+		uint32_t r = s->sys->cfg.iocall(s->ctx, n, a);
+		iocall_hart = NULL;
+		return r;
+	}
+	}
+}
+
+// counter n of the csrs (0: cycle, 1: time, 2: instret, 3..: hpm)
+// when retired instructions have retired so far, not counting the
+// current one
+static uint64_t counter_get(rvstate_t* s, uint32_t n, uint64_t retired) {
+	switch (n) {
+	case 0: return retired + s->cycleoff;
+	case 1: return retired + s->timeoff; // one tick per instruction
+	case 2: return retired + s->instretoff;
+	default: return s->evcount[s->hpmevent[n]] + s->hpmoff[n];
+	}
+}
+// the instruction writing cycle or instret isn't counted
+static void counter_set(rvstate_t* s, uint32_t n, uint64_t v, uint64_t retired) {
+	switch (n) {
+	case 0: s->cycleoff = v - (retired + 1); break;
+	case 1: break;
+	case 2: s->instretoff = v - (retired + 1); break;
+	default: s->hpmoff[n] = v - s->evcount[s->hpmevent[n]]; break;
+	}
+}
+
+// counters: user ones at 0xC00 (read only) and machine ones at 0xB00,
+// each with its high half 0x80 above
+static int is_counter(uint32_t csr) {
+	return ((csr & 0xF60) == 0xC00) ||
+		(((csr & 0xF60) == 0xB00) && ((csr & 0x1F) != 1));
+}
+
+// the CLINT, for word loads and stores that faulted in io_rd()/io_wr()
+// each hart has its own time (counter_get()), so mtime reads and writes
+// that of the hart doing it
+// returns nonzero if addr is not one of its registers
+static int clint_rd(rvstate_t* s, uint32_t addr, uint64_t retired, uint32_t* val) {
+	rvsys_t* sys = s->sys;
+	uint32_t off = addr - sys->clint;
+	if ((sys->clint == 0) || (off >= CLINT_SIZE)) return -1;
+	if ((off - CLINT_MSIP) < (4 * sys->nharts)) {
+		rvstate_t* h = sys->hart[(off - CLINT_MSIP) / 4];
+		*val = (__atomic_load_n(&h->mip, __ATOMIC_RELAXED) & MIP_MSIP) ? 1 : 0;
+	} else if ((off - CLINT_MTIMECMP) < (8 * sys->nharts)) {
+		rvstate_t* h = sys->hart[(off - CLINT_MTIMECMP) / 8];
+		uint64_t cmp = __atomic_load_n(&h->mtimecmp, __ATOMIC_RELAXED);
+		*val = (off & 4) ? (cmp >> 32) : cmp;
+	} else if ((off & ~4) == CLINT_MTIME) {
+		uint64_t now = retired + s->timeoff;
+		*val = (off & 4) ? (now >> 32) : now;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+static int clint_wr(rvstate_t* s, uint32_t addr, uint32_t val, uint64_t retired) {
+	rvsys_t* sys = s->sys;
+	uint32_t off = addr - sys->clint;
+	if ((sys->clint == 0) || (off >= CLINT_SIZE)) return -1;
+	if ((off - CLINT_MSIP) < (4 * sys->nharts)) {
+		hart_raise(sys->hart[(off - CLINT_MSIP) / 4], MIP_MSIP, val & 1);
+	} else if ((off - CLINT_MTIMECMP) < (8 * sys->nharts)) {
+		rvstate_t* h = sys->hart[(off - CLINT_MTIMECMP) / 8];
+		uint64_t cmp = __atomic_load_n(&h->mtimecmp, __ATOMIC_RELAXED);
+		uint64_t nv;
+		do {
+			nv = (off & 4) ? ((cmp & 0xFFFFFFFFULL) | (((uint64_t) val) << 32)) :
+				((cmp & 0xFFFFFFFF00000000ULL) | val);
+		} while (!__atomic_compare_exchange_n(&h->mtimecmp, &cmp, nv, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		hart_kick(h, RVEV_TIMER);
+	} else if ((off & ~4) == CLINT_MTIME) {
+		// like counter_set(), the store itself isn't counted
+		uint64_t now = retired + s->timeoff;
+		now = (off & 4) ? ((now & 0xFFFFFFFFULL) | (((uint64_t) val) << 32)) :
+			((now & 0xFFFFFFFF00000000ULL) | val);
+		s->timeoff = now - (retired + 1);
+		hart_kick(s, RVEV_TIMER);
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static void put_csr(rvstate_t* s, uint32_t csr, uint32_t v, uint64_t retired) {
 	switch (csr) {
+	case CSR_MSTATUS:
+		s->mstatus = v & (MSTATUS_MIE | MSTATUS_MPIE);
+		irq_check(s);
+		break;
+	case CSR_MIE:
+		s->mie = v & (MIP_MSIP | MIP_MTIP | MIP_MEIP);
+		irq_check(s);
+		break;
+	case CSR_MIP:      break; // raised and lowered by the CLINT and rvsim_irq()
 	case CSR_MSCRATCH: s->mscratch = v; break;
-	case CSR_MTVEC:    s->mtvec = v & 0xFFFFFFFC; break;
+	case CSR_MTVEC:    s->mtvec = v & 0xFFFFFFFD; break; // direct or vectored
 	case CSR_MTVAL:    s->mtval = v; break;
-	case CSR_MEPC:     s->mepc = v; break;
+	case CSR_MEPC:     s->mepc = v & ~s->ialign; break;
 	case CSR_MCAUSE:   s->mcause = v; break;
+	default:
+		if (((csr & 0xF00) == 0xB00) && is_counter(csr)) {
+			uint32_t n = csr & 0x1F;
+			uint64_t c = counter_get(s, n, retired);
+			if (csr & 0x80) {
+				c = (c & 0xFFFFFFFF) | (((uint64_t) v) << 32);
+			} else {
+				c = (c & 0xFFFFFFFF00000000ULL) | v;
+			}
+			counter_set(s, n, c, retired);
+		} else if ((csr >= CSR_MHPMEVENT3) && (csr < (CSR_MHPMEVENT3 + RVHPMCOUNTERS - 3))) {
+			// the counter keeps its value, counting the new event from now
+			uint32_t n = csr - CSR_MHPMEVENT3 + 3;
+			uint64_t c = counter_get(s, n, retired);
+			s->hpmevent[n] = (v < RVSIM_EV_COUNT) ? v : RVSIM_EV_NONE;
+			counter_set(s, n, c, retired);
+		}
 	}
 }
-static uint32_t get_csr(rvstate_t* s, uint32_t csr) {
+static uint32_t get_csr(rvstate_t* s, uint32_t csr, uint64_t retired) {
 	switch (csr) {
-	case CSR_MISA:      return 0x40000100; // RV32I
+	case CSR_MISA:      return s->rvc ? 0x40001105 : 0x40001101; // RV32IMA(C)
 	case CSR_MVENDORID: return 0; // NONE
 	case CSR_MARCHID:   return 0; // NONE
 	case CSR_MIMPID:    return 0; // NONE
-	case CSR_MHARTID:   return 0; // Thread Zero
+	case CSR_MHARTID:   return s->hartid;
+	case CSR_MSTATUS:   return s->mstatus | MSTATUS_MPP; // always M
+	case CSR_MIE:       return s->mie;
+	case CSR_MIP:       return __atomic_load_n(&s->mip, __ATOMIC_RELAXED);
 	case CSR_MSCRATCH:  return s->mscratch;
 	case CSR_MTVEC:	    return s->mtvec;
 	case CSR_MTVAL:	    return s->mtval;
 	case CSR_MEPC:	    return s->mepc;
 	case CSR_MCAUSE:    return s->mcause;
 	default:
+		if (is_counter(csr)) {
+			uint64_t c = counter_get(s, csr & 0x1F, retired);
+			return (csr & 0x80) ? (c >> 32) : c;
+		}
+		if ((csr >= CSR_MHPMEVENT3) && (csr < (CSR_MHPMEVENT3 + RVHPMCOUNTERS - 3))) {
+			return s->hpmevent[csr - CSR_MHPMEVENT3 + 3];
+		}
 		return 0;
 	}
 }
 
-#define RdR1() rreg(s, get_r1(ins))
-#define RdR2() rreg(s, get_r2(ins))
-#define RdRd() rreg(s, get_rd(ins))
-#define WrRd(v) wreg(s, get_rd(ins), v)
+// allocate the decode cache page for ram offset off
+static rvpage_t* dcache_page(rvstate_t* s, uint32_t off) {
+	rvpage_t* pg;
+	unsigned slots = RVPAGESLOTS(s);
+	if ((pg = malloc(sizeof(rvpage_t) + (slots + 2) * sizeof(rvop_t))) == NULL) {
+		fprintf(stderr, "error: out of memory for decode cache\n");
+		abort();
+	}
+	uint32_t pc = s->membase + (off & ~RVPAGEMASK);
+	for (unsigned n = 0; n < slots; n++) {
+		pg->op[n].op = OP_DECODE;
+		pg->op[n].pc = pc + (n << s->slotshift);
+	}
+	pg->op[slots].op = OP_PAGE_END;
+	pg->op[slots].pc = pc + RVPAGESIZE;
+	pg->op[slots + 1].op = OP_PAGE_END;
+	pg->op[slots + 1].pc = pc + RVPAGESIZE + 2;
+	pg->jitted = 0;
+	pg->nojit = 0;
+	pg->checked = 0;
+	s->dcache[off >> RVPAGESHIFT] = pg;
+	__atomic_fetch_or(s->codemap + (off >> RVPAGESHIFT), 1ULL << s->hartid,
+		__ATOMIC_SEQ_CST);
+	return pg;
+}
 
-#if DO_TRACE_REG_WR
-#define trace_reg_wr(v) do {\
-	uint32_t r = get_rd(ins); \
-	if (r) { \
-	fprintf(stderr, "          (%s = %08x)\n", \
-		rvregname(get_rd(ins)), v); \
-	}} while (0)
-#else
-#define trace_reg_wr(v) do {} while (0)
-#endif
+// find the decode slot for pc
+// code outside of ram is decoded into tmp[0] on every execution
+static inline rvop_t* dcache_lookup(rvstate_t* s, uint32_t pc, rvop_t tmp[3]) {
+	uint32_t off = pc - s->membase;
+	if (off < s->memsize) {
+		rvpage_t* pg = s->dcache[off >> RVPAGESHIFT];
+		if (pg == NULL) pg = dcache_page(s, off);
+		return pg->op + ((off & RVPAGEMASK) >> s->slotshift);
+	}
+	tmp[0].op = OP_DECODE;
+	tmp[0].pc = pc;
+	tmp[1].op = OP_PAGE_END;
+	tmp[1].pc = pc + (1U << s->slotshift);
+	tmp[2].op = OP_PAGE_END;
+	tmp[2].pc = pc + 4;
+	return tmp;
+}
 
-#if DO_TRACE_MEM_WR
-#define trace_mem_wr(a, v) do {\
-	fprintf(stderr, "          ([%08x] = %08x)\n", a, v);\
-	} while (0)
-#else
-#define trace_mem_wr(a, v) do {} while (0)
-#endif
+// fetch the instruction at pc: the word there, or just the halfword if
+// it is a compressed one (and those are enabled)
+static int ifetch(rvstate_t* s, uint32_t pc, uint32_t* ins) {
+	uint32_t w;
+	if (rd32(s, pc & ~3, &w)) return -1;
+	if (s->rvc == NULL) {
+		*ins = w;
+		return 0;
+	}
+	if (pc & 2) w >>= 16;
+	if ((w & 3) != 3) {
+		*ins = w & 0xffff;
+		return 0;
+	}
+	if (pc & 2) {
+		uint32_t hi;
+		if (rd32(s, pc + 2, &hi)) return -1;
+		w |= hi << 16;
+	}
+	*ins = w;
+	return 0;
+}
 
-int rvsim_exec(rvstate_t* s, uint32_t _pc) {
-	uint32_t pc = _pc;
-	uint32_t next = _pc;
-	uint32_t ins;
-	uint64_t ccount = 0;
-	for (;;) {
-		ccount++;
-		pc = next;
-		ins = rd32(s->memory, pc);
-#if DO_TRACE_INS
-		char dis[128];
-		rvdis(pc, ins, dis);
-		fprintf(stderr, "%08x: %08x %s\n", pc, ins, dis);
-#endif
-		next = pc + 4;
-		switch (get_oc(ins)) {
-		case OC_LOAD: {
-			uint32_t a = RdR1() + get_ii(ins);
-			uint32_t v;
-			switch (get_fn3(ins)) {
-			case F3_LW:
-				if (a & 3) goto trap_load_align;
-				v = rd32(s->memory, a); break;
-			case F3_LHU:
-				if (a & 1) goto trap_load_align;
-				v = rd16(s->memory, a); break;
-			case F3_LBU:
-				v = rd8(s->memory, a); break;
-			case F3_LH:
-				if (a & 1) goto trap_load_align;
-				v = rd16(s->memory, a);
-				if (v & 0x8000) { v |= 0xFFFF0000; } break;
-			case F3_LB:
-				v = rd8(s->memory, a);
-				if (v & 0x80) { v |= 0xFFFFFF00; } break;
-			default:
-				goto inval;
-			}
-			WrRd(v);
-			trace_reg_wr(v);
-			break;
-		trap_load_align:
-			s->mcause = EC_L_ALIGN;
-			s->mtval = a;
-			goto trap_common;
+// decode the instruction at op->pc into op
+static void decode(rvstate_t* s, rvop_t* op) {
+	uint32_t pc = op->pc;
+	uint32_t raw, ins;
+	uint32_t oc = OP_ILLEGAL;
+	uint32_t imm = 0;
+	op->len = 4;
+	if (ifetch(s, pc, &raw)) {
+		// past the end of ram
+		op->op = OP_IFAULT;
+		op->link = NULL;
+		return;
+	}
+	ins = raw;
+	if ((raw & 3) != 3) {
+		if (s->rvc) {
+			op->len = 2;
+			ins = s->rvc[raw];
 		}
-		case OC_CUSTOM_0:
-			switch (get_fn3(ins)) {
-			case 0b000: // _exiti
-				fprintf(stderr, "CCOUNT %lu\n", ccount);
-				return get_ii(ins);
-			case 0b100: // _exit
-				fprintf(stderr, "CCOUNT %lu\n", ccount);
-				return RdR1();
-			case 0b001: // _iocall
-				s->x[10] = iocall(s->ctx, get_ii(ins), s->x + 10);
-				break;
-			default:
-				goto inval;
-			}
+	} else if (((pc & RVPAGEMASK) == (RVPAGESIZE - 2)) &&
+		(((pc + 2) - s->membase) < s->memsize)) {
+		// the rest of it is in the next page, writes there must find it
+		uint32_t pn = ((pc + 2) - s->membase) >> RVPAGESHIFT;
+		__atomic_fetch_or(s->codemap + pn, 1ULL << s->hartid, __ATOMIC_SEQ_CST);
+	}
+	switch (get_oc(ins)) {
+	case OC_LOAD:
+		switch (get_fn3(ins)) {
+		case F3_LW: oc = OP_LW; break;
+		case F3_LHU: oc = OP_LHU; break;
+		case F3_LBU: oc = OP_LBU; break;
+		case F3_LH: oc = OP_LH; break;
+		case F3_LB: oc = OP_LB; break;
+		}
+		imm = get_ii(ins);
+		break;
+	case OC_CUSTOM_0:
+		switch (get_fn3(ins)) {
+		case 0b000: oc = OP_EXITI; break; // _exiti
+		case 0b100: oc = OP_EXIT; break; // _exit
+		case 0b001: oc = OP_IOCALL; break; // _iocall
+		}
+		imm = get_ii(ins);
+		break;
+	case OC_MISC_MEM:
+		switch (get_fn3(ins)) {
+		case F3_FENCE: oc = OP_FENCE; break;
+		case F3_FENCE_I: oc = OP_FENCE_I; break;
+		}
+		break;
+	case OC_AMO:
+		if (get_fn3(ins) != 0b010) break;
+		switch (get_fn5(ins)) {
+		case F5_LR:
+			if (get_r2(ins) == 0) oc = OP_LR;
 			break;
-		case OC_MISC_MEM:
-			switch (get_fn3(ins)) {
-			case F3_FENCE:
-			case F3_FENCE_I:
-				break;
-			default:
-				goto inval;
-			}
+		case F5_SC: oc = OP_SC; break;
+		case F5_AMOSWAP: oc = OP_AMOSWAP; break;
+		case F5_AMOADD: oc = OP_AMOADD; break;
+		case F5_AMOXOR: oc = OP_AMOXOR; break;
+		case F5_AMOAND: oc = OP_AMOAND; break;
+		case F5_AMOOR: oc = OP_AMOOR; break;
+		case F5_AMOMIN: oc = OP_AMOMIN; break;
+		case F5_AMOMAX: oc = OP_AMOMAX; break;
+		case F5_AMOMINU: oc = OP_AMOMINU; break;
+		case F5_AMOMAXU: oc = OP_AMOMAXU; break;
+		}
+		break;
+	case OC_OP_IMM:
+		imm = get_ii(ins);
+		switch (get_fn3(ins)) {
+		case F3_ADDI: oc = OP_ADDI; break;
+		case F3_SLLI:
+			if (imm & 0b111111100000) break;
+			oc = OP_SLLI; break;
+		case F3_SLTI: oc = OP_SLTI; break;
+		case F3_SLTIU: oc = OP_SLTIU; break;
+		case F3_XORI: oc = OP_XORI; break;
+		case F3_SRLI:
+			if (imm & 0b101111100000) break;
+			oc = (imm & 0b010000000000) ? OP_SRAI : OP_SRLI;
+			imm &= 31;
 			break;
-		case OC_OP_IMM: {
-			uint32_t a = RdR1();
-			uint32_t b = get_ii(ins);
-			uint32_t n = 0xe1e1e1e1;
+		case F3_ORI: oc = OP_ORI; break;
+		case F3_ANDI: oc = OP_ANDI; break;
+		}
+		break;
+	case OC_AUIPC:
+		oc = OP_LI;
+		imm = pc + get_iu(ins);
+		break;
+	case OC_STORE:
+		switch (get_fn3(ins)) {
+		case F3_SW: oc = OP_SW; break;
+		case F3_SH: oc = OP_SH; break;
+		case F3_SB: oc = OP_SB; break;
+		}
+		imm = get_is(ins);
+		break;
+	case OC_OP:
+		switch (get_fn7(ins)) {
+		case 0b0000000:
 			switch (get_fn3(ins)) {
-			case F3_ADDI: n = a + b; break;
-			case F3_SLLI:
-				if (b & 0b111111100000) goto inval;
-				n = a << b; break;
-			case F3_SLTI: n = ((int32_t)a) < ((int32_t)b); break;
-			case F3_SLTIU: n = a < b; break;
-			case F3_XORI: n = a ^ b; break;
-			case F3_SRLI:
-				if (b & 0b101111100000) goto inval;
-				if (b & 0b010000000000) {
-					n = ((int32_t)a) >> b;
-				} else {
-					n = a >> b;
-				}
-				break;
-			case F3_ORI: n = a | b; break;
-			case F3_ANDI: n = a & b; break;
+			case F3_ADD: oc = OP_ADD; break;
+			case F3_SLL: oc = OP_SLL; break;
+			case F3_SLT: oc = OP_SLT; break;
+			case F3_SLTU: oc = OP_SLTU; break;
+			case F3_XOR: oc = OP_XOR; break;
+			case F3_SRL: oc = OP_SRL; break;
+			case F3_OR: oc = OP_OR; break;
+			case F3_AND: oc = OP_AND; break;
 			}
-			WrRd(n);
-			trace_reg_wr(n);
 			break;
-			}
-		case OC_AUIPC: {
-			uint32_t v = pc + get_iu(ins);
-			WrRd(v);
-			trace_reg_wr(v);
-			break;
-			}
-		case OC_STORE: {
-			uint32_t a = RdR1() + get_is(ins);
-			uint32_t v = RdR2();
+		case 0b0000001:
 			switch (get_fn3(ins)) {
-			case F3_SW:
-				if (a & 3) goto trap_store_align;
-				wr32(s->memory, a, v); break;
-			case F3_SH:
-				if (a & 1) goto trap_store_align;
-				wr16(s->memory, a, v); break;
-			case F3_SB:
-				wr8(s->memory, a, v); break;
-			default:
-				goto inval;
-			}
-			trace_mem_wr(a, v);
-			break;
-		trap_store_align:
-			s->mcause = EC_S_ALIGN;
-			s->mtval = a;
-			goto trap_common;
-			}
-		case OC_OP: {
-			uint32_t a = RdR1();
-			uint32_t b = RdR2();
-			uint32_t n = get_fn3(ins);
-			switch (ins >> 25) {
-			case 0b0000000:
-				switch (n) {
-				case F3_ADD: n = a + b; break;
-				case F3_SLL: n = a << (b & 31); break;
-				case F3_SLT: n = ((int32_t)a) < ((int32_t)b); break;
-				case F3_SLTU: n = a < b; break;
-				case F3_XOR: n = a ^ b; break;
-				case F3_SRL: n = a >> (b & 31); break;
-				case F3_OR: n = a | b; break;
-				case F3_AND: n = a & b; break;
-				}
-				break;
-			case 0b0000001:
-				switch (n) {
-				case F3_MUL: n = a * b; break;
-				case F3_MULH: n = ((int64_t)(int32_t)a * (int64_t)(int32_t)b) >> 32; break;
-				case F3_MULHSU: n = ((int64_t)(int32_t)a * (uint64_t)b) >> 32; break;
-				case F3_MULHU: n = ((uint64_t)a * (uint64_t)b) >> 32; break;
-				case F3_DIV:
-					if (b == 0) { n = 0xffffffff; }
-					else if ((a == 0x80000000) && (b == 0xffffffff)) { n = a; }
-					else { n = ((int32_t)a / (int32_t)b); }
-					break;
-				case F3_DIVU:
-					if (b == 0) { n = 0xffffffff; }
-					else { n = a / b; }
-					break;
-				case F3_REM:
-					if (b == 0) { n = a; }
-					else if ((a == 0x80000000) && (b == 0xffffffff)) { n = 0; }
-					else { n = ((int32_t)a % (int32_t)b); }
-					break;
-				case F3_REMU:
-					if (b == 0) { n = a; }
-					else { n = a % b; }
-					break;
-				}
-				break;
-			case 0b0100000:
-				switch (n) {
-				case F3_SUB: n = a - b; break;
-				case F3_SRA: n = ((int32_t)a) >> (b & 31); break;
-				default: goto inval;
-				}
-				break;
-			}
-			WrRd(n);
-			trace_reg_wr(n);
-			break;
+			case F3_MUL: oc = OP_MUL; break;
+			case F3_MULH: oc = OP_MULH; break;
+			case F3_MULHSU: oc = OP_MULHSU; break;
+			case F3_MULHU: oc = OP_MULHU; break;
+			case F3_DIV: oc = OP_DIV; break;
+			case F3_DIVU: oc = OP_DIVU; break;
+			case F3_REM: oc = OP_REM; break;
+			case F3_REMU: oc = OP_REMU; break;
 			}
-		case OC_LUI: {
-			uint32_t v = get_iu(ins);
-			WrRd(v);
-			trace_reg_wr(v);
 			break;
-			}
-		case OC_BRANCH: {
-			uint32_t a = RdR1();
-			uint32_t b = RdR2();
-			int32_t p;
+		case 0b0100000:
 			switch (get_fn3(ins)) {
-			case F3_BEQ: p = (a == b); break;
-			case F3_BNE: p = (a != b); break;
-			case F3_BLT: p = (((int32_t)a) < ((int32_t)b)); break;
-			case F3_BGE: p = (((int32_t)a) >= ((int32_t)b)); break;
-			case F3_BLTU: p = (a < b); break;
-			case F3_BGEU: p = (a >= b); break;
-			default:
-				goto inval;
-			}
-			if (p) {
-				next = pc + get_ib(ins);
-				if (next & 3) goto trap_pc_align;
-			}
-			break;
+			case F3_SUB: oc = OP_SUB; break;
+			case F3_SRA: oc = OP_SRA; break;
 			}
-		case OC_JALR: {
-			uint32_t a = (RdR1() + get_ii(ins)) & 0xFFFFFFFE;
-			if (get_fn3(ins) != 0) goto inval;
-			WrRd(next);
-			trace_reg_wr(next);
-			next = a;
-			if (next & 3) goto trap_pc_align;
 			break;
+		}
+		break;
+	case OC_LUI:
+		oc = OP_LI;
+		imm = get_iu(ins);
+		break;
+	case OC_BRANCH:
+		switch (get_fn3(ins)) {
+		case F3_BEQ: oc = OP_BEQ; break;
+		case F3_BNE: oc = OP_BNE; break;
+		case F3_BLT: oc = OP_BLT; break;
+		case F3_BGE: oc = OP_BGE; break;
+		case F3_BLTU: oc = OP_BLTU; break;
+		case F3_BGEU: oc = OP_BGEU; break;
+		}
+		imm = pc + get_ib(ins);
+		break;
+	case OC_JALR:
+		if (get_fn3(ins) == 0) oc = OP_JALR;
+		imm = get_ii(ins);
+		break;
+	case OC_JAL:
+		oc = OP_JAL;
+		imm = pc + get_ij(ins);
+		break;
+	case OC_SYSTEM:
+		switch (get_fn3(ins)) {
+		case 0b000:
+			switch (ins >> 7) {
+			case 0b0000000000000000000000000: oc = OP_ECALL; break;
+			case 0b0000000000010000000000000: oc = OP_EBREAK; break;
+			case 0b0011000000100000000000000: oc = OP_MRET; break;
+			case 0b0001000001010000000000000: oc = OP_WFI; break;
 			}
-		case OC_JAL:
-			WrRd(next);
-			trace_reg_wr(next);
-			next = pc + get_ij(ins);
-			if (next & 3) goto trap_pc_align;
 			break;
-		case OC_SYSTEM: {
-			uint32_t fn = get_fn3(ins);
-			if (fn == 0) {
-				switch(ins >> 7) {
-				case 0b0000000000000000000000000: // ecall
-					s->mcause = EC_ECALL_FROM_M;
-					s->mtval = 0;
-					goto trap_common;
-				case 0b0000000000010000000000000: // ebreak
-					s->mcause = EC_BREAKPOINT;
-					s->mtval = 0;
-					goto trap_common;
-				case 0b0011000000100000000000000: // mret
-					next = s->mepc;
-					break;
-				default:
-					goto inval;
-				}
-				break;
-			}
-			uint32_t c = get_iC(ins);
-			uint32_t nv = (fn & 4) ? get_ic(ins) : RdR1();
-			uint32_t ov = 0;
-			switch (fn & 3) {
-			case F3_CSRRW:
-				// only reads of Rd != x0
-				if (get_rd(ins)) ov = get_csr(s, c);
-				put_csr(s, c, nv);
-				break;
-			case F3_CSRRS:
-				// only writes if nv != 0
-				ov = get_csr(s, c);
-				if (nv) put_csr(s, c, ov | nv);
-				WrRd(ov);
-				break;
-			case F3_CSRRC:
-				// only writes if nv != 0
-				ov = get_csr(s, c);
-				if (nv) put_csr(s, c, ov & (~nv));
-				break;
+		case 0b001: oc = OP_CSRRW; break;
+		case 0b010: oc = OP_CSRRS; break;
+		case 0b011: oc = OP_CSRRC; break;
+		case 0b101: oc = OP_CSRRWI; break;
+		case 0b110: oc = OP_CSRRSI; break;
+		case 0b111: oc = OP_CSRRCI; break;
+		}
+		imm = get_iC(ins);
+		break;
+	}
+	// register writes with no side effects to x0 are nops
+	uint32_t rd = get_rd(ins);
+	if ((rd == 0) && (oc >= OP_LI) && (oc <= OP_REMU)) {
+		oc = OP_NOP;
+	}
+	// calls and returns, for the shadow call stack
+	if (s->callstack) {
+		if (((oc == OP_JAL) || (oc == OP_JALR)) && (rd == 1)) {
+			oc = (oc == OP_JAL) ? OP_CALL : OP_CALLR;
+		} else if ((oc == OP_JALR) && (rd == 0) && (get_r1(ins) == 1) && (imm == 0)) {
+			oc = OP_RET;
+		}
+	}
+	op->rd = rd ? rd : 32;
+	op->r1 = get_r1(ins);
+	op->r2 = get_r2(ins);
+	op->imm = (oc == OP_ILLEGAL) ? raw : imm;
+	op->link = NULL;
+	op->op = oc;
+}
+
+// fuse the instruction decoded into op with the next one, if they are
+// a pair compilers emit for a constant, far call, pc relative load, zero
+// extension or compare and branch, to run as one
+// only the slot of the first changes: jumps to the second, and traps
+// (or io) it takes, find it decoded on its own, and the engines that
+// go an instruction at a time run the first and move on to it
+static void fuse(rvstate_t* s, rvop_t* op) {
+	rvsys_t* sys = s->sys;
+	uint32_t pc = op->pc + 4;
+	uint32_t ins;
+	// both 32 bit, in one page of ram (so code writes reset both)
+	if ((op->len != 4) || ((op->pc & RVPAGEMASK) > (RVPAGESIZE - 8)) ||
+		((pc - s->membase) >= s->memsize) ||
+		ifetch(s, pc, &ins) || ((ins & 3) != 3)) {
+		return;
+	}
+	for (unsigned n = 0; n < sys->nbrk; n++) {
+		if (sys->brk[n] == pc) return;
+	}
+	uint32_t rd = get_rd(ins);
+	uint32_t oc = op->op;
+	int32_t imm2;
+	switch (op->op) {
+	case OP_LI:
+		if (get_r1(ins) != op->rd) return;
+		imm2 = get_ii(ins);
+		if ((get_oc(ins) == OC_OP_IMM) && (get_fn3(ins) == F3_ADDI) &&
+			(rd == op->rd)) {
+			// lui or auipc, addi: a constant
+			oc = OP_LI_ADDI;
+		} else if ((get_oc(ins) == OC_JALR) && (get_fn3(ins) == 0)) {
+			// auipc, jalr: a far call (or tail call, or jump)
+			if (((op->imm + imm2) & ~1 & s->ialign) ||
+				(s->callstack && ((rd == 1) || ((rd == 0) && (imm2 == 0) && (op->rd == 1))))) {
+				return;
 			}
-			WrRd(ov);
-			break;
+			oc = OP_LI_JALR;
+		} else if ((get_oc(ins) == OC_LOAD) && (get_fn3(ins) == F3_LW)) {
+			// auipc, lw: a pc relative load (or lui, lw: io)
+			if ((op->imm + imm2) & 3) return;
+			oc = OP_LI_LW;
+		}
+		break;
+	case OP_SLLI:
+		// slli, srli by the same amount: a zero extension
+		imm2 = get_ii(ins);
+		if ((get_oc(ins) == OC_OP_IMM) && (get_fn3(ins) == F3_SRLI) &&
+			(imm2 == op->imm) && (rd == op->rd) && (get_r1(ins) == op->rd)) {
+			oc = OP_SLLI_SRLI;
+		}
+		break;
+	case OP_SLT:
+	case OP_SLTU:
+	case OP_SLTI:
+	case OP_SLTIU:
+		// a compare, then beqz or bnez on its result
+		imm2 = get_ib(ins);
+		if ((get_oc(ins) != OC_BRANCH) || (get_r1(ins) != op->rd) || (get_r2(ins) != 0) ||
+			((pc + imm2) & s->ialign)) {
+			return;
+		}
+		if (get_fn3(ins) == F3_BEQ) {
+			rd = 0;
+		} else if (get_fn3(ins) == F3_BNE) {
+			rd = 1;
+		} else {
+			return;
+		}
+		oc = (op->op == OP_SLT) ? OP_SLT_BZ : (op->op == OP_SLTU) ? OP_SLTU_BZ :
+			(op->op == OP_SLTI) ? OP_SLTI_BZ : OP_SLTIU_BZ;
+		op->rd2 = rd;
+		op->imm2 = imm2;
+		op->op = oc;
+		return;
+	}
+	if (oc == op->op) return;
+	op->rd2 = rd ? rd : 32;
+	op->imm2 = imm2;
+	op->op = oc;
+}
+
+// decode the instruction at op->pc into op, with a breakpoint over it
+// if there is one there
+void rvsim_decode(rvstate_t* s, rvop_t* op) {
+	rvsys_t* sys = s->sys;
+	decode(s, op);
+	for (unsigned n = 0; n < sys->nbrk; n++) {
+		if (sys->brk[n] == op->pc) op->op = OP_BREAK;
+	}
+	if (s->fuse) fuse(s, op);
+}
+
+// drop the decodes of the instruction at pc (with the harts stopped)
+static void debug_inval(rvsys_t* sys, uint32_t pc) {
+	uint32_t off = pc - sys->membase;
+	if (off >= sys->memsize) return;
+	for (unsigned n = 0; n < sys->nharts; n++) {
+		dcache_word_inval(sys->hart[n], off);
+	}
+}
+
+int rvsim_breakpoint(rvstate_t* s, uint32_t pc, int on) {
+	rvsys_t* sys = s->sys;
+	unsigned n;
+	for (n = 0; n < sys->nbrk; n++) {
+		if (sys->brk[n] == pc) break;
+	}
+	if (on) {
+		if (n < sys->nbrk) return 0;
+		if (n == RVMAXBREAK) return -1;
+		sys->brk[sys->nbrk++] = pc;
+	} else {
+		if (n == sys->nbrk) return -1;
+		sys->brk[n] = sys->brk[--sys->nbrk];
+	}
+	debug_inval(sys, pc);
+	return 0;
+}
+
+int rvsim_watchpoint(rvstate_t* s, uint32_t addr, uint32_t len, int on) {
+	rvsys_t* sys = s->sys;
+	uint32_t off = addr - sys->membase;
+	if ((len == 0) || (off >= sys->memsize) || (len > (sys->memsize - off))) {
+		return -1;
+	}
+	unsigned n;
+	for (n = 0; n < sys->nwatch; n++) {
+		if ((sys->watch[n].off == off) && (sys->watch[n].len == len)) break;
+	}
+	if (!on) {
+		if (n == sys->nwatch) return -1;
+		sys->watch[n] = sys->watch[--sys->nwatch];
+		return 0;
+	}
+	if (n < sys->nwatch) return 0;
+	if (n == RVMAXWATCH) return -1;
+	sys->watch[n].off = off;
+	sys->watch[n].len = len;
+	sys->nwatch++;
+	// send the stores down rvsim_code_write() by marking the pages as
+	// code of every hart (the marks stay, like those of real code)
+	uint64_t harts = (1ULL << sys->nharts) - 1;
+	for (uint32_t pn = off >> RVPAGESHIFT; pn <= ((off + len - 1) >> RVPAGESHIFT); pn++) {
+		__atomic_fetch_or(sys->codemap + pn, harts, __ATOMIC_SEQ_CST);
+	}
+	return 0;
+}
+
+unsigned rvsim_stopped(rvstate_t* s, uint32_t* addr) {
+	unsigned why = s->dbgstop;
+	if (addr) *addr = s->dbgaddr;
+	s->dbgstop = 0;
+	return why;
+}
+
+static void call_push(rvstate_t* s, uint32_t ra) {
+	if (s->calldepth < RVCALLDEPTH) s->callstack[s->calldepth] = ra;
+	s->calldepth++;
+}
+
+// returning to ra unwinds to the call it returns from, if there is one
+// (skipping calls that never returned: longjmp and the like)
+static void call_pop(rvstate_t* s, uint32_t ra) {
+	if (s->calldepth > RVCALLDEPTH) {
+		s->calldepth--;
+		return;
+	}
+	for (unsigned n = s->calldepth; n > 0; n--) {
+		if (s->callstack[n - 1] == ra) {
+			s->calldepth = n - 1;
+			return;
+		}
+	}
+}
+
+#define RdR1() (s->x[op->r1])
+#define RdR2() (s->x[op->r2])
+#define RdRd() (s->x[op->rd])
+#define WrRd(v) (s->x[op->rd] = (v))
+
+// RECORD_*() are the hooks of the trace recorder (nothing outside the
+// hooks engine)
+#define trace_reg_wr(v) do {\
+	if (DO_TRACE_REG_WR && (op->rd != 32)) { \
+	fprintf(stderr, "          (%s = %08x)\n", \
+		rvregname(op->rd), v); \
+	} RECORD_REG_WR(v); } while (0)
+
+#define trace_mem_wr(a, v) do {\
+	if (DO_TRACE_MEM_WR) { \
+	fprintf(stderr, "          ([%08x] = %08x)\n", a, v); \
+	} RECORD_MEM_WR(a, v); } while (0)
+
+// the instruction at pc, for traces: the word there, or the halfword
+// of a compressed one (0 outside of ram)
+static uint32_t fetch_ins(rvstate_t* s, uint32_t pc) {
+	uint32_t off = pc - s->membase;
+	if ((off >= s->memsize) || ((s->memsize - off) < 2)) return 0;
+	uint32_t ins = *((uint16_t*) (s->memory + off));
+	if (((ins & 3) != 3) && s->rvc) return ins;
+	if ((s->memsize - off) < 4) return 0;
+	return ins | (*((uint16_t*) (s->memory + off + 2)) << 16);
+}
+
+// coverage: the hart entered the block at pc, from the last one
+static inline void cover_edge(rvstate_t* s, uint32_t pc) {
+	uint32_t h = (pc * 0x9e3779b1) >> (32 - RVSIM_COVERBITS);
+	s->cover[h ^ s->coverprev]++;
+	s->coverprev = h >> 1;
+}
+
+void rvsim_coverage(rvstate_t* s, uint8_t* map) {
+	rvsys_t* sys = s->sys;
+	for (unsigned n = 0; n < sys->nharts; n++) {
+		sys->hart[n]->cover = map;
+		sys->hart[n]->coverprev = 0;
+	}
+}
+
+#define ENGINE_NAME rvsim_exec_switch
+#define ENGINE_THREADED 0
+#define ENGINE_JIT 0
+#define ENGINE_HOOKS 0
+#define ENGINE_RVC 0
+#define ENGINE_DEBUG 0
+#include "rvengine.h"
+#undef ENGINE_NAME
+#undef ENGINE_THREADED
+#undef ENGINE_JIT
+#undef ENGINE_HOOKS
+#undef ENGINE_RVC
+#undef ENGINE_DEBUG
+
+#define ENGINE_NAME rvsim_exec_threaded
+#define ENGINE_THREADED 1
+#define ENGINE_JIT 0
+#define ENGINE_HOOKS 0
+#define ENGINE_RVC 0
+#define ENGINE_DEBUG 0
+#include "rvengine.h"
+#undef ENGINE_NAME
+#undef ENGINE_THREADED
+#undef ENGINE_JIT
+#undef ENGINE_HOOKS
+#undef ENGINE_RVC
+#undef ENGINE_DEBUG
+
+#define ENGINE_NAME rvsim_exec_jit
+#define ENGINE_THREADED 1
+#define ENGINE_JIT 1
+#define ENGINE_HOOKS 0
+#define ENGINE_RVC 0
+#define ENGINE_DEBUG 0
+#include "rvengine.h"
+#undef ENGINE_NAME
+#undef ENGINE_THREADED
+#undef ENGINE_JIT
+#undef ENGINE_HOOKS
+#undef ENGINE_RVC
+#undef ENGINE_DEBUG
+
+#define ENGINE_NAME rvsim_exec_switch_rvc
+#define ENGINE_THREADED 0
+#define ENGINE_JIT 0
+#define ENGINE_HOOKS 0
+#define ENGINE_RVC 1
+#define ENGINE_DEBUG 0
+#include "rvengine.h"
+#undef ENGINE_NAME
+#undef ENGINE_THREADED
+#undef ENGINE_JIT
+#undef ENGINE_HOOKS
+#undef ENGINE_RVC
+#undef ENGINE_DEBUG
+
+#define ENGINE_NAME rvsim_exec_threaded_rvc
+#define ENGINE_THREADED 1
+#define ENGINE_JIT 0
+#define ENGINE_HOOKS 0
+#define ENGINE_RVC 1
+#define ENGINE_DEBUG 0
+#include "rvengine.h"
+#undef ENGINE_NAME
+#undef ENGINE_THREADED
+#undef ENGINE_JIT
+#undef ENGINE_HOOKS
+#undef ENGINE_RVC
+#undef ENGINE_DEBUG
+
+#define ENGINE_NAME rvsim_exec_jit_rvc
+#define ENGINE_THREADED 1
+#define ENGINE_JIT 1
+#define ENGINE_HOOKS 0
+#define ENGINE_RVC 1
+#define ENGINE_DEBUG 0
+#include "rvengine.h"
+#undef ENGINE_NAME
+#undef ENGINE_THREADED
+#undef ENGINE_JIT
+#undef ENGINE_HOOKS
+#undef ENGINE_RVC
+#undef ENGINE_DEBUG
+
+// the reference engine, once for each combination of the options that
+// print something for every instruction, so that none of them costs
+// anything when it is off
+#define ENGINE_DEBUG 0
+#include "rvhooks.h"
+#undef ENGINE_DEBUG
+#define ENGINE_DEBUG 1
+#include "rvhooks.h"
+#undef ENGINE_DEBUG
+#define ENGINE_DEBUG 2
+#include "rvhooks.h"
+#undef ENGINE_DEBUG
+#define ENGINE_DEBUG 3
+#include "rvhooks.h"
+#undef ENGINE_DEBUG
+#define ENGINE_DEBUG 4
+#include "rvhooks.h"
+#undef ENGINE_DEBUG
+#define ENGINE_DEBUG 5
+#include "rvhooks.h"
+#undef ENGINE_DEBUG
+#define ENGINE_DEBUG 6
+#include "rvhooks.h"
+#undef ENGINE_DEBUG
+#define ENGINE_DEBUG 7
+#include "rvhooks.h"
+#undef ENGINE_DEBUG
+
+#define HOOKS(n) { rvsim_exec_hooks_##n, rvsim_exec_hooks_rvc_##n }
+static int (* const hooks_engine[RVSIM_DEBUG_ENGINE + 1][2])(rvstate_t* s, uint64_t limit) = {
+	HOOKS(0), HOOKS(1), HOOKS(2), HOOKS(3), HOOKS(4), HOOKS(5), HOOKS(6), HOOKS(7),
+};
+#undef HOOKS
+
+static int hart_exec(rvstate_t* s, uint64_t limit) {
+	if (s->trace || s->timing || s->step || s->cover || s->debug) {
+		int r = hooks_engine[s->debug & RVSIM_DEBUG_ENGINE][s->rvc != NULL](s, limit);
+		if (s->trace) rvtrace_sync(s);
+		return r;
+	}
+	switch (s->engine) {
+	case RVSIM_ENGINE_THREADED:
+		return s->rvc ? rvsim_exec_threaded_rvc(s, limit) :
+			rvsim_exec_threaded(s, limit);
+	case RVSIM_ENGINE_JIT: {
+		rvjit_bind(s);
+		int r = s->rvc ? rvsim_exec_jit_rvc(s, limit) :
+			rvsim_exec_jit(s, limit);
+		rvjit_bind(NULL);
+		return r;
+	}
+	default:
+		return s->rvc ? rvsim_exec_switch_rvc(s, limit) :
+			rvsim_exec_switch(s, limit);
+	}
+}
+
+// raise mip.MTIP once time reaches mtimecmp, lower it while it hasn't
+// returns limit, cut short to stop when the timer fires
+static uint64_t timer_limit(rvstate_t* s, uint64_t limit) {
+	uint64_t now = s->ccount + s->timeoff;
+	uint64_t cmp = __atomic_load_n(&s->mtimecmp, __ATOMIC_RELAXED);
+	uint32_t mtip = __atomic_load_n(&s->mip, __ATOMIC_RELAXED) & MIP_MTIP;
+	if (now >= cmp) {
+		if (!mtip) hart_raise(s, MIP_MTIP, 1);
+		return limit;
+	}
+	if (mtip) hart_raise(s, MIP_MTIP, 0);
+	return ((cmp - now) < limit) ? (cmp - now) : limit;
+}
+
+// the hart executed wfi: move time on to its timer interrupt, if that's
+// the next one it can take, otherwise stop until one is raised
+// returns RVRUN_BUDGET to carry on, or RVRUN_WAIT
+static int hart_wfi(rvstate_t* s) {
+	if (__atomic_load_n(&s->mip, __ATOMIC_RELAXED) & s->mie) return RVRUN_BUDGET;
+	uint64_t cmp = __atomic_load_n(&s->mtimecmp, __ATOMIC_RELAXED);
+	if ((s->mie & MIP_MTIP) && (cmp != UINT64_MAX)) {
+		uint64_t now = s->ccount + s->timeoff;
+		if (cmp > now) s->timeoff += cmp - now;
+		return RVRUN_BUDGET;
+	}
+	// hart_kick() sets events, then looks at wfi: either it sees
+	// wfi set or the check here sees what it raised
+	rvsys_t* sys = s->sys;
+	int r = RVRUN_WAIT;
+	pthread_mutex_lock(&sys->lock);
+	__atomic_store_n(&s->wfi, 1, __ATOMIC_SEQ_CST);
+	if ((__atomic_load_n(&s->mip, __ATOMIC_SEQ_CST) & s->mie) ||
+		(__atomic_load_n(&s->events, __ATOMIC_SEQ_CST) & RVEV_TIMER)) {
+		s->wfi = 0;
+		r = RVRUN_BUDGET;
+	}
+	pthread_mutex_unlock(&sys->lock);
+	return r;
+}
+
+// run the engine, stopping for the timer and carrying on after wfi
+// returns RVRUN_*, never RVRUN_WFI
+static int hart_run(rvstate_t* s, uint64_t limit) {
+	s->dbgstop = 0;
+	for (;;) {
+		uint64_t count = s->ccount;
+		int r = hart_exec(s, timer_limit(s, limit));
+		if (r == RVRUN_WFI) r = hart_wfi(s);
+		if (r != RVRUN_BUDGET) return r;
+		if (s->dbgstop) return RVRUN_DEBUG;
+		count = s->ccount - count;
+		if (count >= limit) return RVRUN_BUDGET;
+		limit -= count;
+	}
+}
+
+static int hart_ready(rvstate_t* s) {
+	return s->started && !__atomic_load_n(&s->iowait, __ATOMIC_ACQUIRE) &&
+		!__atomic_load_n(&s->wfi, __ATOMIC_ACQUIRE);
+}
+
+int rvsim_run(rvstate_t* s, uint64_t max) {
+	rvsys_t* sys = s->sys;
+	if (sys->nharts == 1) {
+		if (!sys->stop && hart_ready(s) &&
+			(hart_run(s, max) == RVRUN_DEBUG)) return RVSIM_STOPPED;
+	} else {
+		// started harts take turns, carrying on from the last call
+		// (which may have run out of instructions part way round)
+		while (!sys->stop && max) {
+			int idle = 1;
+			for (unsigned i = 0; i < sys->nharts; i++) {
+				rvstate_t* h = sys->hart[sys->turn];
+				sys->turn = (sys->turn + 1) % sys->nharts;
+				if (!hart_ready(h)) continue;
+				uint64_t count = h->ccount;
+				int r = hart_run(h, (max < RVRUN_QUANTUM) ? max : RVRUN_QUANTUM);
+				if (r == RVRUN_DEBUG) return RVSIM_STOPPED;
+				count = h->ccount - count;
+				max = (count < max) ? max - count : 0;
+				idle = 0;
+				if (sys->stop || (max == 0)) break;
 			}
-trap_pc_align:
-			s->mcause = EC_I_ALIGN;
-			s->mtval = next;
-			goto trap_common;
-		default:
-		inval:
-			s->mcause = EC_I_ILLEGAL;
-			s->mtval = ins;
-#if DO_ABORT_INVAL
-			fprintf(stderr,"          (TRAP ILLEGAL %08x)\n", ins);
-			return -1;
-#endif
-trap_common:
-			s->mepc = pc;
-			next = s->mtvec & 0xFFFFFFFD;
-#if DO_TRACE_TRAPS
-			fprintf(stderr, "          (TRAP C=%08x V=%08x)\n", s->mcause, s->mtval);
-#endif
-			break;
+			if (idle) break;
 		}
 	}
+	if (sys->stop) return RVSIM_EXITED;
+	for (unsigned n = 0; n < sys->nharts; n++) {
+		if (hart_ready(sys->hart[n])) return RVSIM_RUNNING;
+	}
+	return RVSIM_WAITING;
+}
+
+int rvsim_step(rvstate_t* s) {
+	rvsys_t* sys = s->sys;
+	if (!sys->stop && hart_ready(s)) {
+		s->step = 1;
+		int r = hart_run(s, 1);
+		s->step = 0;
+		if (r == RVRUN_DEBUG) return RVSIM_STOPPED;
+	}
+	if (sys->stop) return RVSIM_EXITED;
+	return hart_ready(s) ? RVSIM_RUNNING : RVSIM_WAITING;
 }
 
+// run a hart on its own thread until the simulation stops
+static void hart_loop(rvstate_t* s) {
+	rvsys_t* sys = s->sys;
+	while (hart_run(s, UINT64_MAX) != RVRUN_STOP) {
+		// RVRUN_WAIT: sleep until the iocall completes or, in wfi,
+		// an interrupt is raised
+		pthread_mutex_lock(&sys->lock);
+		while ((s->iowait || s->wfi) && !sys->stop) {
+			pthread_cond_wait(&sys->cond, &sys->lock);
+		}
+		pthread_mutex_unlock(&sys->lock);
+	}
+}
+
+// host thread of a secondary hart
+static void* hart_main(void* arg) {
+	rvstate_t* s = arg;
+	rvsys_t* sys = s->sys;
+	pthread_mutex_lock(&sys->lock);
+	while (!s->started && !sys->stop) {
+		pthread_cond_wait(&sys->cond, &sys->lock);
+	}
+	pthread_mutex_unlock(&sys->lock);
+	hart_loop(s);
+	return NULL;
+}
+
+int rvsim_exec(rvstate_t* s, uint32_t pc) {
+	rvsys_t* sys = s->sys;
+	s->pc = pc;
+	s->started = 1;
+	for (unsigned n = 0; n < sys->nharts; n++) {
+		rvstate_t* h = sys->hart[n];
+		if (h == s) continue;
+		if (pthread_create(&h->thread, NULL, hart_main, h)) {
+			fprintf(stderr, "error: cannot start hart %u\n", n);
+			abort();
+		}
+	}
+	hart_loop(s);
+	for (unsigned n = 0; n < sys->nharts; n++) {
+		rvstate_t* h = sys->hart[n];
+		if (h != s) pthread_join(h->thread, NULL);
+	}
+	return sys->exitcode;
+}
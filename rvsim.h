@@ -3,25 +3,242 @@
 
 #pragma once
 
+#include <stdint.h>
+
 typedef struct rvstate rvstate_t;
 
-// initialize simulator
-int rvsim_init(rvstate_t** s, void* ctx);
+// simulator instance configuration
+// zero fields select the defaults
+typedef struct rvconfig {
+	uint32_t membase; // ram base address (0x80000000), page aligned
+	uint32_t memsize; // ram size (16MB), a multiple of 4KB up to 2GB
+	unsigned harts;   // number of harts sharing ram (1)
+	unsigned engine;  // RVSIM_ENGINE_*
+	unsigned hugepages; // RVSIM_HUGEPAGES_*
+	int callstack;    // keep shadow call stacks (rvsim_callstack())
+	int rvc;          // the C extension: compressed instructions, and
+	                  // jumps to any halfword instead of only words
+	uint32_t clint;   // base of a CLINT (msip, mtimecmp and mtime, see
+	                  // riscv.h), outside of ram and devices (0: none)
+	int nofuse;       // run each instruction on its own, instead of
+	                  // fusing pairs like lui+addi (RVSIM_EV_FUSED)
+	unsigned debug;   // RVSIM_DEBUG_*: print what the harts do to
+	                  // stderr (running the reference engine)
+
+	// passed to the callbacks (the rvstate_t of the calling hart)
+	void* ctx;
+
+	// "syscalls" (returns -1)
+	uint32_t (*iocall)(void* ctx, uint32_t n, const uint32_t args[8]);
+
+	// word accesses below membase that no device claims (reads return
+	// all ones, writes are dropped)
+	// accesses past the end of ram no device claims raise access faults
+	uint32_t (*ior32)(void* ctx, uint32_t addr);
+	void (*iow32)(void* ctx, uint32_t addr, uint32_t val);
+} rvconfig_t;
+
+#define RVSIM_ENGINE_SWITCH   0 // reference interpreter
+#define RVSIM_ENGINE_THREADED 1 // threaded dispatch, chained basic blocks
+#define RVSIM_ENGINE_JIT      2 // threaded, hot blocks compiled to x86-64
+
+// debug output (to stderr), any combination of
+#define RVSIM_DEBUG_INS    1  // each instruction, disassembled
+#define RVSIM_DEBUG_MEM_WR 2  // each memory write
+#define RVSIM_DEBUG_REG_WR 4  // each register write
+#define RVSIM_DEBUG_TRAPS  8  // each trap's cause and value
+#define RVSIM_DEBUG_INVAL  16 // exit (status -1) on an illegal instruction
+#define RVSIM_DEBUG_ALL    31
+
+// ram is allocated on first touch, in pages of
+#define RVSIM_HUGEPAGES_NONE    0 // 4KB
+#define RVSIM_HUGEPAGES_THP     1 // 2MB where the kernel can (transparent)
+#define RVSIM_HUGEPAGES_HUGETLB 2 // 2MB from the reserved hugetlbfs pool
+                                  // (membase and memsize must be
+                                  // multiples of 2MB, and rvsim_mmap()
+                                  // is not available)
+
+// create a simulator instance (hart 0 of a new machine)
+// instances share nothing and may run concurrently on different threads
+int rvsim_create(rvstate_t** s, const rvconfig_t* cfg);
+
+// release an instance that is not running
+void rvsim_destroy(rvstate_t* s);
+
+// obtain hart n of the instance s belongs to
+rvstate_t* rvsim_hart(rvstate_t* s, unsigned n);
 
-// start simulator running at pc
+// set the pc hart s starts or resumes at (membase by default)
+void rvsim_set_pc(rvstate_t* s, uint32_t pc);
+
+// run for about max_instructions (summed over all harts), stopping at
+// the first basic block boundary past that, on the calling thread
+// returns RVSIM_RUNNING, RVSIM_EXITED, RVSIM_WAITING if every
+// started hart is stopped in a deferred iocall or in wfi, or
+// RVSIM_STOPPED as soon as a hart stops for the debugger
+int rvsim_run(rvstate_t* s, uint64_t max_instructions);
+
+#define RVSIM_RUNNING 0
+#define RVSIM_EXITED  1
+#define RVSIM_WAITING 2
+#define RVSIM_STOPPED 3
+
+// debugging, with rvsim_run() (the harts stopped in between): a
+// breakpoint replaces the decoded instruction and writes to a watched
+// page take the path writes to code take, so while none are set they
+// cost nothing, and only the decoder looks for them
+// stop harts when they are about to run the instruction at pc (on 1),
+// or stop stopping them there (on 0)
+int rvsim_breakpoint(rvstate_t* s, uint32_t pc, int on);
+
+// stop a hart after it writes to any of len bytes of ram at addr (a word
+// at a time, so a write to a neighbouring byte may stop it too)
+int rvsim_watchpoint(rvstate_t* s, uint32_t addr, uint32_t len, int on);
+
+// run hart s for one instruction (or into the handler of the trap or
+// interrupt it takes instead), returns like rvsim_run()
+int rvsim_step(rvstate_t* s);
+
+// why hart s stopped for the debugger (and clear that), or 0
+// with RVSIM_STOP_WATCH, *addr is the watched address written
+unsigned rvsim_stopped(rvstate_t* s, uint32_t* addr);
+
+#define RVSIM_STOP_BREAK 1
+#define RVSIM_STOP_WATCH 2
+
+// start running at pc until the guest exits, returning its exit status
+// every started hart runs on its own host thread
 int rvsim_exec(rvstate_t* s, uint32_t pc);
 
+// the exit status of a guest that has exited
+int rvsim_exit_status(rvstate_t* s);
+
+// instructions executed by hart s so far
+uint64_t rvsim_icount(rvstate_t* s);
+
+// where hart s resumes
+uint32_t rvsim_pc(rvstate_t* s);
+
+// with rvconfig_t.callstack, harts follow calls (jal or jalr to ra) and
+// returns (jalr x0, 0(ra)): copy up to max return addresses of the
+// calls hart s is in, outermost first, and return how many there are
+unsigned rvsim_callstack(rvstate_t* s, uint32_t* ra, unsigned max);
+
+// events each hart counts, which its mhpmcounters can be set to count
+// by writing these to the matching mhpmevent csrs
+#define RVSIM_EV_NONE     0
+#define RVSIM_EV_LOADS    1 // loads retired (lr.w and amos included)
+#define RVSIM_EV_STORES   2 // stores retired (successful sc.w and amos included)
+#define RVSIM_EV_BRANCHES 3 // conditional branches taken
+#define RVSIM_EV_TRAPS    4 // exceptions taken
+#define RVSIM_EV_IOCALLS  5
+#define RVSIM_EV_FUSED    6 // pairs of instructions run as one
+#define RVSIM_EV_COUNT    7
+
+// events of a kind seen by hart s so far
+uint64_t rvsim_counter(rvstate_t* s, unsigned ev);
+
+// record every instruction executed by the harts of the instance, with
+// the register and memory each writes and the traps taken, to a file
+// (see rvtrace.h), until rvsim_trace_stop()
+// harts run the reference engine while tracing, whatever their engine
+// neither may be called while the instance is running
+int rvsim_trace_start(rvstate_t* s, const char* fn);
+
+// finish the trace, returns -1 if it could not all be written
+int rvsim_trace_stop(rvstate_t* s);
+
+// count the edges between basic blocks the harts of the instance take
+// (branches either way, jumps and traps) in map, as AFL does: a byte
+// per edge, map[hash(to) ^ (hash(from) >> 1)], counting up and wrapping
+// around, until called again with NULL
+// harts run the reference engine while counting, whatever their engine
+void rvsim_coverage(rvstate_t* s, uint8_t* map);
+
+#define RVSIM_COVERBITS 16
+#define RVSIM_COVERSIZE (1U << RVSIM_COVERBITS)
+
+// save the state of the instance s belongs to, which is not running, to
+// a checkpoint file fn (see rvsnap.h): the registers, pc and csrs of
+// every hart, and ram, but for pages of zeros or, when base names the
+// checkpoint last saved or restored, pages not written since then
+// returns -1 if it could not, a hart is in a deferred iocall, or fn is
+// base or one of the checkpoints it adds to (what the host keeps for
+// devices and iocalls is not saved)
+int rvsim_checkpoint(rvstate_t* s, const char* fn, const char* base);
+
+// load checkpoint fn (and those it adds to) into the instance s belongs
+// to, which is not running and was created with the rvsnap_config() of
+// it, where the checkpoint left off
+// ram maps the pages of the files copy-on-write where it can, so this
+// costs little more than opening them, and they must not change while
+// the instance lives (if it fails, ram may be left part way there)
+int rvsim_restore(rvstate_t* s, const char* fn);
+
+// go back to the checkpoint last saved or restored by the instance s
+// belongs to, which is not running: every hart as it was then, and the
+// pages of ram written since (only those, so it costs about as much as
+// the guest wrote), even if it had exited
+int rvsim_rewind(rvstate_t* s);
+
+// called from the iocall callback of hart s: the iocall will complete
+// later, from any thread, through rvsim_iocall_complete(), and the hart
+// stops until then (the callback's return value is ignored)
+void rvsim_iocall_defer(rvstate_t* s);
+
+// the hart whose iocall callback is running (on the calling thread),
+// for when rvconfig_t.ctx does not say
+rvstate_t* rvsim_iocall_hart(void);
+
+// supply the result (a0) of a deferred iocall of hart s
+// returns 1 if the hart had stopped and can be run again, 0 if it
+// hadn't stopped yet and will just continue
+int rvsim_iocall_complete(rvstate_t* s, uint32_t result);
+
+// raise (level 1) or lower (level 0) the machine external interrupt
+// (mip.MEIP) of hart s, from any thread
+// a hart waiting in wfi wakes up when any of its interrupts is raised
+// (an instance whose started harts all wait in wfi is RVSIM_WAITING)
+void rvsim_irq(rvstate_t* s, int level);
+
+// start a waiting hart at pc, with sp, a0 = hartid, a1 = arg
+// also available to guests as IOCALL_HARTSTART
+int rvsim_hart_start(rvstate_t* s, uint32_t hartid, uint32_t pc, uint32_t sp, uint32_t arg);
+
 // obtain a pointer for direct memory access
 void* rvsim_dma(rvstate_t* s, uint32_t va, uint32_t len);
 
-// read a word from memory
-uint32_t rvsim_rd32(rvstate_t* s, uint32_t addr);
+// the host changed len bytes of ram at va: drop the instructions harts
+// decoded from there (each does at its next basic block), and count
+// those pages as written for the next incremental checkpoint
+void rvsim_dma_written(rvstate_t* s, uint32_t va, uint32_t len);
 
+// map len bytes of file fd from offset off into ram at addr, private
+// and copy-on-write, or fresh demand-zero pages if fd is -1
+// addr, len and off must be host page aligned
+// pages past the end of the file are demand-zero, fd may be closed
+// once mapped, and the mapping lasts until it is mapped over (with -1
+// to drop it) or the instance is destroyed
+int rvsim_mmap(rvstate_t* s, uint32_t addr, uint32_t len, int fd, uint64_t off);
 
-// hook for "syscalls"
-uint32_t iocall(void* ctx, uint32_t n, const uint32_t args[8]);
+// a memory mapped device: handlers for each access width, given the
+// offset into the device's range
+// a width without a read handler is read from rd32 (or all ones),
+// a width without a write handler drops the write
+// with several harts, handlers are called from their threads concurrently
+typedef struct rvdevice {
+	uint32_t (*rd8)(void* ctx, uint32_t off);
+	uint32_t (*rd16)(void* ctx, uint32_t off);
+	uint32_t (*rd32)(void* ctx, uint32_t off);
+	void (*wr8)(void* ctx, uint32_t off, uint32_t val);
+	void (*wr16)(void* ctx, uint32_t off, uint32_t val);
+	void (*wr32)(void* ctx, uint32_t off, uint32_t val);
+} rvdevice_t;
 
-// hooks to implement io read/write access
-uint32_t ior32(uint32_t addr);
-void iow32(uint32_t addr, uint32_t val);
+// map a device at [base, base + size), outside of ram and of every
+// other device, before the instance runs
+int rvsim_device_add(rvstate_t* s, uint32_t base, uint32_t size,
+	const rvdevice_t* dev, void* ctx);
 
+// read a word from memory
+uint32_t rvsim_rd32(rvstate_t* s, uint32_t addr);
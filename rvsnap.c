@@ -0,0 +1,556 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// Checkpoints save ram a run of pages at a time, straight from where
+// it lives, and restoring one maps the pages back in copy-on-write
+// (rvsim_mmap()), falling back to reading them where that's not
+// possible (hugetlb ram, larger host pages).  The files stay mapped
+// read-only as well, for rvsim_rewind() to copy pages back from.
+// Which pages an incremental checkpoint, or a rewind, needs is tracked
+// by the code write path: after a checkpoint every page is marked clean
+// in the codemap, and the first store to it comes through
+// rvsim_code_write(), which notes it dirty.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rvsim.h"
+#include "rvcore.h"
+#include "rvsnap.h"
+
+// checkpoints an incremental one may add to, one on another
+#define RVSNAP_MAXDEPTH 64
+
+// what rvsim_rewind() goes back to: the harts of the checkpoint last
+// saved or restored, and where each page of its ram is, in the files of
+// it and of those it adds to (mapped read-only), or NULL for zeros
+typedef struct rvsnapshot {
+	rvsnap_hart_t* harts;
+	const uint8_t** page;
+	struct { void* addr; size_t len; }* map;
+	unsigned nmaps;
+	unsigned maxmaps;
+} rvsnapshot_t;
+
+static uint64_t snap_id(void) {
+	static uint64_t seq;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	uint64_t id = (((uint64_t) ts.tv_sec) << 32) ^ ts.tv_nsec ^
+		(((uint64_t) getpid()) << 40) ^
+		__atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED);
+	return id ? id : 1;
+}
+
+static int page_zero(const uint64_t* p) {
+	uint64_t bits = 0;
+	for (unsigned n = 0; n < (RVPAGESIZE / sizeof(uint64_t)); n++) {
+		bits |= p[n];
+	}
+	return bits == 0;
+}
+
+static int pwrite_all(int fd, const void* ptr, size_t len, uint64_t off) {
+	while (len > 0) {
+		ssize_t r = pwrite(fd, ptr, len, off);
+		if (r <= 0) return -1;
+		ptr += r;
+		len -= r;
+		off += r;
+	}
+	return 0;
+}
+
+static int pread_all(int fd, void* ptr, size_t len, uint64_t off) {
+	while (len > 0) {
+		ssize_t r = pread(fd, ptr, len, off);
+		if (r <= 0) return -1;
+		ptr += r;
+		len -= r;
+		off += r;
+	}
+	return 0;
+}
+
+// read the header of checkpoint fd and what follows it up to the pages
+// (harts, runs and path, in a buffer the caller frees)
+static void* snap_read(int fd, rvsnap_header_t* hdr) {
+	if ((pread_all(fd, hdr, sizeof(*hdr), 0) < 0) ||
+		(hdr->magic != RVSNAP_MAGIC) || (hdr->version != RVSNAP_VERSION) ||
+		(hdr->nharts == 0) || (hdr->nharts > RVMAXHARTS) ||
+		(hdr->nruns > (hdr->memsize >> RVPAGESHIFT)) || (hdr->pathlen > 4096)) {
+		return NULL;
+	}
+	size_t len = hdr->nharts * sizeof(rvsnap_hart_t) +
+		hdr->nruns * sizeof(rvsnap_run_t) + hdr->pathlen + 1;
+	uint8_t* meta;
+	if ((meta = malloc(len)) == NULL) {
+		return NULL;
+	}
+	if (pread_all(fd, meta, len - 1, sizeof(*hdr)) < 0) {
+		free(meta);
+		return NULL;
+	}
+	meta[len - 1] = 0;
+	return meta;
+}
+
+static int snap_header(const char* fn, rvsnap_header_t* hdr) {
+	int fd;
+	if ((fd = open(fn, O_RDONLY)) < 0) {
+		return -1;
+	}
+	void* meta = snap_read(fd, hdr);
+	close(fd);
+	free(meta);
+	return meta ? 0 : -1;
+}
+
+// the checkpoint the one at fn adds to, from the path saved in it
+// (relative to the directory of fn, unless absolute)
+// returns a string the caller frees, or NULL
+static char* snap_parent(const char* fn, const char* path) {
+	const char* slash = strrchr(fn, '/');
+	size_t dir = ((path[0] != '/') && slash) ? (slash - fn + 1) : 0;
+	char* p;
+	if ((p = malloc(dir + strlen(path) + 1)) == NULL) {
+		return NULL;
+	}
+	memcpy(p, fn, dir);
+	strcpy(p + dir, path);
+	return p;
+}
+
+// whether fn is the checkpoint base or one of those it adds to, which
+// renaming a checkpoint adding to base over it would destroy
+static int snap_ancestor(const char* fn, const char* base) {
+	struct stat fst, st;
+	if (stat(fn, &fst) < 0) return 0;
+	char* cur = strdup(base);
+	for (unsigned depth = 0; cur && (depth <= RVSNAP_MAXDEPTH); depth++) {
+		if (stat(cur, &st) < 0) break;
+		if ((st.st_dev == fst.st_dev) && (st.st_ino == fst.st_ino)) {
+			free(cur);
+			return 1;
+		}
+		rvsnap_header_t hdr;
+		uint8_t* meta = NULL;
+		int fd;
+		if ((fd = open(cur, O_RDONLY)) >= 0) {
+			meta = snap_read(fd, &hdr);
+			close(fd);
+		}
+		char* next = NULL;
+		if (meta && hdr.parent) {
+			next = snap_parent(cur, (const char*) meta +
+				hdr.nharts * sizeof(rvsnap_hart_t) +
+				hdr.nruns * sizeof(rvsnap_run_t));
+		}
+		free(meta);
+		free(cur);
+		cur = next;
+	}
+	free(cur);
+	return 0;
+}
+
+int rvsnap_config(const char* fn, rvconfig_t* cfg) {
+	rvsnap_header_t hdr;
+	if (snap_header(fn, &hdr) < 0) {
+		return -1;
+	}
+	cfg->membase = hdr.membase;
+	cfg->memsize = hdr.memsize;
+	cfg->harts = hdr.nharts;
+	cfg->clint = hdr.clint;
+	cfg->rvc = !!(hdr.flags & RVSNAP_RVC);
+	return 0;
+}
+
+static void hart_save(rvstate_t* s, rvsnap_hart_t* h) {
+	memset(h, 0, sizeof(*h));
+	memcpy(h->x, s->x, sizeof(h->x));
+	h->pc = s->pc;
+	h->flags = (s->started ? RVSNAP_STARTED : 0) | (s->wfi ? RVSNAP_WFI : 0);
+	h->mstatus = s->mstatus;
+	h->mie = s->mie;
+	h->mip = s->mip;
+	h->mtvec = s->mtvec;
+	h->mscratch = s->mscratch;
+	h->mepc = s->mepc;
+	h->mcause = s->mcause;
+	h->mtval = s->mtval;
+	h->mtimecmp = s->mtimecmp;
+	h->timeoff = s->timeoff;
+	h->ccount = s->ccount;
+	h->cycleoff = s->cycleoff;
+	h->instretoff = s->instretoff;
+	memcpy(h->hpmoff, s->hpmoff, sizeof(s->hpmoff));
+	memcpy(h->evcount, s->evcount, sizeof(s->evcount));
+	memcpy(h->hpmevent, s->hpmevent, sizeof(s->hpmevent));
+}
+
+// what is not saved starts afresh: no reservation, call stack, deferred
+// iocall, debugger stop or coverage edge, and an interrupt left pending
+// is taken at once
+static void hart_load(rvstate_t* s, const rvsnap_hart_t* h) {
+	memcpy(s->x, h->x, sizeof(h->x));
+	s->x[0] = 0;
+	s->pc = h->pc;
+	s->started = !!(h->flags & RVSNAP_STARTED);
+	s->wfi = !!(h->flags & RVSNAP_WFI);
+	s->mstatus = h->mstatus;
+	s->mie = h->mie;
+	s->mip = h->mip;
+	s->mtvec = h->mtvec;
+	s->mscratch = h->mscratch;
+	s->mepc = h->mepc;
+	s->mcause = h->mcause;
+	s->mtval = h->mtval;
+	s->mtimecmp = h->mtimecmp;
+	s->timeoff = h->timeoff;
+	s->ccount = h->ccount;
+	s->cycleoff = h->cycleoff;
+	s->instretoff = h->instretoff;
+	memcpy(s->hpmoff, h->hpmoff, sizeof(s->hpmoff));
+	memcpy(s->evcount, h->evcount, sizeof(s->evcount));
+	memcpy(s->hpmevent, h->hpmevent, sizeof(s->hpmevent));
+	s->resv_addr = RVRESV_NONE;
+	s->calldepth = 0;
+	s->coverprev = 0;
+	s->dbgstop = 0;
+	s->iodefer = 0;
+	s->iowait = 0;
+	s->iodone = 0;
+	__atomic_fetch_and(&s->events, ~RVEV_STOP, __ATOMIC_RELAXED);
+	__atomic_fetch_or(&s->events, RVEV_IRQ, __ATOMIC_RELAXED);
+}
+
+// every hart as saved, and the simulation not over
+static void snap_harts(rvsys_t* sys, const rvsnap_hart_t* harts) {
+	for (unsigned n = 0; n < sys->nharts; n++) {
+		hart_load(sys->hart[n], harts + n);
+	}
+	sys->exitcode = 0;
+	sys->stop = 0;
+}
+
+static void snap_unmap(rvsnapshot_t* sn) {
+	for (unsigned n = 0; n < sn->nmaps; n++) {
+		munmap(sn->map[n].addr, sn->map[n].len);
+	}
+	sn->nmaps = 0;
+}
+
+void rvsnap_free(rvstate_t* s) {
+	rvsys_t* sys = s->sys;
+	rvsnapshot_t* sn = sys->snap;
+	if (sn == NULL) return;
+	snap_unmap(sn);
+	free(sn->harts);
+	free(sn->page);
+	free(sn->map);
+	free(sn);
+	sys->snap = NULL;
+	sys->snapid = 0;
+}
+
+static rvsnapshot_t* snap_get(rvsys_t* sys) {
+	rvsnapshot_t* sn = sys->snap;
+	if (sn) return sn;
+	if ((sn = calloc(1, sizeof(rvsnapshot_t))) == NULL) {
+		return NULL;
+	}
+	if (((sn->harts = calloc(sys->nharts, sizeof(rvsnap_hart_t))) == NULL) ||
+		((sn->page = calloc(sys->memsize >> RVPAGESHIFT, sizeof(void*))) == NULL)) {
+		free(sn->harts);
+		free(sn);
+		return NULL;
+	}
+	sys->snap = sn;
+	return sn;
+}
+
+// map checkpoint fd to rewind to its pages (given by its runs), over
+// those of the checkpoint it adds to, or of zeros if full
+static int snap_map(rvsys_t* sys, int fd, const rvsnap_run_t* run,
+	uint32_t nruns, int full) {
+	rvsnapshot_t* sn = snap_get(sys);
+	struct stat st;
+	if ((sn == NULL) || (fstat(fd, &st) < 0)) {
+		return -1;
+	}
+	if (full) {
+		snap_unmap(sn);
+		memset(sn->page, 0, (sys->memsize >> RVPAGESHIFT) * sizeof(void*));
+	}
+	if (sn->nmaps == sn->maxmaps) {
+		unsigned max = sn->maxmaps ? sn->maxmaps * 2 : 4;
+		void* list;
+		if ((list = realloc(sn->map, max * sizeof(sn->map[0]))) == NULL) {
+			return -1;
+		}
+		sn->map = list;
+		sn->maxmaps = max;
+	}
+	uint8_t* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		return -1;
+	}
+	sn->map[sn->nmaps].addr = p;
+	sn->map[sn->nmaps].len = st.st_size;
+	sn->nmaps++;
+	for (uint32_t n = 0; n < nruns; n++) {
+		for (uint32_t i = 0; i < run[n].count; i++) {
+			sn->page[run[n].page + i] = run[n].data ?
+				(p + run[n].data + (i << RVPAGESHIFT)) : NULL;
+		}
+	}
+	return 0;
+}
+
+int rvsim_checkpoint(rvstate_t* s, const char* fn, const char* base) {
+	rvsys_t* sys = s->sys;
+	uint32_t pages = sys->memsize >> RVPAGESHIFT;
+	rvsnap_header_t hdr = {
+		.magic = RVSNAP_MAGIC,
+		.version = RVSNAP_VERSION,
+		.id = snap_id(),
+		.membase = sys->membase,
+		.memsize = sys->memsize,
+		.clint = sys->clint,
+		.nharts = sys->nharts,
+		.flags = sys->cfg.rvc ? RVSNAP_RVC : 0,
+	};
+	for (unsigned n = 0; n < sys->nharts; n++) {
+		rvstate_t* h = sys->hart[n];
+		if (h->iodefer || h->iowait) return -1;
+	}
+	char* path = NULL;
+	if (base) {
+		// it must add to the checkpoint the pages written since are
+		// counted from, without replacing it (or those it adds to),
+		// and find it from anywhere
+		rvsnap_header_t bh;
+		if ((sys->dirty == NULL) || (snap_header(base, &bh) < 0) ||
+			(bh.id != sys->snapid) || snap_ancestor(fn, base) ||
+			((path = realpath(base, NULL)) == NULL)) {
+			return -1;
+		}
+		hdr.parent = bh.id;
+		hdr.pathlen = strlen(path);
+	}
+	size_t len = sizeof(hdr) + sys->nharts * sizeof(rvsnap_hart_t) +
+		pages * sizeof(rvsnap_run_t) + hdr.pathlen;
+	uint8_t* meta;
+	if ((meta = malloc(len)) == NULL) {
+		free(path);
+		return -1;
+	}
+	rvsnap_hart_t* harts = (void*) (meta + sizeof(hdr));
+	rvsnap_run_t* run = (void*) (harts + sys->nharts);
+	for (unsigned n = 0; n < sys->nharts; n++) {
+		hart_save(sys->hart[n], harts + n);
+	}
+
+	// runs of pages of zeros (data 0) and not (data 1, for now)
+	uint32_t nruns = 0;
+	for (uint32_t pn = 0; pn < pages; pn++) {
+		if (base && !(sys->dirty[pn >> 6] & (1ULL << (pn & 63)))) continue;
+		uint64_t data = !page_zero(sys->memory + (pn << RVPAGESHIFT));
+		if (!base && !data) continue;
+		if (nruns && (run[nruns - 1].data == data) &&
+			((run[nruns - 1].page + run[nruns - 1].count) == pn)) {
+			run[nruns - 1].count++;
+		} else {
+			run[nruns].page = pn;
+			run[nruns].count = 1;
+			run[nruns].data = data;
+			nruns++;
+		}
+	}
+	hdr.nruns = nruns;
+	memcpy(meta, &hdr, sizeof(hdr));
+	if (base) memcpy(run + nruns, path, hdr.pathlen);
+	free(path);
+	len = sizeof(hdr) + sys->nharts * sizeof(rvsnap_hart_t) +
+		nruns * sizeof(rvsnap_run_t) + hdr.pathlen;
+	uint64_t off = (len + RVSNAP_ALIGN - 1) & ~(uint64_t) (RVSNAP_ALIGN - 1);
+	for (uint32_t n = 0; n < nruns; n++) {
+		if (run[n].data == 0) continue;
+		run[n].data = off;
+		off += ((uint64_t) run[n].count) << RVPAGESHIFT;
+	}
+
+	// written alongside and renamed into place, as ram may be mapped
+	// from the file it replaces
+	char tmp[4096];
+	int fd = -1;
+	if ((snprintf(tmp, sizeof(tmp), "%s.tmp", fn) >= sizeof(tmp)) ||
+		((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)) {
+		free(meta);
+		return -1;
+	}
+	if (pwrite_all(fd, meta, len, 0) < 0) {
+		goto fail;
+	}
+	for (uint32_t n = 0; n < nruns; n++) {
+		if (run[n].data && (pwrite_all(fd, sys->memory +
+			(run[n].page << RVPAGESHIFT), run[n].count << RVPAGESHIFT,
+			run[n].data) < 0)) {
+			goto fail;
+		}
+	}
+	if ((close(fd) < 0) || (rename(tmp, fn) < 0)) {
+		fd = -1;
+		goto fail;
+	}
+	// and keep it to rewind to
+	if (((fd = open(fn, O_RDONLY)) < 0) ||
+		(snap_map(sys, fd, run, nruns, base == NULL) < 0) ||
+		(rvsim_dirty_clear(s) < 0)) {
+		if (fd >= 0) close(fd);
+		rvsnap_free(s);
+		free(meta);
+		return -1;
+	}
+	close(fd);
+	memcpy(sys->snap->harts, harts, sys->nharts * sizeof(rvsnap_hart_t));
+	free(meta);
+	sys->snapid = hdr.id;
+	return 0;
+fail:
+	if (fd >= 0) close(fd);
+	unlink(tmp);
+	free(meta);
+	return -1;
+}
+
+// ram offset off, len bytes, from offset data of file fd, or zeros
+static int ram_load(rvstate_t* s, uint32_t off, uint32_t len, int fd, uint64_t data) {
+	if (rvsim_mmap(s, s->membase + off, len, fd, data) == 0) {
+		return 0;
+	}
+	if (fd < 0) {
+		memset(s->memory + off, 0, len);
+		return 0;
+	}
+	return pread_all(fd, s->memory + off, len, data);
+}
+
+// load the pages of checkpoint fn, with the given id (or any, 0), over
+// those of the checkpoints it adds to, and return the rest (harts, runs
+// and path) if meta is not NULL
+static int snap_load(rvstate_t* s, const char* fn, uint64_t id, unsigned depth,
+	rvsnap_header_t* hdr, void** meta) {
+	rvsys_t* sys = s->sys;
+	int fd;
+	if ((fd = open(fn, O_RDONLY)) < 0) {
+		return -1;
+	}
+	void* m;
+	struct stat st;
+	if ((m = snap_read(fd, hdr)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	rvsnap_run_t* run = m + hdr->nharts * sizeof(rvsnap_hart_t);
+	const char* path = (void*) (run + hdr->nruns);
+	if ((id && (hdr->id != id)) || (hdr->membase != sys->membase) ||
+		(hdr->memsize != sys->memsize) || (hdr->nharts != sys->nharts) ||
+		(!!(hdr->flags & RVSNAP_RVC) != !!sys->cfg.rvc) ||
+		(fstat(fd, &st) < 0)) {
+		goto fail;
+	}
+	if (hdr->parent) {
+		rvsnap_header_t ph;
+		char* pfn = NULL;
+		if ((depth == RVSNAP_MAXDEPTH) ||
+			((pfn = snap_parent(fn, path)) == NULL) ||
+			(snap_load(s, pfn, hdr->parent, depth + 1, &ph, NULL) < 0)) {
+			free(pfn);
+			goto fail;
+		}
+		free(pfn);
+	} else if (ram_load(s, 0, sys->memsize, -1, 0) < 0) {
+		goto fail;
+	}
+	uint32_t pages = sys->memsize >> RVPAGESHIFT;
+	for (uint32_t n = 0; n < hdr->nruns; n++) {
+		uint64_t len = ((uint64_t) run[n].count) << RVPAGESHIFT;
+		if ((run[n].count == 0) || (run[n].page >= pages) ||
+			(run[n].count > (pages - run[n].page)) ||
+			(run[n].data & (RVSNAP_ALIGN - 1)) ||
+			(run[n].data && ((run[n].data + len) > st.st_size)) ||
+			(ram_load(s, run[n].page << RVPAGESHIFT, len,
+			run[n].data ? fd : -1, run[n].data) < 0)) {
+			goto fail;
+		}
+	}
+	if (snap_map(sys, fd, run, hdr->nruns, hdr->parent == 0) < 0) {
+		goto fail;
+	}
+	close(fd);
+	if (meta) {
+		*meta = m;
+	} else {
+		free(m);
+	}
+	return 0;
+fail:
+	close(fd);
+	free(m);
+	return -1;
+}
+
+int rvsim_restore(rvstate_t* s, const char* fn) {
+	rvsys_t* sys = s->sys;
+	rvsnap_header_t hdr;
+	void* meta;
+	if (snap_load(s, fn, 0, 0, &hdr, &meta) < 0) {
+		// ram may be part way there: drop what was decoded from it
+		rvsim_dma_written(s, sys->membase, sys->memsize);
+		rvsnap_free(s);
+		return -1;
+	}
+	memcpy(sys->snap->harts, meta, sys->nharts * sizeof(rvsnap_hart_t));
+	free(meta);
+	snap_harts(sys, sys->snap->harts);
+	rvsim_dma_written(s, sys->membase, sys->memsize);
+	if (rvsim_dirty_clear(s) < 0) {
+		rvsnap_free(s);
+		return -1;
+	}
+	sys->snapid = hdr.id;
+	return 0;
+}
+
+int rvsim_rewind(rvstate_t* s) {
+	rvsys_t* sys = s->sys;
+	rvsnapshot_t* sn = sys->snap;
+	if (sn == NULL) return -1;
+	uint32_t words = ((sys->memsize >> RVPAGESHIFT) + 63) >> 6;
+	for (uint32_t w = 0; w < words; w++) {
+		uint64_t bits = sys->dirty[w];
+		while (bits) {
+			uint32_t pn = (w << 6) + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			uint8_t* p = sys->memory + (pn << RVPAGESHIFT);
+			if (sn->page[pn]) {
+				memcpy(p, sn->page[pn], RVPAGESIZE);
+			} else {
+				memset(p, 0, RVPAGESIZE);
+			}
+			rvsim_dma_written(s, sys->membase + (pn << RVPAGESHIFT), RVPAGESIZE);
+		}
+	}
+	snap_harts(sys, sn->harts);
+	return rvsim_dirty_clear(s);
+}
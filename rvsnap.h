@@ -0,0 +1,79 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "rvsim.h"
+
+// checkpoints (rvsim_checkpoint(), rvsim_restore())
+//
+// A checkpoint file is an rvsnap_header_t, nharts rvsnap_hart_t, nruns
+// rvsnap_run_t and the path of the checkpoint it adds to (pathlen
+// bytes, no terminator), then the pages of ram the runs point at, each
+// at a multiple of RVSNAP_ALIGN into the file so they can be mapped
+// straight into ram.  rvsim_checkpoint() saves the absolute path of
+// its base (realpath()); a relative one is taken to be relative to the
+// directory of the checkpoint adding to it.
+//
+// A full checkpoint (parent 0) has runs for the pages of ram that are
+// not all zeros, the rest are zero.  An incremental one has runs for
+// the pages written since the checkpoint it adds to was saved or
+// restored, zero or not, on top of that checkpoint's.
+
+#define RVSNAP_MAGIC   0x4e535652 // "RVSN"
+#define RVSNAP_VERSION 1
+#define RVSNAP_ALIGN   4096
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t id;     // of this checkpoint
+	uint64_t parent; // id of the checkpoint this adds to, or 0
+	uint32_t membase;
+	uint32_t memsize;
+	uint32_t clint;
+	uint32_t nharts;
+	uint32_t flags;  // RVSNAP_*
+	uint32_t nruns;
+	uint32_t pathlen;
+	uint32_t reserved;
+} rvsnap_header_t;
+
+#define RVSNAP_RVC 1 // harts run compressed instructions
+
+typedef struct {
+	uint32_t x[32];
+	uint32_t pc;
+	uint32_t flags; // RVSNAP_STARTED, RVSNAP_WFI
+	uint32_t mstatus;
+	uint32_t mie;
+	uint32_t mip;
+	uint32_t mtvec;
+	uint32_t mscratch;
+	uint32_t mepc;
+	uint32_t mcause;
+	uint32_t mtval;
+	uint64_t mtimecmp;
+	uint64_t timeoff;
+	uint64_t ccount;
+	uint64_t cycleoff;
+	uint64_t instretoff;
+	uint64_t hpmoff[32];
+	uint64_t evcount[8];
+	uint8_t hpmevent[32];
+} rvsnap_hart_t;
+
+#define RVSNAP_STARTED 1
+#define RVSNAP_WFI     2 // stopped in wfi
+
+typedef struct {
+	uint32_t page;  // ram offset / 4096
+	uint32_t count; // pages
+	uint64_t data;  // file offset of their contents, or 0 for zeros
+} rvsnap_run_t;
+
+// fill in the membase, memsize, harts, clint and rvc an instance must
+// be created with to restore checkpoint fn
+int rvsnap_config(const char* fn, rvconfig_t* cfg);
@@ -0,0 +1,523 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// Runs signature tests (riscv-arch-test style) in one process: every
+// image is a separate instance on a pool of worker threads, and the
+// words between its begin_signature and end_signature symbols are
+// checked against a reference file (one hex word per line) once the
+// test exits.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "rvsim.h"
+#include "rvsched.h"
+#include "rvelf.h"
+
+#define DEFAULT_LIMIT 500000000
+
+enum { T_PASS, T_FAIL, T_ERROR };
+static const char* result_name[] = { "pass", "fail", "error" };
+
+typedef struct {
+	const char* image;
+	const char* ref;
+	uint32_t* refw;
+	unsigned refcount;
+	uint32_t begin;
+	uint32_t end;
+	rvstate_t* s;
+
+	int result;
+	char msg[128];
+	uint64_t instructions;
+	uint64_t load_ns;
+	uint64_t run_ns;
+} test_t;
+
+static test_t* tests;
+static unsigned count;
+static unsigned maxtests;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t retired = PTHREAD_COND_INITIALIZER;
+static unsigned inflight;
+static unsigned passed;
+static int quiet;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int add_test(const char* image, const char* ref) {
+	if (count == maxtests) {
+		unsigned max = maxtests ? maxtests * 2 : 256;
+		test_t* list;
+		if ((list = realloc(tests, max * sizeof(test_t))) == NULL) {
+			return -1;
+		}
+		tests = list;
+		maxtests = max;
+	}
+	memset(tests + count, 0, sizeof(test_t));
+	tests[count].image = image;
+	tests[count].ref = ref;
+	count++;
+	return 0;
+}
+
+// "image reference" per line
+static int read_list(const char* fn) {
+	char line[2048];
+	FILE* fp;
+	if ((fp = fopen(fn, "r")) == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char image[1024], ref[1024];
+		if ((line[0] == '#') || (sscanf(line, "%1023s %1023s", image, ref) != 2)) {
+			continue;
+		}
+		if (add_test(strdup(image), strdup(ref)) < 0) {
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int read_ref(test_t* t) {
+	char line[128];
+	unsigned max = 0;
+	FILE* fp;
+	if ((fp = fopen(t->ref, "r")) == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char* end;
+		uint32_t v = strtoul(line, &end, 16);
+		if (end == line) continue;
+		if (t->refcount == max) {
+			max = max ? max * 2 : 256;
+			uint32_t* w;
+			if ((w = realloc(t->refw, max * sizeof(uint32_t))) == NULL) {
+				fclose(fp);
+				return -1;
+			}
+			t->refw = w;
+		}
+		t->refw[t->refcount++] = v;
+	}
+	fclose(fp);
+	return 0;
+}
+
+// raw binaries have their symbols in an nm listing next to them
+static int read_map(test_t* t) {
+	char fn[1024], line[256];
+	size_t len = strlen(t->image);
+	const char* dot = strrchr(t->image, '.');
+	if ((dot != NULL) && (strchr(dot, '/') == NULL)) len = dot - t->image;
+	if (len > (sizeof(fn) - 5)) return -1;
+	memcpy(fn, t->image, len);
+	strcpy(fn + len, ".map");
+
+	FILE* fp;
+	if ((fp = fopen(fn, "r")) == NULL) {
+		return -1;
+	}
+	unsigned found = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char type, name[128];
+		unsigned addr;
+		if (sscanf(line, "%x %c %127s", &addr, &type, name) != 3) continue;
+		if (!strcmp(name, "begin_signature")) {
+			t->begin = addr;
+			found |= 1;
+		} else if (!strcmp(name, "end_signature")) {
+			t->end = addr;
+			found |= 2;
+		}
+	}
+	fclose(fp);
+	return (found == 3) ? 0 : -1;
+}
+
+static int load_bin(test_t* t, rvconfig_t* cfg) {
+	FILE* fp;
+	void* ptr = rvsim_dma(t->s, cfg->membase, cfg->memsize);
+	if ((fp = fopen(t->image, "rb")) == NULL) {
+		return -1;
+	}
+	size_t n = fread(ptr, 1, cfg->memsize, fp);
+	int r = (n > 0) && !ferror(fp) && (fgetc(fp) == EOF);
+	fclose(fp);
+	if (!r) return -1;
+	rvsim_set_pc(t->s, cfg->membase);
+	return 0;
+}
+
+static int load_elf(test_t* t) {
+	rvelf_t* e;
+	if (rvelf_open(&e, t->image) < 0) {
+		return -1;
+	}
+	int r = -1;
+	if ((rvelf_load(e, t->s) == 0) &&
+		(rvelf_symbol(e, "begin_signature", &t->begin) == 0) &&
+		(rvelf_symbol(e, "end_signature", &t->end) == 0)) {
+		rvsim_set_pc(t->s, rvelf_entry(e));
+		r = 0;
+	}
+	rvelf_close(e);
+	return r;
+}
+
+static int load_test(test_t* t, rvconfig_t* cfg) {
+	if (read_ref(t) < 0) {
+		snprintf(t->msg, sizeof(t->msg), "cannot read reference");
+		return -1;
+	}
+	if (rvsim_create(&t->s, cfg) < 0) {
+		snprintf(t->msg, sizeof(t->msg), "cannot create instance");
+		return -1;
+	}
+	if (rvelf_check(t->image)) {
+		if (load_elf(t) < 0) {
+			snprintf(t->msg, sizeof(t->msg), "cannot load elf image");
+			return -1;
+		}
+	} else {
+		if (load_bin(t, cfg) < 0) {
+			snprintf(t->msg, sizeof(t->msg), "cannot load image");
+			return -1;
+		}
+		if (read_map(t) < 0) {
+			snprintf(t->msg, sizeof(t->msg), "no signature symbols");
+			return -1;
+		}
+	}
+	if ((t->end < t->begin) || (t->end & 3) || (t->begin & 3) ||
+		(rvsim_dma(t->s, t->begin, t->end - t->begin) == NULL)) {
+		snprintf(t->msg, sizeof(t->msg), "bad signature range");
+		return -1;
+	}
+	return 0;
+}
+
+static void report(test_t* t) {
+	if (quiet && (t->result == T_PASS)) return;
+	flockfile(stdout);
+	if (t->result == T_PASS) {
+		printf("PASS: %s\n", t->image);
+	} else {
+		printf("%s: %s: %s\n", t->result == T_FAIL ? "FAIL" : "ERROR",
+			t->image, t->msg);
+	}
+	fflush(stdout);
+	funlockfile(stdout);
+}
+
+static void retire(test_t* t) {
+	if (t->s) {
+		rvsim_destroy(t->s);
+		t->s = NULL;
+	}
+	free(t->refw);
+	t->refw = NULL;
+	report(t);
+	pthread_mutex_lock(&lock);
+	if (t->result == T_PASS) passed++;
+	inflight--;
+	pthread_cond_signal(&retired);
+	pthread_mutex_unlock(&lock);
+}
+
+static void check(test_t* t) {
+	unsigned words = (t->end - t->begin) / 4;
+	if (words != t->refcount) {
+		t->result = T_FAIL;
+		snprintf(t->msg, sizeof(t->msg), "signature is %u words, reference %u",
+			words, t->refcount);
+		return;
+	}
+	for (unsigned n = 0; n < words; n++) {
+		uint32_t v = rvsim_rd32(t->s, t->begin + n * 4);
+		if (v != t->refw[n]) {
+			t->result = T_FAIL;
+			snprintf(t->msg, sizeof(t->msg), "word %u (%08x) is %08x, expected %08x",
+				n, t->begin + n * 4, v, t->refw[n]);
+			return;
+		}
+	}
+	t->result = T_PASS;
+}
+
+static void test_done(rvguest_t* g, void* cookie) {
+	test_t* t = cookie;
+	rvguest_stats_t st;
+	rvsched_guest_stats(g, &st);
+	t->instructions = st.instructions;
+	t->run_ns = st.run_ns;
+	if (st.timeout) {
+		t->result = T_FAIL;
+		snprintf(t->msg, sizeof(t->msg), "timeout after %lu instructions",
+			st.instructions);
+	} else {
+		check(t);
+	}
+	retire(t);
+}
+
+static void xml_puts(FILE* fp, const char* s) {
+	for (; *s; s++) {
+		switch (*s) {
+		case '<': fputs("&lt;", fp); break;
+		case '>': fputs("&gt;", fp); break;
+		case '&': fputs("&amp;", fp); break;
+		case '"': fputs("&quot;", fp); break;
+		default: fputc(*s, fp);
+		}
+	}
+}
+
+static void json_puts(FILE* fp, const char* s) {
+	fputc('"', fp);
+	for (; *s; s++) {
+		if ((*s == '"') || (*s == '\\')) {
+			fprintf(fp, "\\%c", *s);
+		} else if ((unsigned char) *s < 0x20) {
+			fprintf(fp, "\\u%04x", *s);
+		} else {
+			fputc(*s, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+static int write_junit(const char* fn, uint64_t wall_ns) {
+	unsigned failures = 0, errors = 0;
+	FILE* fp;
+	if ((fp = fopen(fn, "w")) == NULL) {
+		return -1;
+	}
+	for (unsigned n = 0; n < count; n++) {
+		if (tests[n].result == T_FAIL) failures++;
+		if (tests[n].result == T_ERROR) errors++;
+	}
+	fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	fprintf(fp, "<testsuite name=\"rvtest\" tests=\"%u\" failures=\"%u\" "
+		"errors=\"%u\" time=\"%.6f\">\n", count, failures, errors,
+		wall_ns / 1000000000.0);
+	for (unsigned n = 0; n < count; n++) {
+		test_t* t = tests + n;
+		fprintf(fp, "  <testcase classname=\"rvtest\" name=\"");
+		xml_puts(fp, t->image);
+		fprintf(fp, "\" time=\"%.6f\"", (t->load_ns + t->run_ns) / 1000000000.0);
+		if (t->result == T_PASS) {
+			fprintf(fp, "/>\n");
+			continue;
+		}
+		fprintf(fp, ">\n    <%s message=\"", t->result == T_FAIL ? "failure" : "error");
+		xml_puts(fp, t->msg);
+		fprintf(fp, "\"/>\n  </testcase>\n");
+	}
+	fprintf(fp, "</testsuite>\n");
+	return fclose(fp);
+}
+
+static int write_json(const char* fn, uint64_t wall_ns) {
+	FILE* fp;
+	if ((fp = fopen(fn, "w")) == NULL) {
+		return -1;
+	}
+	fprintf(fp, "{\n  \"tests\": %u,\n  \"passed\": %u,\n  \"time_ms\": %.3f,\n"
+		"  \"results\": [\n", count, passed, wall_ns / 1000000.0);
+	for (unsigned n = 0; n < count; n++) {
+		test_t* t = tests + n;
+		fprintf(fp, "    { \"image\": ");
+		json_puts(fp, t->image);
+		fprintf(fp, ", \"reference\": ");
+		json_puts(fp, t->ref);
+		fprintf(fp, ", \"result\": \"%s\", \"instructions\": %lu, "
+			"\"load_ms\": %.3f, \"run_ms\": %.3f",
+			result_name[t->result], t->instructions,
+			t->load_ns / 1000000.0, t->run_ns / 1000000.0);
+		if (t->result != T_PASS) {
+			fprintf(fp, ", \"message\": ");
+			json_puts(fp, t->msg);
+		}
+		fprintf(fp, " }%s\n", (n + 1) < count ? "," : "");
+	}
+	fprintf(fp, "  ]\n}\n");
+	return fclose(fp);
+}
+
+static void usage(void) {
+	fprintf(stderr,
+"usage: rvtest [options] [ <image> <reference> ]*\n"
+"\n"
+"options: -list=<file>       more tests, an image and reference per line\n"
+"         -junit=<file>      write a JUnit XML report\n"
+"         -json=<file>       write a JSON report\n"
+"         -workers=<n>       worker threads (one per cpu)\n"
+"         -quantum=<n>       instructions per time slice\n"
+"         -limit=<n>         fail tests running longer (%u)\n"
+"         -engine=<engine>   switch, threaded, or jit\n"
+"         -membase=<addr>    ram base (0x80000000)\n"
+"         -memsize=<size>    ram size (16MB)\n"
+"         -rvc               the C (compressed) extension\n"
+"         -q                 only report failures\n"
+"\n"
+"Images are ELF executables, or raw binaries loaded at membase\n"
+"with an nm listing of their symbols in a .map file next to them.\n",
+	DEFAULT_LIMIT);
+}
+
+int main(int argc, char** argv) {
+	const char* junitfn = NULL;
+	const char* jsonfn = NULL;
+	unsigned workers = 0;
+	uint64_t quantum = 0;
+	uint64_t limit = DEFAULT_LIMIT;
+	rvconfig_t cfg = {
+		.membase = 0x80000000,
+		.memsize = 0x01000000,
+		.engine = RVSIM_ENGINE_SWITCH,
+	};
+
+	while (argc > 1) {
+		argc--;
+		argv++;
+		if (argv[0][0] != '-') {
+			if (argc < 2) {
+				fprintf(stderr, "error: no reference for '%s'\n", argv[0]);
+				return -1;
+			}
+			if (add_test(argv[0], argv[1]) < 0) {
+				fprintf(stderr, "error: out of memory\n");
+				return -1;
+			}
+			argc--;
+			argv++;
+			continue;
+		}
+		if (!strncmp(argv[0],"-list=",6)) {
+			if (read_list(argv[0] + 6) < 0) {
+				fprintf(stderr, "error: cannot read list '%s'\n", argv[0] + 6);
+				return -1;
+			}
+			continue;
+		}
+		if (!strncmp(argv[0],"-junit=",7)) {
+			junitfn = argv[0] + 7;
+			continue;
+		}
+		if (!strncmp(argv[0],"-json=",6)) {
+			jsonfn = argv[0] + 6;
+			continue;
+		}
+		if (!strncmp(argv[0],"-workers=",9)) {
+			workers = strtoul(argv[0] + 9, NULL, 0);
+			continue;
+		}
+		if (!strncmp(argv[0],"-quantum=",9)) {
+			quantum = strtoull(argv[0] + 9, NULL, 0);
+			continue;
+		}
+		if (!strncmp(argv[0],"-limit=",7)) {
+			limit = strtoull(argv[0] + 7, NULL, 0);
+			continue;
+		}
+		if (!strncmp(argv[0],"-membase=",9)) {
+			cfg.membase = strtoul(argv[0] + 9, NULL, 0);
+			continue;
+		}
+		if (!strncmp(argv[0],"-memsize=",9)) {
+			cfg.memsize = strtoul(argv[0] + 9, NULL, 0);
+			continue;
+		}
+		if (!strcmp(argv[0],"-engine=switch")) {
+			cfg.engine = RVSIM_ENGINE_SWITCH;
+			continue;
+		}
+		if (!strcmp(argv[0],"-engine=threaded")) {
+			cfg.engine = RVSIM_ENGINE_THREADED;
+			continue;
+		}
+		if (!strcmp(argv[0],"-engine=jit")) {
+			cfg.engine = RVSIM_ENGINE_JIT;
+			continue;
+		}
+		if (!strcmp(argv[0],"-rvc")) {
+			cfg.rvc = 1;
+			continue;
+		}
+		if (!strcmp(argv[0],"-q")) {
+			quiet = 1;
+			continue;
+		}
+		fprintf(stderr, "error: unknown argument: %s\n", argv[0]);
+		usage();
+		return -1;
+	}
+	if (count == 0) {
+		usage();
+		return -1;
+	}
+
+	rvsched_t* sc;
+	if ((sc = rvsched_create(workers, quantum)) == NULL) {
+		fprintf(stderr, "error: cannot create scheduler\n");
+		return -1;
+	}
+	rvsched_set_limit(sc, limit);
+
+	// keep a bounded number of tests loaded, rather than all of them
+	unsigned maxinflight = 64;
+	uint64_t t0 = now_ns();
+	for (unsigned n = 0; n < count; n++) {
+		test_t* t = tests + n;
+		pthread_mutex_lock(&lock);
+		while (inflight >= maxinflight) {
+			pthread_cond_wait(&retired, &lock);
+		}
+		inflight++;
+		pthread_mutex_unlock(&lock);
+
+		uint64_t l0 = now_ns();
+		int r = load_test(t, &cfg);
+		t->load_ns = now_ns() - l0;
+		if (r < 0) {
+			t->result = T_ERROR;
+			retire(t);
+			continue;
+		}
+		if (rvsched_add(sc, t->s, test_done, t) == NULL) {
+			t->result = T_ERROR;
+			snprintf(t->msg, sizeof(t->msg), "cannot schedule");
+			retire(t);
+		}
+	}
+	rvsched_wait(sc);
+	uint64_t wall = now_ns() - t0;
+	rvsched_destroy(sc);
+
+	printf("%u of %u tests passed in %.3f s\n", passed, count, wall / 1000000000.0);
+	if (junitfn && (write_junit(junitfn, wall) < 0)) {
+		fprintf(stderr, "error: cannot write '%s'\n", junitfn);
+		return -1;
+	}
+	if (jsonfn && (write_json(jsonfn, wall) < 0)) {
+		fprintf(stderr, "error: cannot write '%s'\n", jsonfn);
+		return -1;
+	}
+	return (passed == count) ? 0 : 1;
+}
@@ -0,0 +1,409 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// Timing model (see rvtiming.h).
+//
+// rvsim_exec_hooks() hands rvtiming_ins() each instruction before it
+// executes, so addresses come from the registers as they are then.  How
+// a branch or jump went is only known from the pc of the instruction
+// after it, so that is when it is accounted for.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riscv.h"
+#include "rvsim.h"
+#include "rvcore.h"
+#include "rvtiming.h"
+
+// what an instruction does, and whether it reads r1 and r2
+#define K_NONE   0 // (no previous instruction)
+#define K_OTHER  1
+#define K_MUL    2
+#define K_DIV    3
+#define K_LOAD   4 // address r1 + imm
+#define K_STORE  5 // address r1 + imm
+#define K_ATOMIC 6 // address r1, result in rd
+#define K_BRANCH 7
+#define K_JAL    8
+#define K_JALR   9
+#define K_KIND   15
+#define U_R1     16
+#define U_R2     32
+
+static const uint8_t opinfo[OP_COUNT] = {
+	[OP_LI] = K_OTHER,
+	[OP_ADDI ... OP_SRAI] = K_OTHER | U_R1,
+	[OP_ADD ... OP_AND] = K_OTHER | U_R1 | U_R2,
+	[OP_MUL ... OP_MULHU] = K_MUL | U_R1 | U_R2,
+	[OP_DIV ... OP_REMU] = K_DIV | U_R1 | U_R2,
+	[OP_LB ... OP_LHU] = K_LOAD | U_R1,
+	[OP_SB ... OP_SW] = K_STORE | U_R1 | U_R2,
+	[OP_BEQ ... OP_BGEU] = K_BRANCH | U_R1 | U_R2,
+	[OP_JAL] = K_JAL,
+	[OP_CALL] = K_JAL,
+	[OP_JALR] = K_JALR | U_R1,
+	[OP_CALLR] = K_JALR | U_R1,
+	[OP_RET] = K_JALR | U_R1,
+	[OP_LR] = K_ATOMIC | U_R1,
+	[OP_SC ... OP_AMOMAXU] = K_ATOMIC | U_R1 | U_R2,
+	[OP_CSRRW ... OP_CSRRC] = K_OTHER | U_R1,
+	[OP_EXIT] = K_OTHER | U_R1,
+	// fused pairs are run (and timed) an instruction at a time, but
+	// may be seen here before they are split
+	[OP_LI_ADDI ... OP_LI_LW] = K_OTHER,
+	[OP_SLLI_SRLI] = K_OTHER | U_R1,
+	[OP_SLT_BZ ... OP_SLTU_BZ] = K_OTHER | U_R1 | U_R2,
+	[OP_SLTI_BZ ... OP_SLTIU_BZ] = K_OTHER | U_R1,
+};
+
+typedef struct {
+	uint32_t* tag;  // per way of each set: line number + 1, 0 if empty
+	uint64_t* used; // when each way was last accessed
+	uint64_t clock;
+	uint32_t setmask;
+	uint32_t ways;  // 0 if there is no cache
+	uint32_t shift; // log2 of the line size
+} cache_t;
+
+typedef struct {
+	uint32_t pc;
+	uint32_t target;
+} btb_t;
+
+struct rvtiming {
+	rvtiming_config_t cfg;
+	rvtiming_stats_t st;
+	cache_t l1i;
+	cache_t l1d;
+	cache_t l2;
+	uint32_t fetchline; // line number of the last fetch + 1
+	uint32_t fetchshift;
+	uint8_t* pht;       // gshare 2 bit counters
+	uint32_t history;
+	uint32_t phtmask;
+	btb_t* btb;
+	uint32_t* ras;
+	unsigned rastop;
+	unsigned rascount;
+	// the previous instruction
+	unsigned kind;
+	uint32_t pc;
+	uint32_t next;      // where it falls through to
+	uint32_t loaded;    // register it loaded, or 32
+	int call;
+	int ret;
+};
+
+static int log2_of(uint32_t n) {
+	if ((n == 0) || (n & (n - 1))) return -1;
+	return __builtin_ctz(n);
+}
+
+static int cache_init(cache_t* c, const rvcache_config_t* cfg) {
+	memset(c, 0, sizeof(cache_t));
+	if (cfg->size == 0) return 0;
+	int shift = log2_of(cfg->line);
+	if ((shift < 2) || (cfg->ways == 0) ||
+		(cfg->size % (cfg->line * cfg->ways))) {
+		return -1;
+	}
+	uint32_t sets = cfg->size / (cfg->line * cfg->ways);
+	if (log2_of(sets) < 0) return -1;
+	c->tag = calloc(sets * cfg->ways, sizeof(uint32_t));
+	c->used = calloc(sets * cfg->ways, sizeof(uint64_t));
+	if ((c->tag == NULL) || (c->used == NULL)) return -1;
+	c->setmask = sets - 1;
+	c->ways = cfg->ways;
+	c->shift = shift;
+	return 0;
+}
+
+static void cache_free(cache_t* c) {
+	free(c->tag);
+	free(c->used);
+}
+
+// returns 1 on a hit, otherwise replaces the least recently used way
+static int cache_access(cache_t* c, uint32_t addr) {
+	if (c->ways == 0) return 0;
+	uint32_t line = addr >> c->shift;
+	uint32_t n = (line & c->setmask) * c->ways;
+	uint32_t* tag = c->tag + n;
+	uint64_t* used = c->used + n;
+	unsigned victim = 0;
+	c->clock++;
+	for (unsigned w = 0; w < c->ways; w++) {
+		if (tag[w] == line + 1) {
+			used[w] = c->clock;
+			return 1;
+		}
+		if (used[w] < used[victim]) victim = w;
+	}
+	tag[victim] = line + 1;
+	used[victim] = c->clock;
+	return 0;
+}
+
+// cycles to fill an L1 line from L2 or memory
+static uint32_t l1_miss(rvtiming_t* t, uint32_t addr) {
+	if (t->l2.ways == 0) return t->cfg.memlatency;
+	t->st.l2_accesses++;
+	if (cache_access(&t->l2, addr)) return t->cfg.l2latency;
+	t->st.l2_misses++;
+	return t->cfg.l2latency + t->cfg.memlatency;
+}
+
+static int btb_hit(rvtiming_t* t, uint32_t pc, uint32_t target) {
+	if (t->btb == NULL) return 0;
+	btb_t* b = t->btb + ((pc >> 2) & (t->cfg.btbentries - 1));
+	return (b->pc == pc) && (b->target == target);
+}
+
+static void btb_set(rvtiming_t* t, uint32_t pc, uint32_t target) {
+	if (t->btb == NULL) return;
+	btb_t* b = t->btb + ((pc >> 2) & (t->cfg.btbentries - 1));
+	b->pc = pc;
+	b->target = target;
+}
+
+static void ras_push(rvtiming_t* t, uint32_t ra) {
+	if (t->ras == NULL) return;
+	t->ras[t->rastop] = ra;
+	t->rastop = (t->rastop + 1) % t->cfg.rasentries;
+	if (t->rascount < t->cfg.rasentries) t->rascount++;
+}
+
+static int ras_pop(rvtiming_t* t, uint32_t ra) {
+	if (t->rascount == 0) return 0;
+	t->rascount--;
+	t->rastop = (t->rastop + t->cfg.rasentries - 1) % t->cfg.rasentries;
+	return t->ras[t->rastop] == ra;
+}
+
+// the previous instruction was followed by the one at pc
+static void resolve(rvtiming_t* t, uint32_t pc) {
+	uint32_t seq = t->next;
+	switch (t->kind) {
+	case K_BRANCH: {
+		int taken = (pc != seq);
+		int predict = 0;
+		t->st.branches++;
+		if (t->pht) {
+			uint8_t* ctr = t->pht + (((t->pc >> 2) ^ t->history) & t->phtmask);
+			predict = (*ctr >= 2);
+			if (taken) {
+				if (*ctr < 3) (*ctr)++;
+			} else {
+				if (*ctr > 0) (*ctr)--;
+			}
+			t->history = (t->history << 1) | taken;
+		}
+		if (predict != taken) {
+			t->st.mispredicts++;
+			t->st.branch += t->cfg.mispredict;
+		} else if (taken && !btb_hit(t, t->pc, pc)) {
+			t->st.branch += t->cfg.redirect;
+		}
+		if (taken) btb_set(t, t->pc, pc);
+		break;
+	}
+	case K_JAL:
+		t->st.jumps++;
+		if (!btb_hit(t, t->pc, pc)) {
+			t->st.jump_misses++;
+			t->st.branch += t->cfg.redirect;
+			btb_set(t, t->pc, pc);
+		}
+		if (t->call) ras_push(t, seq);
+		break;
+	case K_JALR: {
+		int hit;
+		t->st.jumps++;
+		if (t->ret && t->ras) {
+			hit = ras_pop(t, pc);
+		} else {
+			hit = btb_hit(t, t->pc, pc);
+			btb_set(t, t->pc, pc);
+		}
+		if (!hit) {
+			t->st.jump_misses++;
+			t->st.branch += t->cfg.mispredict;
+		}
+		if (t->call) ras_push(t, seq);
+		break;
+	}
+	default:
+		// traps, mret and the like flush the pipeline
+		if (pc != seq) t->st.branch += t->cfg.mispredict;
+	}
+}
+
+void rvtiming_ins(rvstate_t* s, rvop_t* op) {
+	rvtiming_t* t = s->timing;
+	if (op->op == OP_DECODE) rvsim_decode(s, op);
+	const rvop_t* d = (op->op == OP_JIT) ? &op->jit->op : op;
+	uint32_t pc = op->pc;
+	if (t->kind) resolve(t, pc);
+
+	t->st.instructions++;
+	t->st.base++;
+	uint32_t line = (pc >> t->fetchshift) + 1;
+	if (line != t->fetchline) {
+		t->fetchline = line;
+		t->st.l1i_accesses++;
+		if (!cache_access(&t->l1i, pc)) {
+			t->st.l1i_misses++;
+			t->st.fetch += l1_miss(t, pc);
+		}
+	}
+
+	unsigned info = opinfo[d->op];
+	if ((t->loaded != 32) &&
+		(((info & U_R1) && (d->r1 == t->loaded)) ||
+		((info & U_R2) && (d->r2 == t->loaded)))) {
+		t->st.hazard += t->cfg.loaduse;
+	}
+	t->loaded = 32;
+	t->kind = info & K_KIND;
+	t->pc = pc;
+	t->next = pc + d->len;
+	switch (t->kind) {
+	case K_NONE:
+		t->kind = K_OTHER;
+		break;
+	case K_MUL:
+		t->st.execute += t->cfg.mullatency;
+		break;
+	case K_DIV:
+		t->st.execute += t->cfg.divlatency;
+		break;
+	case K_LOAD:
+	case K_STORE:
+	case K_ATOMIC: {
+		uint32_t a = s->x[d->r1];
+		if (t->kind != K_ATOMIC) a += d->imm;
+		if (t->kind != K_STORE) t->loaded = d->rd;
+		if ((a - s->membase) >= s->memsize) {
+			t->st.memory += t->cfg.memlatency;
+			break;
+		}
+		t->st.l1d_accesses++;
+		if (!cache_access(&t->l1d, a)) {
+			t->st.l1d_misses++;
+			t->st.memory += l1_miss(t, a);
+		}
+		break;
+	}
+	case K_JAL:
+		t->call = (d->rd == 1);
+		break;
+	case K_JALR:
+		t->call = (d->rd == 1);
+		t->ret = (d->rd == 32) && (d->r1 == 1) && (d->imm == 0);
+		break;
+	}
+}
+
+void rvtiming_defaults(rvtiming_config_t* cfg) {
+	rvtiming_config_t def = {
+		.l1i = { .size = 32768, .ways = 4, .line = 64 },
+		.l1d = { .size = 32768, .ways = 4, .line = 64 },
+		.l2 = { .size = 262144, .ways = 8, .line = 64 },
+		.l2latency = 12,
+		.memlatency = 80,
+		.gsharebits = 12,
+		.btbentries = 512,
+		.rasentries = 8,
+		.mispredict = 3,
+		.redirect = 1,
+		.loaduse = 1,
+		.mullatency = 2,
+		.divlatency = 32,
+	};
+	*cfg = def;
+}
+
+static void timing_free(rvtiming_t* t) {
+	if (t == NULL) return;
+	cache_free(&t->l1i);
+	cache_free(&t->l1d);
+	cache_free(&t->l2);
+	free(t->pht);
+	free(t->btb);
+	free(t->ras);
+	free(t);
+}
+
+static rvtiming_t* timing_new(const rvtiming_config_t* cfg) {
+	rvtiming_t* t;
+	if ((t = calloc(1, sizeof(rvtiming_t))) == NULL) {
+		return NULL;
+	}
+	t->cfg = *cfg;
+	t->loaded = 32;
+	if ((cache_init(&t->l1i, &cfg->l1i) < 0) ||
+		(cache_init(&t->l1d, &cfg->l1d) < 0) ||
+		(cache_init(&t->l2, &cfg->l2) < 0) ||
+		(cfg->gsharebits > 24) ||
+		(cfg->btbentries && (log2_of(cfg->btbentries) < 0))) {
+		goto fail;
+	}
+	// without an L1I, fetches go to L2 a line (or instruction) at a time
+	t->fetchshift = t->l1i.ways ? t->l1i.shift : (t->l2.ways ? t->l2.shift : 2);
+	if (cfg->gsharebits) {
+		t->phtmask = (1U << cfg->gsharebits) - 1;
+		if ((t->pht = malloc(t->phtmask + 1)) == NULL) goto fail;
+		// weakly not taken
+		memset(t->pht, 1, t->phtmask + 1);
+	}
+	if (cfg->btbentries) {
+		if ((t->btb = malloc(cfg->btbentries * sizeof(btb_t))) == NULL) goto fail;
+		// no pc matches (they are even)
+		memset(t->btb, 0xff, cfg->btbentries * sizeof(btb_t));
+	}
+	if (cfg->rasentries &&
+		((t->ras = calloc(cfg->rasentries, sizeof(uint32_t))) == NULL)) {
+		goto fail;
+	}
+	return t;
+fail:
+	timing_free(t);
+	return NULL;
+}
+
+int rvtiming_start(rvstate_t* s, const rvtiming_config_t* cfg) {
+	rvsys_t* sys = s->sys;
+	rvtiming_config_t def;
+	if (cfg == NULL) {
+		rvtiming_defaults(&def);
+		cfg = &def;
+	}
+	if (sys->hart[0]->timing) return -1;
+	for (unsigned n = 0; n < sys->nharts; n++) {
+		if ((sys->hart[n]->timing = timing_new(cfg)) == NULL) {
+			rvtiming_stop(s);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void rvtiming_stop(rvstate_t* s) {
+	rvsys_t* sys = s->sys;
+	for (unsigned n = 0; n < sys->nharts; n++) {
+		timing_free(sys->hart[n]->timing);
+		sys->hart[n]->timing = NULL;
+	}
+}
+
+int rvtiming_stats(rvstate_t* s, rvtiming_stats_t* st) {
+	rvtiming_t* t = s->timing;
+	if (t == NULL) return -1;
+	*st = t->st;
+	st->cycles = st->base + st->fetch + st->memory + st->branch +
+		st->hazard + st->execute;
+	return 0;
+}
@@ -0,0 +1,73 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "rvsim.h"
+
+// a timing model of a simple in-order core, fed by the instructions the
+// harts execute: estimates the cycles a run would take, by cause
+//
+// Every instruction takes a cycle, plus stalls for instruction and data
+// cache misses (in L1I or L1D, then a unified L2, then memory; devices
+// are uncached), branches the predictor (gshare for conditional ones, a
+// BTB for targets and a return address stack) got wrong, a use of the
+// result of a load by the next instruction, and multiplies and divides.
+// Each hart has caches, L2 included, and predictor of its own.
+
+typedef struct {
+	uint32_t size; // bytes, 0 for none
+	uint32_t ways;
+	uint32_t line; // bytes
+} rvcache_config_t;
+
+typedef struct {
+	rvcache_config_t l1i;
+	rvcache_config_t l1d;
+	rvcache_config_t l2;
+	uint32_t l2latency;   // cycles added by a miss in L1 that hits in L2
+	uint32_t memlatency;  // further cycles added by a miss in L2
+	uint32_t gsharebits;  // log2 of the counters (and bits of history)
+	uint32_t btbentries;  // 0 for none
+	uint32_t rasentries;  // 0 for none
+	uint32_t mispredict;  // cycles lost to a wrong direction or target
+	uint32_t redirect;    // cycles lost to a taken jump or branch
+	                      // predicted right, but missing from the BTB
+	uint32_t loaduse;
+	uint32_t mullatency;  // added to mul*
+	uint32_t divlatency;  // added to div* and rem*
+} rvtiming_config_t;
+
+typedef struct {
+	uint64_t instructions;
+	uint64_t cycles;
+	// what the cycles went to (these add up to cycles)
+	uint64_t base;     // one per instruction
+	uint64_t fetch;    // instruction cache misses
+	uint64_t memory;   // data cache misses and device accesses
+	uint64_t branch;   // mispredictions, redirects and traps
+	uint64_t hazard;   // load-use stalls
+	uint64_t execute;  // multiply and divide latency
+	// what happened
+	uint64_t l1i_accesses, l1i_misses;
+	uint64_t l1d_accesses, l1d_misses;
+	uint64_t l2_accesses, l2_misses;
+	uint64_t branches, mispredicts; // conditional branches
+	uint64_t jumps, jump_misses;    // jumps predicted wrong or redirected
+} rvtiming_stats_t;
+
+// a 32K 4-way L1I and L1D, 256K 8-way L2 (64 byte lines), 12 bit gshare,
+// 512 entry BTB and 8 entry RAS
+void rvtiming_defaults(rvtiming_config_t* cfg);
+
+// start modelling all harts of an instance (with the defaults if cfg is
+// NULL), while it is not running
+// harts run the reference engine while modelled, whatever their engine
+int rvtiming_start(rvstate_t* s, const rvtiming_config_t* cfg);
+
+void rvtiming_stop(rvstate_t* s);
+
+// the totals of hart s since rvtiming_start()
+int rvtiming_stats(rvstate_t* s, rvtiming_stats_t* st);
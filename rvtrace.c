@@ -0,0 +1,387 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// Trace recording and reading (see rvtrace.h for the format).
+//
+// Instructions are recorded by rvsim_exec_hooks(), the reference
+// engine built with recording hooks, which harts run instead of their
+// own engine while a trace is being taken.  A record is only encoded
+// once the next instruction starts (or the engine returns), as the
+// flags byte depends on what the instruction turned out to do.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "riscv.h"
+#include "rvsim.h"
+#include "rvcore.h"
+#include "rvtrace.h"
+
+// bytes of records a hart buffers before writing a chunk
+#define RVTRACE_BUFSIZE (1024 * 1024)
+
+// what the writer and reader both predict
+typedef struct {
+	uint32_t next; // pc after the previous instruction
+	uint32_t x[32];
+	uint32_t memaddr;
+	struct {
+		uint32_t pc;
+		uint32_t ins;
+	} icache[RVTRACE_ICACHE];
+} predict_t;
+
+struct rvtracer {
+	predict_t pr;
+	// the instruction being executed
+	int pending;
+	uint32_t flags;
+	uint32_t pc;
+	uint32_t ins;
+	uint32_t rdval;
+	uint32_t memaddr;
+	uint32_t memval;
+	uint32_t cause;
+	uint32_t tval;
+
+	uint8_t* p;
+	uint8_t buf[RVTRACE_BUFSIZE];
+};
+
+static void predict_init(predict_t* pr) {
+	memset(pr, 0, sizeof(predict_t));
+}
+
+// the size in bytes of an instruction (a compressed one is recorded as
+// its halfword)
+static uint32_t ins_len(uint32_t ins) {
+	return ((ins & 3) == 3) ? 4 : 2;
+}
+
+// the register an instruction writes
+static uint32_t ins_rd(uint32_t ins) {
+	if (ins_len(ins) == 2) ins = rvc_expand(ins);
+	// iocalls return in a0
+	if ((get_oc(ins) == OC_CUSTOM_0) && (get_fn3(ins) == 0b001)) return 10;
+	return get_rd(ins);
+}
+
+// the width of a store
+static uint32_t ins_memsize(uint32_t ins) {
+	if (ins_len(ins) == 2) ins = rvc_expand(ins);
+	if (get_oc(ins) == OC_STORE) {
+		switch (get_fn3(ins)) {
+		case F3_SB: return 1;
+		case F3_SH: return 2;
+		}
+	}
+	return 4;
+}
+
+static uint8_t* put_uv(uint8_t* p, uint32_t v) {
+	while (v > 0x7F) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static uint8_t* put_zz(uint8_t* p, uint32_t v) {
+	return put_uv(p, (v << 1) ^ (uint32_t) (((int32_t) v) >> 31));
+}
+
+// encode the pending record
+static void encode(rvtracer_t* t) {
+	predict_t* pr = &t->pr;
+	uint8_t* p = t->p + 1;
+	uint32_t flags = t->flags;
+	if (t->pc != pr->next) {
+		flags |= RVTRACE_PC;
+		p = put_zz(p, t->pc - pr->next);
+	}
+	pr->next = t->pc + ins_len(t->ins);
+	unsigned n = (t->pc >> 1) & (RVTRACE_ICACHE - 1);
+	if ((pr->icache[n].pc != t->pc) || (pr->icache[n].ins != t->ins)) {
+		flags |= RVTRACE_INS;
+		memcpy(p, &t->ins, 4);
+		p += 4;
+		pr->icache[n].pc = t->pc;
+		pr->icache[n].ins = t->ins;
+	}
+	if (flags & RVTRACE_RD) {
+		uint32_t rd = ins_rd(t->ins);
+		p = put_zz(p, t->rdval - pr->x[rd]);
+		pr->x[rd] = t->rdval;
+	}
+	if (flags & RVTRACE_MEM) {
+		uint32_t size = ins_memsize(t->ins);
+		p = put_zz(p, t->memaddr - pr->memaddr);
+		p = put_uv(p, (size == 4) ? t->memval : (t->memval & ((1U << (size * 8)) - 1)));
+		pr->memaddr = t->memaddr;
+	}
+	if (flags & RVTRACE_TRAP) {
+		p = put_uv(p, t->cause);
+		p = put_uv(p, t->tval);
+	}
+	*t->p = flags;
+	t->p = p;
+	t->pending = 0;
+}
+
+// write out the chunk buffered by hart s
+static void flush(rvstate_t* s) {
+	rvtracer_t* t = s->trace;
+	rvsys_t* sys = s->sys;
+	rvtrace_chunk_t ch = {
+		.hart = s->hartid,
+		.size = t->p - t->buf,
+	};
+	if (ch.size == 0) return;
+	struct iovec iov[2] = {
+		{ .iov_base = &ch, .iov_len = sizeof(ch) },
+		{ .iov_base = t->buf, .iov_len = ch.size },
+	};
+	pthread_mutex_lock(&sys->tracelock);
+	if (writev(sys->tracefd, iov, 2) != (ssize_t) (sizeof(ch) + ch.size)) {
+		sys->traceerr = 1;
+	}
+	pthread_mutex_unlock(&sys->tracelock);
+	t->p = t->buf;
+}
+
+void rvtrace_ins(rvstate_t* s, uint32_t pc, uint32_t ins) {
+	rvtracer_t* t = s->trace;
+	if (t->pending) encode(t);
+	if ((t->buf + RVTRACE_BUFSIZE - t->p) < RVTRACE_RECMAX) flush(s);
+	t->pending = 1;
+	t->flags = 0;
+	t->pc = pc;
+	t->ins = ins;
+}
+
+void rvtrace_rd(rvstate_t* s, uint32_t v) {
+	rvtracer_t* t = s->trace;
+	t->flags |= RVTRACE_RD;
+	t->rdval = v;
+}
+
+void rvtrace_mem(rvstate_t* s, uint32_t addr, uint32_t v) {
+	rvtracer_t* t = s->trace;
+	t->flags |= RVTRACE_MEM;
+	t->memaddr = addr;
+	t->memval = v;
+}
+
+void rvtrace_trap(rvstate_t* s, uint32_t cause, uint32_t tval) {
+	rvtracer_t* t = s->trace;
+	t->flags |= RVTRACE_TRAP;
+	t->cause = cause;
+	t->tval = tval;
+}
+
+void rvtrace_sync(rvstate_t* s) {
+	rvtracer_t* t = s->trace;
+	if (t->pending) encode(t);
+}
+
+int rvsim_trace_start(rvstate_t* s, const char* fn) {
+	rvsys_t* sys = s->sys;
+	if (sys->tracefd >= 0) return -1;
+	int fd;
+	if ((fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		return -1;
+	}
+	rvtrace_header_t hdr = {
+		.magic = RVTRACE_MAGIC,
+		.version = RVTRACE_VERSION,
+		.membase = sys->membase,
+		.memsize = sys->memsize,
+	};
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		goto fail;
+	}
+	for (unsigned n = 0; n < sys->nharts; n++) {
+		rvtracer_t* t;
+		if ((t = malloc(sizeof(rvtracer_t))) == NULL) {
+			goto fail;
+		}
+		predict_init(&t->pr);
+		t->pending = 0;
+		t->p = t->buf;
+		sys->hart[n]->trace = t;
+	}
+	sys->tracefd = fd;
+	sys->traceerr = 0;
+	return 0;
+fail:
+	for (unsigned n = 0; n < sys->nharts; n++) {
+		free(sys->hart[n]->trace);
+		sys->hart[n]->trace = NULL;
+	}
+	close(fd);
+	unlink(fn);
+	return -1;
+}
+
+int rvsim_trace_stop(rvstate_t* s) {
+	rvsys_t* sys = s->sys;
+	if (sys->tracefd < 0) return -1;
+	for (unsigned n = 0; n < sys->nharts; n++) {
+		rvstate_t* h = sys->hart[n];
+		rvtrace_sync(h);
+		flush(h);
+		free(h->trace);
+		h->trace = NULL;
+	}
+	if (close(sys->tracefd) < 0) sys->traceerr = 1;
+	sys->tracefd = -1;
+	return sys->traceerr ? -1 : 0;
+}
+
+// reading
+
+struct rvtrace {
+	uint8_t* data;
+	size_t size;
+	size_t next;      // offset of the next chunk
+	uint8_t* p;       // in the current chunk
+	uint8_t* end;
+	unsigned hart;    // of the current chunk
+	predict_t* pr[RVMAXHARTS];
+	uint64_t index[RVMAXHARTS];
+};
+
+int rvtrace_open(rvtrace_t** _t, const char* fn) {
+	rvtrace_t* t;
+	if ((t = calloc(1, sizeof(rvtrace_t))) == NULL) {
+		return -1;
+	}
+	struct stat st;
+	int fd;
+	if ((fd = open(fn, O_RDONLY)) < 0) {
+		goto fail;
+	}
+	if ((fstat(fd, &st) < 0) || (st.st_size < sizeof(rvtrace_header_t))) {
+		close(fd);
+		goto fail;
+	}
+	t->size = st.st_size;
+	t->data = mmap(NULL, t->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (t->data == MAP_FAILED) {
+		t->data = NULL;
+		goto fail;
+	}
+	madvise(t->data, t->size, MADV_SEQUENTIAL);
+	const rvtrace_header_t* hdr = (void*) t->data;
+	if ((hdr->magic != RVTRACE_MAGIC) || (hdr->version != RVTRACE_VERSION)) {
+		goto fail;
+	}
+	t->next = sizeof(rvtrace_header_t);
+	*_t = t;
+	return 0;
+fail:
+	rvtrace_close(t);
+	return -1;
+}
+
+void rvtrace_close(rvtrace_t* t) {
+	for (unsigned n = 0; n < RVMAXHARTS; n++) {
+		free(t->pr[n]);
+	}
+	if (t->data) munmap(t->data, t->size);
+	free(t);
+}
+
+const rvtrace_header_t* rvtrace_header(rvtrace_t* t) {
+	return (void*) t->data;
+}
+
+static int get_uv(rvtrace_t* t, uint32_t* v) {
+	uint32_t x = 0;
+	for (unsigned shift = 0; shift < 35; shift += 7) {
+		if (t->p == t->end) return -1;
+		uint8_t b = *t->p++;
+		x |= ((uint32_t) (b & 0x7F)) << shift;
+		if (!(b & 0x80)) {
+			*v = x;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int get_zz(rvtrace_t* t, uint32_t* v) {
+	uint32_t x;
+	if (get_uv(t, &x)) return -1;
+	*v = (x >> 1) ^ -(x & 1);
+	return 0;
+}
+
+int rvtrace_next(rvtrace_t* t, rvtrace_rec_t* rec) {
+	while (t->p == t->end) {
+		if (t->next == t->size) return 0;
+		rvtrace_chunk_t ch;
+		if ((t->size - t->next) < sizeof(ch)) return -1;
+		memcpy(&ch, t->data + t->next, sizeof(ch));
+		t->next += sizeof(ch);
+		if ((ch.hart >= RVMAXHARTS) || (ch.size > (t->size - t->next))) return -1;
+		if ((t->pr[ch.hart] == NULL) &&
+			((t->pr[ch.hart] = malloc(sizeof(predict_t))) != NULL)) {
+			predict_init(t->pr[ch.hart]);
+		}
+		if (t->pr[ch.hart] == NULL) return -1;
+		t->hart = ch.hart;
+		t->p = t->data + t->next;
+		t->end = t->p + ch.size;
+		t->next += ch.size;
+	}
+	predict_t* pr = t->pr[t->hart];
+	uint32_t flags = *t->p++;
+	uint32_t v;
+	if (flags & ~(RVTRACE_PC | RVTRACE_INS | RVTRACE_RD | RVTRACE_MEM | RVTRACE_TRAP)) {
+		return -1;
+	}
+	memset(rec, 0, sizeof(rvtrace_rec_t));
+	rec->hart = t->hart;
+	rec->index = t->index[t->hart]++;
+	rec->flags = flags & (RVTRACE_RD | RVTRACE_MEM | RVTRACE_TRAP);
+	rec->pc = pr->next;
+	if (flags & RVTRACE_PC) {
+		if (get_zz(t, &v)) return -1;
+		rec->pc += v;
+	}
+	unsigned n = (rec->pc >> 1) & (RVTRACE_ICACHE - 1);
+	if (flags & RVTRACE_INS) {
+		if ((t->end - t->p) < 4) return -1;
+		memcpy(&pr->icache[n].ins, t->p, 4);
+		pr->icache[n].pc = rec->pc;
+		t->p += 4;
+	}
+	rec->ins = pr->icache[n].ins;
+	pr->next = rec->pc + ins_len(rec->ins);
+	if (flags & RVTRACE_RD) {
+		if (get_zz(t, &v)) return -1;
+		rec->rd = ins_rd(rec->ins);
+		pr->x[rec->rd] += v;
+		rec->rdval = pr->x[rec->rd];
+	}
+	if (flags & RVTRACE_MEM) {
+		if (get_zz(t, &v) || get_uv(t, &rec->memval)) return -1;
+		pr->memaddr += v;
+		rec->memaddr = pr->memaddr;
+		rec->memsize = ins_memsize(rec->ins);
+	}
+	if (flags & RVTRACE_TRAP) {
+		if (get_uv(t, &rec->cause) || get_uv(t, &rec->tval)) return -1;
+	}
+	return 1;
+}
@@ -0,0 +1,93 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+#pragma once
+
+#include <stdint.h>
+
+// execution traces (rvsim_trace_start())
+//
+// A trace file is an rvtrace_header_t followed by chunks, each an
+// rvtrace_chunk_t and that many bytes of records of one hart.  A hart
+// writes a chunk whenever its buffer fills, so chunks of different
+// harts interleave in roughly the order they ran.
+//
+// There is a record per instruction executed, in order: a flags byte,
+// then the fields it flags, in this order
+//
+//   RVTRACE_PC   pc - (previous pc + its size), zigzag varint
+//   RVTRACE_INS  instruction word (or halfword, zero extended, of a
+//                compressed instruction), 4 bytes little endian
+//   RVTRACE_RD   value written to rd - its previous value, zigzag varint
+//   RVTRACE_MEM  address stored to - previous such address, zigzag
+//                varint, then the value stored, varint
+//   RVTRACE_TRAP mcause, then mtval, varints
+//
+// Everything else is predicted from what came before, by the reader as
+// by the writer, for each hart: the pc follows the previous
+// instruction (2 bytes on if it was compressed, 4 otherwise), the
+// instruction is the one last seen at that pc (in a cache of
+// RVTRACE_ICACHE entries, indexed by pc), rd is the instruction's (a0
+// for iocalls) and the width of a store is the instruction's.  The
+// first record of a hart is predicted to be at pc 0, with registers,
+// store address and cache (pc and word) of all zeros.
+//
+// A varint is 7 bits per byte, least significant first, with the top
+// bit set on all but the last byte; zigzag maps signed to unsigned
+// values as 0, -1, 1, -2, ... to 0, 1, 2, 3, ...
+
+#define RVTRACE_MAGIC   0x52545652 // "RVTR"
+#define RVTRACE_VERSION 2
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t membase;
+	uint32_t memsize;
+} rvtrace_header_t;
+
+typedef struct {
+	uint32_t hart;
+	uint32_t size; // bytes of records following
+} rvtrace_chunk_t;
+
+#define RVTRACE_PC   0x01
+#define RVTRACE_INS  0x02
+#define RVTRACE_RD   0x04
+#define RVTRACE_MEM  0x08
+#define RVTRACE_TRAP 0x10
+
+#define RVTRACE_ICACHE 4096
+
+// longest record
+#define RVTRACE_RECMAX (1 + 5 + 4 + 5 + 5 + 5 + 5 + 5)
+
+// reading traces
+
+typedef struct rvtrace rvtrace_t;
+
+typedef struct {
+	unsigned hart;
+	uint64_t index;   // of the instruction, counting from 0 for each hart
+	uint32_t flags;   // RVTRACE_RD, _MEM and _TRAP say which follow
+	uint32_t pc;
+	uint32_t ins;
+	uint32_t rd;      // register written
+	uint32_t rdval;
+	uint32_t memaddr; // store
+	uint32_t memval;
+	uint32_t memsize; // 1, 2 or 4 bytes
+	uint32_t cause;   // trap taken instead of completing
+	uint32_t tval;
+} rvtrace_rec_t;
+
+// map a trace file
+int rvtrace_open(rvtrace_t** t, const char* fn);
+
+void rvtrace_close(rvtrace_t* t);
+
+const rvtrace_header_t* rvtrace_header(rvtrace_t* t);
+
+// the next record, in file order
+// returns 1, 0 at the end, or -1 if the trace is damaged
+int rvtrace_next(rvtrace_t* t, rvtrace_rec_t* rec);
@@ -0,0 +1,151 @@
+// Copyright 2019, Brian Swetland <swetland@frotz.net>
+// Licensed under the Apache License, Version 2.0.
+
+// Decodes an execution trace (rvsim -trace=file) into the listing the
+// -debug= options of rvsim print, or summarizes it.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "riscv.h"
+#include "rvtrace.h"
+
+#define MAXHARTS 64
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: rvtrace [options] <trace>\n"
+		"  -hart=N     only instructions of hart N\n"
+		"  -from=ADDR  only instructions at pc >= ADDR (hex)\n"
+		"  -to=ADDR    only instructions at pc < ADDR (hex)\n"
+		"  -skip=N     leave out the first N of those\n"
+		"  -count=N    stop after N of them\n"
+		"  -stats      summarize instead of listing\n");
+}
+
+typedef struct {
+	uint64_t ins;
+	uint64_t rd;
+	uint64_t mem;
+	uint64_t traps;
+} stats_t;
+
+int main(int argc, char** argv) {
+	const char* fn = NULL;
+	int hart = -1;
+	uint32_t from = 0, to = 0;
+	uint64_t skip = 0;
+	uint64_t count = UINT64_MAX;
+	int stats = 0;
+	while (argc > 1) {
+		argc--;
+		argv++;
+		if (argv[0][0] != '-') {
+			if (fn != NULL) {
+				usage();
+				return -1;
+			}
+			fn = argv[0];
+			continue;
+		}
+		if (!strncmp(argv[0],"-hart=",6)) {
+			hart = strtoul(argv[0] + 6, NULL, 0);
+			continue;
+		}
+		if (!strncmp(argv[0],"-from=",6)) {
+			from = strtoul(argv[0] + 6, NULL, 16);
+			continue;
+		}
+		if (!strncmp(argv[0],"-to=",4)) {
+			to = strtoul(argv[0] + 4, NULL, 16);
+			continue;
+		}
+		if (!strncmp(argv[0],"-skip=",6)) {
+			skip = strtoull(argv[0] + 6, NULL, 0);
+			continue;
+		}
+		if (!strncmp(argv[0],"-count=",7)) {
+			count = strtoull(argv[0] + 7, NULL, 0);
+			continue;
+		}
+		if (!strcmp(argv[0],"-stats")) {
+			stats = 1;
+			continue;
+		}
+		fprintf(stderr, "error: unknown argument: %s\n", argv[0]);
+		usage();
+		return -1;
+	}
+	if (fn == NULL) {
+		usage();
+		return -1;
+	}
+
+	rvtrace_t* t;
+	if (rvtrace_open(&t, fn) < 0) {
+		fprintf(stderr, "error: cannot open trace '%s'\n", fn);
+		return -1;
+	}
+	stats_t st[MAXHARTS] = { 0 };
+	unsigned last = 0;
+	rvtrace_rec_t rec;
+	int r = 0;
+	while ((count > 0) && ((r = rvtrace_next(t, &rec)) > 0)) {
+		if ((hart >= 0) && (rec.hart != hart)) continue;
+		if ((rec.pc < from) || (to && (rec.pc >= to))) continue;
+		if (skip) {
+			skip--;
+			continue;
+		}
+		count--;
+		if (stats) {
+			stats_t* x = st + (rec.hart % MAXHARTS);
+			x->ins++;
+			if (rec.flags & RVTRACE_RD) x->rd++;
+			if (rec.flags & RVTRACE_MEM) x->mem++;
+			if (rec.flags & RVTRACE_TRAP) x->traps++;
+			continue;
+		}
+		char dis[128];
+		if (rec.hart != last) {
+			printf("          (HART %u)\n", rec.hart);
+			last = rec.hart;
+		}
+		rvdis(rec.pc, rec.ins, dis);
+		printf("%08x: %08x %s\n", rec.pc, rec.ins, dis);
+		if (rec.flags & RVTRACE_MEM) {
+			printf("          ([%08x] = %08x)\n", rec.memaddr, rec.memval);
+		}
+		if (rec.flags & RVTRACE_RD) {
+			printf("          (%s = %08x)\n", rvregname(rec.rd), rec.rdval);
+		}
+		if (rec.flags & RVTRACE_TRAP) {
+			printf("          (TRAP C=%08x V=%08x)\n", rec.cause, rec.tval);
+		}
+	}
+	if (r < 0) {
+		fprintf(stderr, "error: trace '%s' is damaged\n", fn);
+	}
+	if (stats) {
+		const rvtrace_header_t* hdr = rvtrace_header(t);
+		printf("ram %08x..%08x\n", hdr->membase, hdr->membase + hdr->memsize);
+		uint64_t total = 0;
+		for (unsigned n = 0; n < MAXHARTS; n++) {
+			if (st[n].ins == 0) continue;
+			printf("hart %u: %lu instructions, %lu register writes,"
+				" %lu stores, %lu traps\n", n,
+				st[n].ins, st[n].rd, st[n].mem, st[n].traps);
+			total += st[n].ins;
+		}
+		struct stat sb;
+		if (total && (stat(fn, &sb) == 0)) {
+			printf("%lu bytes, %.2f per instruction\n",
+				(uint64_t) sb.st_size, (double) sb.st_size / total);
+		}
+	}
+	rvtrace_close(t);
+	return (r < 0) ? -1 : 0;
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "iocall.h"
+
 #define O_RDONLY    00
 #define O_WRONLY    01
 #define O_RDWR      02
@@ -15,3 +17,64 @@ int close(int fd);
 int read(int fd, void* ptr, int len);
 int write(int fd, void* ptr, int len);
 
+// asynchronous i/o (the ring layout is in iocall.h): set up a ring of
+// entries slots at ring (zeroing its header), then queue submissions
+// and call ringenter() to have the host start on them
+int ringsetup(ioring_t* ring, unsigned entries);
+int ringenter(unsigned flags);
+
+// map len bytes of file fd from offset off at addr, in ram, without
+// copying: reads see the file, writes stay private to the guest
+// addr, len and off must be 4KB aligned; fd may be closed afterwards
+// returns addr, or (void*) -1
+void* mmap(void* addr, unsigned len, int fd, unsigned long long off);
+
+// drop a mapping (or any part of one): the range reads as zeros again
+int munmap(void* addr, unsigned len);
+
+// have the host save a checkpoint here (if it was asked to), which runs
+// restored from it carry on from as this returns
+int checkpoint(void);
+
+// an input to fuzz with, when run by the fuzzer (rvsim -fuzz=), which
+// rewinds the guest to this first call for each input: a run ends when
+// the guest calls again, or exits (nonzero for a crash)
+// returns the length of the input, or -1 when not fuzzing
+int fuzzinput(void* buf, unsigned max);
+
+// start hart id running fn(id, arg) on the given stack
+// fn must not return
+int hartstart(unsigned id, void (*fn)(unsigned id, void* arg), void* stack, void* arg);
+
+// performance counters
+// mhpmevent values: what mhpmcounter3..31 count (RVSIM_EV_* in rvsim.h)
+#define HPM_EV_NONE     0
+#define HPM_EV_LOADS    1
+#define HPM_EV_STORES   2
+#define HPM_EV_BRANCHES 3 // conditional branches taken
+#define HPM_EV_TRAPS    4
+#define HPM_EV_IOCALLS  5
+#define HPM_EV_FUSED    6 // pairs of instructions run as one
+
+#define csr_read(csr) ({ \
+	unsigned __v; \
+	__asm__ volatile ("csrr %0, " #csr : "=r" (__v)); \
+	__v; })
+#define csr_write(csr, val) \
+	__asm__ volatile ("csrw " #csr ", %0" :: "r" (val))
+
+// 64bit counters, read as halves: retry if the low half wrapped
+#define csr_read64(csr) ({ \
+	unsigned __hi, __lo; \
+	do { \
+		__hi = csr_read(csr##h); \
+		__lo = csr_read(csr); \
+	} while (__hi != csr_read(csr##h)); \
+	(((unsigned long long) __hi) << 32) | __lo; })
+
+static inline unsigned long long rdcycle64(void) {
+	return csr_read64(cycle);
+}
+static inline unsigned long long rdinstret64(void) {
+	return csr_read64(instret);
+}